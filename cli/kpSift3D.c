@@ -38,7 +38,7 @@ const char help_msg[] =
         "       Supported file formats: .csv, .csv.gz \n"
         " --desc [filename] \n"
         "       Specifies the output file name for the descriptors. \n"
-        "       Supported file formats: .csv, .csv.gz \n"
+        "       Supported file formats: .csv, .csv.gz, .sdb (binary) \n"
         " --draw [filename] \n"
         "       Draws the keypoints in image space. \n"
         "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include "immacros.h"
 #include "imutil.h"
@@ -29,6 +30,10 @@
 #define NUM_ITER 'l'
 #define TYPE 'm' 
 #define RESAMPLE 'n'
+#define SEED 'o'
+#define CONF 'p'
+#define PROSAC 'q'
+#define TDD 'r'
 
 /* Message buffer size */
 #define BUF_SIZE 1024
@@ -73,15 +78,29 @@ static void print_help() {
         "       (0, inf). This is a threshold on the squared Euclidean \n"
         "       distance in real-world units. (default: %.1f) \n"
         " --num_iter [value] - Number of RANSAC iterations. (default: %d) \n"
+        " --seed [value] - Seed for the RANSAC random sampling. Results are \n"
+        "       reproducible for a given seed. (default: %llu) \n"
+        " --conf [value] - RANSAC stops early once the best model has been \n"
+        "       found with this probability, in the interval (0, 1]. The \n"
+        "       default of 1 always runs num_iter iterations, while e.g. \n"
+        "       0.999 is faster. (default: %.3f) \n"
+        " --prosac - Sample the RANSAC hypotheses progressively, starting \n"
+        "       from the matches with the best nearest neighbor ratios. \n"
+        " --tdd [value] - Number of random matches on which each RANSAC \n"
+        "       hypothesis must be an inlier before it is scored on all of \n"
+        "       them. Use 0 to score every hypothesis. (default: %d) \n"
         " --type [value] - Type of transformation to be applied. \n"
-        "       Supported arguments: \"affine\" (default: affine) \n"
+        "       Supported arguments: \"affine\", \"similarity\", \"rigid\" \n"
+        "       (default: affine) \n"
 	" --resample - Internally resample the images to have the same \n"
-	"	physical resolution. This is slow. Use it when the images \n"
-	"	have very different resolutions, for example registering 5mm \n"
-	"	to 1mm slices. \n"
+	"	physical resolution. Use it when the images have very \n"
+	"	different resolutions, for example registering 5mm to 1mm \n"
+	"	slices. \n"
         "\n",
         SIFT3D_nn_thresh_default, SIFT3D_err_thresh_default, 
-        SIFT3D_num_iter_default);
+        SIFT3D_num_iter_default, 
+        (unsigned long long) SIFT3D_seed_default, SIFT3D_conf_default,
+        SIFT3D_tdd_default);
         print_opts_SIFT3D();
 }
 
@@ -122,10 +141,16 @@ int main(int argc, char *argv[]) {
                 {"num_iter", required_argument, NULL, NUM_ITER},
                 {"type", required_argument, NULL, TYPE},
 		{"resample", no_argument, NULL, RESAMPLE},
+                {"seed", required_argument, NULL, SEED},
+                {"conf", required_argument, NULL, CONF},
+                {"prosac", no_argument, NULL, PROSAC},
+                {"tdd", required_argument, NULL, TDD},
                 {0, 0, 0, 0}
         };
 
         const char str_affine[] = "affine";
+        const char str_similarity[] = "similarity";
+        const char str_rigid[] = "rigid";
 
         // Parse the GNU standard options
         switch (parse_gnu(argc, argv)) {
@@ -159,9 +184,8 @@ int main(int argc, char *argv[]) {
         // Parse the SIFT3D options
         if ((argc = parse_args_SIFT3D(&sift3d, argc, argv, SIFT3D_FALSE)) < 0)
                 return 1;
-        if (set_SIFT3D_Reg_SIFT3D(&reg, &sift3d) ||
-                set_Ransac_Reg_SIFT3D(&reg, &ran)) {
-                err_msgu("Failed to save the SIFT3D or Ransac parameters.");
+        if (set_SIFT3D_Reg_SIFT3D(&reg, &sift3d)) {
+                err_msgu("Failed to save the SIFT3D parameters.");
                 return 1;
         }
 
@@ -226,6 +250,10 @@ int main(int argc, char *argv[]) {
                 case TYPE:
                         if (!strcmp(optarg, str_affine)) {
                                 type = AFFINE;
+                        } else if (!strcmp(optarg, str_similarity)) {
+                                type = SIMILARITY;
+                        } else if (!strcmp(optarg, str_rigid)) {
+                                type = RIGID;
                         } else {
 
                                 char msg[BUF_SIZE];
@@ -240,12 +268,56 @@ int main(int argc, char *argv[]) {
                 case RESAMPLE:
                         resample = SIFT3D_TRUE;
                         break;
+                case SEED:
+                {
+                        char *end;
+                        uint64_t seed;
+
+                        errno = 0;
+                        seed = strtoull(optarg, &end, 0);
+                        if (end == optarg || *end != '\0' || errno ||
+                                set_seed_Ransac(&ran, seed)) {
+                                err_msg("Invalid value for seed.");
+                                return 1;
+                        }
+                        break;
+                }
+                case CONF:
+                {
+                        const double conf = atof(optarg);
+                        if (set_conf_Ransac(&ran, conf)) {
+                                err_msg("Invalid value for conf.");
+                                return 1;
+                        }
+                        break;
+                }
+                case TDD:
+                {
+                        const int tdd = atoi(optarg);
+                        if (set_tdd_Ransac(&ran, tdd)) {
+                                err_msg("Invalid value for tdd.");
+                                return 1;
+                        }
+                        break;
+                }
+                case PROSAC:
+                        if (set_prosac_Ransac(&ran, SIFT3D_TRUE)) {
+                                err_msgu("Failed to enable PROSAC.");
+                                return 1;
+                        }
+                        break;
                 case '?':
                 default:
                         return 1;
                 }
         }
 
+        // Save the Ransac parameters
+        if (set_Ransac_Reg_SIFT3D(&reg, &ran)) {
+                err_msgu("Failed to save the Ransac parameters.");
+                return 1;
+        }
+
         // Ensure that at least one output was specified
         if (!have_match && !have_tform) {
                 err_msg("No outputs were specified.");
@@ -0,0 +1,155 @@
+/* -----------------------------------------------------------------------------
+ * matchQuantC.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Benchmark of matching quantized SIFT3D descriptors using the C API. Reports
+ * the speed of each matcher, and the agreement between their match sets.
+ */
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* SIFT3D headers */
+#include "imutil.h"
+#include "sift.h"
+
+/* Example file paths */
+const char *ref_path = "1.nii.gz";
+const char *src_path = "2.nii.gz";
+
+/* Benchmark parameters */
+const float nn_thresh = 0.8f; // Matching threshold, as in Reg_SIFT3D
+const int num_reps = 5; // Number of times each matcher is run
+
+/* Get the wall-clock time, in seconds */
+static double get_time(void) {
+
+        struct timespec ts;
+
+        timespec_get(&ts, TIME_UTC);
+        return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+}
+
+/* Helper function to read an image and extract its descriptors */
+static int extract(SIFT3D *const sift3d, const char *path, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        Image im;
+        Keypoint_store kp;
+        int ret;
+
+        init_im(&im);
+        init_Keypoint_store(&kp);
+
+        ret = im_read(path, &im) || 
+                SIFT3D_detect_keypoints(sift3d, &im, &kp) ||
+                SIFT3D_extract_descriptors(sift3d, &kp, desc);
+
+        im_free(&im);
+        cleanup_Keypoint_store(&kp);
+        return ret;
+}
+
+/* This illustrates how to quantize and match descriptors, and measures the
+ * agreement with the full-precision matches. */
+int demo(void) {
+
+	SIFT3D sift3d;
+	SIFT3D_Descriptor_store desc[2];
+        SIFT3D_Qdesc_store qdesc[2];
+        double start, time_float, time_quant;
+        float scale;
+        int *matches_float, *matches_quant;
+        int i, num_float, num_quant, num_both, ret;
+
+        // Initialize the intermediates
+        init_SIFT3D_Descriptor_store(desc);
+        init_SIFT3D_Descriptor_store(desc + 1);
+        init_SIFT3D_Qdesc_store(qdesc);
+        init_SIFT3D_Qdesc_store(qdesc + 1);
+        matches_float = matches_quant = NULL;
+        ret = 1;
+        if (init_SIFT3D(&sift3d))
+                return 1;
+
+        // Extract the descriptors
+        if (extract(&sift3d, ref_path, desc) || 
+                extract(&sift3d, src_path, desc + 1))
+                goto demo_quit;
+
+        // Quantize both stores with a common scale
+        if (SIFT3D_calibrate_quant_scale(desc, 2, &scale) ||
+                SIFT3D_quantize_descriptors(desc, scale, qdesc) ||
+                SIFT3D_quantize_descriptors(desc + 1, scale, qdesc + 1))
+                goto demo_quit;
+
+        // Time the full-precision matcher
+        start = get_time();
+        for (i = 0; i < num_reps; i++) {
+                if (SIFT3D_nn_match(desc, desc + 1, nn_thresh, 
+                        &matches_float))
+                        goto demo_quit;
+        }
+        time_float = (get_time() - start) / num_reps;
+
+        // Time the quantized matcher
+        start = get_time();
+        for (i = 0; i < num_reps; i++) {
+                if (SIFT3D_nn_match_quant(qdesc, qdesc + 1, nn_thresh,
+                        &matches_quant))
+                        goto demo_quit;
+        }
+        time_quant = (get_time() - start) / num_reps;
+
+        // Compare the match sets
+        num_float = num_quant = num_both = 0;
+        for (i = 0; i < (int) desc[0].num; i++) {
+                num_float += matches_float[i] >= 0;
+                num_quant += matches_quant[i] >= 0;
+                num_both += matches_float[i] >= 0 && 
+                        matches_float[i] == matches_quant[i];
+        }
+
+        // Print the results
+        printf("Descriptors: %lu, %lu \n", (unsigned long) desc[0].num,
+                (unsigned long) desc[1].num);
+        printf("Quantization scale: %f \n", scale);
+        printf("float matcher: %d matches, %f s \n", num_float, time_float);
+        printf("quantized matcher: %d matches, %f s (%.1fx) \n", num_quant, 
+                time_quant, time_float / time_quant);
+        printf("Agreement: %d common matches, Jaccard index %f \n", num_both, 
+                num_float + num_quant - num_both > 0 ? (double) num_both / 
+                (double) (num_float + num_quant - num_both) : 1.0);
+        ret = 0;
+
+demo_quit:
+        // Clean up
+        cleanup_SIFT3D(&sift3d);
+        cleanup_SIFT3D_Descriptor_store(desc);
+        cleanup_SIFT3D_Descriptor_store(desc + 1);
+        cleanup_SIFT3D_Qdesc_store(qdesc);
+        cleanup_SIFT3D_Qdesc_store(qdesc + 1);
+        free(matches_float);
+        free(matches_quant);
+
+        return ret;
+}
+
+int main(void) {
+
+        int ret;
+
+        // Do the demo
+        ret = demo();
+
+        // Check for errors
+        if (ret != 0) {
+                fprintf(stderr, "Fatal demo error, code %d. \n", ret);
+                return 1;
+        }
+
+        return 0;
+}
@@ -12,6 +12,20 @@
 #include "immacros.h"
 #include "dicom.h"
 
+/* Whether read_dcm_dir keeps an index of the series metadata */
+static int dcm_index_enabled = SIFT3D_FALSE;
+
+/* Enable or disable the DICOM series index. When enabled, reading a directory
+ * of DICOM files stores the metadata of its files in a hidden index file in
+ * that directory. Later reads of the same directory take the metadata from
+ * the index, rather than opening every file, provided that the names, 
+ * inodes, sizes, and modification and status change times of the files still
+ * match. Directories which cannot be written are read as usual. Disabled by 
+ * default. */
+void im_set_dcm_index(const int enable) {
+        dcm_index_enabled = enable;
+}
+
 #ifndef SIFT3D_WITH_DICOM
 /* Return error messages if this was not compiled with DICOM support. */ 
 
@@ -65,6 +79,7 @@ int write_dcm_dir(const char *path, const Image *const im,
 #include "dcmtk/dcmimgle/diutils.h"     /* for DIPixel */
 #include "dcmtk/dcmimage/diregist.h"     /* include to support color images */
 #include "dcmtk/dcmdata/dcrledrg.h"      /* for DcmRLEDecoderRegistration */
+#include "dcmtk/dcmdata/dcistrmb.h"      /* for DcmInputBufferStream */
 
 #include "dcmtk/dcmjpeg/djdecode.h"      /* for dcmjpeg decoders */
 #include "dcmtk/dcmjpeg/dipijpeg.h"      /* for dcmimage JPEG plugin */
@@ -87,6 +102,8 @@ int write_dcm_dir(const char *path, const Image *const im,
 #include <cfloat>
 #include <stdint.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* Macro to call a C++ function and catch any exceptions it throws,
  * returning SIFT3D_FAILURE when an exception is caught. The return value is
@@ -107,6 +124,7 @@ const std::string sepStr(1, SIFT3D_FILE_SEP);
 
 /* Dicom parameteres */
 const unsigned int dcm_bit_width = 8; // Bits per pixel
+const int dcm_read_batch = 256; // Number of files read into memory at once
 
 /* DICOM metadata defaults */
 const char *default_patient_name = "DefaultSIFT3DPatient";
@@ -114,16 +132,34 @@ const char *default_series_descrip = "Series generated by SIFT3D";
 const char *default_patient_id = "DefaultSIFT3DPatientID";
 const char default_instance_num = 1;
 
+/* DICOM index file name and format version */
+const char *dcm_index_name = ".sift3d_dcm_index";
+const char *dcm_index_magic = "SIFT3D_DCM_INDEX";
+const int dcm_index_version = 2;
+
 /* Helper declarations */
 class Dicom;
 static bool isLittleEndian(void);
 static void default_Dcm_meta(Dcm_meta *const meta);
 static int load_file(const char *path, DcmFileFormat &fileFormat);
+static int load_header(const char *path, DcmFileFormat &fileFormat);
+static void register_decoders(void);
+static void cleanup_decoders(void);
 static int read_dcm_cpp(const char *path, Image *const im);
 static int read_dcm_img(const Dicom &dicom, Image *const im);
+static int decode_dcm_img(const Dicom &dicom, const void *const buf, 
+        const size_t len, const int off_z, Image *const im);
 static int read_dso(const char *imDir, Dicom &dso, 
                             Image *const mask);
 static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms);
+static void dcm_index_stamp(const struct stat &st, long long *const stamp);
+static int read_dcm_index(const char *path, 
+        const std::vector<std::string> &files, 
+        const std::vector<struct stat> &stats, std::vector<Dicom> &headers);
+static void write_dcm_index(const char *path, 
+        const std::vector<std::string> &files, 
+        const std::vector<struct stat> &stats, 
+        const std::vector<Dicom> &headers);
 static int read_dcm_dir_cpp(const char *path, Image *const im);
 static int write_dcm_cpp(const char *path, const Image *const im,
         const Dcm_meta *const meta, const float max_val);
@@ -132,8 +168,6 @@ static int write_dcm_dir_cpp(const char *path, const Image *const im,
 static void set_meta_defaults(const Dcm_meta *const meta, 
         Dcm_meta *const meta_new);
 static int dcm_resize_im(const std::vector<Dicom> &dicoms, Image *const im);
-static int copy_slice(const Image *const slice, const int off_z, 
-        Image *const volume);
 
 /* Helper class to store DICOM data. */
 class Dicom {
@@ -157,6 +191,13 @@ public:
         /* Load a file */
         Dicom(const char *filename);
 
+        /* Write the metadata to a line of an index file */
+        void writeIndex(FILE *const f) const;
+
+        /* Read the metadata of the file at path from a line of an index 
+         * file */
+        bool readIndex(FILE *const f, const char *path);
+
         /* Get the x-dimension */
         int getNx(void) const {
                 return nx;
@@ -242,12 +283,29 @@ static int load_file(const char *path, DcmFileFormat &fileFormat) {
         return SIFT3D_SUCCESS;
 }
 
-/* Load the data from a DICOM file */
+/* Read the header of a DICOM file with DCMTK, stopping at the pixel data.
+ * This is all that is needed to sort and validate a series, and avoids 
+ * reading and decoding every slice twice. */
+static int load_header(const char *path, DcmFileFormat &fileFormat) {
+
+        OFCondition status = fileFormat.loadFileUntilTag(path, EXS_Unknown, 
+                EGL_noChange, DCM_MaxReadLength, ERM_autoDetect, 
+                DCM_PixelData);
+        if (status.bad()) {
+                SIFT3D_ERR("load_header: failed to read DICOM file %s (%s)\n",
+                        path, status.text());
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Load the metadata from a DICOM file */
 Dicom::Dicom(const char *path) : filename(path), valid(false) {
 
-        // Read the file
+        // Read the header, leaving the pixel data on disk
         DcmFileFormat fileFormat;
-        if (load_file(path, fileFormat))
+        if (load_header(path, fileFormat))
                 return;
         DcmDataset *data = fileFormat.getDataset();
 
@@ -385,39 +443,81 @@ Dicom::Dicom(const char *path) : filename(path), valid(false) {
                 }
         }
 
-        // Load the DicomImage object
-        DicomImage dicomImage(path);
-        if (dicomImage.getStatus() != EIS_Normal) {
-                SIFT3D_ERR("Dicom.Dicom: failed to open image %s (%s)\n",
-                        path, 
-                        DicomImage::getString(dicomImage.getStatus()));
+        // Check for color images
+        const char *photometricStr;
+        Uint16 samplesPerPixel;
+        status = data->findAndGetString(DCM_PhotometricInterpretation, 
+                                        photometricStr);
+        if (status.bad() || photometricStr == NULL) {
+                SIFT3D_ERR("Dicom.Dicom: failed to get "
+                        "PhotometricInterpretation from file %s (%s)\n", 
+                        path, status.text());
                 return;
         }
-
-        // Check for color images
-        if (!dicomImage.isMonochrome()) {
+        if (data->findAndGetUint16(DCM_SamplesPerPixel, 
+                samplesPerPixel).bad())
+                samplesPerPixel = 1;
+        if (strncmp(photometricStr, "MONOCHROME", 10) || 
+                samplesPerPixel != 1) {
                 SIFT3D_ERR("Dicom.Dicom: reading of color DICOM images is "
                         "not supported at this time \n");
                 return;
         }
         nc = 1;
 
-        // Read the dimensions
-        nx = dicomImage.getWidth();
-        ny = dicomImage.getHeight();
-        nz = dicomImage.getFrameCount();
+        // Read the dimensions. Single-frame files may omit NumberOfFrames.
+        Uint16 rows, cols;
+        Sint32 frames;
+        if (data->findAndGetUint16(DCM_Columns, cols).bad() ||
+                data->findAndGetUint16(DCM_Rows, rows).bad()) {
+                SIFT3D_ERR("Dicom.Dicom: failed to get the image dimensions "
+                        "from file %s \n", path);
+                return;
+        }
+        if (data->findAndGetSint32(DCM_NumberOfFrames, frames).bad())
+                frames = 1;
+        nx = cols;
+        ny = rows;
+        nz = frames;
         if (nx < 1 || ny < 1 || nz < 1) {
                 SIFT3D_ERR("Dicom.Dicom: invalid dimensions for file %s "
                         "(%d, %d, %d)\n", path, nx, ny, nz);
                 return;
         }
 
-        // Set the window 
-        dicomImage.setMinMaxWindow();
-
         valid = true;
 }
 
+/* Write the metadata to a line of an index file. The UIDs are the first
+ * fields, as they contain no whitespace. */
+void Dicom::writeIndex(FILE *const f) const {
+        fprintf(f, "%s %s %s %.17g %.17g %.17g %.17g %d %d %d %d\n", 
+                classUID.c_str(), seriesUID.c_str(), instanceUID.c_str(), 
+                z, ux, uy, uz, nx, ny, nz, nc);
+}
+
+/* Read the metadata of the file at path from a line of an index file, as
+ * written by writeIndex. Returns true on success. */
+bool Dicom::readIndex(FILE *const f, const char *path) {
+
+        char classBuf[SIFT3D_UID_LEN], seriesBuf[SIFT3D_UID_LEN], 
+                instanceBuf[SIFT3D_UID_LEN];
+
+        valid = false;
+        if (fscanf(f, "%1023s %1023s %1023s %lf %lf %lf %lf %d %d %d %d", 
+                classBuf, seriesBuf, instanceBuf, &z, &ux, &uy, &uz, &nx, &ny,
+                &nz, &nc) != 11)
+                return false;
+
+        filename = path;
+        classUID = classBuf;
+        seriesUID = seriesBuf;
+        instanceUID = instanceBuf;
+        valid = nx > 0 && ny > 0 && nz > 0 && nc > 0;
+
+        return valid;
+}
+
 /* Check the endianness of the machine. Returns true if the machine is little-
  * endian, false otherwise. */
 static bool isLittleEndian(void) {
@@ -520,26 +620,22 @@ static int read_dcm_cpp(const char *path, Image *const im) {
         return read_dcm_img(dicom, im);
 }
 
-/* Helper function to read DICOM image data */
-static int read_dcm_img(const Dicom &dicom, Image *const im) {
-
-        const void *data;
-        const DiMonoPixel *pixels;
-	uint32_t shift;
-	int x, y, z, depth;
-        const int bufNBits = 32;
+/* Register the decoders for compressed transfer syntaxes. This modifies
+ * global DCMTK state, so it must not be called concurrently with 
+ * decode_dcm_img. */
+static void register_decoders(void) {
+        DJDecoderRegistration::registerCodecs();
+        DcmRLEDecoderRegistration::registerCodecs();
+}
 
-	// Initialize JPEG decoders
-	DJDecoderRegistration::registerCodecs();
+/* Release the decoders registered by register_decoders. */
+static void cleanup_decoders(void) {
+        DJDecoderRegistration::cleanup();
+        DcmRLEDecoderRegistration::cleanup();
+}
 
-        // Initialize the DicomImage object
-        const char *path = dicom.name();
-	DicomImage dicomImage(path);
-        if (dicomImage.getStatus() != EIS_Normal) {
-                SIFT3D_ERR("read_dcm_cpp: failed to open image %s (%s)\n",
-                        path, DicomImage::getString(dicomImage.getStatus()));
-		goto read_dcm_img_quit;
-        }
+/* Helper function to read DICOM image data */
+static int read_dcm_img(const Dicom &dicom, Image *const im) {
 
         // Initialize the image fields
         im->nx = dicom.getNx();
@@ -553,25 +649,91 @@ static int read_dcm_img(const Dicom &dicom, Image *const im) {
         // Resize the output
         im_default_stride(im);
         if (im_resize(im))
-		goto read_dcm_img_quit;
+                return SIFT3D_FAILURE;
+
+        // Decode the pixel data
+        register_decoders();
+        const int ret = decode_dcm_img(dicom, NULL, 0, 0, im);
+        cleanup_decoders();
+
+        return ret;
+}
+
+/* Decode the pixel data of a DICOM file into the slices of an image, 
+ * starting at slice off_z. The image must already be allocated, with the same
+ * x and y dimensions as the file. Different files may be decoded into the 
+ * same image concurrently, provided the decoders are already registered. 
+ *
+ * If buf is not NULL, it holds the contents of the file, of length len, and
+ * the file is parsed from memory. Otherwise, the file is read from disk. */
+static int decode_dcm_img(const Dicom &dicom, const void *const buf, 
+        const size_t len, const int off_z, Image *const im) {
+
+        const void *data;
+        const DiMonoPixel *pixels;
+        int x, y, z;
+
+        const char *path = dicom.name();
+        const int nx = dicom.getNx();
+        const int ny = dicom.getNy();
+        const int nz = dicom.getNz();
+
+        // Verify dimensions
+        if (im->nx != nx || im->ny != ny || im->nz < nz + off_z ||
+                im->nc != dicom.getNc()) {
+                SIFT3D_ERR("decode_dcm_img: file %s does not fit into the "
+                        "image volume \n", path);
+                return SIFT3D_FAILURE;
+        }
+
+        // Initialize the DicomImage object, parsing the file from memory if
+        // it was already read. fileFormat must outlive dicomImage.
+        DcmFileFormat fileFormat;
+        std::unique_ptr<DicomImage> dicomImage;
+        if (buf == NULL) {
+                dicomImage.reset(new DicomImage(path));
+        } else {
+                DcmInputBufferStream stream;
+                stream.setBuffer(buf, len);
+                stream.setEos();
+                fileFormat.transferInit();
+                OFCondition status = fileFormat.read(stream);
+                fileFormat.transferEnd();
+                if (status.bad()) {
+                        SIFT3D_ERR("decode_dcm_img: failed to parse DICOM "
+                                "file %s (%s)\n", path, status.text());
+                        return SIFT3D_FAILURE;
+                }
+                dicomImage.reset(new DicomImage(&fileFormat, 
+                        fileFormat.getDataset()->getOriginalXfer()));
+        }
+        if (dicomImage->getStatus() != EIS_Normal) {
+                SIFT3D_ERR("decode_dcm_img: failed to open image %s (%s)\n",
+                        path, DicomImage::getString(dicomImage->getStatus()));
+                return SIFT3D_FAILURE;
+        }
 
         // Get the vendor-independent intermediate pixel data
-        pixels = (const DiMonoPixel *) dicomImage.getInterData();
+        pixels = (const DiMonoPixel *) dicomImage->getInterData();
         if (pixels == NULL) {
-                SIFT3D_ERR("read_dcm_img: failed to get intermediate data for "
-                        "%s\n", path);
-                goto read_dcm_img_quit;
+                SIFT3D_ERR("decode_dcm_img: failed to get intermediate data "
+                        "for %s\n", path);
+                return SIFT3D_FAILURE;
         }
-        depth = pixels->getBits();
 
         // Macro to copy the data
+        const int x_start = 0;
+        const int y_start = 0;
+        const int z_start = off_z;
+        const int x_end = nx - 1;
+        const int y_end = ny - 1;
+        const int z_end = off_z + nz - 1;
 #define COPY_DATA(type) \
-        SIFT3D_IM_LOOP_START(im, x, y, z) \
-                const int y_stride = im->nx; \
-                const int z_stride = im->nx * im->ny; \
+        SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, x_start, x_end, y_start, \
+                y_end, z_start, z_end) \
                 SIFT3D_IM_GET_VOX(im, x, y, z, 0) = \
-                        (float) *((type *) data + x + y * y_stride + \
-                                z * z_stride);\
+                        (float) *((type *) data + x + y * nx + \
+                                (z - off_z) * nx * ny);\
         SIFT3D_IM_LOOP_END
 
         // Choose the appropriate data type and copy the data
@@ -596,74 +758,13 @@ static int read_dcm_img(const Dicom &dicom, Image *const im) {
                 COPY_DATA(int32_t)
                 break;
         default:
-                SIFT3D_ERR("read_dcm_img: unrecognized pixel representation "
+                SIFT3D_ERR("decode_dcm_img: unrecognized pixel representation "
                         "for %s\n", path);
-                goto read_dcm_img_quit;
+                return SIFT3D_FAILURE;
         }
 #undef COPY_DATA
 
-#if 0
-        // Get the bit depth of the image
-        depth = dicomImage.Depth();
-        if (depth > bufNBits) 
-                SIFT3D_ERR("read_dcm_cpp: buffer is insufficiently wide "
-                        "for %d-bit data of image %s \n", depth, path);
-		goto read_dcm_img_quit;
-        }
-
-        // Get the number of bits by which we need to shift the 32-bit data, to
-        // recover the original resolution (DICOM uses Big-endian encoding)
-        shift = isLittleEndian() ? static_cast<uint32_t>(bufNBits - depth) : 0;
-
-        // Read each frame
-        for (int i = 0; i < im->nz; i++) { 
-
-                int x, y, z;
-
-                const int x_start = 0;
-                const int y_start = 0;
-                const int z_start = i;
-                const int x_end = im->nx - 1;
-                const int y_end = im->ny - 1;
-                const int z_end = z_start;
-
-                // Get a pointer to the data, rendered as a 32-bit int
-                const uint32_t *const frameData = 
-                        static_cast<const uint32_t *const>(
-                                dicomImage.getOutputData(
-                                        static_cast<int>(bufNBits), i));
-                if (frameData == NULL) {
-                        SIFT3D_ERR("read_dcm_cpp: could not get data from "
-                                "image %s frame %d (%s)\n", path, i, 
-                                DicomImage::getString(dicomImage.getStatus()));
-			goto read_dcm_img_quit;
-                }
-
-                // Copy the frame
-                SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, x_start, x_end,
-                        y_start, y_end, z_start, z_end)
-
-                        // Get the voxel and shift it to match the original
-                        // magnitude 
-                        const uint32_t vox =
-                                frameData[x + y * im->nx] >> shift;
-
-                        // Convert to float and write to the output image
-                        SIFT3D_IM_GET_VOX(im, x, y, z, 0) =
-                                static_cast<float>(vox);
-
-                SIFT3D_IM_LOOP_END
-        }
-#endif
-
-	// Clean up
-	DJDecoderRegistration::cleanup();
-
         return SIFT3D_SUCCESS;
-
-read_dcm_img_quit:
-	DJDecoderRegistration::cleanup();
-	return SIFT3D_FAILURE;
 }
 
 /* Read a DICOM Segmentation Object (DSO) mask. 
@@ -846,8 +947,8 @@ static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
                 return SIFT3D_FAILURE;
         }
 
-        // Get all of the .dcm files in the directory, ignoring DSOs
-        dicoms.clear();
+        // Get all of the .dcm files in the directory
+        std::vector<std::string> files;
         while ((ent = readdir(dir)) != NULL) {
 
                 // Form the full file path
@@ -857,24 +958,66 @@ static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
                 if (im_get_format(fullfile.c_str()) != DICOM)
                         continue;
 
-                // Read the file
-                Dicom dicom(fullfile.c_str());
-                if (!dicom.isValid()) {
-                        closedir(dir);
-                        return SIFT3D_FAILURE;
+                files.push_back(fullfile);
+        }
+
+        // Release the directory
+        closedir(dir);
+
+        // Sort the files by name, so they can be matched against the index
+        std::sort(files.begin(), files.end());
+        const int num_files = files.size();
+        std::vector<Dicom> headers(num_files);
+
+        // Get the file stamps for the index
+        std::vector<struct stat> stats;
+        if (dcm_index_enabled) {
+                stats.resize(num_files);
+                for (int i = 0; i < num_files; i++) {
+                        if (stat(files[i].c_str(), &stats[i])) {
+                                SIFT3D_ERR("read_dcm_dir_cpp: cannot find "
+                                        "file %s \n", files[i].c_str());
+                                return SIFT3D_FAILURE;
+                        }
+                }
+        }
+
+        // Read the headers in parallel, unless they are indexed
+        if (!dcm_index_enabled || 
+                read_dcm_index(path, files, stats, headers)) {
+
+#pragma omp parallel for schedule(dynamic)
+                for (int i = 0; i < num_files; i++) {
+                        try {
+                                headers[i] = Dicom(files[i].c_str());
+                        } catch (std::exception &e) {
+                                SIFT3D_ERR("read_dcm_dir_cpp: %s\n", 
+                                        e.what());
+                        } catch (...) {
+                                SIFT3D_ERR("read_dcm_dir_cpp: unexpected "
+                                        "exception \n");
+                        }
                 }
 
-                // Ignore DSOs
+                if (dcm_index_enabled)
+                        write_dcm_index(path, files, stats, headers);
+        }
+
+        // Keep the valid images, ignoring DSOs
+        dicoms.clear();
+        for (int i = 0; i < num_files; i++) {
+
+                const Dicom &dicom = headers[i];
+
+                if (!dicom.isValid())
+                        return SIFT3D_FAILURE;
+
                 if (dicom.isDSO())
                         continue;
 
-                // Add the file to the list
                 dicoms.push_back(dicom);
         }
 
-        // Release the directory
-        closedir(dir);
-        
         // Verify that dicom files were found
         if (dicoms.size() == 0) {
                 SIFT3D_ERR("read_dcm_dir_cpp: no DICOM files found in %s \n",
@@ -888,6 +1031,155 @@ static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
         return SIFT3D_SUCCESS;
 }
 
+/* Helper function to get the path of the index file for a directory */
+static std::string dcm_index_path(const char *path) {
+        return std::string(path) + sepStr + dcm_index_name;
+}
+
+/* Helper function to get the name of a file from its path. */
+static const char *dcm_base_name(const std::string &file) {
+        const size_t sep = file.find_last_of(SIFT3D_FILE_SEP);
+        return file.c_str() + (sep == std::string::npos ? 0 : sep + 1);
+}
+
+/* Number of fields identifying a version of a file in the index */
+#define DCM_INDEX_STAMP_LEN 6
+
+/* Helper function to get the fields identifying a version of a file in the
+ * index: its inode, size, and modification and status change times, to the 
+ * nanosecond. The status change time cannot be set by users, so a file which
+ * is rewritten in place is detected, even with the same size and 
+ * modification time. */
+static void dcm_index_stamp(const struct stat &st, long long *const stamp) {
+
+        stamp[0] = (long long) st.st_ino;
+        stamp[1] = (long long) st.st_size;
+#ifdef __APPLE__
+        stamp[2] = (long long) st.st_mtimespec.tv_sec;
+        stamp[3] = (long long) st.st_mtimespec.tv_nsec;
+        stamp[4] = (long long) st.st_ctimespec.tv_sec;
+        stamp[5] = (long long) st.st_ctimespec.tv_nsec;
+#else
+        stamp[2] = (long long) st.st_mtim.tv_sec;
+        stamp[3] = (long long) st.st_mtim.tv_nsec;
+        stamp[4] = (long long) st.st_ctim.tv_sec;
+        stamp[5] = (long long) st.st_ctim.tv_nsec;
+#endif
+}
+
+/* Read the DICOM headers of a directory from its index file.
+ *
+ * Parameters:
+ *      path - The directory.
+ *      files - The DICOM files in the directory, sorted by name.
+ *      stats - The result of stat() for each file.
+ *      headers - The metadata of each file, resized to match files.
+ *
+ * Returns SIFT3D_SUCCESS if the index exists and matches the names of the 
+ * files and their stamps, as in dcm_index_stamp, SIFT3D_FAILURE otherwise. */
+static int read_dcm_index(const char *path, 
+        const std::vector<std::string> &files, 
+        const std::vector<struct stat> &stats, std::vector<Dicom> &headers) {
+
+        char magic[32], name[FILENAME_MAX + 2];
+        long long stamp[DCM_INDEX_STAMP_LEN], stamp_st[DCM_INDEX_STAMP_LEN];
+        int version, num;
+        FILE *f;
+
+        const int num_files = files.size();
+
+        // Open the index
+        const std::string index = dcm_index_path(path);
+        if ((f = fopen(index.c_str(), "r")) == NULL)
+                return SIFT3D_FAILURE;
+
+        // Check the header
+        if (fscanf(f, "%31s %d %d", magic, &version, &num) != 3 ||
+                strcmp(magic, dcm_index_magic) || 
+                version != dcm_index_version || num != num_files)
+                goto read_dcm_index_quit;
+
+        // Read the entry of each file. The first line holds the stamp and 
+        // metadata, while the second holds the name.
+        for (int i = 0; i < num_files; i++) {
+
+                dcm_index_stamp(stats[i], stamp_st);
+                for (int j = 0; j < DCM_INDEX_STAMP_LEN; j++) {
+                        if (fscanf(f, "%lld", stamp + j) != 1 ||
+                                stamp[j] != stamp_st[j])
+                                goto read_dcm_index_quit;
+                }
+
+                if (!headers[i].readIndex(f, files[i].c_str()) ||
+                        fgets(name, sizeof(name), f) == NULL ||
+                        fgets(name, sizeof(name), f) == NULL)
+                        goto read_dcm_index_quit;
+
+                name[strcspn(name, "\r\n")] = '\0';
+                if (strcmp(name, dcm_base_name(files[i])))
+                        goto read_dcm_index_quit;
+        }
+
+        fclose(f);
+        return SIFT3D_SUCCESS;
+
+read_dcm_index_quit:
+        fclose(f);
+        return SIFT3D_FAILURE;
+}
+
+/* Write the DICOM headers of a directory to its index file, as read by
+ * read_dcm_index. The index is written to a uniquely named temporary file and
+ * then renamed, so that concurrent readers never see a partial index, and
+ * concurrent writers never touch each other's files. Failure to write the
+ * index is not an error, as it only serves to speed up later reads. */
+static void write_dcm_index(const char *path, 
+        const std::vector<std::string> &files, 
+        const std::vector<struct stat> &stats, 
+        const std::vector<Dicom> &headers) {
+
+        long long stamp[DCM_INDEX_STAMP_LEN];
+        FILE *f;
+        int fd, ok;
+
+        const int num_files = files.size();
+
+        // Only index directories in which every file could be read
+        for (int i = 0; i < num_files; i++) {
+                if (!headers[i].isValid())
+                        return;
+        }
+
+        // Write the temporary file
+        const std::string index = dcm_index_path(path);
+        std::string tmp = index + ".XXXXXX";
+        if ((fd = mkstemp(&tmp[0])) < 0)
+                return;
+        if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) ||
+                (f = fdopen(fd, "w")) == NULL) {
+                close(fd);
+                remove(tmp.c_str());
+                return;
+        }
+        ok = fprintf(f, "%s %d %d\n", dcm_index_magic, dcm_index_version, 
+                num_files) > 0;
+        for (int i = 0; ok && i < num_files; i++) {
+                dcm_index_stamp(stats[i], stamp);
+                for (int j = 0; ok && j < DCM_INDEX_STAMP_LEN; j++) {
+                        ok = fprintf(f, "%lld ", stamp[j]) > 0;
+                }
+                headers[i].writeIndex(f);
+                ok = ok && fprintf(f, "%s\n", dcm_base_name(files[i])) > 0;
+        }
+        ok = !ferror(f) && ok;
+        ok = !fclose(f) && ok;
+
+        // Atomically replace the index. If this fails, leave the existing
+        // index alone, as it may have just been written by another process.
+        if (!ok || rename(tmp.c_str(), index.c_str()))
+                remove(tmp.c_str());
+}
+
 /* Resize an image to fit a DICOM series. */
 static int dcm_resize_im(const std::vector<Dicom> &dicoms, Image *const im) {
 
@@ -1003,34 +1295,10 @@ static int dcm_resize_im(const std::vector<Dicom> &dicoms, Image *const im) {
         return SIFT3D_SUCCESS;
 }
 
-/* Helper function to copy a slice into a larger volume. */
-static int copy_slice(const Image *const slice, const int off_z, 
-        Image *const volume) {
-
-        int x, y, z, c;
-
-        // Verify dimensions
-        if (volume->nz < slice->nz + off_z ||
-                volume->nx != slice->nx ||
-                volume->ny != slice->ny ||
-                volume->nc != slice->nc)
-                return SIFT3D_FAILURE;
-
-        // Copy the data
-        SIFT3D_IM_LOOP_START_C(slice, x, y, z, c)
-
-                SIFT3D_IM_GET_VOX(volume, x, y, z + off_z, c) =
-                        SIFT3D_IM_GET_VOX(slice, x, y, z, c);
-
-        SIFT3D_IM_LOOP_END_C
-
-        return SIFT3D_SUCCESS;
-}
-
 /* Helper function to read a directory of DICOM files using C++ */
 static int read_dcm_dir_cpp(const char *path, Image *const im) {
 
-        int ret, i, off_z;
+        int ret, i, error;
 
         // Read the DICOM metadata
         std::vector<Dicom> dicoms;
@@ -1041,27 +1309,61 @@ static int read_dcm_dir_cpp(const char *path, Image *const im) {
         if (ret = dcm_resize_im(dicoms, im))
                 return ret;
 
-        // Allocate a temporary image for the slices
-        Image slice;
-        init_im(&slice);
-
-        // Read the image data
-        off_z = 0;
+        // Compute the slice offset of each file
         const int num_files = dicoms.size();
+        std::vector<int> offs(num_files);
+        int off_z = 0;
         for (i = 0; i < num_files; i++) {
+                offs[i] = off_z;
+                off_z += dicoms[i].getNz();
+        }
+        assert(off_z == im->nz);
 
-                // Read and copy the slice data
-                if (read_dcm_img(dicoms[i], &slice) ||
-                        copy_slice(&slice, off_z, im)) {
-                        im_free(&slice);
-                        return SIFT3D_FAILURE;
+        // Read the files in batches, decoding each batch directly into the 
+        // volume, in parallel
+        const int batch_max = SIFT3D_MIN(num_files, dcm_read_batch);
+        std::vector<const char *> paths(batch_max);
+        std::vector<void *> bufs(batch_max);
+        std::vector<size_t> lens(batch_max);
+        error = SIFT3D_FALSE;
+        register_decoders();
+        for (int start = 0; start < num_files && !error; 
+                start += batch_max) {
+
+                const int batch = SIFT3D_MIN(batch_max, num_files - start);
+
+                // Read the batch into memory
+                for (i = 0; i < batch; i++) {
+                        paths[i] = dicoms[start + i].name();
+                }
+                if (im_read_files(paths.data(), batch, 0, bufs.data(), 
+                        lens.data())) {
+                        error = SIFT3D_TRUE;
+                        break;
+                }
+
+                // Decode the batch
+#pragma omp parallel for schedule(dynamic)
+                for (i = 0; i < batch; i++) {
+
+                        int ret_i;
+
+                        CATCH_EXCEPTIONS(ret_i, "read_dcm_dir_cpp", 
+                                decode_dcm_img, dicoms[start + i], bufs[i], 
+                                lens[i], offs[start + i], im);
+                        if (ret_i) {
+#pragma omp atomic write
+                                error = SIFT3D_TRUE;
+                        }
+                }
+
+                for (i = 0; i < batch; i++) {
+                        free(bufs[i]);
                 }
-                off_z += slice.nz;
         }
-        assert(off_z == im->nz);
-        im_free(&slice);
+        cleanup_decoders();
 
-        return SIFT3D_SUCCESS;
+        return error ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
 } 
 
 /* Helper function to set meta_new to default values if meta is NULL,
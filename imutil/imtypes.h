@@ -8,6 +8,7 @@
  */
 
 #include <time.h>
+#include <stdint.h>
 
 #ifndef _IMTYPES_H
 #define _IMTYPES_H
@@ -89,6 +90,7 @@ extern "C" {
 /* Derived constants */
 #define DESC_NUM_TOTAL_HIST (NHIST_PER_DIM * NHIST_PER_DIM * NHIST_PER_DIM)
 #define DESC_NUMEL (DESC_NUM_TOTAL_HIST * HIST_NUMEL)
+#define DESC_BIN_WORDS ((DESC_NUMEL + 63) / 64) // Words in a binary descriptor
 
 // The number of elements in a gradient histogram
 #ifdef ICOS_HIST
@@ -164,6 +166,8 @@ typedef struct _Image {
         size_t xs, ys, zs;      // Stride in x, y, and z
         int nc;                 // The number of channels
 	int cl_valid;		// If TRUE, cl_image is valid
+        void *map;              // File mapping holding data, or NULL
+        size_t map_size;        // Size of map in bytes
 
 } Image;
 
@@ -304,6 +308,68 @@ typedef struct _SIFT3D_Descriptor_store {
 
 } SIFT3D_Descriptor_store;
 
+/* Struct to hold SIFT3D descriptors quantized to 7-bit unsigned integers.
+ * Each feature element is round(x * scale), clamped to [0, 127], so that the
+ * features may also be read as signed bytes by the dot-product kernels. */
+typedef struct _SIFT3D_Qdesc_store {
+
+        uint8_t *feat;          // num x DESC_NUMEL array of features
+        int32_t *norm_sq;       // Squared L2 norm of each row of feat
+        float *coords;          // num x 4 array of [x y z s]
+        size_t num;             // Number of descriptors
+        float scale;            // Quantization scale
+        int nx, ny, nz;         // Image dimensions
+
+} SIFT3D_Qdesc_store;
+
+/* Struct to hold binary SIFT3D descriptors. Each descriptor is a bit vector 
+ * of DESC_NUMEL bits, packed into DESC_BIN_WORDS 64-bit words. */
+typedef struct _SIFT3D_Bdesc_store {
+
+        uint64_t *bits;         // num x DESC_BIN_WORDS array of bits
+        float *coords;          // num x 4 array of [x y z s]
+        size_t num;             // Number of descriptors
+        int nx, ny, nz;         // Image dimensions
+
+} SIFT3D_Bdesc_store;
+
+/* Struct to hold a PCA projection of SIFT3D descriptors. The projection of
+ * a feature vector x is proj * (x - mean). */
+typedef struct _SIFT3D_Pca {
+
+        float *mean;            // Mean feature vector, DESC_NUMEL elements
+        float *proj;            // dim x DESC_NUMEL array of principal axes
+        float *var;             // Variance along each axis, dim elements
+        int dim;                // Projected dimension
+
+} SIFT3D_Pca;
+
+/* Struct to hold PCA-projected SIFT3D descriptors */
+typedef struct _SIFT3D_Pdesc_store {
+
+        float *feat;            // num x dim array of projected features
+        float *coords;          // num x 4 array of [x y z s]
+        size_t num;             // Number of descriptors
+        int dim;                // Projected dimension
+        int nx, ny, nz;         // Image dimensions
+
+} SIFT3D_Pdesc_store;
+
+/* Read-only view of a binary descriptor database. The data are memory-mapped
+ * where possible, so they can be shared between processes. See
+ * open_SIFT3D_Descriptor_db for the file format. */
+typedef struct _SIFT3D_Descriptor_db {
+
+        const float *coords;    // num x 4 array of [x y z s]
+        const float *feat;      // num x DESC_NUMEL array of features
+        void *map;              // Start of the mapped file, or a buffer
+        size_t map_size;        // Size of map, in bytes
+        size_t num;             // Number of descriptors
+        int nx, ny, nz;         // Image dimensions
+        int mapped;             // SIFT3D_TRUE if map was memory-mapped
+
+} SIFT3D_Descriptor_db;
+
 /* Struct to hold all parameters and internal data of the 
  * SIFT3D algorithms */
 typedef struct _SIFT3D {
@@ -336,7 +402,12 @@ typedef struct _SIFT3D {
 /* Geometric transformations that can be applied by this library. */
 typedef enum _tform_type {
 	AFFINE,         // Affine (linear + constant)
-	TPS             // Thin-plate spline	
+	TPS,            // Thin-plate spline	
+	RIGID,          // Rotation + constant, stored as an Affine
+	SIMILARITY,     // Rotation, isotropic scaling + constant, as RIGID
+	BSPLINE_FFD,    // Affine + cubic B-spline free-form deformation
+	DISPLACEMENT_FIELD, // Dense displacement field, see Disp_field
+	COMPOSITE       // Composition of transformations, see Composite
 } tform_type;
 
 /* Interpolation algorithms that can be used by this library. */
@@ -356,9 +427,15 @@ typedef struct _Tform_vtable {
         int (*apply_Mat_rm)(const void *const, const Mat_rm *const, 
                 Mat_rm *const);
 
+        int (*apply_points)(const void *const, const Mat_rm_type, const int, 
+                const void *const, const void *const, const void *const,
+                void *const, void *const, void *const);
+
         size_t (*get_size)(void);
 
         int (*write)(const char *, const void *const);
+
+        int (*read)(const char *, void *const);
        
         void (*cleanup)(void *const);
 
@@ -384,10 +461,63 @@ typedef struct _Tps {
 	int dim; 	// Dimensionality, e.g. 3
 } Tps;
 
+/* Struct to hold a 3D cubic B-spline free-form deformation, x' = Ax + d(x).
+ * The displacement d is a tensor product of cubic B-splines, with control 
+ * point [i, j, k] at ((i - 1) * spacing[0], (j - 1) * spacing[1], 
+ * (k - 1) * spacing[2]). It vanishes outside the support of the lattice. */
+typedef struct _Bspline {
+        Tform tform;                    // Abstract parent class
+        Mat_rm A;                       // Affine part, [3x4]
+        Mat_rm coef;                    // Displacements, [num_ctrl x 3], 
+                                        // x fastest
+        double spacing[IM_NDIMS];       // Control point spacing, in the 
+                                        // units of the input coordinates
+        int dims[IM_NDIMS];             // Lattice dimensions, in nodes
+} Bspline;
+
+/* Struct to hold a dense 3D displacement field, x' = x + d(x). d is stored 
+ * at every voxel of a lattice, typically that of the images to be warped, 
+ * and interpolated trilinearly in between. Outside the lattice, the 
+ * displacement of the nearest lattice voxel is used. See make_Disp_field. */
+typedef struct _Disp_field {
+        Tform tform;    // Abstract parent class
+        Image disp;     // Displacements, [nx x ny x nz x 3]
+} Disp_field;
+
+/* Struct to hold a composition of transformations, 
+ * x' = tforms[0](tforms[1](... tforms[num - 1](x))), evaluated lazily. The
+ * composite owns copies of its transformations. See append_Composite. */
+typedef struct _Composite {
+        Tform tform;    // Abstract parent class
+        void **tforms;  // The transformations, outermost first
+        int num;        // Number of transformations
+} Composite;
+
+/* Struct to hold a 3D thin-plate spline sampled on a lattice, for fast 
+ * evaluation by cubic B-spline interpolation. See make_Tps_grid. */
+typedef struct _Tps_grid {
+        const Tps *tps;         // The spline, evaluated exactly off the domain
+        double *coef;           // B-spline coefficients, 3 per lattice node
+        double err;             // Largest error measured at the test 
+                                // points, in voxels. Not a bound.
+        int spacing;            // Lattice spacing in voxels, or 0 if exact
+        int nx, ny, nz;         // Domain dimensions, in voxels
+        int lx, ly, lz;         // Lattice dimensions, in nodes
+} Tps_grid;
+
 /* Struct to hold RANSAC parameters */
 typedef struct _Ransac {
  	double err_thresh; //error threshold for RANSAC inliers
 	int num_iter; //number of RANSAC iterations
+	uint64_t seed; //seed for the random sample streams
+	double conf; //confidence for early termination, in (0, 1]
+	int prosac; //if true, sample progressively from the best matches
+	int tdd; //number of points in the T(d,d) pre-verification, or 0
+	int tps_ctrl; //maximum number of TPS control points
+	double tps_lambda; //TPS smoothing weight
+	double ffd_spacing; //B-spline control point spacing, in the units of the 
+			    //matches, i.e. mm in register_SIFT3D
+	double ffd_lambda; //B-spline smoothing weight
 } Ransac;
 
 #ifdef __cplusplus
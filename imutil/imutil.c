@@ -20,13 +20,24 @@
 #include <string.h>
 #include <stddef.h>
 #include <float.h>
+#include <limits.h>
 #include <zlib.h>
+#ifdef SIFT3D_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifndef _WINDOWS
+#include <sys/mman.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "immacros.h"
 #include "imtypes.h"
 #include "dicom.h"
 #include "nifti.h"
+#include "uring.h"
 #include "imutil.h"
 
 /* Check for a version number */
@@ -52,6 +63,24 @@
 /* Implementation parameters */
 //#define SIFT3D_USE_OPENCL // Use OpenCL acceleration
 #define SIFT3D_RANSAC_REFINE	// Use least-squares refinement in RANSAC
+#define RANSAC_MAX_DRAWS 100    // Maximum singular samples per RANSAC iteration
+#define RANSAC_BATCH 64         // RANSAC iterations between termination checks
+#define RANSAC_CHUNK 256        // Points scored between early abort checks
+#define TPS_GRID_SPACING_MAX 16 // Coarsest TPS lattice spacing, in voxels
+#define TPS_GRID_PAD 6          // TPS lattice nodes beyond each side of the domain
+#define TPS_GRID_NUM_TEST 24    // Maximum TPS error test cells per dimension
+#define TPS_FIT_BLOCK 256       // Points per block of the TPS normal equations
+#define BSPLINE_CG_MAX_ITER 1000 // Maximum conjugate gradient iterations
+#define BSPLINE_CG_TOL 1e-6     // Conjugate gradient relative tolerance
+#define LANCZOS_A 2             // Lanczos kernel parameter
+#define LANCZOS_TAPS (2 * LANCZOS_A) // Lanczos taps per dimension
+#define LANCZOS_PHASES 1024     // Tabulated sub-voxel phases of the Lanczos kernel
+#define GZ_LEVEL Z_DEFAULT_COMPRESSION // gzip compression level
+#define BGZF_BLOCK_MAX 65536    // Maximum size of a compressed BGZF block
+#define BGZF_DATA_MAX 0xff00    // Maximum uncompressed bytes per BGZF block
+#define BGZF_HEADER_SIZE 18     // Size of a BGZF block header
+#define BGZF_FOOTER_SIZE 8      // Size of a BGZF block footer
+#define CSV_NUM_PARTS 64        // Row blocks formatted in parallel for CSV output
 
 /* Implement strnlen, if it's missing */
 #ifndef SIFT3D_HAVE_STRNLEN
@@ -101,10 +130,20 @@ const mode_t out_mode = 0755;
 /* Default parameters */
 const double SIFT3D_err_thresh_default = 5.0;
 const int SIFT3D_num_iter_default = 500;
+const uint64_t SIFT3D_seed_default = 0x5EED5EED5EED5EEDULL;
+const double SIFT3D_conf_default = 1.0;
+const int SIFT3D_tdd_default = 0;
+const int SIFT3D_tps_ctrl_default = 500;
+const double SIFT3D_tps_lambda_default = 1e-4;
+const double SIFT3D_ffd_spacing_default = 32.0;
+const double SIFT3D_ffd_lambda_default = 1e-2;
 
 /* Declarations for the virtual function implementations */
 static int copy_Affine(const void *const src, void *const dst);
 static int copy_Tps(const void *const src, void *const dst);
+static int copy_Bspline(const void *const src, void *const dst);
+static int copy_Disp_field(const void *const src, void *const dst);
+static int copy_Composite(const void *const src, void *const dst);
 static void apply_Affine_xyz(const void *const affine, const double x_in,
 			     const double y_in, const double z_in,
 			     double *const x_out, double *const y_out,
@@ -113,16 +152,68 @@ static void apply_Tps_xyz(const void *const tps, const double x_in,
                           const double y_in, const double z_in, 
                           double *const x_out, double *const y_out, 
                           double *const z_out);
+static void apply_Bspline_xyz(const void *const bspline, const double x_in, 
+                              const double y_in, const double z_in, 
+                              double *const x_out, double *const y_out, 
+                              double *const z_out);
+static void apply_Disp_field_xyz(const void *const field, const double x_in, 
+                                 const double y_in, const double z_in, 
+                                 double *const x_out, double *const y_out, 
+                                 double *const z_out);
+static void apply_Composite_xyz(const void *const comp, const double x_in, 
+                                const double y_in, const double z_in, 
+                                double *const x_out, double *const y_out, 
+                                double *const z_out);
 static int apply_Affine_Mat_rm(const void *const affine, 
         const Mat_rm * const mat_in, Mat_rm * const mat_out);
 static int apply_Tps_Mat_rm(const void *const tps, const Mat_rm * const mat_in,
 			    Mat_rm * const mat_out);
+static int apply_Bspline_Mat_rm(const void *const bspline, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out);
+static int apply_Disp_field_Mat_rm(const void *const field, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out);
+static int apply_Composite_Mat_rm(const void *const comp, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out);
+static int apply_Affine_points(const void *const affine, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out);
+static int apply_Tps_points(const void *const tps, const Mat_rm_type type,
+        const int num, const void *const x_in, const void *const y_in, 
+        const void *const z_in, void *const x_out, void *const y_out, 
+        void *const z_out);
+static int apply_Bspline_points(const void *const bspline, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out);
+static int apply_Disp_field_points(const void *const field, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out);
+static int apply_Composite_points(const void *const comp, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out);
 static size_t Affine_get_size(void);
 static size_t Tps_get_size(void);
+static size_t Bspline_get_size(void);
+static size_t Disp_field_get_size(void);
+static size_t Composite_get_size(void);
 static int write_Affine(const char *path, const void *const tform);
 static int write_Tps(const char *path, const void *const tform);
+static int write_Bspline(const char *path, const void *const tform);
+static int write_Disp_field(const char *path, const void *const tform);
+static int write_Composite(const char *path, const void *const tform);
+static int read_Affine(const char *path, void *const tform);
+static int read_Tps(const char *path, void *const tform);
+static int read_Bspline(const char *path, void *const tform);
+static int read_Disp_field(const char *path, void *const tform);
+static int read_Composite(const char *path, void *const tform);
 static void cleanup_Affine(void *const affine);
 static void cleanup_Tps(void *const tps);
+static void cleanup_Bspline(void *const bspline);
+static void cleanup_Disp_field(void *const field);
+static void cleanup_Composite(void *const comp);
 static int mkpath(const char *path, mode_t mode);
 
 /* Virtual function tables */
@@ -130,8 +221,10 @@ const Tform_vtable Affine_vtable = {
 	copy_Affine,
 	apply_Affine_xyz,
 	apply_Affine_Mat_rm,
+	apply_Affine_points,
 	Affine_get_size,
 	write_Affine,
+	read_Affine,
 	cleanup_Affine
 };
 
@@ -139,14 +232,80 @@ const Tform_vtable Tps_vtable = {
 	copy_Tps,
 	apply_Tps_xyz,
 	apply_Tps_Mat_rm,
+	apply_Tps_points,
 	Tps_get_size,
 	write_Tps,
+	read_Tps,
 	cleanup_Tps
 };
 
+const Tform_vtable Bspline_vtable = {
+	copy_Bspline,
+	apply_Bspline_xyz,
+	apply_Bspline_Mat_rm,
+	apply_Bspline_points,
+	Bspline_get_size,
+	write_Bspline,
+	read_Bspline,
+	cleanup_Bspline
+};
+
+const Tform_vtable Disp_field_vtable = {
+	copy_Disp_field,
+	apply_Disp_field_xyz,
+	apply_Disp_field_Mat_rm,
+	apply_Disp_field_points,
+	Disp_field_get_size,
+	write_Disp_field,
+	read_Disp_field,
+	cleanup_Disp_field
+};
+
+const Tform_vtable Composite_vtable = {
+	copy_Composite,
+	apply_Composite_xyz,
+	apply_Composite_Mat_rm,
+	apply_Composite_points,
+	Composite_get_size,
+	write_Composite,
+	read_Composite,
+	cleanup_Composite
+};
+
 /* Internal macros */
 #define TFORM_GET_VTABLE(arg) (((Affine *) arg)->tform.vtable)
 #define AFFINE_GET_DIM(affine) ((affine)->A.num_rows)
+#define TFORM_IS_AFFINE(type) ((type) == AFFINE || (type) == RIGID || \
+        (type) == SIMILARITY)
+
+/* Internal types */
+
+/* Preallocated workspace for the RANSAC iterations, with the source and 
+ * reference points in structure-of-arrays layout */
+typedef struct _Ransac_ws {
+        double *buf;                    // Storage for src and ref
+        double *src[IM_NDIMS];          // Source coordinates, per dimension
+        double *ref[IM_NDIMS];          // Reference coordinates, per dimension
+        int *cset;                      // Consensus set indices, [num_pts]
+        int *prosac_iter;               // PROSAC growth schedule, or NULL
+        tform_type type;                // Type of the model
+        int num_sample;                 // Size of a minimal sample
+        int num_pts;                    // Number of correspondences
+} Ransac_ws;
+
+/* State of a xoshiro256** pseudo-random number generator. Each RANSAC 
+ * iteration draws from its own stream, so the results do not depend on the 
+ * number of threads. */
+typedef struct _Ransac_rng {
+        uint64_t s[4];
+} Ransac_rng;
+
+/* Lanczos kernel weights, tabulated at fixed sub-voxel phases. Row p holds 
+ * the weights of the taps floor(x) - LANCZOS_A + 1, ..., floor(x) + LANCZOS_A,
+ * for x - floor(x) = p / LANCZOS_PHASES. */
+typedef struct _Lanczos_table {
+        double w[LANCZOS_PHASES + 1][LANCZOS_TAPS];
+} Lanczos_table;
 
 /* Global data */
 CL_data cl_data;
@@ -165,6 +324,8 @@ typedef mwSignedIndex fortran_int;
 #define dgetrf_ dgetrf
 #define dgetrs_ dgetrs
 #define dsyevd_ dsyevd
+#define dsysv_ dsysv
+#define dsyrk_ dsyrk
 #endif
 #else
 typedef int32_t fortran_int;
@@ -193,15 +354,37 @@ extern void dsyevd_(const char *, const char *, const fortran_int *, double *,
 		    const fortran_int *, fortran_int *, const fortran_int *,
 		    fortran_int *);
 
+extern void dsysv_(const char *, const fortran_int *, const fortran_int *,
+		   double *, const fortran_int *, fortran_int *, double *,
+		   const fortran_int *, double *, const fortran_int *,
+		   fortran_int *);
+
+extern void dsyrk_(const char *, const char *, const fortran_int *,
+		   const fortran_int *, const double *, const double *,
+		   const fortran_int *, const double *, double *,
+		   const fortran_int *);
+
 /* Internal helper routines */
 static char *read_file(const char *path);
 static int do_mkdir(const char *path, mode_t mode);
 static int cross_mkdir(const char *path, mode_t mode);
-static double resample_linear(const Image * const in, const double x,
-			      const double y, const double z, const int c);
-static double resample_lanczos2(const Image * const in, const double x,
-				const double y, const double z, const int c);
+static void resample_linear(const Image * const in, const double x,
+			    const double y, const double z, const int nc,
+                            float *const out);
+static void resample_lanczos2(const Image * const im, 
+                              const Lanczos_table *const tab, const double x,
+			      const double y, const double z, const int nc,
+                              float *const out);
 static double lanczos(double x, double a);
+static void init_Lanczos_table(Lanczos_table *const tab);
+static const double *lanczos_weights(const Lanczos_table *const tab, 
+                                     const double frac);
+static double resample_kernel(const interp_type interp, const double dist);
+static int im_resample_axis(const Image *const src, const int dim,
+        const double step, const interp_type interp, const int antialias,
+        const Lanczos_table *const tab, Image *const dst);
+static int im_resample_gen(const Image *const src, const double *const units, 
+	const interp_type interp, const int antialias, Image *const dst);
 static int check_cl_image_support(cl_context context, cl_mem_flags mem_flags,
 				  cl_image_format image_format,
 				  cl_mem_object_type image_type);
@@ -210,19 +393,65 @@ static int compile_cl_program_from_source(cl_program * program,
 					  cl_device_id * devices,
 					  int num_devices, char **src,
 					  int num_str);
-static int n_choose_k(const int n, const int k, int **ret);
+static int init_Ransac_ws(const Ransac *const ran, const tform_type type,
+        const Mat_rm *const src, const Mat_rm *const ref, Ransac_ws *const ws);
+static void cleanup_Ransac_ws(Ransac_ws *const ws);
+static uint64_t splitmix64(uint64_t *const x);
+static void seed_Ransac_rng(Ransac_rng *const rng, const uint64_t seed,
+        const uint64_t stream);
+static uint64_t next_Ransac_rng(Ransac_rng *const rng);
+static int rand_int_Ransac_rng(Ransac_rng *const rng, const int n);
+static void ransac_sample(Ransac_rng *const rng, const int n, const int k, 
+        int *const idx);
 static int make_spline_matrix(Mat_rm * src, Mat_rm * src_in, Mat_rm * sp_src,
 			      int K_terms, int *r, int dim);
 static int make_affine_matrix(const Mat_rm *const pts_in, const int dim, 
         Mat_rm *const mat_out);
 static Mat_rm *extract_ctrl_pts(void *tform, tform_type type);
 static Mat_rm *extract_ctrl_pts_Tps(Tps * tps);
+static int select_ctrl_pts(const Mat_rm *const pts, const int max_ctrl,
+        int *const idx);
+static int Tps_set_affine(const Mat_rm *const A, Tps *const tps);
+static int resize_Bspline(Bspline *const bspline, const int nx, const int ny,
+        const int nz, const double spacing);
 static int solve_system(const Mat_rm *const src, const Mat_rm *const ref, 
         void *const tform);
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i);
-static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len);
+static int solve_affine_min(const Ransac_ws *const ws, const int *const idx,
+        double A[IM_NDIMS][IM_NDIMS + 1]);
+static void eig_sym4(double a[4][4], double w[4], double v[4][4]);
+static int solve_umeyama(const Ransac_ws *const ws, const int *const idx,
+        const int num, const int scale, double A[IM_NDIMS][IM_NDIMS + 1]);
+static int ransac_solve(const Ransac_ws *const ws, const int *const idx,
+        const int num, double A[IM_NDIMS][IM_NDIMS + 1]);
+static int ransac_score(const Ransac_ws *const ws, 
+        const double A[IM_NDIMS][IM_NDIMS + 1], const double err_thresh_sq,
+        const int start, const int end);
+static int ransac_cset(Ransac_ws *const ws, 
+        const double A[IM_NDIMS][IM_NDIMS + 1], const double err_thresh_sq);
+static void prosac_sample(const Ransac_ws *const ws, Ransac_rng *const rng,
+        const int iter, int *const idx);
+static int ransac(const Ransac_ws *const ws, const Ransac *const ran, 
+        const int iter, const int len_bound, 
+        double A[IM_NDIMS][IM_NDIMS + 1], int *const len);
+static void ransac_batch(const Ransac_ws *const ws, const Ransac *const ran,
+        const int start, const int end, double A_best[IM_NDIMS][IM_NDIMS + 1],
+        int *const len_best, int *const iter_best);
+static int ransac_num_iter(const Ransac *const ran, 
+        const Ransac_ws *const ws, const int len_best);
+static void bspline_prefilter(double *const c, const int n, 
+        const size_t stride);
+static int bspline_weights(const double u, double w[4]);
+static int sample_Tps_grid(const int spacing, Tps_grid *const grid);
+static int im_inv_transform_gen(const void *const tform, 
+        const Tps_grid *const grid, const Image * const src, 
+        const interp_type interp, Image *const dst);
+static int im_inv_transform_affine(const Affine *const aff, 
+        const Image *const src, Image *const dst);
+static int im_inv_transform_Disp_field(const Disp_field *const field, 
+        const Image *const src, const interp_type interp, Image *const dst);
+static void affine_row_bounds(const double A[IM_NDIMS][IM_NDIMS + 1],
+        const double base[IM_NDIMS], const Image *const src, const int nx, 
+        int *const start, int *const end);
 static int convolve_sep(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit);
@@ -237,6 +466,8 @@ static int convolve_sep_sym(const Image * const src, Image * const dst,
                             const double unit);
 static const char *get_file_name(const char *path);
 static const char *get_file_ext(const char *name);
+static int write_Mat_rm_text(const char *path, const Mat_rm *const mat,
+        const int exact);
 
 /* Unfinished public routines */
 int init_Tps(Tps * tps, int dim, int terms);
@@ -1337,1469 +1568,4509 @@ char *im_get_parent_dir(const char *path) {
         return dirName; 
 }
 
-/* Write a matrix to a .csv or .csv.gz file. */
-int write_Mat_rm(const char *path, const Mat_rm * const mat)
-{
+/* Helper function to read a file into memory with stdio. See im_read_files
+ * for the parameters. Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE
+ * otherwise. */
+static int read_file_stdio(const char *path, const size_t max_len, 
+        void **const buf, size_t *const len) {
 
-	FILE *file;
-	gzFile gz;
-	const char *ext;
-	int i, j, compress;
+        FILE *file;
+        long size;
 
-	const char *mode = "w";
+        *buf = NULL;
+        *len = 0;
 
-	// Validate and create the output directory
-	if (mkpath(path, out_mode))
-		return SIFT3D_FAILURE;
+        // Open the file and get its size
+        if ((file = fopen(path, "rb")) == NULL) {
+                SIFT3D_ERR("read_file_stdio: failed to open file %s \n", 
+                        path);
+                return SIFT3D_FAILURE;
+        }
+        if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 ||
+                fseek(file, 0, SEEK_SET)) {
+                SIFT3D_ERR("read_file_stdio: failed to get the size of file "
+                        "%s \n", path);
+                goto read_file_stdio_quit;
+        }
+        *len = (size_t) size;
+        if (max_len > 0 && *len > max_len)
+                *len = max_len;
+
+        // Read the data
+        if ((*buf = malloc(*len > 0 ? *len : 1)) == NULL ||
+                fread(*buf, 1, *len, file) != *len) {
+                SIFT3D_ERR("read_file_stdio: failed to read file %s \n", 
+                        path);
+                goto read_file_stdio_quit;
+        }
+        fclose(file);
 
-	// Get the file extension
-	ext = get_file_ext(path);
+        return SIFT3D_SUCCESS;
 
-	// Check if we need to compress the file
-	compress = strcmp(ext, ext_gz) == 0;
+read_file_stdio_quit:
+        fclose(file);
+        free(*buf);
+        *buf = NULL;
+        *len = 0;
+        return SIFT3D_FAILURE;
+}
 
-	// Open the file
-	if (compress) {
-		if ((gz = gzopen(path, mode)) == Z_NULL)
-			return SIFT3D_FAILURE;
-	} else {
-		if ((file = fopen(path, mode)) == NULL)
-			return SIFT3D_FAILURE;
-	}
+/* Whether im_read_files tries io_uring */
+static int uring_enabled = SIFT3D_TRUE;
 
-#define WRITE_MAT(mat, format, type) \
-    SIFT3D_MAT_RM_LOOP_START(mat, i, j) \
-                const char delim = j < mat->num_cols - 1 ? ',' : '\n'; \
-                if (compress) { \
-                        gzprintf(gz, format, SIFT3D_MAT_RM_GET(mat, i, j, \
-                                type)); \
-                        gzputc(gz, delim); \
-                } else { \
-                	fprintf(file, format, SIFT3D_MAT_RM_GET(mat, i, j, \
-                 		type)); \
-                        fputc(delim, file); \
-                } \
-    SIFT3D_MAT_RM_LOOP_END
+/* Enable or disable reading files with io_uring in im_read_files. This has no
+ * effect unless SIFT3D was compiled with io_uring support. When disabled, 
+ * files are read with stdio, as on systems without io_uring. Enabled by 
+ * default. */
+void im_set_uring(const int enable) {
+        uring_enabled = enable;
+}
 
-	// Write the matrix
-	switch (mat->type) {
-	case SIFT3D_DOUBLE:
-		WRITE_MAT(mat, "%f", double); 
-		break;
-	case SIFT3D_FLOAT:
-		WRITE_MAT(mat, "%f", float); 
-		break;
-	case SIFT3D_INT:
-		WRITE_MAT(mat, "%d", int); 
-		break;
-	default:
-		goto write_mat_quit;
-	}
-#undef WRITE_MAT
+/* Read a batch of files into memory. 
+ *
+ * When compiled with io_uring support, the opens and reads of all the files 
+ * are queued to the kernel together, which hides the per-file latency of 
+ * network storage. Otherwise, if io_uring is unavailable at runtime, or if it
+ * was disabled with im_set_uring, the files are read in parallel with 
+ * stdio.
+ *
+ * Parameters:
+ *      paths - The paths of the files.
+ *      num - The number of files.
+ *      max_len - The maximum number of bytes to read from each file, or 0 to
+ *              read whole files.
+ *      bufs - An array of num pointers, which receive the file contents. 
+ *              Each must later be freed.
+ *      lens - An array of num lengths, which receive the number of bytes 
+ *              read from each file.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise, in which case
+ * no memory is allocated. */
+int im_read_files(const char *const *paths, const int num, 
+        const size_t max_len, void **const bufs, size_t *const lens) {
+
+        int i, error;
+
+        // Try io_uring, which leaves unread files as NULL
+        if (!uring_enabled || 
+                read_files_uring(paths, num, max_len, bufs, lens)) {
+                for (i = 0; i < num; i++) {
+                        bufs[i] = NULL;
+                        lens[i] = 0;
+                }
+        }
 
-	// Check for errors and finish writing the matrix
-	if (compress) {
-		if (gzclose(gz) != Z_OK)
-			goto write_mat_quit;
-	} else {
-		if (ferror(file))
-			goto write_mat_quit;
-		fclose(file);
-	}
+        // Read the remaining files with stdio
+        error = SIFT3D_FALSE;
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < num; i++) {
+                if (bufs[i] != NULL)
+                        continue;
+                if (read_file_stdio(paths[i], max_len, bufs + i, lens + i)) {
+#pragma omp atomic write
+                        error = SIFT3D_TRUE;
+                }
+        }
+        if (!error)
+                return SIFT3D_SUCCESS;
 
-	return SIFT3D_SUCCESS;
+        // Clean up
+        for (i = 0; i < num; i++) {
+                free(bufs[i]);
+                bufs[i] = NULL;
+                lens[i] = 0;
+        }
+        return SIFT3D_FAILURE;
+}
 
- write_mat_quit:
-	if (compress) {
-		gzclose(gz);
-	} else {
-		fclose(file);
-	}
-	return SIFT3D_FAILURE;
+/* Helper functions to access little-endian integers in gzip headers */
+static unsigned int gz_get_le16(const unsigned char *const p) {
+        return (unsigned int) p[0] | (unsigned int) p[1] << 8;
 }
 
-/* Shortcut to initialize an image for first-time use.
- * Allocates memory, and assumes the default stride. This
- * function calls init_im and initializes all values to 0. */
-int init_im_with_dims(Image *const im, const int nx, const int ny, const int nz,
-        const int nc)
-{
+static uint32_t gz_get_le32(const unsigned char *const p) {
+        return (uint32_t) p[0] | (uint32_t) p[1] << 8 | 
+                (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
 
-	init_im(im);
-	im->nx = nx;
-	im->ny = ny;
-	im->nz = nz;
-	im->nc = nc;
+static void gz_put_le32(unsigned char *const p, const uint32_t val) {
+        p[0] = val & 0xff;
+        p[1] = (val >> 8) & 0xff;
+        p[2] = (val >> 16) & 0xff;
+        p[3] = (val >> 24) & 0xff;
+}
 
-	im_default_stride(im);
-	if (im_resize(im))
-		return SIFT3D_FAILURE;
+/* Helper function to compress one BGZF block, consisting of at most
+ * BGZF_DATA_MAX bytes of input, into a buffer of BGZF_BLOCK_MAX bytes.
+ * strm must be initialized for raw deflate. The size of the block is returned
+ * in size. Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int bgzf_deflate_block(z_stream *const strm, const unsigned char *in,
+        const size_t in_len, unsigned char *const out, size_t *const size) {
 
-	im_zero(im);
+        static const unsigned char header[BGZF_HEADER_SIZE] = {
+                0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                0, 0
+        };
 
-	return SIFT3D_SUCCESS;
+        // Compress the data between the header and footer
+        if (deflateReset(strm) != Z_OK)
+                return SIFT3D_FAILURE;
+        strm->next_in = (Bytef *) in;
+        strm->avail_in = (uInt) in_len;
+        strm->next_out = out + BGZF_HEADER_SIZE;
+        strm->avail_out = BGZF_BLOCK_MAX - BGZF_HEADER_SIZE - 
+                BGZF_FOOTER_SIZE;
+        if (deflate(strm, Z_FINISH) != Z_STREAM_END)
+                return SIFT3D_FAILURE;
+        *size = BGZF_HEADER_SIZE + strm->total_out + BGZF_FOOTER_SIZE;
+
+        // Write the header, recording the block size, and the footer
+        memcpy(out, header, BGZF_HEADER_SIZE);
+        out[16] = (*size - 1) & 0xff;
+        out[17] = ((*size - 1) >> 8) & 0xff;
+        gz_put_le32(out + *size - 8, 
+                (uint32_t) crc32(0L, in, (uInt) in_len));
+        gz_put_le32(out + *size - 4, (uint32_t) in_len);
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Calculate the strides of an image object in the default
- * manner. The following parameters must be initialized:
- * -nx
- * -ny
- * -nz
- * -nc
- * If a dimension is not used, its size should be set
- * to 1. */
-void im_default_stride(Image *const im)
+/* Write data to a gzip file, compressing it in parallel.
+ *
+ * The data are split into blocks of 64KB, each compressed separately as a 
+ * gzip member, following the BGZF format. Any gzip reader can read the 
+ * result, while im_read_gz can also decompress the blocks in parallel.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_write_gz(const char *path, const void *const data, const size_t len) {
+
+        /* The empty block which terminates a BGZF file */
+        static const unsigned char bgzf_eof[] = {
+                0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+        };
+
+        FILE *file;
+        unsigned char *blocks;
+        size_t *sizes;
+        ptrdiff_t i;
+        int error;
+
+        const unsigned char *const in = data;
+        const ptrdiff_t num_blocks = (len + BGZF_DATA_MAX - 1) / 
+                BGZF_DATA_MAX;
+
+        file = NULL;
+        blocks = NULL;
+        sizes = NULL;
+
+        // Allocate the compressed blocks
+        if ((blocks = malloc(num_blocks * BGZF_BLOCK_MAX + 1)) == NULL ||
+                (sizes = malloc(num_blocks * sizeof(size_t) + 1)) == NULL)
+                goto im_write_gz_quit;
+
+        // Compress the blocks in parallel
+        error = SIFT3D_FALSE;
+#pragma omp parallel
 {
+        z_stream strm;
+        int ready;
 
-        size_t prod;
-	int i;
+        memset(&strm, 0, sizeof(strm));
+        ready = deflateInit2(&strm, GZ_LEVEL, Z_DEFLATED, -MAX_WBITS, 8,
+                Z_DEFAULT_STRATEGY) == Z_OK;
 
-	prod = (size_t) im->nc;
-	SIFT3D_IM_GET_STRIDES(im)[0] = prod;
+#pragma omp for schedule(dynamic)
+        for (i = 0; i < num_blocks; i++) {
 
-	for (i = 1; i < IM_NDIMS; i++) {
-		prod *= SIFT3D_IM_GET_DIMS(im)[i - 1];
-		SIFT3D_IM_GET_STRIDES(im)[i] = prod;
-	}
-}
+                const size_t start = (size_t) i * BGZF_DATA_MAX;
+                const size_t block_len = SIFT3D_MIN(len - start, 
+                        BGZF_DATA_MAX);
 
-/* Pads an image to a new size. Prior to calling this function, initialize 
- * pad with all dimensions and strides, as in im_resize. Other metadata,
- * such as units, will be copied from im to pad. */
-int im_pad(const Image * const im, Image * const pad)
-{
+                if (!ready || bgzf_deflate_block(&strm, in + start, 
+                        block_len, blocks + i * BGZF_BLOCK_MAX, sizes + i)) {
+#pragma omp atomic write
+                        error = SIFT3D_TRUE;
+                }
+        }
 
-	int x, y, z, c;
+        if (ready)
+                deflateEnd(&strm);
+}
+        if (error) {
+                SIFT3D_ERR("im_write_gz: failed to compress data for file "
+                        "%s \n", path);
+                goto im_write_gz_quit;
+        }
 
-	const int pad_x_end = pad->nx - 1;
-	const int pad_y_end = pad->ny - 1;
-	const int pad_z_end = pad->nz - 1;
+        // Write the blocks in order
+        if ((file = fopen(path, "wb")) == NULL) {
+                SIFT3D_ERR("im_write_gz: failed to open file %s \n", path);
+                goto im_write_gz_quit;
+        }
+        for (i = 0; i < num_blocks; i++) {
+                if (fwrite(blocks + i * BGZF_BLOCK_MAX, 1, sizes[i], file) !=
+                        sizes[i])
+                        break;
+        }
+        fwrite(bgzf_eof, 1, sizeof(bgzf_eof), file);
+        if (ferror(file)) {
+                SIFT3D_ERR("im_write_gz: failed to write file %s \n", path);
+                goto im_write_gz_quit;
+        }
+        if (fclose(file)) {
+                file = NULL;
+                SIFT3D_ERR("im_write_gz: failed to close file %s \n", path);
+                goto im_write_gz_quit;
+        }
 
-	const int data_x_end = SIFT3D_MIN(im->nx - 1, pad_x_end);
-	const int data_y_end = SIFT3D_MIN(im->ny - 1, pad_y_end);
-	const int data_z_end = SIFT3D_MIN(im->nz - 1, pad_z_end);
+        free(blocks);
+        free(sizes);
+        return SIFT3D_SUCCESS;
 
-        // Copy relevant metadata, omitting dimensions and strides
-        memcpy(SIFT3D_IM_GET_UNITS(pad), SIFT3D_IM_GET_UNITS(im), 
-                IM_NDIMS * sizeof(double));
+im_write_gz_quit:
+        if (file != NULL)
+                fclose(file);
+        free(blocks);
+        free(sizes);
+        return SIFT3D_FAILURE;
+}
 
-	// Resize the output 
-	if (im_resize(pad))
-		return SIFT3D_FAILURE;
+/* Helper function to find the BGZF blocks of a gzip file. Returns the block
+ * offsets in the array offsets, which must later be freed, or NULL if the 
+ * file is not in BGZF format, in which case num is undefined. The last
+ * offset is the end of the file. */
+static size_t *bgzf_scan(const unsigned char *const in, const size_t len,
+        ptrdiff_t *const num) {
+
+        size_t *offsets;
+        size_t pos, cap;
+
+        offsets = NULL;
+        cap = *num = 0;
+        pos = 0;
+        while (pos < len) {
+
+                size_t xlen, sub, bsize;
+
+                // Check the gzip header for the extra field, and no other
+                // optional fields, as bgzf_inflate expects the data to 
+                // follow it
+                if (len - pos < BGZF_HEADER_SIZE || in[pos] != 0x1f || 
+                        in[pos + 1] != 0x8b || in[pos + 2] != 8 || 
+                        in[pos + 3] != 4)
+                        goto bgzf_scan_quit;
+                xlen = gz_get_le16(in + pos + 10);
+                if (len - pos < 12 + xlen)
+                        goto bgzf_scan_quit;
+
+                // Find the subfield holding the block size
+                bsize = 0;
+                for (sub = pos + 12; sub + 4 <= pos + 12 + xlen; 
+                        sub += 4 + gz_get_le16(in + sub + 2)) {
+                        if (in[sub] == 'B' && in[sub + 1] == 'C' &&
+                                gz_get_le16(in + sub + 2) == 2 &&
+                                sub + 6 <= pos + 12 + xlen) {
+                                bsize = gz_get_le16(in + sub + 4) + 1;
+                                break;
+                        }
+                }
+                if (bsize < 12 + xlen + BGZF_FOOTER_SIZE || 
+                        bsize > len - pos)
+                        goto bgzf_scan_quit;
+
+                // Record the block
+                if ((size_t) *num + 2 > cap) {
+                        cap = 2 * cap + 64;
+                        if ((offsets = SIFT3D_safe_realloc(offsets, 
+                                cap * sizeof(size_t))) == NULL)
+                                return NULL;
+                }
+                offsets[(*num)++] = pos;
+                pos += bsize;
+        }
+        if (*num == 0)
+                goto bgzf_scan_quit;
+        offsets[*num] = len;
 
-	// Copy the image 
-	SIFT3D_IM_LOOP_LIMITED_START_C(im, x, y, z, c, 0, data_x_end, 0,
-				       data_y_end, 0, data_z_end)
+        return offsets;
 
-	    SIFT3D_IM_GET_VOX(pad, x, y, z, c) =
-	    SIFT3D_IM_GET_VOX(im, x, y, z, c);
+bgzf_scan_quit:
+        free(offsets);
+        return NULL;
+}
 
-	SIFT3D_IM_LOOP_END_C
-	    // Pad the remaining data with zeros
-	    SIFT3D_IM_LOOP_LIMITED_START_C(im, x, y, z, c, data_x_end,
-					   pad_x_end, data_y_end, pad_y_end,
-					   data_z_end, pad_z_end)
+/* Helper function to decompress a BGZF file in parallel, given the block 
+ * offsets from bgzf_scan. The output is allocated with an extra byte, as in 
+ * im_read_gz. Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int bgzf_inflate(const unsigned char *const in, 
+        const size_t *const offsets, const ptrdiff_t num, 
+        unsigned char **const out, size_t *const out_len) {
 
-	    SIFT3D_IM_GET_VOX(pad, x, y, z, c) = 0.0f;
+        size_t *starts;
+        ptrdiff_t i;
+        int error;
 
-	SIFT3D_IM_LOOP_END_C return SIFT3D_SUCCESS;
-}
+        *out = NULL;
 
-/* Resize an image according to the current nx, ny,
- * and nz. Does not modify scale space information or
- * strides. Prior to calling this function, use init_im(im)
- * and initialize the following fields:
- * -nx
- * -ny
- * -nz
- * -nc
- * -xs (can be set by im_default_stride(im)) 
- * -ys (can be set by im_default_stride(im)) 
- * -zs (can be set by im_default_stride(im)) 
- *
- * All of this initialization can also be done with
- * init_im_with_dims(), which calls this function.
- *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int im_resize(Image *const im)
+        // Get the output position of each block from its footer
+        if ((starts = malloc((num + 1) * sizeof(size_t))) == NULL)
+                return SIFT3D_FAILURE;
+        starts[0] = 0;
+        for (i = 0; i < num; i++) {
+                starts[i + 1] = starts[i] + 
+                        gz_get_le32(in + offsets[i + 1] - 4);
+        }
+        *out_len = starts[num];
+        if ((*out = malloc(*out_len + 1)) == NULL)
+                goto bgzf_inflate_quit;
+
+        // Decompress the blocks in parallel
+        error = SIFT3D_FALSE;
+#pragma omp parallel
 {
+#ifdef SIFT3D_WITH_LIBDEFLATE
+        struct libdeflate_decompressor *const d = 
+                libdeflate_alloc_decompressor();
+        const int ready = d != NULL;
+#else
+        z_stream strm;
+        int ready;
 
-	int i;
+        memset(&strm, 0, sizeof(strm));
+        ready = inflateInit2(&strm, -MAX_WBITS) == Z_OK;
+#endif
 
-	//FIXME: This will not work for strange strides
-	const size_t size = im->nx * im->ny * im->nz * im->nc;
+#pragma omp for schedule(dynamic)
+        for (i = 0; i < num; i++) {
+
+                const unsigned char *const block = in + offsets[i];
+                const size_t data_start = 12 + gz_get_le16(block + 10);
+                const size_t block_len = offsets[i + 1] - offsets[i];
+                const size_t data_len = block_len - data_start - 
+                        BGZF_FOOTER_SIZE;
+                const size_t size = starts[i + 1] - starts[i];
+                int ok;
+
+                if (!ready) {
+                        ok = SIFT3D_FALSE;
+                } else {
+#ifdef SIFT3D_WITH_LIBDEFLATE
+                        ok = libdeflate_deflate_decompress(d, 
+                                block + data_start, data_len, 
+                                *out + starts[i], size, NULL) == 
+                                LIBDEFLATE_SUCCESS;
+#else
+                        ok = inflateReset(&strm) == Z_OK;
+                        strm.next_in = (Bytef *) block + data_start;
+                        strm.avail_in = (uInt) data_len;
+                        strm.next_out = *out + starts[i];
+                        strm.avail_out = (uInt) size;
+                        ok = ok && inflate(&strm, Z_FINISH) == 
+                                Z_STREAM_END && strm.total_out == size;
+#endif
+                }
 
-	// Verify inputs
-	for (i = 0; i < IM_NDIMS; i++) {
+                // Verify the checksum
+                if (!ok || crc32(0L, *out + starts[i], (uInt) size) != 
+                        gz_get_le32(block + block_len - 8)) {
+#pragma omp atomic write
+                        error = SIFT3D_TRUE;
+                }
+        }
 
-		const int dim = SIFT3D_IM_GET_DIMS(im)[i];
+        if (ready) {
+#ifdef SIFT3D_WITH_LIBDEFLATE
+                libdeflate_free_decompressor(d);
+#else
+                inflateEnd(&strm);
+#endif
+        }
+}
+        if (error)
+                goto bgzf_inflate_quit;
 
-		if (dim > 0)
-			continue;
+        free(starts);
+        return SIFT3D_SUCCESS;
 
-		SIFT3D_ERR("im_resize: invalid dimension %d: %d \n", i,
-			dim);
-		return SIFT3D_FAILURE;
-	}
-	if (im->nc < 1) {
-		SIFT3D_ERR("im_resize: invalid number of channels: %d \n",
-			im->nc);
-		return SIFT3D_FAILURE;
-	}
+bgzf_inflate_quit:
+        free(starts);
+        free(*out);
+        *out = NULL;
+        return SIFT3D_FAILURE;
+}
 
-        // Do nothing if the size has not changed
-        if (im->size == size)
-                return SIFT3D_SUCCESS;
-	im->size = size;
+/* Helper function to decompress a gzip file serially, for files which are 
+ * not in BGZF format. Decodes all consecutive members. The output is 
+ * allocated with an extra byte, as in im_read_gz. Returns SIFT3D_SUCCESS on 
+ * success, SIFT3D_FAILURE otherwise. */
+static int gz_inflate_serial(const unsigned char *const in, const size_t len,
+        unsigned char **const out, size_t *const out_len) {
 
-	// Allocate new memory
-	im->data = SIFT3D_safe_realloc(im->data, size * sizeof(float));
+        size_t pos, cap;
 
-#ifdef SIFT3D_USE_OPENCL
-	{
-		cl_int err;
-		int initialized;
+        // Guess the output size from the last member's footer
+        cap = (len >= 4 ? gz_get_le32(in + len - 4) : 0) + 1;
+        cap = SIFT3D_MAX(cap, BGZF_BLOCK_MAX);
+        if ((*out = malloc(cap)) == NULL)
+                return SIFT3D_FAILURE;
+        *out_len = 0;
 
-		if (cl_data.valid) {
-			initialized = (im->data != NULL);
+        pos = 0;
+#ifdef SIFT3D_WITH_LIBDEFLATE
+{
+        struct libdeflate_decompressor *d;
 
-			// Destroy the old image
-			if (initialized && im->cl_valid)
-				clReleaseMemObject(im->cl_image);
+        if ((d = libdeflate_alloc_decompressor()) == NULL)
+                goto gz_inflate_serial_quit;
 
-			// Init an OpenCL image
-			if (im->nz > 0) {
-				im->cl_image = clCreateImage2D(cl_data.context,
-							       cl_data.
-							       mem_flags,
-							       &cl_data.
-							       image_format,
-							       im->nx, im->ny,
-							       im->ys,
-							       im->data, &err);
-			} else {
-				im->cl_image = clCreateImage3D(cl_data.context,
-							       cl_data.
-							       mem_flags,
-							       &cl_data.
-							       image_format,
-							       im->nx, im->ny,
-							       im->nz,
-							       im->ys,
-							       im->zs,
-							       im->data, &err);
-			}
+        // Decompress each member, enlarging the output as needed
+        while (len - pos >= 2 && in[pos] == 0x1f && in[pos + 1] == 0x8b) {
 
-			if (err != CL_SUCCESS) {
-				im->cl_valid = SIFT3D_FALSE;
-				return SIFT3D_FAILURE;
-			}
+                size_t in_used, out_used;
+                enum libdeflate_result result;
 
-			im->cl_valid = SIFT3D_TRUE;
-		}
-	}
+                while ((result = libdeflate_gzip_decompress_ex(d, in + pos,
+                        len - pos, *out + *out_len, cap - 1 - *out_len,
+                        &in_used, &out_used)) == 
+                        LIBDEFLATE_INSUFFICIENT_SPACE) {
+                        cap *= 2;
+                        if ((*out = SIFT3D_safe_realloc(*out, cap)) == NULL)
+                                break;
+                }
+                if (*out == NULL || result != LIBDEFLATE_SUCCESS) {
+                        libdeflate_free_decompressor(d);
+                        goto gz_inflate_serial_quit;
+                }
+                pos += in_used;
+                *out_len += out_used;
+        }
+        libdeflate_free_decompressor(d);
+}
+#else
+{
+        z_stream strm;
+        int ret;
+
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit2(&strm, MAX_WBITS + 16) != Z_OK)
+                goto gz_inflate_serial_quit;
+
+        // Decompress each member, enlarging the output as needed
+        ret = Z_OK;
+        while (len - pos >= 2 && in[pos] == 0x1f && in[pos + 1] == 0x8b) {
+
+                strm.next_in = (Bytef *) in + pos;
+                strm.avail_in = 0;
+                do {
+                        if (strm.avail_in == 0) {
+                                strm.avail_in = (uInt) SIFT3D_MIN(len - 
+                                        (size_t) (strm.next_in - in), 
+                                        UINT_MAX);
+                        }
+                        if (*out_len + 1 == cap) {
+                                cap *= 2;
+                                if ((*out = SIFT3D_safe_realloc(*out, 
+                                        cap)) == NULL)
+                                        break;
+                        }
+                        strm.next_out = *out + *out_len;
+                        strm.avail_out = (uInt) SIFT3D_MIN(
+                                cap - 1 - *out_len, UINT_MAX);
+                        ret = inflate(&strm, Z_NO_FLUSH);
+                        *out_len = (size_t) (strm.next_out - *out);
+                } while (ret == Z_OK);
+                pos = (size_t) (strm.next_in - in);
+
+                if (*out == NULL || ret != Z_STREAM_END || 
+                        inflateReset(&strm) != Z_OK)
+                        break;
+        }
+        inflateEnd(&strm);
+        if (*out == NULL || ret != Z_STREAM_END)
+                goto gz_inflate_serial_quit;
+}
 #endif
-	return size != 0 && im->data == NULL ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+
+        return SIFT3D_SUCCESS;
+
+gz_inflate_serial_quit:
+        free(*out);
+        *out = NULL;
+        return SIFT3D_FAILURE;
 }
 
-/* Concatenate two images in dimension dim, so that src1 comes before src2.
- * For example, if dim == 0, the images are horizontally concatenated in x,
- * so that src1 is on the left and src2 is on the right. Resizes dst. 
+/* Read a file into memory, decompressing it if it is gzipped. Uncompressed 
+ * files are returned as-is, as with gzread.
+ *
+ * Files in BGZF format, such as those written by im_write_gz, are 
+ * decompressed in parallel. Other gzip files are decompressed serially, with
+ * libdeflate if it was found at compile time.
+ *
+ * Parameters:
+ *      path - The path of the file.
+ *      data - Receives the contents, which must later be freed. These are
+ *              followed by a terminating null byte, not counted in len.
+ *      len - Receives the length of the contents, in bytes.
  *
  * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-int im_concat(const Image * const src1, const Image * const src2, const int dim,
-	      Image * const dst)
-{
+int im_read_gz(const char *path, void **const data, size_t *const len) {
 
-	int off[IM_NDIMS], dims_out[IM_NDIMS];
-	int i, x, y, z, c;
-
-	const int nc = src1->nc;
+        void *buf;
+        unsigned char *in, *out;
+        size_t *offsets;
+        size_t in_len;
+        ptrdiff_t num_blocks;
+        int ret;
 
-	// Verify inputs
-	for (i = 0; i < IM_NDIMS; i++) {
+        // Read the raw file
+        if (im_read_files(&path, 1, 0, &buf, &in_len))
+                return SIFT3D_FAILURE;
+        in = buf;
 
-		const int src1d = SIFT3D_IM_GET_DIMS(src1)[i];
-		const int src2d = SIFT3D_IM_GET_DIMS(src2)[i];
+        // Return uncompressed files as-is
+        if (in_len < 2 || in[0] != 0x1f || in[1] != 0x8b) {
+                if ((in = SIFT3D_safe_realloc(in, in_len + 1)) == NULL)
+                        return SIFT3D_FAILURE;
+                in[in_len] = '\0';
+                *data = in;
+                *len = in_len;
+                return SIFT3D_SUCCESS;
+        }
 
-		if (i == dim)
-			continue;
-		if (src1d != src2d) {
-			SIFT3D_ERR("im_concat: dimension %d must be "
-				"equal in input images. src1: %d src2: %d \n",
-				i, src1d, src2d);
-			return SIFT3D_FAILURE;
-		}
-	}
-	if (src1->nc != src2->nc) {
-		SIFT3D_ERR("im_concat: images must have an equal number "
-			"of channels. src1: %d src2: %d \n", src1->nc,
-			src2->nc);
-		return SIFT3D_FAILURE;
-	}
-	// Get the output dimensions and offsets
-	for (i = 0; i < IM_NDIMS; i++) {
+        // Decompress in parallel if possible, otherwise serially
+        ret = SIFT3D_FAILURE;
+        if ((offsets = bgzf_scan(in, in_len, &num_blocks)) != NULL) {
+                ret = bgzf_inflate(in, offsets, num_blocks, &out, len);
+                free(offsets);
+        }
+        if (ret)
+                ret = gz_inflate_serial(in, in_len, &out, len);
+        free(in);
+        if (ret) {
+                SIFT3D_ERR("im_read_gz: failed to decompress file %s \n", 
+                        path);
+                return SIFT3D_FAILURE;
+        }
+        out[*len] = '\0';
+        *data = out;
 
-		const int src1d = SIFT3D_IM_GET_DIMS(src1)[i];
-		const int src2d = SIFT3D_IM_GET_DIMS(src2)[i];
+        return SIFT3D_SUCCESS;
+}
 
-                dims_out[i] = dim == i ? src1d + src2d : src1d;
-                off[i] = dim == i ? src1d : 0;
-	}
+/* Helper function to format a range of matrix rows as CSV text, appending 
+ * it to str, which has length len and capacity cap. If exact is true, 
+ * floating-point elements are written with enough digits to be read back 
+ * exactly. Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int format_Mat_rm_rows(const Mat_rm *const mat, const int exact,
+        const int row_start, const int row_end, char **const str, 
+        size_t *const len, size_t *const cap) {
 
-	// Resize dst 
-	memcpy(SIFT3D_IM_GET_DIMS(dst), dims_out, IM_NDIMS * sizeof(int));
-	dst->nc = nc;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        int i, j;
 
-	// Copy the data from src1 
-	SIFT3D_IM_LOOP_START_C(src1, x, y, z, c)
-	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
-	    SIFT3D_IM_GET_VOX(src1, x, y, z, c);
-	SIFT3D_IM_LOOP_END_C 
+        const char *const fmt_double = exact ? "%.17g%c" : "%f%c";
+        const char *const fmt_float = exact ? "%.9g%c" : "%f%c";
 
-        // Copy the data from src2
-        SIFT3D_IM_LOOP_START_C(src2, x, y, z, c)
+        // Allocate the initial string
+        if (*str == NULL) {
+                *cap = BUFSIZ;
+                if ((*str = malloc(*cap)) == NULL)
+                        return SIFT3D_FAILURE;
+        }
 
-                // Get the destination coordinates with offsets
-                const int x_dst = x + off[0];
-                const int y_dst = y + off[1];
-                const int z_dst = z + off[2];
+        for (i = row_start; i < row_end; i++) {
+        for (j = 0; j < mat->num_cols; j++) {
+
+                int n;
+
+                const char delim = j < mat->num_cols - 1 ? ',' : '\n';
+
+                // Format the element, enlarging the string until it fits
+                while (1) {
+
+                        const size_t avail = *cap - *len;
+
+                        switch (mat->type) {
+                        case SIFT3D_DOUBLE:
+                                n = snprintf(*str + *len, avail, fmt_double,
+                                        SIFT3D_MAT_RM_GET(mat, i, j, double),
+                                        delim);
+                                break;
+                        case SIFT3D_FLOAT:
+                                n = snprintf(*str + *len, avail, fmt_float,
+                                        SIFT3D_MAT_RM_GET(mat, i, j, float),
+                                        delim);
+                                break;
+                        case SIFT3D_INT:
+                                n = snprintf(*str + *len, avail, "%d%c",
+                                        SIFT3D_MAT_RM_GET(mat, i, j, int),
+                                        delim);
+                                break;
+                        default:
+                                return SIFT3D_FAILURE;
+                        }
+                        if (n < 0)
+                                return SIFT3D_FAILURE;
+                        if ((size_t) n < avail)
+                                break;
 
-                // Copy the data from src2
-                SIFT3D_IM_GET_VOX(dst, x_dst, y_dst, z_dst, c) =
-                    SIFT3D_IM_GET_VOX(src2, x, y, z, c);
+                        *cap = 2 * *cap + n + 1;
+                        if ((*str = SIFT3D_safe_realloc(*str, *cap)) == NULL)
+                                return SIFT3D_FAILURE;
+                }
+                *len += n;
+        }}
 
-        SIFT3D_IM_LOOP_END_C 
-        
         return SIFT3D_SUCCESS;
 }
 
-/* Upsample an image by a factor of 2 in each dimension.
- * This function resizes dst and modifies its units. */
-int im_upsample_2x(const Image *const src, Image *const dst)
-{
-
-	double units[IM_NDIMS];
-	int dims[IM_NDIMS];
-	int i, x, y, z, c, sx, sy, sz;
-
-	const int nc = src->nc;
-	const int w = 2;
-	const float weight = (float) (1.0 / pow((double) w, IM_NDIMS));
+/* Helper function to format a matrix as CSV text, in parallel over blocks of
+ * rows. The result is returned in str, which must later be freed, and its 
+ * length in len. See format_Mat_rm_rows for exact. Returns SIFT3D_SUCCESS on
+ * success, SIFT3D_FAILURE otherwise. */
+static int format_Mat_rm(const Mat_rm *const mat, const int exact, 
+        char **const str, size_t *const len) {
 
-	// Resize the output 
-	for (i = 0; i < IM_NDIMS; i++) {
-		dims[i] = SIFT3D_IM_GET_DIMS(src)[i] * 2;	
-		units[i] = SIFT3D_IM_GET_UNITS(src)[i] / 2.0;
-	}
-	memcpy(SIFT3D_IM_GET_DIMS(dst), dims, IM_NDIMS * sizeof(int));
-	memcpy(SIFT3D_IM_GET_UNITS(dst), units, IM_NDIMS * sizeof(float));
-	dst->nc = nc;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        char **parts;
+        size_t *part_lens;
+        size_t pos;
+        int i, error;
 
-	// TODO: 3-pass (separable) upsample might be faster
+        const int num_parts = SIFT3D_MAX(SIFT3D_MIN(mat->num_rows, 
+                CSV_NUM_PARTS), 1);
 
-	// Upsample
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        *str = NULL;
 
-		const int sx_start = x >> 1;
-		const int sy_start = y >> 1;
-		const int sz_start = z >> 1;
+        // Allocate the parts
+        if ((parts = calloc(num_parts, sizeof(char *))) == NULL ||
+                (part_lens = malloc(num_parts * sizeof(size_t))) == NULL) {
+                free(parts);
+                return SIFT3D_FAILURE;
+        }
 
-		const int sx_end = sx_start + w - 1;
-		const int sy_end = sy_start + w - 1;
-		const int sz_end = sz_start + w - 1;
+        // Format each block of rows
+        error = SIFT3D_FALSE;
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < num_parts; i++) {
 
-		SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 0;
+                size_t cap = 0;
 
-		SIFT3D_IM_LOOP_LIMITED_START(dst, sx, sy, sz, sx_start,
-					       sx_end, sy_start, sy_end,
-					       sz_start, sz_end)
+                const int row_start = (int) ((long long) mat->num_rows * i / 
+                        num_parts);
+                const int row_end = (int) ((long long) mat->num_rows * 
+                        (i + 1) / num_parts);
 
-			SIFT3D_IM_GET_VOX(dst, x, y, z, c) += 
-				SIFT3D_IM_GET_VOX(src, sx, sy, sz, c);
+                part_lens[i] = 0;
+                if (format_Mat_rm_rows(mat, exact, row_start, row_end, 
+                        parts + i,
+                        part_lens + i, &cap)) {
+#pragma omp atomic write
+                        error = SIFT3D_TRUE;
+                }
+        }
+        if (error)
+                goto format_Mat_rm_quit;
 
-		SIFT3D_IM_LOOP_END 
+        // Concatenate the parts
+        *len = 0;
+        for (i = 0; i < num_parts; i++) {
+                *len += part_lens[i];
+        }
+        if ((*str = malloc(*len + 1)) == NULL)
+                goto format_Mat_rm_quit;
+        pos = 0;
+        for (i = 0; i < num_parts; i++) {
+                if (part_lens[i] > 0)
+                        memcpy(*str + pos, parts[i], part_lens[i]);
+                pos += part_lens[i];
+        }
 
-		SIFT3D_IM_GET_VOX(dst, x, y, z, c) *= weight;	
+        for (i = 0; i < num_parts; i++) {
+                free(parts[i]);
+        }
+        free(parts);
+        free(part_lens);
+        return SIFT3D_SUCCESS;
 
-	SIFT3D_IM_LOOP_END_C
+format_Mat_rm_quit:
+        for (i = 0; i < num_parts; i++) {
+                free(parts[i]);
+        }
+        free(parts);
+        free(part_lens);
+        return SIFT3D_FAILURE;
+}
 
-	return SIFT3D_SUCCESS;
+/* Write a matrix to a .csv or .csv.gz file. Compressed files are written in 
+ * parallel, as in im_write_gz. */
+int write_Mat_rm(const char *path, const Mat_rm * const mat)
+{
+        return write_Mat_rm_text(path, mat, SIFT3D_FALSE);
 }
 
-/* Downsample an image by a factor of 2 in each dimension.
- * This function initializes dst with the proper 
- * dimensions, and allocates memory. */
-int im_downsample_2x(const Image *const src, Image *const dst)
+/* Helper function for write_Mat_rm. If exact is true, floating-point 
+ * elements are written with enough digits to be read back exactly, as for 
+ * parameters which are too small for the default format. */
+static int write_Mat_rm_text(const char *path, const Mat_rm *const mat,
+        const int exact)
 {
 
-	int x, y, z, c;
+	FILE *file;
+        char *str;
+        size_t len;
+	const char *ext;
+	int compress;
 
-	// Initialize dst
-	dst->nx = (int)floor((double)src->nx / 2.0);
-	dst->ny = (int)floor((double)src->ny / 2.0);
-	dst->nz = (int)floor((double)src->nz / 2.0);
-	dst->nc = src->nc;
-	im_default_stride(dst);
-	if (im_resize(dst))
+	// Validate and create the output directory
+	if (mkpath(path, out_mode))
 		return SIFT3D_FAILURE;
 
-	// Downsample
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+	// Get the file extension
+	ext = get_file_ext(path);
 
-		const int src_x = x << 1;
-		const int src_y = y << 1;
-		const int src_z = z << 1;
+	// Check if we need to compress the file
+	compress = strcmp(ext, ext_gz) == 0;
 
-		SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
-		    SIFT3D_IM_GET_VOX(src, src_x, src_y, src_z, c);
-	SIFT3D_IM_LOOP_END_C 
+        // Format the matrix
+        if (format_Mat_rm(mat, exact, &str, &len))
+                return SIFT3D_FAILURE;
+
+        // Write the file
+        if (compress) {
+                if (im_write_gz(path, str, len))
+                        goto write_mat_quit;
+        } else {
+                if ((file = fopen(path, "w")) == NULL)
+                        goto write_mat_quit;
+                if (fwrite(str, 1, len, file) != len || ferror(file)) {
+                        fclose(file);
+                        goto write_mat_quit;
+                }
+                if (fclose(file))
+                        goto write_mat_quit;
+        }
 
+        free(str);
 	return SIFT3D_SUCCESS;
+
+ write_mat_quit:
+        free(str);
+	return SIFT3D_FAILURE;
 }
 
-/* Same as im_downsample_2x, but with OpenCL acceleration. This function DOES NOT
- * read the results back dst->data. Use im_read_back for that. */
-int im_downsample_2x_cl(Image * src, Image * dst)
+/* Read a matrix from a .csv or .csv.gz file, as written by write_Mat_rm. 
+ * The result has type SIFT3D_DOUBLE. mat must be initialized. */
+int read_Mat_rm(const char *path, Mat_rm *const mat)
 {
-#ifdef SIFT3D_USE_OPENCL
-	size_t global_work_size[3];
-	cl_int err, dim;
-	cl_kernel kernel;
+        void *data;
+        char *buf, *line, *next, *pos, *end;
+        size_t len;
+        int i, j, num_rows, num_cols;
+
+        // Read the whole file. This also reads uncompressed files, and
+        // decompresses files written by write_Mat_rm in parallel.
+        if (im_read_gz(path, &data, &len)) {
+                SIFT3D_ERR("read_Mat_rm: failed to read file %s \n", path);
+                return SIFT3D_FAILURE;
+        }
+        buf = data;
 
-	// Verify image dimensions
-	if (src->nx % 2 != 0 || src->ny % 2 != 0 || src->nz % 2 != 0)
-		return SIFT3D_FAILURE;
+#define READ_MAT_NEXT_LINE(line, next) \
+        next = strchr(line, '\n'); \
+        next = next == NULL ? line + strlen(line) : next + 1;
 
-	// Initialize dst dimensions, resized in im_set_kernel_arg
-	dst->nx = src->nx / 2;
-	dst->ny = src->ny / 2;
-	dst->nz = src->nz / 2;
-	dst->nc = src->nc;
-	im_default_stride(dst);
+        // Count the rows and columns, skipping blank lines
+        num_rows = num_cols = 0;
+        for (line = buf; *line != '\0'; line = next) {
 
-	// Do not have a 2D kernel right now
-	assert(src->nz > 0);
-	dim = 3;
-	global_work_size[0] = dst->nx;
-	global_work_size[1] = dst->ny;
-	global_work_size[2] = dst->nz;
+                int cols;
 
-	kernel = cl_data.kernels.downsample_2x_3d;
-	im_set_kernel_arg(kernel, 0, src);
-	im_set_kernel_arg(kernel, 1, dst);
+                READ_MAT_NEXT_LINE(line, next)
+                if (strspn(line, " \t\r\n") >= (size_t) (next - line))
+                        continue;
 
-	err =
-	    clEnqueueNDRangeKernel(cl_data.queues[0], kernel, dim, NULL,
-				   global_work_size, NULL, 0, NULL, NULL);
-	return (int)err;
-#else
-	printf
-	    ("im_downsample_2x_cl: This version was not compiled with OpenCL!\n");
-	return SIFT3D_FAILURE;
-#endif
+                cols = 1;
+                for (pos = line; pos < next; pos++) {
+                        if (*pos == ',')
+                                cols++;
+                }
+
+                if (num_rows == 0) {
+                        num_cols = cols;
+                } else if (cols != num_cols) {
+                        SIFT3D_ERR("read_Mat_rm: inconsistent number of "
+                                "columns in file %s \n", path);
+                        goto read_Mat_rm_quit;
+                }
+                num_rows++;
+        }
+
+        // Resize the output
+        mat->type = SIFT3D_DOUBLE;
+        mat->num_rows = num_rows;
+        mat->num_cols = num_cols;
+        if (resize_Mat_rm(mat))
+                goto read_Mat_rm_quit;
+
+        // Parse the values
+        i = 0;
+        for (line = buf; *line != '\0'; line = next) {
+
+                READ_MAT_NEXT_LINE(line, next)
+                if (strspn(line, " \t\r\n") >= (size_t) (next - line))
+                        continue;
+
+                pos = line;
+                for (j = 0; j < num_cols; j++) {
+                        SIFT3D_MAT_RM_GET(mat, i, j, double) = 
+                                strtod(pos, &end);
+                        if (end == pos) {
+                                SIFT3D_ERR("read_Mat_rm: failed to parse "
+                                        "file %s \n", path);
+                                goto read_Mat_rm_quit;
+                        }
+                        pos = end + strspn(end, " \t");
+                        if (*pos == ',')
+                                pos++;
+                }
+                i++;
+        }
+
+#undef READ_MAT_NEXT_LINE
+
+        free(buf);
+        return SIFT3D_SUCCESS;
+
+read_Mat_rm_quit:
+        free(buf);
+        return SIFT3D_FAILURE;
 }
 
-/* Loads the C-accessible data of an image into its OpenCL data. If blocking is set,
- * block the function until the load is complete. */
-int im_load_cl(Image * im, int blocking)
+/* Shortcut to initialize an image for first-time use.
+ * Allocates memory, and assumes the default stride. This
+ * function calls init_im and initializes all values to 0. */
+int init_im_with_dims(Image *const im, const int nx, const int ny, const int nz,
+        const int nc)
 {
-#ifdef SIFT3D_USE_OPENCL
-	const size_t origin[] = { 0, 0, 0 };
+
+	init_im(im);
+	im->nx = nx;
+	im->ny = ny;
+	im->nz = nz;
+	im->nc = nc;
+
+	im_default_stride(im);
+	if (im_resize(im))
+		return SIFT3D_FAILURE;
+
+	im_zero(im);
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Calculate the strides of an image object in the default
+ * manner. The following parameters must be initialized:
+ * -nx
+ * -ny
+ * -nz
+ * -nc
+ * If a dimension is not used, its size should be set
+ * to 1. */
+void im_default_stride(Image *const im)
+{
+
+        size_t prod;
+	int i;
+
+	prod = (size_t) im->nc;
+	SIFT3D_IM_GET_STRIDES(im)[0] = prod;
+
+	for (i = 1; i < IM_NDIMS; i++) {
+		prod *= SIFT3D_IM_GET_DIMS(im)[i - 1];
+		SIFT3D_IM_GET_STRIDES(im)[i] = prod;
+	}
+}
+
+/* Pads an image to a new size. Prior to calling this function, initialize 
+ * pad with all dimensions and strides, as in im_resize. Other metadata,
+ * such as units, will be copied from im to pad. */
+int im_pad(const Image * const im, Image * const pad)
+{
+
+	int x, y, z, c;
+
+	const int pad_x_end = pad->nx - 1;
+	const int pad_y_end = pad->ny - 1;
+	const int pad_z_end = pad->nz - 1;
+
+	const int data_x_end = SIFT3D_MIN(im->nx - 1, pad_x_end);
+	const int data_y_end = SIFT3D_MIN(im->ny - 1, pad_y_end);
+	const int data_z_end = SIFT3D_MIN(im->nz - 1, pad_z_end);
+
+        // Copy relevant metadata, omitting dimensions and strides
+        memcpy(SIFT3D_IM_GET_UNITS(pad), SIFT3D_IM_GET_UNITS(im), 
+                IM_NDIMS * sizeof(double));
+
+	// Resize the output 
+	if (im_resize(pad))
+		return SIFT3D_FAILURE;
+
+	// Copy the image 
+	SIFT3D_IM_LOOP_LIMITED_START_C(im, x, y, z, c, 0, data_x_end, 0,
+				       data_y_end, 0, data_z_end)
+
+	    SIFT3D_IM_GET_VOX(pad, x, y, z, c) =
+	    SIFT3D_IM_GET_VOX(im, x, y, z, c);
+
+	SIFT3D_IM_LOOP_END_C
+	    // Pad the remaining data with zeros
+	    SIFT3D_IM_LOOP_LIMITED_START_C(im, x, y, z, c, data_x_end,
+					   pad_x_end, data_y_end, pad_y_end,
+					   data_z_end, pad_z_end)
+
+	    SIFT3D_IM_GET_VOX(pad, x, y, z, c) = 0.0f;
+
+	SIFT3D_IM_LOOP_END_C return SIFT3D_SUCCESS;
+}
+
+/* Resize an image according to the current nx, ny,
+ * and nz. Does not modify scale space information or
+ * strides. Prior to calling this function, use init_im(im)
+ * and initialize the following fields:
+ * -nx
+ * -ny
+ * -nz
+ * -nc
+ * -xs (can be set by im_default_stride(im)) 
+ * -ys (can be set by im_default_stride(im)) 
+ * -zs (can be set by im_default_stride(im)) 
+ *
+ * All of this initialization can also be done with
+ * init_im_with_dims(), which calls this function.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int im_resize(Image *const im)
+{
+
+	int i;
+
+	//FIXME: This will not work for strange strides
+	const size_t size = im->nx * im->ny * im->nz * im->nc;
+
+	// Verify inputs
+	for (i = 0; i < IM_NDIMS; i++) {
+
+		const int dim = SIFT3D_IM_GET_DIMS(im)[i];
+
+		if (dim > 0)
+			continue;
+
+		SIFT3D_ERR("im_resize: invalid dimension %d: %d \n", i,
+			dim);
+		return SIFT3D_FAILURE;
+	}
+	if (im->nc < 1) {
+		SIFT3D_ERR("im_resize: invalid number of channels: %d \n",
+			im->nc);
+		return SIFT3D_FAILURE;
+	}
+
+        // Do nothing if the size has not changed
+        if (im->size == size)
+                return SIFT3D_SUCCESS;
+
+	// Allocate new memory. Data in a file mapping is copied out, as
+        // mappings cannot be resized.
+#ifndef _WINDOWS
+        if (im->map != NULL) {
+                float *const data = (float *) malloc(size * sizeof(float));
+                if (data != NULL)
+                        memcpy(data, im->data, 
+                                SIFT3D_MIN(im->size, size) * sizeof(float));
+                munmap(im->map, im->map_size);
+                im->map = NULL;
+                im->map_size = 0;
+                im->data = data;
+        } else
+#endif
+	im->data = SIFT3D_safe_realloc(im->data, size * sizeof(float));
+	im->size = size;
+
+#ifdef SIFT3D_USE_OPENCL
+	{
+		cl_int err;
+		int initialized;
+
+		if (cl_data.valid) {
+			initialized = (im->data != NULL);
+
+			// Destroy the old image
+			if (initialized && im->cl_valid)
+				clReleaseMemObject(im->cl_image);
+
+			// Init an OpenCL image
+			if (im->nz > 0) {
+				im->cl_image = clCreateImage2D(cl_data.context,
+							       cl_data.
+							       mem_flags,
+							       &cl_data.
+							       image_format,
+							       im->nx, im->ny,
+							       im->ys,
+							       im->data, &err);
+			} else {
+				im->cl_image = clCreateImage3D(cl_data.context,
+							       cl_data.
+							       mem_flags,
+							       &cl_data.
+							       image_format,
+							       im->nx, im->ny,
+							       im->nz,
+							       im->ys,
+							       im->zs,
+							       im->data, &err);
+			}
+
+			if (err != CL_SUCCESS) {
+				im->cl_valid = SIFT3D_FALSE;
+				return SIFT3D_FAILURE;
+			}
+
+			im->cl_valid = SIFT3D_TRUE;
+		}
+	}
+#endif
+	return size != 0 && im->data == NULL ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* Concatenate two images in dimension dim, so that src1 comes before src2.
+ * For example, if dim == 0, the images are horizontally concatenated in x,
+ * so that src1 is on the left and src2 is on the right. Resizes dst. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_concat(const Image * const src1, const Image * const src2, const int dim,
+	      Image * const dst)
+{
+
+	int off[IM_NDIMS], dims_out[IM_NDIMS];
+	int i, x, y, z, c;
+
+	const int nc = src1->nc;
+
+	// Verify inputs
+	for (i = 0; i < IM_NDIMS; i++) {
+
+		const int src1d = SIFT3D_IM_GET_DIMS(src1)[i];
+		const int src2d = SIFT3D_IM_GET_DIMS(src2)[i];
+
+		if (i == dim)
+			continue;
+		if (src1d != src2d) {
+			SIFT3D_ERR("im_concat: dimension %d must be "
+				"equal in input images. src1: %d src2: %d \n",
+				i, src1d, src2d);
+			return SIFT3D_FAILURE;
+		}
+	}
+	if (src1->nc != src2->nc) {
+		SIFT3D_ERR("im_concat: images must have an equal number "
+			"of channels. src1: %d src2: %d \n", src1->nc,
+			src2->nc);
+		return SIFT3D_FAILURE;
+	}
+	// Get the output dimensions and offsets
+	for (i = 0; i < IM_NDIMS; i++) {
+
+		const int src1d = SIFT3D_IM_GET_DIMS(src1)[i];
+		const int src2d = SIFT3D_IM_GET_DIMS(src2)[i];
+
+                dims_out[i] = dim == i ? src1d + src2d : src1d;
+                off[i] = dim == i ? src1d : 0;
+	}
+
+	// Resize dst 
+	memcpy(SIFT3D_IM_GET_DIMS(dst), dims_out, IM_NDIMS * sizeof(int));
+	dst->nc = nc;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Copy the data from src1 
+	SIFT3D_IM_LOOP_START_C(src1, x, y, z, c)
+	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
+	    SIFT3D_IM_GET_VOX(src1, x, y, z, c);
+	SIFT3D_IM_LOOP_END_C 
+
+        // Copy the data from src2
+        SIFT3D_IM_LOOP_START_C(src2, x, y, z, c)
+
+                // Get the destination coordinates with offsets
+                const int x_dst = x + off[0];
+                const int y_dst = y + off[1];
+                const int z_dst = z + off[2];
+
+                // Copy the data from src2
+                SIFT3D_IM_GET_VOX(dst, x_dst, y_dst, z_dst, c) =
+                    SIFT3D_IM_GET_VOX(src2, x, y, z, c);
+
+        SIFT3D_IM_LOOP_END_C 
+        
+        return SIFT3D_SUCCESS;
+}
+
+/* Upsample an image by a factor of 2 in each dimension.
+ * This function resizes dst and modifies its units. */
+int im_upsample_2x(const Image *const src, Image *const dst)
+{
+
+	double units[IM_NDIMS];
+	int dims[IM_NDIMS];
+	int i, x, y, z, c, sx, sy, sz;
+
+	const int nc = src->nc;
+	const int w = 2;
+	const float weight = (float) (1.0 / pow((double) w, IM_NDIMS));
+
+	// Resize the output 
+	for (i = 0; i < IM_NDIMS; i++) {
+		dims[i] = SIFT3D_IM_GET_DIMS(src)[i] * 2;	
+		units[i] = SIFT3D_IM_GET_UNITS(src)[i] / 2.0;
+	}
+	memcpy(SIFT3D_IM_GET_DIMS(dst), dims, IM_NDIMS * sizeof(int));
+	memcpy(SIFT3D_IM_GET_UNITS(dst), units, IM_NDIMS * sizeof(float));
+	dst->nc = nc;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// TODO: 3-pass (separable) upsample might be faster
+
+	// Upsample
+	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+
+		const int sx_start = x >> 1;
+		const int sy_start = y >> 1;
+		const int sz_start = z >> 1;
+
+		const int sx_end = sx_start + w - 1;
+		const int sy_end = sy_start + w - 1;
+		const int sz_end = sz_start + w - 1;
+
+		SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 0;
+
+		SIFT3D_IM_LOOP_LIMITED_START(dst, sx, sy, sz, sx_start,
+					       sx_end, sy_start, sy_end,
+					       sz_start, sz_end)
+
+			SIFT3D_IM_GET_VOX(dst, x, y, z, c) += 
+				SIFT3D_IM_GET_VOX(src, sx, sy, sz, c);
+
+		SIFT3D_IM_LOOP_END 
+
+		SIFT3D_IM_GET_VOX(dst, x, y, z, c) *= weight;	
+
+	SIFT3D_IM_LOOP_END_C
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Downsample an image by a factor of 2 in each dimension.
+ * This function initializes dst with the proper 
+ * dimensions, and allocates memory. */
+int im_downsample_2x(const Image *const src, Image *const dst)
+{
+
+	int x, y, z, c;
+
+	// Initialize dst
+	dst->nx = (int)floor((double)src->nx / 2.0);
+	dst->ny = (int)floor((double)src->ny / 2.0);
+	dst->nz = (int)floor((double)src->nz / 2.0);
+	dst->nc = src->nc;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Downsample
+	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+
+		const int src_x = x << 1;
+		const int src_y = y << 1;
+		const int src_z = z << 1;
+
+		SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
+		    SIFT3D_IM_GET_VOX(src, src_x, src_y, src_z, c);
+	SIFT3D_IM_LOOP_END_C 
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Same as im_downsample_2x, but with OpenCL acceleration. This function DOES NOT
+ * read the results back dst->data. Use im_read_back for that. */
+int im_downsample_2x_cl(Image * src, Image * dst)
+{
+#ifdef SIFT3D_USE_OPENCL
+	size_t global_work_size[3];
+	cl_int err, dim;
+	cl_kernel kernel;
+
+	// Verify image dimensions
+	if (src->nx % 2 != 0 || src->ny % 2 != 0 || src->nz % 2 != 0)
+		return SIFT3D_FAILURE;
+
+	// Initialize dst dimensions, resized in im_set_kernel_arg
+	dst->nx = src->nx / 2;
+	dst->ny = src->ny / 2;
+	dst->nz = src->nz / 2;
+	dst->nc = src->nc;
+	im_default_stride(dst);
+
+	// Do not have a 2D kernel right now
+	assert(src->nz > 0);
+	dim = 3;
+	global_work_size[0] = dst->nx;
+	global_work_size[1] = dst->ny;
+	global_work_size[2] = dst->nz;
+
+	kernel = cl_data.kernels.downsample_2x_3d;
+	im_set_kernel_arg(kernel, 0, src);
+	im_set_kernel_arg(kernel, 1, dst);
+
+	err =
+	    clEnqueueNDRangeKernel(cl_data.queues[0], kernel, dim, NULL,
+				   global_work_size, NULL, 0, NULL, NULL);
+	return (int)err;
+#else
+	printf
+	    ("im_downsample_2x_cl: This version was not compiled with OpenCL!\n");
+	return SIFT3D_FAILURE;
+#endif
+}
+
+/* Loads the C-accessible data of an image into its OpenCL data. If blocking is set,
+ * block the function until the load is complete. */
+int im_load_cl(Image * im, int blocking)
+{
+#ifdef SIFT3D_USE_OPENCL
+	const size_t origin[] = { 0, 0, 0 };
 	const size_t region[] = { im->nx, im->ny, im->nz };
 	const cl_bool cl_blocking = (blocking) ? CL_TRUE : CL_FALSE;
 	return clEnqueueWriteImage(cl_data.queues[0], im->cl_image, cl_blocking,
 				   origin, region, im->ys, im->zs,
 				   im->data, 0, NULL, NULL);
 #else
-	printf("im_load_cl: This version was not compiled with OpenCL!\n");
+	printf("im_load_cl: This version was not compiled with OpenCL!\n");
+	return SIFT3D_FAILURE;
+#endif
+}
+
+/* Reads the OpenCL data of an image back to its C-accessible data. If blocking is set,
+ * block the function until the read is complete. */
+int im_read_back(Image * im, int blocking)
+{
+#ifdef SIFT3D_USE_OPENCL
+	const size_t origin[] = { 0, 0, 0 };
+	const size_t region[] = { im->nx, im->ny, im->nz };
+	const cl_bool cl_blocking = (blocking) ? CL_TRUE : CL_FALSE;
+	return clEnqueueReadImage(cl_data.queues[0], im->cl_image, cl_blocking,
+				  origin, region, im->ys, im->zs,
+				  im->data, 0, NULL, NULL);
+#else
+	printf("im_read_back: This version was not compiled with OpenCL!\n");
+	return SIFT3D_FAILURE;
+#endif
+}
+
+/* Updates an Image struct's OpenCL data, if neccessary, and sets it as argument n
+ * in the provided kernel. */
+int im_set_kernel_arg(cl_kernel kernel, int n, Image * im)
+{
+#ifdef SIFT3D_USE_OPENCL
+	cl_int err;
+
+	if (!im->cl_valid && im_resize(im))
+		return SIFT3D_FAILURE;
+	err = clSetKernelArg(kernel, n, sizeof(cl_mem), &im->cl_image);
+	check_cl_error(err, "im_set_kernel_arg");
+
+	return SIFT3D_SUCCESS;
+#else
+	printf
+	    ("im_set_kernel_arg: This version was not compiled with OpenCL!\n");
+	return SIFT3D_FAILURE;
+#endif
+}
+
+/* Copy an image's dimensions and stride into another. 
+ * This function resizes dst.
+ * 
+ * @param src The source image.
+ * @param dst The destination image.
+ * @return Returns SIFT3D_SUCCESS or SIFT3D_FAILURE.
+ */
+int im_copy_dims(const Image * const src, Image * dst)
+{
+        if (src->data == NULL)
+                return SIFT3D_FAILURE;
+
+	dst->nx = src->nx;
+	dst->ny = src->ny;
+	dst->nz = src->nz;
+	dst->xs = src->xs;
+	dst->ys = src->ys;
+	dst->zs = src->zs;
+	dst->nc = src->nc;
+        dst->ux = src->ux;
+        dst->uy = src->uy;
+        dst->uz = src->uz;
+
+	return im_resize(dst);
+}
+
+/* Copy an image's data into another. This function
+ * changes the dimensions and stride of dst,
+ * and allocates memory. */
+int im_copy_data(const Image * const src, Image * const dst)
+{
+
+	int x, y, z, c;
+
+        // Return if src has no data 
+        if (src->data == NULL)
+                return SIFT3D_FAILURE;
+
+	// Return if src and dst are the same
+	if (dst->data == src->data)
+		return SIFT3D_SUCCESS;
+
+	// Resize dst
+	if (im_copy_dims(src, dst))
+		return SIFT3D_FAILURE;
+
+	// Copy data
+        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
+                        SIFT3D_IM_GET_VOX(src, x, y, z, c);
+        SIFT3D_IM_LOOP_END_C
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Clean up memory for an Image */
+void im_free(Image * im)
+{
+#ifndef _WINDOWS
+        if (im->map != NULL) {
+                munmap(im->map, im->map_size);
+                im->map = NULL;
+                return;
+        }
+#endif
+	if (im->data != NULL)
+		free(im->data);
+}
+
+/* Make a deep copy of a single channel of an image. */
+int im_channel(const Image * const src, Image * const dst,
+	       const unsigned int chan)
+{
+
+	int x, y, z;
+
+	const int c = chan;
+
+	// Verify inputs
+	if (c >= src->nc) {
+		SIFT3D_ERR("im_channel: invalid channel: %d, image has "
+			"%d channels", c, src->nc);
+		return SIFT3D_FAILURE;
+	}
+	// Resize the output
+	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
+                IM_NDIMS * sizeof(int));
+	dst->nc = 1;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Copy the channel
+	SIFT3D_IM_LOOP_START(dst, x, y, z)
+	    SIFT3D_IM_GET_VOX(dst, x, y, z, 0) =
+	    SIFT3D_IM_GET_VOX(src, x, y, z, c);
+	SIFT3D_IM_LOOP_END return SIFT3D_SUCCESS;
+}
+
+/* Find the maximum absolute value of an image */
+float im_max_abs(const Image *const im) {
+
+        float max;
+        int x, y, z, c;
+
+	max = 0.0f;
+	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+
+	        const float samp = fabsf(SIFT3D_IM_GET_VOX(im, x, y, z, c));
+                max = SIFT3D_MAX(max, samp);
+
+	SIFT3D_IM_LOOP_END_C
+
+        return max;
+}
+
+/* Scale an image to the [-1, 1] range, where
+ * the largest absolute value is 1. */
+void im_scale(const Image *const im)
+{
+
+	int x, y, z, c;
+
+        // Find the maximum absolute value
+	const float max = im_max_abs(im);
+        if (max == 0.0f)
+	        return;
+
+	// Divide by the max 
+	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+	        SIFT3D_IM_GET_VOX(im, x, y, z, c) /= max;
+        SIFT3D_IM_LOOP_END_C
+}
+
+/* Subtract src2 from src1, saving the result in
+ * dst.
+ * Resizes dst. 
+ */
+int im_subtract(Image * src1, Image * src2, Image * dst)
+{
+
+	int x, y, z, c;
+
+	// Verify inputs
+	if (src1->nx != src2->nx ||
+	    src1->ny != src2->ny ||
+	    src1->nz != src2->nz || src1->nc != src2->nc)
+		return SIFT3D_FAILURE;
+
+	// Resize the output image
+	if (im_copy_dims(src1, dst))
+		return SIFT3D_FAILURE;
+
+	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
+	    SIFT3D_IM_GET_VOX(src1, x, y, z, c) -
+	    SIFT3D_IM_GET_VOX(src2, x, y, z, c);
+	SIFT3D_IM_LOOP_END_C return SIFT3D_SUCCESS;
+}
+
+/* Zero an image. */
+void im_zero(Image * im)
+{
+
+	int x, y, z, c;
+
+	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+	    SIFT3D_IM_GET_VOX(im, x, y, z, c) = 0.0f;
+SIFT3D_IM_LOOP_END_C}
+
+/* Transform an image according to the inverse of the provided tform. 
+ * 
+ * Paramters:
+ *   tform: The transformation. 
+ *   src: The input image.
+ *   interp: The type of interpolation.
+ *   resize: If true, resizes the dst to be the same size as src. Otherwise,
+ *     uses the dimensions of dst. 
+ *   dst: The output image.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_inv_transform(const void *const tform, const Image * const src,
+		     const interp_type interp, const int resize, 
+                     Image *const dst)
+{
+	// Optionally resize the output image
+	if (resize && im_copy_dims(src, dst))
+		return SIFT3D_FAILURE;
+
+        // Use the fast path for linear interpolation of affine 
+        // transformations
+        switch (tform_get_type(tform)) {
+        case AFFINE:
+        case RIGID:
+        case SIMILARITY:
+                if (interp == LINEAR && 
+                        AFFINE_GET_DIM((const Affine *) tform) == IM_NDIMS &&
+                        dst->nc <= src->nc)
+                        return im_inv_transform_affine(tform, src, dst);
+                break;
+        case COMPOSITE:
+                // Transform by the only member of the composite, if any
+                if (((const Composite *) tform)->num == 1)
+                        return im_inv_transform(
+                                ((const Composite *) tform)->tforms[0], src,
+                                interp, SIFT3D_FALSE, dst);
+                break;
+        case DISPLACEMENT_FIELD:
+                // Read the coordinates directly if the field matches dst
+                if (!memcmp(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(
+                        &((const Disp_field *) tform)->disp), 
+                        IM_NDIMS * sizeof(int)))
+                        return im_inv_transform_Disp_field(tform, src, interp,
+                                dst);
+                break;
+        default:
+                break;
+        }
+
+        return im_inv_transform_gen(tform, NULL, src, interp, dst);
+}
+
+/* Helper routine for im_inv_transform. Resamples an image by trilinear 
+ * interpolation, under a 3D affine transformation. 
+ *
+ * Along each row of dst, the source coordinates advance by a constant step,
+ * so the transformation is never applied per voxel. The range of each row 
+ * which maps inside src is found in advance, and the rest is set to zero 
+ * without interpolation, as in resample_linear. The slices in z are 
+ * resampled in parallel. With AVX2, single-channel rows are interpolated 8 
+ * voxels at a time, with gathers and single-precision coordinates. */
+static int im_inv_transform_affine(const Affine *const aff, 
+        const Image *const src, Image *const dst)
+{
+        double A[IM_NDIMS][IM_NDIMS + 1];
+        int i, j, z;
+
+        // Steps to the next voxel in each dimension, or zero if the source 
+        // has a single voxel in that dimension
+        const size_t dx = src->nx > 1 ? src->xs : 0;
+        const size_t dy = src->ny > 1 ? src->ys : 0;
+        const size_t dz = src->nz > 1 ? src->zs : 0;
+        const int max_ix = SIFT3D_MAX(src->nx - 2, 0);
+        const int max_iy = SIFT3D_MAX(src->ny - 2, 0);
+        const int max_iz = SIFT3D_MAX(src->nz - 2, 0);
+
+        for (i = 0; i < IM_NDIMS; i++) {
+                for (j = 0; j <= IM_NDIMS; j++) {
+                        A[i][j] = SIFT3D_MAT_RM_GET(&aff->A, i, j, double);
+                }
+        }
+
+#pragma omp parallel for schedule(dynamic)
+        for (z = 0; z < dst->nz; z++) {
+
+                int x, y, c;
+
+                for (y = 0; y < dst->ny; y++) {
+
+                        double base[IM_NDIMS];
+                        int start, end;
+
+                        // Source coordinates of the start of the row
+                        for (i = 0; i < IM_NDIMS; i++) {
+                                base[i] = A[i][1] * y + A[i][2] * z + A[i][3];
+                        }
+
+                        // Zero the voxels which map outside the source
+                        affine_row_bounds(A, base, src, dst->nx, &start, &end);
+                        for (x = 0; x < dst->nx; x++) {
+                                if (x == start) 
+                                        x = end + 1;
+                                if (x >= dst->nx)
+                                        break;
+                                for (c = 0; c < dst->nc; c++) {
+                                        SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
+                                                0.0f;
+                                }
+                        }
+
+                        x = start;
+#ifdef __AVX2__
+                        if (dst->nc == 1 && dst->xs == 1 && 
+                                src->size <= INT32_MAX) {
+
+                                float *const row = 
+                                        &SIFT3D_IM_GET_VOX(dst, 0, y, z, 0);
+                                const __m256 iota = _mm256_setr_ps(0.0f, 1.0f,
+                                        2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+                                const __m256 step_x = _mm256_set1_ps(
+                                        (float) A[0][0]);
+                                const __m256 step_y = _mm256_set1_ps(
+                                        (float) A[1][0]);
+                                const __m256 step_z = _mm256_set1_ps(
+                                        (float) A[2][0]);
+                                const __m256 base_x = _mm256_set1_ps(
+                                        (float) base[0]);
+                                const __m256 base_y = _mm256_set1_ps(
+                                        (float) base[1]);
+                                const __m256 base_z = _mm256_set1_ps(
+                                        (float) base[2]);
+                                const __m256i zero = _mm256_setzero_si256();
+                                const __m256i max_x = _mm256_set1_epi32(max_ix);
+                                const __m256i max_y = _mm256_set1_epi32(max_iy);
+                                const __m256i max_z = _mm256_set1_epi32(max_iz);
+                                const __m256i stride_x = _mm256_set1_epi32(
+                                        (int) src->xs);
+                                const __m256i stride_y = _mm256_set1_epi32(
+                                        (int) src->ys);
+                                const __m256i stride_z = _mm256_set1_epi32(
+                                        (int) src->zs);
+                                const __m256i off_x = _mm256_set1_epi32(
+                                        (int) dx);
+                                const __m256i off_y = _mm256_set1_epi32(
+                                        (int) dy);
+                                const __m256i off_z = _mm256_set1_epi32(
+                                        (int) dz);
+
+                                for (; x + 7 <= end; x += 8) {
+
+                                        __m256 v0, v1, v2, v3, v4, v5, v6, v7;
+                                        __m256i ix, iy, iz, idx;
+
+                                        const __m256 xv = _mm256_add_ps(
+                                                _mm256_set1_ps((float) x), 
+                                                iota);
+                                        const __m256 px = _mm256_add_ps(
+                                                base_x, _mm256_mul_ps(xv, 
+                                                step_x));
+                                        const __m256 py = _mm256_add_ps(
+                                                base_y, _mm256_mul_ps(xv, 
+                                                step_y));
+                                        const __m256 pz = _mm256_add_ps(
+                                                base_z, _mm256_mul_ps(xv, 
+                                                step_z));
+
+                                        // Clamp the indices, in case of 
+                                        // rounding at the boundaries
+                                        ix = _mm256_max_epi32(zero, 
+                                                _mm256_min_epi32(max_x,
+                                                _mm256_cvttps_epi32(px)));
+                                        iy = _mm256_max_epi32(zero, 
+                                                _mm256_min_epi32(max_y,
+                                                _mm256_cvttps_epi32(py)));
+                                        iz = _mm256_max_epi32(zero, 
+                                                _mm256_min_epi32(max_z,
+                                                _mm256_cvttps_epi32(pz)));
+
+                                        const __m256 fx = _mm256_sub_ps(px, 
+                                                _mm256_cvtepi32_ps(ix));
+                                        const __m256 fy = _mm256_sub_ps(py, 
+                                                _mm256_cvtepi32_ps(iy));
+                                        const __m256 fz = _mm256_sub_ps(pz, 
+                                                _mm256_cvtepi32_ps(iz));
+
+                                        idx = _mm256_add_epi32(
+                                                _mm256_mullo_epi32(ix, 
+                                                stride_x), _mm256_add_epi32(
+                                                _mm256_mullo_epi32(iy, 
+                                                stride_y), _mm256_mullo_epi32(
+                                                iz, stride_z)));
+
+#define AFFINE_GATHER(off) \
+        _mm256_i32gather_ps(src->data, _mm256_add_epi32(idx, off), 4)
+#define AFFINE_LERP(a, b, t) \
+        _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)))
+
+                                        v0 = AFFINE_GATHER(zero);
+                                        v1 = AFFINE_GATHER(off_x);
+                                        v2 = AFFINE_GATHER(off_y);
+                                        v3 = AFFINE_GATHER(_mm256_add_epi32(
+                                                off_x, off_y));
+                                        v4 = AFFINE_GATHER(off_z);
+                                        v5 = AFFINE_GATHER(_mm256_add_epi32(
+                                                off_x, off_z));
+                                        v6 = AFFINE_GATHER(_mm256_add_epi32(
+                                                off_y, off_z));
+                                        v7 = AFFINE_GATHER(_mm256_add_epi32(
+                                                off_x, _mm256_add_epi32(off_y,
+                                                off_z)));
+
+                                        v0 = AFFINE_LERP(v0, v1, fx);
+                                        v2 = AFFINE_LERP(v2, v3, fx);
+                                        v4 = AFFINE_LERP(v4, v5, fx);
+                                        v6 = AFFINE_LERP(v6, v7, fx);
+                                        v0 = AFFINE_LERP(v0, v2, fy);
+                                        v4 = AFFINE_LERP(v4, v6, fy);
+                                        _mm256_storeu_ps(row + x, 
+                                                AFFINE_LERP(v0, v4, fz));
+
+#undef AFFINE_GATHER
+#undef AFFINE_LERP
+                                }
+                        }
+#endif
+
+                        // Scalar interpolation
+                        for (; x <= end; x++) {
+
+                                const double px = base[0] + A[0][0] * x;
+                                const double py = base[1] + A[1][0] * x;
+                                const double pz = base[2] + A[2][0] * x;
+                                const int ix = SIFT3D_MIN((int) px, max_ix);
+                                const int iy = SIFT3D_MIN((int) py, max_iy);
+                                const int iz = SIFT3D_MIN((int) pz, max_iz);
+                                const double fx = px - ix;
+                                const double fy = py - iy;
+                                const double fz = pz - iz;
+                                const float *const v = 
+                                        &SIFT3D_IM_GET_VOX(src, ix, iy, iz, 0);
+
+                                for (c = 0; c < dst->nc; c++) {
+
+                                        const double c00 = v[c] + fx * 
+                                                (v[c + dx] - v[c]);
+                                        const double c10 = v[c + dy] + fx * 
+                                                (v[c + dx + dy] - v[c + dy]);
+                                        const double c01 = v[c + dz] + fx * 
+                                                (v[c + dx + dz] - v[c + dz]);
+                                        const double c11 = v[c + dy + dz] + 
+                                                fx * (v[c + dx + dy + dz] - 
+                                                v[c + dy + dz]);
+                                        const double c0 = c00 + fy * 
+                                                (c10 - c00);
+                                        const double c1 = c01 + fy * 
+                                                (c11 - c01);
+
+                                        SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
+                                                (float) (c0 + fz * (c1 - c0));
+                                }
+                        }
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper routine for im_inv_transform. Resamples an image under a 
+ * displacement field with the same dimensions as dst, reading the source 
+ * coordinates of each voxel from the field. The slices in z are resampled in
+ * parallel. */
+static int im_inv_transform_Disp_field(const Disp_field *const field, 
+        const Image *const src, const interp_type interp, Image *const dst)
+{
+        Lanczos_table *lanczos_tab;
+        int z;
+
+        const Image *const disp = &field->disp;
+
+        lanczos_tab = NULL;
+	switch (interp) {
+	case LINEAR:
+		break;
+	case LANCZOS2:
+                if ((lanczos_tab = malloc(sizeof(Lanczos_table))) == NULL)
+                        return SIFT3D_FAILURE;
+                init_Lanczos_table(lanczos_tab);
+                break;
+	default:
+		SIFT3D_ERR("im_inv_transform: unrecognized "
+			"interpolation type");
+                return SIFT3D_FAILURE;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+        for (z = 0; z < dst->nz; z++) {
+
+                int x, y;
+
+                for (y = 0; y < dst->ny; y++) {
+                        for (x = 0; x < dst->nx; x++) {
+
+                                const float *const d = 
+                                        &SIFT3D_IM_GET_VOX(disp, x, y, z, 0);
+                                float *const out = 
+                                        &SIFT3D_IM_GET_VOX(dst, x, y, z, 0);
+
+                                if (lanczos_tab == NULL)
+                                        resample_linear(src, x + d[0], 
+                                                y + d[1], z + d[2], dst->nc,
+                                                out);
+                                else
+                                        resample_lanczos2(src, lanczos_tab,
+                                                x + d[0], y + d[1], z + d[2],
+                                                dst->nc, out);
+                        }
+                }
+        }
+
+        if (lanczos_tab != NULL)
+                free(lanczos_tab);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper routine for im_inv_transform_affine. Finds the range [start, end]
+ * of the row of nx voxels, whose source coordinates start at base and 
+ * advance by the first column of A, that lies within the bounds of src. If 
+ * there is none, start = nx and end = nx - 1. */
+static void affine_row_bounds(const double A[IM_NDIMS][IM_NDIMS + 1],
+        const double base[IM_NDIMS], const Image *const src, const int nx, 
+        int *const start, int *const end)
+{
+        double lo, hi;
+        int i, x_start, x_end;
+
+        const int *const dims = SIFT3D_IM_GET_DIMS(src);
+
+#define AFFINE_IN_BOUNDS(x) ( \
+        base[0] + A[0][0] * (x) >= 0.0 && \
+        base[0] + A[0][0] * (x) <= (double) (dims[0] - 1) && \
+        base[1] + A[1][0] * (x) >= 0.0 && \
+        base[1] + A[1][0] * (x) <= (double) (dims[1] - 1) && \
+        base[2] + A[2][0] * (x) >= 0.0 && \
+        base[2] + A[2][0] * (x) <= (double) (dims[2] - 1))
+
+        // Intersect the ranges of each coordinate
+        lo = 0.0;
+        hi = (double) (nx - 1);
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                double t0, t1;
+
+                const double step = A[i][0];
+                const double max = (double) (dims[i] - 1);
+
+                if (step == 0.0) {
+                        if (base[i] < 0.0 || base[i] > max)
+                                hi = -1.0;
+                        continue;
+                }
+
+                t0 = -base[i] / step;
+                t1 = (max - base[i]) / step;
+                lo = SIFT3D_MAX(lo, SIFT3D_MIN(t0, t1));
+                hi = SIFT3D_MIN(hi, SIFT3D_MAX(t0, t1));
+        }
+        if (!(lo <= hi)) {
+                *start = nx;
+                *end = nx - 1;
+                return;
+        }
+        x_start = (int) ceil(lo);
+        x_end = (int) floor(hi);
+
+        // Correct for rounding, so that the range agrees exactly with the 
+        // coordinates used for interpolation
+        while (x_start <= x_end && !AFFINE_IN_BOUNDS(x_start))
+                x_start++;
+        while (x_end >= x_start && !AFFINE_IN_BOUNDS(x_end))
+                x_end--;
+        if (x_start > x_end) {
+                *start = nx;
+                *end = nx - 1;
+                return;
+        }
+        while (x_start > 0 && AFFINE_IN_BOUNDS(x_start - 1))
+                x_start--;
+        while (x_end < nx - 1 && AFFINE_IN_BOUNDS(x_end + 1))
+                x_end++;
+
+#undef AFFINE_IN_BOUNDS
+
+        *start = x_start;
+        *end = x_end;
+}
+
+/* As im_inv_transform, for a thin-plate spline. Rather than evaluating the
+ * spline at each voxel, this samples it on a lattice, refined until the 
+ * largest error measured against the exact spline is at most tol voxels. 
+ * The error is only measured at sample points, so it is an estimate, not a 
+ * bound. See make_Tps_grid.
+ *
+ * Parameters:
+ *   tps: The transformation.
+ *   src: The input image.
+ *   interp: The type of interpolation.
+ *   resize: As in im_inv_transform.
+ *   tol: The tolerance on the measured error, in voxels.
+ *   dst: The output image.
+ *   err: If not NULL, receives the largest error measured on the lattice,
+ *      in voxels.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_inv_transform_Tps(const Tps *const tps, const Image * const src,
+                         const interp_type interp, const int resize,
+                         const double tol, Image *const dst, 
+                         double *const err)
+{
+        Tps_grid grid;
+
+	// Optionally resize the output image
+	if (resize && im_copy_dims(src, dst))
+		return SIFT3D_FAILURE;
+
+        // Sample the spline over the output image
+        init_Tps_grid(&grid);
+        if (make_Tps_grid(tps, dst->nx, dst->ny, dst->nz, tol, &grid))
+                goto im_inv_transform_Tps_quit;
+
+        // Transform
+        if (im_inv_transform_gen(tps, &grid, src, interp, dst))
+                goto im_inv_transform_Tps_quit;
+
+        if (err != NULL)
+                *err = grid.err;
+
+        cleanup_Tps_grid(&grid);
+        return SIFT3D_SUCCESS;
+
+im_inv_transform_Tps_quit:
+        cleanup_Tps_grid(&grid);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper routine for im_inv_transform and im_inv_transform_Tps. If grid is
+ * not NULL, it is used in place of tform. dst must already be sized. */
+static int im_inv_transform_gen(const void *const tform, 
+        const Tps_grid *const grid, const Image * const src, 
+        const interp_type interp, Image *const dst)
+{
+        Lanczos_table *lanczos_tab;
+        double *buf, *x_in, *y_in, *z_in, *x_out, *y_out, *z_out;
+	int x, y, z;
+
+        lanczos_tab = NULL;
+
+        // Allocate the coordinates of one row, before and after the 
+        // transformation
+        if ((buf = malloc(6 * SIFT3D_MAX(dst->nx, 1) * sizeof(double))) == 
+                NULL)
+                return SIFT3D_FAILURE;
+        x_in = buf;
+        y_in = x_in + dst->nx;
+        z_in = y_in + dst->nx;
+        x_out = z_in + dst->nx;
+        y_out = x_out + dst->nx;
+        z_out = y_out + dst->nx;
+        for (x = 0; x < dst->nx; x++) {
+                x_in[x] = (double) x;
+        }
+
+#define IMUTIL_RESAMPLE(expr) \
+    for (z = 0; z < dst->nz; z++) { \
+    for (y = 0; y < dst->ny; y++) { \
+\
+        for (x = 0; x < dst->nx; x++) { \
+                y_in[x] = (double) y; \
+                z_in[x] = (double) z; \
+        } \
+        if (grid == NULL ? \
+                apply_tform_points(tform, SIFT3D_DOUBLE, dst->nx, x_in, \
+                        y_in, z_in, x_out, y_out, z_out) : \
+                apply_Tps_grid_points(grid, dst->nx, x_in, y_in, z_in, \
+                        x_out, y_out, z_out)) \
+                goto im_inv_transform_gen_quit; \
+                        \
+        for (x = 0; x < dst->nx; x++) { \
+                expr; \
+        } \
+    } \
+    }
+
+	// Transform
+	switch (interp) {
+	case LINEAR:
+		IMUTIL_RESAMPLE(resample_linear(src, x_out[x], y_out[x], 
+                        z_out[x], dst->nc, &SIFT3D_IM_GET_VOX(dst, x, y, z, 0)))
+		    break;
+	case LANCZOS2:
+                if ((lanczos_tab = malloc(sizeof(Lanczos_table))) == NULL)
+                        goto im_inv_transform_gen_quit;
+                init_Lanczos_table(lanczos_tab);
+		IMUTIL_RESAMPLE(resample_lanczos2(src, lanczos_tab, x_out[x], 
+                        y_out[x], z_out[x], dst->nc, 
+                        &SIFT3D_IM_GET_VOX(dst, x, y, z, 0)))
+		    break;
+	default:
+		SIFT3D_ERR("im_inv_transform: unrecognized "
+			"interpolation type");
+                goto im_inv_transform_gen_quit;
+	}
+
+#undef IMUTIL_RESAMPLE
+
+        if (lanczos_tab != NULL)
+                free(lanczos_tab);
+        free(buf);
+	return SIFT3D_SUCCESS;
+
+im_inv_transform_gen_quit:
+        if (lanczos_tab != NULL)
+                free(lanczos_tab);
+        free(buf);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper routine for image transformation. Performs trilinear
+ * interpolation of channels [0, nc) at a point, setting out-of-bounds voxels 
+ * to zero. The weights are computed once and shared by all channels, which 
+ * are written to out[0], ..., out[nc - 1]. */
+static void resample_linear(const Image * const in, const double x,
+			    const double y, const double z, const int nc,
+                            float *const out)
+{
+        int c;
+
+	// Detect out-of-bounds
+	if (x < 0 || x > in->nx - 1 ||
+	    y < 0 || y > in->ny - 1 || z < 0 || z > in->nz - 1) {
+                for (c = 0; c < nc; c++) {
+                        out[c] = 0.0f;
+                }
+		return;
+        }
+
+	int fx = (int)floor(x);
+	int fy = (int)floor(y);
+	int fz = (int)floor(z);
+	int cx = (int)ceil(x);
+	int cy = (int)ceil(y);
+	int cz = (int)ceil(z);
+
+	double dist_x = x - fx;
+	double dist_y = y - fy;
+	double dist_z = z - fz;
+
+        const double w0 = (1.0 - dist_x) * (1.0 - dist_y) * (1.0 - dist_z);
+        const double w1 = (1.0 - dist_x) * dist_y * (1.0 - dist_z);
+        const double w2 = dist_x * (1.0 - dist_y) * (1.0 - dist_z);
+        const double w3 = dist_x * dist_y * (1.0 - dist_z);
+        const double w4 = (1.0 - dist_x) * (1.0 - dist_y) * dist_z;
+        const double w5 = (1.0 - dist_x) * dist_y * dist_z;
+        const double w6 = dist_x * (1.0 - dist_y) * dist_z;
+        const double w7 = dist_x * dist_y * dist_z;
+
+	const float *const c0 = &SIFT3D_IM_GET_VOX(in, fx, fy, fz, 0);
+	const float *const c1 = &SIFT3D_IM_GET_VOX(in, fx, cy, fz, 0);
+	const float *const c2 = &SIFT3D_IM_GET_VOX(in, cx, fy, fz, 0);
+	const float *const c3 = &SIFT3D_IM_GET_VOX(in, cx, cy, fz, 0);
+	const float *const c4 = &SIFT3D_IM_GET_VOX(in, fx, fy, cz, 0);
+	const float *const c5 = &SIFT3D_IM_GET_VOX(in, fx, cy, cz, 0);
+	const float *const c6 = &SIFT3D_IM_GET_VOX(in, cx, fy, cz, 0);
+	const float *const c7 = &SIFT3D_IM_GET_VOX(in, cx, cy, cz, 0);
+
+#pragma omp simd
+        for (c = 0; c < nc; c++) {
+                out[c] = (float) (c0[c] * w0 + c1[c] * w1 + c2[c] * w2 + 
+                        c3[c] * w3 + c4[c] * w4 + c5[c] * w5 + c6[c] * w6 + 
+                        c7[c] * w7);
+        }
+}
+
+/* Helper routine to resample channels [0, nc) of an image at a point, using 
+ * the Lanczos kernel, with weights from the table tab. Taps outside the image
+ * are skipped. The weights are computed once and shared by all channels, 
+ * which are written to out[0], ..., out[nc - 1]. */
+static void resample_lanczos2(const Image * const im, 
+                              const Lanczos_table *const tab, const double x,
+			      const double y, const double z, const int nc,
+                              float *const out)
+{
+        double wx[LANCZOS_TAPS], wy[LANCZOS_TAPS], wz[LANCZOS_TAPS];
+        size_t ox[LANCZOS_TAPS], oy[LANCZOS_TAPS], oz[LANCZOS_TAPS];
+        int i, j, k, c;
+
+        for (c = 0; c < nc; c++) {
+                out[c] = 0.0f;
+        }
+
+	// Check bounds
+	if (x < 0 || y < 0 || z < 0 ||
+	    x > im->nx - 1 || y > im->ny - 1 || z > im->nz - 1)
+		return;
+
+        // Look up the weights and offsets of the taps in each dimension, 
+        // zeroing those outside the image
+#define LANCZOS_TAPS_1D(p, n, stride, w, o) { \
+        const int fp = (int) (p); \
+        const double *const row = lanczos_weights(tab, (p) - fp); \
+        for (i = 0; i < LANCZOS_TAPS; i++) { \
+                const int q = fp - LANCZOS_A + 1 + i; \
+                const int inside = q >= 0 && q < (n); \
+                (w)[i] = inside ? row[i] : 0.0; \
+                (o)[i] = inside ? (size_t) q * (stride) : 0; \
+        } \
+}
+        LANCZOS_TAPS_1D(x, im->nx, im->xs, wx, ox)
+        LANCZOS_TAPS_1D(y, im->ny, im->ys, wy, oy)
+        LANCZOS_TAPS_1D(z, im->nz, im->zs, wz, oz)
+#undef LANCZOS_TAPS_1D
+
+        // A single channel is accumulated separably, one row of taps at a 
+        // time
+        if (nc == 1) {
+
+                double val = 0.0;
+
+                for (k = 0; k < LANCZOS_TAPS; k++) {
+
+                        double val_z = 0.0;
+
+                        for (j = 0; j < LANCZOS_TAPS; j++) {
+
+                                double val_y = 0.0;
+
+                                const float *const row = im->data + oz[k] + 
+                                        oy[j];
+
+#pragma omp simd reduction(+:val_y)
+                                for (i = 0; i < LANCZOS_TAPS; i++) {
+                                        val_y += wx[i] * row[ox[i]];
+                                }
+                                val_z += wy[j] * val_y;
+                        }
+                        val += wz[k] * val_z;
+                }
+
+                out[0] = (float) val;
+                return;
+        }
+
+        // Otherwise, accumulate the contiguous channels of each tap
+        for (k = 0; k < LANCZOS_TAPS; k++) {
+                for (j = 0; j < LANCZOS_TAPS; j++) {
+
+                        const double w_yz = wz[k] * wy[j];
+
+                        if (w_yz == 0.0)
+                                continue;
+
+                        for (i = 0; i < LANCZOS_TAPS; i++) {
+
+                                const float w = (float) (w_yz * wx[i]);
+                                const float *const v = im->data + oz[k] + 
+                                        oy[j] + ox[i];
+
+#pragma omp simd
+                                for (c = 0; c < nc; c++) {
+                                        out[c] += w * v[c];
+                                }
+                        }
+                }
+        }
+}
+
+/* Lanczos kernel function */
+static double lanczos(double x, double a)
+{
+	const double pi_x = M_PI * x;
+	return a * sin(pi_x) * sin(pi_x / a) / (pi_x * pi_x);
+}
+
+/* Tabulate the Lanczos kernel. Each row is normalized to sum to one, so that
+ * constant images are preserved. */
+static void init_Lanczos_table(Lanczos_table *const tab)
+{
+        int p, i;
+
+        for (p = 0; p <= LANCZOS_PHASES; p++) {
+
+                double sum;
+
+                const double frac = (double) p / LANCZOS_PHASES;
+
+                sum = 0.0;
+                for (i = 0; i < LANCZOS_TAPS; i++) {
+                        const double dist = fabs(frac + LANCZOS_A - 1 - i);
+                        const double w = dist < DBL_EPSILON ? 1.0 : 
+                                dist >= LANCZOS_A ? 0.0 : 
+                                lanczos(dist, LANCZOS_A);
+                        tab->w[p][i] = w;
+                        sum += w;
+                }
+                for (i = 0; i < LANCZOS_TAPS; i++) {
+                        tab->w[p][i] /= sum;
+                }
+        }
+}
+
+/* Returns the row of tab nearest to the sub-voxel phase frac, in [0, 1]. */
+static const double *lanczos_weights(const Lanczos_table *const tab, 
+                                     const double frac)
+{
+        return tab->w[(int) (frac * LANCZOS_PHASES + 0.5)];
+}
+
+/* Helper routine for im_resample_axis. Evaluates the kernel of the given 
+ * interpolation type at distance dist. */
+static double resample_kernel(const interp_type interp, const double dist)
+{
+        const double d = fabs(dist);
+
+        switch (interp) {
+        case LINEAR:
+                return SIFT3D_MAX(1.0 - d, 0.0);
+        case LANCZOS2:
+                return d < DBL_EPSILON ? 1.0 : d >= LANCZOS_A ? 0.0 : 
+                        lanczos(d, LANCZOS_A);
+        default:
+                return 0.0;
+        }
+}
+
+/* Helper routine for im_resample_gen. Resamples src along dimension dim, so
+ * that voxel i of dst samples src at coordinate i * step. The other 
+ * dimensions of dst must match those of src, and dst must have the default 
+ * stride. 
+ *
+ * The source offsets and weights of each output index are tabulated once, 
+ * then applied to every row in parallel. As in im_inv_transform, samples 
+ * beyond the end of src are zero, and taps outside src are skipped. 
+ *
+ * If antialias is true and step > 1, the kernel is stretched by step, and 
+ * the weights of each sample are normalized over the taps inside src. 
+ *
+ * tab must be initialized for Lanczos interpolation, and may be NULL 
+ * otherwise. */
+static int im_resample_axis(const Image *const src, const int dim,
+        const double step, const interp_type interp, const int antialias,
+        const Lanczos_table *const tab, Image *const dst)
+{
+        double *w;
+        size_t *off;
+        double radius, scale;
+        int i, k, x, y, z, c, taps, half;
+
+        const int n_src = SIFT3D_IM_GET_DIMS(src)[dim];
+        const int n_dst = SIFT3D_IM_GET_DIMS(dst)[dim];
+        const size_t stride = SIFT3D_IM_GET_STRIDES(src)[dim];
+
+        // Get the support of the kernel
+        switch (interp) {
+        case LINEAR:
+                radius = 1.0;
+                break;
+        case LANCZOS2:
+                radius = LANCZOS_A;
+                break;
+        default:
+		SIFT3D_ERR("im_resample_axis: unrecognized "
+			"interpolation type \n");
+                return SIFT3D_FAILURE;
+        }
+        scale = antialias && step > 1.0 ? step : 1.0;
+        half = (int) ceil(radius * scale);
+        taps = 2 * half;
+
+        // Allocate the weights and offsets of each output index
+        w = NULL;
+        off = NULL;
+        if ((w = malloc((size_t) n_dst * taps * sizeof(double))) == NULL ||
+                (off = malloc((size_t) n_dst * taps * sizeof(size_t))) == 
+                NULL)
+                goto im_resample_axis_quit;
+
+        // Tabulate the taps of each output index
+        for (i = 0; i < n_dst; i++) {
+
+                double *const wi = w + (size_t) i * taps;
+                size_t *const oi = off + (size_t) i * taps;
+                const double p = i * step;
+                const int fp = (int) p;
+                const int in_bounds = p <= n_src - 1;
+                double sum;
+
+                sum = 0.0;
+                for (k = 0; k < taps; k++) {
+
+                        const int q = fp - half + 1 + k;
+                        const int inside = in_bounds && q >= 0 && q < n_src;
+
+                        if (scale > 1.0)
+                                wi[k] = resample_kernel(interp, 
+                                        (q - p) / scale);
+                        else if (interp == LANCZOS2)
+                                wi[k] = lanczos_weights(tab, p - fp)[k];
+                        else
+                                wi[k] = k == 0 ? 1.0 - (p - fp) : p - fp;
+
+                        wi[k] = inside ? wi[k] : 0.0;
+                        oi[k] = inside ? (size_t) q * stride : 0;
+                        sum += wi[k];
+                }
+
+                if (scale > 1.0 && sum > 0.0) {
+                        for (k = 0; k < taps; k++) {
+                                wi[k] /= sum;
+                        }
+                }
+        }
+
+        // Filter each row of dst
+#pragma omp parallel for private(x) private(y) private(c) private(k)
+        for (z = 0; z < dst->nz; z++) {
+        for (y = 0; y < dst->ny; y++) {
+
+                float *const row = &SIFT3D_IM_GET_VOX(dst, 0, y, z, 0);
+
+                if (dim == 0) {
+
+                        // Filter along the row
+                        const float *const v = 
+                                &SIFT3D_IM_GET_VOX(src, 0, y, z, 0);
+
+                        for (x = 0; x < dst->nx; x++) {
+
+                                const double *const wx = w + (size_t) x * taps;
+                                const size_t *const ox = off + 
+                                        (size_t) x * taps;
+
+                                for (c = 0; c < dst->nc; c++) {
+
+                                        double val = 0.0;
+
+                                        for (k = 0; k < taps; k++) {
+                                                val += wx[k] * v[ox[k] + c];
+                                        }
+                                        row[x * dst->xs + c] = (float) val;
+                                }
+                        }
+                        continue;
+                }
+
+                // Accumulate whole rows of src
+                const int j = dim == 1 ? y : z;
+                const double *const wj = w + (size_t) j * taps;
+                const size_t *const oj = off + (size_t) j * taps;
+                const float *const v = &SIFT3D_IM_GET_VOX(src, 0, 
+                        dim == 1 ? 0 : y, dim == 2 ? 0 : z, 0);
+                const int len = dst->nx * dst->nc;
+
+                for (x = 0; x < len; x++) {
+                        row[x] = 0.0f;
+                }
+                for (k = 0; k < taps; k++) {
+
+                        const float wk = (float) wj[k];
+                        const float *const vk = v + oj[k];
+
+                        if (wk == 0.0f)
+                                continue;
+
+                        if (src->xs == (size_t) src->nc) {
+#pragma omp simd
+                                for (x = 0; x < len; x++) {
+                                        row[x] += wk * vk[x];
+                                }
+                        } else {
+                                for (x = 0; x < dst->nx; x++) {
+                                        for (c = 0; c < dst->nc; c++) {
+                                                row[x * dst->nc + c] += wk * 
+                                                        vk[x * src->xs + c];
+                                        }
+                                }
+                        }
+                }
+        }
+        }
+
+        free(w);
+        free(off);
+        return SIFT3D_SUCCESS;
+
+im_resample_axis_quit:
+        if (w != NULL)
+                free(w);
+        if (off != NULL)
+                free(off);
+        return SIFT3D_FAILURE;
+}
+
+/* Resample an image to different units.
+ *
+ * The image is rescaled one dimension at a time, with separable kernels.
+ *
+ * Parameters:
+ *   src: The input image.
+ *   units: The new units. 
+ *   interp: The type of interpolation to use.
+ *   dst: The output image. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_resample(const Image *const src, const double *const units, 
+	const interp_type interp, Image *const dst) {
+        return im_resample_gen(src, units, interp, SIFT3D_FALSE, dst);
+}
+
+/* Like im_resample, but when downsampling, the interpolation kernel of each
+ * dimension is stretched by the downsampling factor, to suppress aliasing. */
+int im_resample_antialias(const Image *const src, const double *const units, 
+	const interp_type interp, Image *const dst) {
+        return im_resample_gen(src, units, interp, SIFT3D_TRUE, dst);
+}
+
+/* Helper routine for im_resample and im_resample_antialias. */
+static int im_resample_gen(const Image *const src, const double *const units, 
+	const interp_type interp, const int antialias, Image *const dst) {
+
+        Image tmp[IM_NDIMS - 1];
+        Lanczos_table *lanczos_tab;
+	double factors[IM_NDIMS];
+        int order[IM_NDIMS];
+	int i, j;
+
+	// Initialize intermediates
+        lanczos_tab = NULL;
+        for (i = 0; i < IM_NDIMS - 1; i++) {
+                init_im(tmp + i);
+        }
+        if (interp == LANCZOS2) {
+                if ((lanczos_tab = malloc(sizeof(Lanczos_table))) == NULL)
+                        goto im_resample_quit;
+                init_Lanczos_table(lanczos_tab);
+        }
+
+	// Compute the scaling factors
+	for (i = 0; i < IM_NDIMS; i++) {
+		factors[i] = SIFT3D_IM_GET_UNITS(src)[i] / units[i];
+	}
+
+        // Resample the most-reduced dimensions first, to shrink the later 
+        // passes
+        for (i = 0; i < IM_NDIMS; i++) {
+                order[i] = i;
+        }
+        for (i = 1; i < IM_NDIMS; i++) {
+                for (j = i; j > 0 && factors[order[j]] < factors[order[j - 1]]; 
+                        j--) {
+                        const int swap = order[j];
+                        order[j] = order[j - 1];
+                        order[j - 1] = swap;
+                }
+        }
+
+	// Set the output dimensions
+	dst->nc = src->nc;
+	for (i = 0; i < IM_NDIMS; i++) {
+		SIFT3D_IM_GET_DIMS(dst)[i] = (int) ceil((double) 
+                        SIFT3D_IM_GET_DIMS(src)[i] * factors[i]);
+	}
+	im_default_stride(dst);	
+        if (im_resize(dst))
+		goto im_resample_quit;
+
+        // Resample one dimension at a time, from src to tmp[0], tmp[0] to 
+        // tmp[1], and tmp[1] to dst
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                const int dim = order[i];
+                const Image *const in = i == 0 ? src : tmp + i - 1;
+                Image *const out = i == IM_NDIMS - 1 ? dst : tmp + i;
+
+                if (out != dst) {
+                        memcpy(SIFT3D_IM_GET_DIMS(out), 
+                                SIFT3D_IM_GET_DIMS(in), 
+                                IM_NDIMS * sizeof(int));
+                        SIFT3D_IM_GET_DIMS(out)[dim] = 
+                                SIFT3D_IM_GET_DIMS(dst)[dim];
+                        out->nc = in->nc;
+                        im_default_stride(out);
+                        if (im_resize(out))
+                                goto im_resample_quit;
+                }
+
+                if (im_resample_axis(in, dim, 1.0 / factors[dim], interp, 
+                        antialias, lanczos_tab, out))
+                        goto im_resample_quit;
+        }
+
+        // Set the new output units
+	memcpy(SIFT3D_IM_GET_UNITS(dst), units, IM_NDIMS * sizeof(double));
+
+	// Clean up
+        if (lanczos_tab != NULL)
+                free(lanczos_tab);
+        for (i = 0; i < IM_NDIMS - 1; i++) {
+                im_free(tmp + i);
+        }
+
+	return SIFT3D_SUCCESS;
+
+im_resample_quit:
+        if (lanczos_tab != NULL)
+                free(lanczos_tab);
+        for (i = 0; i < IM_NDIMS - 1; i++) {
+                im_free(tmp + i);
+        }
+	return SIFT3D_FAILURE;
+}
+
+/* Horizontally convolves a separable filter with an image, 
+ * on CPU. Currently only works in 3D.
+ * 
+ * This function chooses among the best variant of convolve_sep* based on
+ * compilation options and filter parameters.
+ * 
+ * Parameters: 
+ * src - input image (initialized)
+ * dst - output image (initialized) 
+    int x, y, z;
+ * f - filter to be applied
+ * dim - dimension in which to convolve
+ * unit - the spacing of the filter coefficients
+ */
+static int convolve_sep(const Image * const src,
+			Image * const dst, const Sep_FIR_filter * const f,
+			const int dim, const double unit) {
+
+#ifdef SIFT3D_USE_OPENCL
+        return convolve_sep_cl(src, dst, f, dim, unit);
+#else
+	return f->symmetric ? 
+                convolve_sep_sym(src, dst, f, dim, unit) : 
+                convolve_sep_gen(src, dst, f, dim, unit);
+#endif
+}
+
+/* Convolve_sep for general filters */
+static int convolve_sep_gen(const Image * const src,
+			Image * const dst, const Sep_FIR_filter * const f,
+			const int dim, const double unit)
+{
+	register int x, y, z, c, d;
+
+	register const int half_width = f->width / 2;
+	register const int nx = src->nx;
+	register const int ny = src->ny;
+	register const int nz = src->nz;
+        register const float conv_eps = 0.1f;
+	register const int dim_end = SIFT3D_IM_GET_DIMS(src)[dim] - 1;
+        register const float unit_factor =  unit /
+                SIFT3D_IM_GET_UNITS(src)[dim];
+        register const int unit_half_width = 
+                (int) ceilf(half_width * unit_factor);
+        int start[] = {0, 0, 0};
+        int end[] = {nx - 1, ny - 1, nz - 1};
+
+        // Compute starting and ending points for the convolution dimension
+        start[dim] += unit_half_width;
+        end[dim] -= unit_half_width + 1;
+
+	//TODO: Convert this to convolve_x, which only convolves in x,
+	// then make a wrapper to restride, transpose, convolve x, and transpose 
+	// back
+
+	// Resize the output, with the default stride
+        if (im_copy_dims(src, dst))
+                return SIFT3D_FAILURE;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Initialize the output to zeros
+	im_zero(dst);
+
+#define SAMP_AND_ACC(src, dst, tap, coords, c) \
+{ \
+        float frac; \
+\
+        const int idx_lo[] = {(coords)[0], (coords)[1], (coords)[2]}; \
+        int idx_hi[] = {idx_lo[0], idx_lo[1], idx_lo[2]}; \
+\
+        /* Convert the physical coordinates to integer indices*/ \
+        idx_hi[dim] += 1; \
+        frac = (coords)[dim] - (float) idx_lo[dim]; \
+\
+        /* Sample with linear interpolation */ \
+        SIFT3D_IM_GET_VOX(dst, x, y, z, c) += (tap) * \
+                ((1.0f - frac) * \
+                SIFT3D_IM_GET_VOX(src, idx_lo[0], idx_lo[1], idx_lo[2], c) + \
+                frac * \
+                SIFT3D_IM_GET_VOX(src, idx_hi[0], idx_hi[1], idx_hi[2], c)); \
+}
+
+	// First pass: process the interior
+#pragma omp parallel for private(x) private(y) private(c)
+	SIFT3D_IM_LOOP_LIMITED_START_C(dst, x, y, z, c, start[0], end[0], 
+                start[1], end[1], start[2], end[2])
+
+                float coords[] = { x, y, z };
+
+                for (d = -half_width; d <= half_width; d++) {
+
+                        const float tap = f->kernel[d + half_width];
+                        const float step = d * unit_factor;
+
+                        // Adjust the sampling coordinates
+                        coords[dim] -= step;
+
+                        // Sample
+                        SAMP_AND_ACC(src, dst, tap, coords, c);
+
+                        // Reset the sampling coordinates
+                        coords[dim] += step;
+                }
+
+	SIFT3D_IM_LOOP_END_C
+
+        // Second pass: process the boundaries
+#pragma omp parallel for private(x) private(y) private(c)
+        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+
+                const int i_coords[] = { x, y, z };
+
+                // Skip pixels we have already processed
+                if (i_coords[dim] >= start[dim] && i_coords[dim] <= end[dim]) 
+                        continue;
+
+                // Process the boundary pixel
+                for (d = -half_width; d <= half_width; d++) {
+
+                        float coords[] = { x, y, z };
+                        const float tap = f->kernel[d + half_width];
+                        const float step = d * unit_factor;
+
+                        // Adjust the sampling coordinates
+                        coords[dim] -= step;
+
+                        // Mirror coordinates
+                        if ((int) coords[dim] < 0) {
+                                coords[dim] = -coords[dim];
+                                assert((int) coords[dim] >= 0);
+                        } else if ((int) coords[dim] >= dim_end) {
+                                coords[dim] = 2.0f * dim_end - coords[dim] -    
+                                        conv_eps;
+                                assert((int) coords[dim] < dim_end);
+                        }
+
+                        // Sample
+                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                }
+
+	SIFT3D_IM_LOOP_END_C 
+
+#undef SAMP_AND_ACC
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Same as convolve_sep, but with OpenCL acceleration. This does NOT
+ * read back the results to C-accessible data. Use im_read_back for that. */
+SIFT3D_IGNORE_UNUSED
+static int convolve_sep_cl(const Image * const src, Image * const dst,
+			   const Sep_FIR_filter * const f, const int dim,
+                           const double unit)
+{
+#ifdef SIFT3D_USE_OPENCL
+	cl_kernel kernel;
+	cl_int dx, dy, dz, err;
+
+	const size_t global_work_size[] = { src->nx, src->ny, src->nz };
+
+	// Resize the output, with the default stride
+        if (im_copy_dims(src, dst))
+                return SIFT3D_FAILURE;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Do not have a 2D kernel right now
+	if (dim != 3) {
+		printf("convolve_sep_cl: unsupported dimension: %d \n", dim);
+	return SIFT3D_FAILURE}
+
+	// Form the dimension offsets
+	dx = dy = dz = 0;
+	switch (dim) {
+	case 0:
+		dx = 1;
+		break;
+	case 1:
+		dy = 1;
+		break;
+	case 2:
+		dz = 1;
+		break;
+	default:
+		return SIFT3D_FAILURE;
+	}
+
+	kernel = f->cl_apply_unrolled;
+	im_set_kernel_arg(kernel, 0, src);
+	im_set_kernel_arg(kernel, 1, dst);
+	err = clSetKernelArg(kernel, 2, sizeof(cl_int), &dx);
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &dy);
+	err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &dz);
+	check_cl_error(err, "convolve_sep_cl: set kernel arg");
+
+	err =
+	    clEnqueueNDRangeKernel(cl_data.queues[0], kernel, dim, NULL,
+				   global_work_size, NULL, 0, NULL, NULL);
+	return (int)err;
+#else
+	printf("colvolve_sep_cl: This version was not compiled with OpenCL!\n");
 	return SIFT3D_FAILURE;
 #endif
 }
 
-/* Reads the OpenCL data of an image back to its C-accessible data. If blocking is set,
- * block the function until the read is complete. */
-int im_read_back(Image * im, int blocking)
+ /* Convolve_sep for symmetric filters. */
+static int convolve_sep_sym(const Image * const src, Image * const dst,
+			    const Sep_FIR_filter * const f, const int dim,
+                            const double unit)
+{
+
+	// TODO: Symmetry-specific function
+	return convolve_sep_gen(src, dst, f, dim, unit);
+}
+
+/* Permute the dimensions of an image.
+ *
+ * Arguments: 
+ * src - input image (initialized)
+ * dim1 - input permutation dimension (x = 0, y = 1, z = 2)
+ * dim2 - output permutation dimension (x = 0, y = 1, z = 2)
+ * dst - output image (initialized)
+ * 
+ * example:
+ * im_permute(src, dst, 0, 1) -- permute x with y in src
+ *                              and save to dst
+ */
+int im_permute(const Image * const src, const int dim1, const int dim2,
+		 Image * const dst)
+{
+	register int x, y, z, c;
+
+	// Verify inputs
+	if (dim1 < 0 || dim2 < 0 || dim1 > 3 || dim2 > 3) {
+		printf("im_permute: invalid dimensions: dim1 %d dim2 %d \n",
+		       dim1, dim2);
+		return SIFT3D_FAILURE;
+	}
+
+	// Check for the trivial case
+	if (dim1 == dim2) {
+		return im_copy_data(src, dst);
+        }
+
+        // Permute the units
+        memcpy(SIFT3D_IM_GET_UNITS(dst), SIFT3D_IM_GET_UNITS(src), 
+                IM_NDIMS * sizeof(double));
+        SIFT3D_IM_GET_UNITS(dst)[dim1] = SIFT3D_IM_GET_UNITS(src)[dim2];
+        SIFT3D_IM_GET_UNITS(dst)[dim2] = SIFT3D_IM_GET_UNITS(src)[dim1];
+
+	// Resize the output
+	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
+                IM_NDIMS * sizeof(int));
+        SIFT3D_IM_GET_DIMS(dst)[dim1] = SIFT3D_IM_GET_DIMS(src)[dim2];
+        SIFT3D_IM_GET_DIMS(dst)[dim2] = SIFT3D_IM_GET_DIMS(src)[dim1];
+	dst->nc = src->nc;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Transpose the data
+	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+
+                int src_coords[] = {x, y, z};
+                int temp;
+
+                // Permute the coordinates
+                temp = src_coords[dim1];
+                src_coords[dim1] = src_coords[dim2];
+                src_coords[dim2] = temp;
+
+                // Copy the datum
+                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = SIFT3D_IM_GET_VOX(src, 
+                        src_coords[0], src_coords[1], src_coords[2], c);
+
+	SIFT3D_IM_LOOP_END_C 
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Change an image's stride, preserving its data. 
+ *
+ * Parameters:
+ *  -src: The source image. Must be initialized
+ *  -strides: an array of length IM_NDIMS specifying the new strides
+ *  -dst: The destination image. Must be initialized
+ * 
+ * Return: SIFT3D_SUCCESS (0) on success, nonzero otherwise. */
+int im_restride(const Image * const src, const size_t *const strides,
+		Image * const dst)
+{
+
+	int x, y, z, c;
+
+	// Resize the output
+	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
+                IM_NDIMS * sizeof(int));
+	memcpy(SIFT3D_IM_GET_STRIDES(dst), strides, IM_NDIMS * sizeof(size_t));
+	dst->nc = src->nc;
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+	// Copy the data
+	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
+	    SIFT3D_IM_GET_VOX(src, x, y, z, c);
+	SIFT3D_IM_LOOP_END_C 
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Initializes a tform to ensure memory safety. 
+ * Either this or the type-specific version must be called prior to using
+ * a tform. */
+int init_tform(void *const tform, const tform_type type)
+{
+
+	switch (type) {
+	case TPS:
+		if (init_Tps((Tps *) tform, IM_NDIMS, IM_NDIMS + 1))
+			return SIFT3D_FAILURE;
+		break;
+	case AFFINE:
+		if (init_Affine((Affine *) tform, IM_NDIMS))
+			return SIFT3D_FAILURE;
+		break;
+	case RIGID:
+		if (init_Rigid((Affine *) tform, IM_NDIMS))
+			return SIFT3D_FAILURE;
+		break;
+	case SIMILARITY:
+		if (init_Similarity((Affine *) tform, IM_NDIMS))
+			return SIFT3D_FAILURE;
+		break;
+	case BSPLINE_FFD:
+		if (init_Bspline((Bspline *) tform))
+			return SIFT3D_FAILURE;
+		break;
+	case DISPLACEMENT_FIELD:
+		if (init_Disp_field((Disp_field *) tform))
+			return SIFT3D_FAILURE;
+		break;
+	case COMPOSITE:
+		if (init_Composite((Composite *) tform))
+			return SIFT3D_FAILURE;
+		break;
+	default:
+		puts("init_tform: unrecognized type \n");
+		return SIFT3D_FAILURE;
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize an Affine struct. This initializes
+ * all fields, and allocates memory for the inner
+ * matrix, initializing it to zero. */
+int init_Affine(Affine * const affine, const int dim)
+{
+
+	// Verify inputs
+	if (dim < 2)
+		return SIFT3D_FAILURE;
+
+	// Initialize the type
+	affine->tform.type = AFFINE;
+
+	// Initialize the vtable
+	affine->tform.vtable = &Affine_vtable;
+
+	// Initialize the matrix
+	if (init_Mat_rm(&affine->A, dim, dim + 1, SIFT3D_DOUBLE, SIFT3D_TRUE))
+		return SIFT3D_FAILURE;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize a rigid transformation. Rigid transformations are stored as
+ * Affine structs, and share their virtual functions. They are initialized to
+ * zero, as in init_Affine. */
+int init_Rigid(Affine *const rigid, const int dim)
 {
-#ifdef SIFT3D_USE_OPENCL
-	const size_t origin[] = { 0, 0, 0 };
-	const size_t region[] = { im->nx, im->ny, im->nz };
-	const cl_bool cl_blocking = (blocking) ? CL_TRUE : CL_FALSE;
-	return clEnqueueReadImage(cl_data.queues[0], im->cl_image, cl_blocking,
-				  origin, region, im->ys, im->zs,
-				  im->data, 0, NULL, NULL);
-#else
-	printf("im_read_back: This version was not compiled with OpenCL!\n");
-	return SIFT3D_FAILURE;
-#endif
+	if (init_Affine(rigid, dim))
+		return SIFT3D_FAILURE;
+
+	rigid->tform.type = RIGID;
+
+	return SIFT3D_SUCCESS;
 }
 
-/* Updates an Image struct's OpenCL data, if neccessary, and sets it as argument n
- * in the provided kernel. */
-int im_set_kernel_arg(cl_kernel kernel, int n, Image * im)
+/* Initialize a similarity transformation, i.e. a rigid transformation with
+ * isotropic scaling. See init_Rigid. */
+int init_Similarity(Affine *const sim, const int dim)
 {
-#ifdef SIFT3D_USE_OPENCL
-	cl_int err;
+	if (init_Affine(sim, dim))
+		return SIFT3D_FAILURE;
 
-	if (!im->cl_valid && im_resize(im))
+	sim->tform.type = SIMILARITY;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize a 3D B-spline free-form deformation. This initializes all 
+ * fields, setting the affine part to the identity, with an empty lattice. */
+int init_Bspline(Bspline *const bspline)
+{
+        int i;
+
+	// Initialize the type
+	bspline->tform.type = BSPLINE_FFD;
+
+	// Initialize the vtable
+	bspline->tform.vtable = &Bspline_vtable;
+
+	// Initialize the matrices
+	if (init_Mat_rm(&bspline->A, IM_NDIMS, IM_NDIMS + 1, SIFT3D_DOUBLE, 
+                SIFT3D_TRUE))
 		return SIFT3D_FAILURE;
-	err = clSetKernelArg(kernel, n, sizeof(cl_mem), &im->cl_image);
-	check_cl_error(err, "im_set_kernel_arg");
+        if (init_Mat_rm(&bspline->coef, 0, IM_NDIMS, SIFT3D_DOUBLE, 
+                SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&bspline->A);
+                return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < IM_NDIMS; i++) {
+                SIFT3D_MAT_RM_GET(&bspline->A, i, i, double) = 1.0;
+                bspline->spacing[i] = 1.0;
+                bspline->dims[i] = 0;
+        }
 
 	return SIFT3D_SUCCESS;
-#else
-	printf
-	    ("im_set_kernel_arg: This version was not compiled with OpenCL!\n");
-	return SIFT3D_FAILURE;
-#endif
 }
 
-/* Copy an image's dimensions and stride into another. 
- * This function resizes dst.
- * 
- * @param src The source image.
- * @param dst The destination image.
- * @return Returns SIFT3D_SUCCESS or SIFT3D_FAILURE.
- */
-int im_copy_dims(const Image * const src, Image * dst)
+/* Initialize a displacement field, with an empty lattice. */
+int init_Disp_field(Disp_field *const field)
 {
-        if (src->data == NULL)
+	// Initialize the type
+	field->tform.type = DISPLACEMENT_FIELD;
+
+	// Initialize the vtable
+	field->tform.vtable = &Disp_field_vtable;
+
+        // Initialize the displacements
+        init_im(&field->disp);
+        field->disp.nc = IM_NDIMS;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize a composite transformation, with no members. The empty 
+ * composite is the identity. */
+int init_Composite(Composite *const comp)
+{
+	// Initialize the type
+	comp->tform.type = COMPOSITE;
+
+	// Initialize the vtable
+	comp->tform.vtable = &Composite_vtable;
+
+        comp->tforms = NULL;
+        comp->num = 0;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Compose a transformation into comp, so that it becomes comp(tform(x)). 
+ * In a chain of resamplings, append the transformations in the order they 
+ * were applied to the images, to resample through the whole chain at once.
+ *
+ * tform is copied. If tform is itself a Composite, its members are appended
+ * in turn. An affine transformation following an affine member is merged 
+ * into it analytically, with compose_Affine.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int append_Composite(Composite *const comp, const void *const tform)
+{
+        void **tforms;
+        void *copy;
+        int i;
+
+        const tform_type type = tform_get_type(tform);
+
+        // Flatten composites
+        if (type == COMPOSITE) {
+
+                const Composite *const other = tform;
+                const int num = other->num;
+
+                if (other == comp) {
+                        SIFT3D_ERR("append_Composite: cannot append a "
+                                "composite to itself \n");
+                        return SIFT3D_FAILURE;
+                }
+
+                for (i = 0; i < num; i++) {
+                        if (append_Composite(comp, other->tforms[i]))
+                                return SIFT3D_FAILURE;
+                }
+                return SIFT3D_SUCCESS;
+        }
+
+        // Merge consecutive affine transformations
+        if (comp->num > 0 && TFORM_IS_AFFINE(type) && 
+                TFORM_IS_AFFINE(tform_get_type(comp->tforms[comp->num - 1]))) {
+
+                Affine *const last = comp->tforms[comp->num - 1];
+                const tform_type last_type = tform_get_type(last);
+
+                if (AFFINE_GET_DIM(last) == AFFINE_GET_DIM((const Affine *) 
+                        tform)) {
+
+                        if (compose_Affine(last, tform, last))
+                                return SIFT3D_FAILURE;
+
+                        // The composition is as general as either input
+                        last->tform.type = last_type == AFFINE || 
+                                type == AFFINE ? AFFINE : last_type == 
+                                SIMILARITY || type == SIMILARITY ? 
+                                SIMILARITY : RIGID;
+                        return SIFT3D_SUCCESS;
+                }
+        }
+
+        // Copy the transformation
+        if ((copy = malloc(tform_get_size(tform))) == NULL)
                 return SIFT3D_FAILURE;
+        if (init_tform(copy, type)) {
+                free(copy);
+                return SIFT3D_FAILURE;
+        }
+        if (copy_tform(tform, copy))
+                goto append_Composite_quit;
 
-	dst->nx = src->nx;
-	dst->ny = src->ny;
-	dst->nz = src->nz;
-	dst->xs = src->xs;
-	dst->ys = src->ys;
-	dst->zs = src->zs;
-	dst->nc = src->nc;
-        dst->ux = src->ux;
-        dst->uy = src->uy;
-        dst->uz = src->uz;
+        // Append it
+        if ((tforms = realloc(comp->tforms, (comp->num + 1) * 
+                sizeof(void *))) == NULL)
+                goto append_Composite_quit;
+        comp->tforms = tforms;
+        comp->tforms[comp->num++] = copy;
 
-	return im_resize(dst);
+        return SIFT3D_SUCCESS;
+
+append_Composite_quit:
+        cleanup_tform(copy);
+        free(copy);
+        return SIFT3D_FAILURE;
 }
 
-/* Copy an image's data into another. This function
- * changes the dimensions and stride of dst,
- * and allocates memory. */
-int im_copy_data(const Image * const src, Image * const dst)
+/* Compose two affine transformations of the same dimensionality, so that
+ * out(x) = outer(inner(x)). out may alias either input.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int compose_Affine(const Affine *const outer, const Affine *const inner,
+                   Affine *const out)
 {
+        Mat_rm A;
+        int i, j, k;
 
-	int x, y, z, c;
+        const int dim = AFFINE_GET_DIM(outer);
 
-        // Return if src has no data 
-        if (src->data == NULL)
+        if (AFFINE_GET_DIM(inner) != dim) {
+                SIFT3D_ERR("compose_Affine: mismatched dimensionality: %d, "
+                        "%d \n", dim, AFFINE_GET_DIM(inner));
                 return SIFT3D_FAILURE;
+        }
 
-	// Return if src and dst are the same
-	if (dst->data == src->data)
-		return SIFT3D_SUCCESS;
+        if (init_Mat_rm(&A, dim, dim + 1, SIFT3D_DOUBLE, SIFT3D_TRUE))
+                return SIFT3D_FAILURE;
 
-	// Resize dst
-	if (im_copy_dims(src, dst))
-		return SIFT3D_FAILURE;
+        // [Ao bo] [Ai bi; 0 1] = [Ao Ai, Ao bi + bo]
+        for (i = 0; i < dim; i++) {
+                for (j = 0; j <= dim; j++) {
 
-	// Copy data
-        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
-                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
-                        SIFT3D_IM_GET_VOX(src, x, y, z, c);
-        SIFT3D_IM_LOOP_END_C
+                        double sum = j == dim ? 
+                                SIFT3D_MAT_RM_GET(&outer->A, i, dim, double) :
+                                0.0;
 
-	return SIFT3D_SUCCESS;
+                        for (k = 0; k < dim; k++) {
+                                sum += SIFT3D_MAT_RM_GET(&outer->A, i, k, 
+                                        double) * SIFT3D_MAT_RM_GET(
+                                        &inner->A, k, j, double);
+                        }
+                        SIFT3D_MAT_RM_GET(&A, i, j, double) = sum;
+                }
+        }
+
+        if (Affine_set_mat(&A, out)) {
+                cleanup_Mat_rm(&A);
+                return SIFT3D_FAILURE;
+        }
+
+        cleanup_Mat_rm(&A);
+        return SIFT3D_SUCCESS;
 }
 
-/* Clean up memory for an Image */
-void im_free(Image * im)
+/* Bake a transformation into a displacement field over the lattice 
+ * [0, nx - 1] x [0, ny - 1] x [0, nz - 1], by applying it once at every 
+ * voxel. Warping images of those dimensions with the field then costs only 
+ * the interpolation, however expensive tform is. tform may be of any type.
+ *
+ * field must be initialized, e.g. with init_tform, and must not be tform.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int make_Disp_field(const void *const tform, const int nx, const int ny,
+                    const int nz, Disp_field *const field)
 {
-	if (im->data != NULL)
-		free(im->data);
+        int z, error;
+
+        Image *const disp = &field->disp;
+
+        // Verify inputs
+        if (nx < 1 || ny < 1 || nz < 1) {
+                SIFT3D_ERR("make_Disp_field: invalid dimensions [%d, %d, %d] "
+                        "\n", nx, ny, nz);
+                return SIFT3D_FAILURE;
+        }
+        if (tform == field) {
+                SIFT3D_ERR("make_Disp_field: tform and field must differ \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the field
+        disp->nx = nx;
+        disp->ny = ny;
+        disp->nz = nz;
+        disp->nc = IM_NDIMS;
+        im_default_stride(disp);
+        if (im_resize(disp))
+                return SIFT3D_FAILURE;
+
+        // Transform one row at a time, with a buffer per thread
+        error = SIFT3D_FALSE;
+#pragma omp parallel
+{
+        double *buf, *x_in, *y_in, *z_in, *x_out, *y_out, *z_out;
+        int x, y;
+
+        // Allocate the coordinates of one row, before and after the 
+        // transformation
+        if ((buf = malloc(6 * nx * sizeof(double))) != NULL) {
+                x_in = buf;
+                y_in = x_in + nx;
+                z_in = y_in + nx;
+                x_out = z_in + nx;
+                y_out = x_out + nx;
+                z_out = y_out + nx;
+                for (x = 0; x < nx; x++) {
+                        x_in[x] = (double) x;
+                }
+        }
+
+#pragma omp for schedule(dynamic)
+        for (z = 0; z < nz; z++) {
+
+                if (buf == NULL) {
+#pragma omp atomic write
+                        error = SIFT3D_TRUE;
+                        continue;
+                }
+
+                for (y = 0; y < ny; y++) {
+
+                        for (x = 0; x < nx; x++) {
+                                y_in[x] = (double) y;
+                                z_in[x] = (double) z;
+                        }
+                        if (apply_tform_points(tform, SIFT3D_DOUBLE, nx, x_in, 
+                                y_in, z_in, x_out, y_out, z_out)) {
+#pragma omp atomic write
+                                error = SIFT3D_TRUE;
+                                break;
+                        }
+
+                        for (x = 0; x < nx; x++) {
+                                float *const d = 
+                                        &SIFT3D_IM_GET_VOX(disp, x, y, z, 0);
+                                d[0] = (float) (x_out[x] - x);
+                                d[1] = (float) (y_out[x] - y);
+                                d[2] = (float) (z_out[x] - z);
+                        }
+                }
+        }
+
+        if (buf != NULL)
+                free(buf);
+}
+        if (error) {
+                SIFT3D_ERR("make_Disp_field: failed to transform the "
+                        "lattice \n");
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Make a deep copy of a single channel of an image. */
-int im_channel(const Image * const src, Image * const dst,
-	       const unsigned int chan)
+/* Helper function to resize the lattice of a Bspline, with isotropic 
+ * spacing. The displacements are set to zero. */
+static int resize_Bspline(Bspline *const bspline, const int nx, const int ny,
+        const int nz, const double spacing)
 {
+        Mat_rm *const coef = &bspline->coef;
 
-	int x, y, z;
+        coef->num_rows = nx * ny * nz;
+        coef->num_cols = IM_NDIMS;
+        if (resize_Mat_rm(coef) || zero_Mat_rm(coef))
+                return SIFT3D_FAILURE;
 
-	const int c = chan;
+        bspline->dims[0] = nx;
+        bspline->dims[1] = ny;
+        bspline->dims[2] = nz;
+        bspline->spacing[0] = bspline->spacing[1] = bspline->spacing[2] =
+                spacing;
 
-	// Verify inputs
-	if (c >= src->nc) {
-		SIFT3D_ERR("im_channel: invalid channel: %d, image has "
-			"%d channels", c, src->nc);
-		return SIFT3D_FAILURE;
-	}
-	// Resize the output
-	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
-                IM_NDIMS * sizeof(int));
-	dst->nc = 1;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        return SIFT3D_SUCCESS;
+}
 
-	// Copy the channel
-	SIFT3D_IM_LOOP_START(dst, x, y, z)
-	    SIFT3D_IM_GET_VOX(dst, x, y, z, 0) =
-	    SIFT3D_IM_GET_VOX(src, x, y, z, c);
-	SIFT3D_IM_LOOP_END return SIFT3D_SUCCESS;
+/* Deep copy of a tform. Both src and dst must be initialized. */
+int copy_tform(const void *const src, void *const dst)
+{
+	return TFORM_GET_VTABLE(src)->copy(src, dst);
 }
 
-/* Find the maximum absolute value of an image */
-float im_max_abs(const Image *const im) {
+/* Deep copy of one Affine to another. Both must be initialized. */
+static int copy_Affine(const void *const src, void *const dst)
+{
 
-        float max;
-        int x, y, z, c;
+	const Affine *const srcAff = src;
+	Affine *const dstAff = dst;
 
-	max = 0.0f;
-	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+	return Affine_set_mat(&srcAff->A, dstAff);
+}
 
-	        const float samp = fabsf(SIFT3D_IM_GET_VOX(im, x, y, z, c));
-                max = SIFT3D_MAX(max, samp);
+/* Deep copy of one TPS to another. Both must be initialized. */
+static int copy_Tps(const void *const src, void *const dst)
+{
 
-	SIFT3D_IM_LOOP_END_C
+	const Tps *const srcTps = src;
+	Tps *const dstTps = dst;
 
-        return max;
+	if (copy_Mat_rm(&srcTps->params, &dstTps->params) ||
+	    copy_Mat_rm(&srcTps->kp_src, &dstTps->kp_src))
+		return SIFT3D_FAILURE;
+
+	dstTps->dim = srcTps->dim;
+	return SIFT3D_SUCCESS;
+}
+
+/* Deep copy of one Bspline to another. Both must be initialized. */
+static int copy_Bspline(const void *const src, void *const dst)
+{
+
+	const Bspline *const srcB = src;
+	Bspline *const dstB = dst;
+
+	if (copy_Mat_rm(&srcB->A, &dstB->A) ||
+	    copy_Mat_rm(&srcB->coef, &dstB->coef))
+		return SIFT3D_FAILURE;
+
+        memcpy(dstB->spacing, srcB->spacing, IM_NDIMS * sizeof(double));
+        memcpy(dstB->dims, srcB->dims, IM_NDIMS * sizeof(int));
+	return SIFT3D_SUCCESS;
 }
 
-/* Scale an image to the [-1, 1] range, where
- * the largest absolute value is 1. */
-void im_scale(const Image *const im)
+/* Deep copy of one displacement field to another. Both must be initialized.
+ */
+static int copy_Disp_field(const void *const src, void *const dst)
 {
+	const Disp_field *const srcD = src;
+	Disp_field *const dstD = dst;
+
+        // Copy an empty field
+        if (srcD->disp.data == NULL) {
+                im_free(&dstD->disp);
+                init_im(&dstD->disp);
+                dstD->disp.nc = IM_NDIMS;
+                return SIFT3D_SUCCESS;
+        }
 
-	int x, y, z, c;
+        return im_copy_data(&srcD->disp, &dstD->disp);
+}
 
-        // Find the maximum absolute value
-	const float max = im_max_abs(im);
-        if (max == 0.0f)
-	        return;
+/* Deep copy of one composite transformation to another. Both must be 
+ * initialized. */
+static int copy_Composite(const void *const src, void *const dst)
+{
+	const Composite *const srcC = src;
+	Composite *const dstC = dst;
 
-	// Divide by the max 
-	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
-	        SIFT3D_IM_GET_VOX(im, x, y, z, c) /= max;
-        SIFT3D_IM_LOOP_END_C
+        if (srcC == dstC)
+                return SIFT3D_SUCCESS;
+
+        cleanup_Composite(dstC);
+        init_Composite(dstC);
+        return append_Composite(dstC, srcC);
 }
 
-/* Subtract src2 from src1, saving the result in
- * dst.
- * Resizes dst. 
- */
-int im_subtract(Image * src1, Image * src2, Image * dst)
+/* Set an Affine transform to the given matrix.
+ * mat is copied. mat must be an n x (n + 1) matrix, where
+ * n is the dimensionality of the transformation. */
+int Affine_set_mat(const Mat_rm * const mat, Affine * const affine)
 {
 
-	int x, y, z, c;
-
 	// Verify inputs
-	if (src1->nx != src2->nx ||
-	    src1->ny != src2->ny ||
-	    src1->nz != src2->nz || src1->nc != src2->nc)
+	if (mat->num_cols != mat->num_rows + 1 || mat->num_rows < 2)
 		return SIFT3D_FAILURE;
 
-	// Resize the output image
-	if (im_copy_dims(src1, dst))
-		return SIFT3D_FAILURE;
+	return convert_Mat_rm(mat, &affine->A, SIFT3D_DOUBLE);
+}
 
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
-	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
-	    SIFT3D_IM_GET_VOX(src1, x, y, z, c) -
-	    SIFT3D_IM_GET_VOX(src2, x, y, z, c);
-	SIFT3D_IM_LOOP_END_C return SIFT3D_SUCCESS;
+/* Apply an arbitrary transformation to an [x, y, z] triple. */
+void apply_tform_xyz(const void *const tform, const double x_in, 
+                     const double y_in, const double z_in, double *const x_out,
+		     double *const y_out, double *const z_out)
+{
+	TFORM_GET_VTABLE(tform)->apply_xyz(tform, x_in, y_in, z_in,
+					   x_out, y_out, z_out);
 }
 
-/* Zero an image. */
-void im_zero(Image * im)
+/* Apply an Affine transformation to an [x, y, z] triple. */
+static void apply_Affine_xyz(const void *const affine, const double x_in,
+			     const double y_in, const double z_in,
+			     double *const x_out, double *const y_out,
+			     double *const z_out)
 {
 
-	int x, y, z, c;
+	const Affine *const aff = affine;
 
-	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
-	    SIFT3D_IM_GET_VOX(im, x, y, z, c) = 0.0f;
-SIFT3D_IM_LOOP_END_C}
+	const Mat_rm *const A = &aff->A;
+	assert(AFFINE_GET_DIM(aff) == 3);
+	*x_out = SIFT3D_MAT_RM_GET(A, 0, 0, double) * x_in +
+	    SIFT3D_MAT_RM_GET(A, 0, 1, double) * y_in +
+	    SIFT3D_MAT_RM_GET(A, 0, 2, double) * z_in +
+	    SIFT3D_MAT_RM_GET(A, 0, 3, double);
+	*y_out = SIFT3D_MAT_RM_GET(A, 1, 0, double) * x_in +
+	    SIFT3D_MAT_RM_GET(A, 1, 1, double) * y_in +
+	    SIFT3D_MAT_RM_GET(A, 1, 2, double) * z_in +
+	    SIFT3D_MAT_RM_GET(A, 1, 3, double);
+	*z_out = SIFT3D_MAT_RM_GET(A, 2, 0, double) * x_in +
+	    SIFT3D_MAT_RM_GET(A, 2, 1, double) * y_in +
+	    SIFT3D_MAT_RM_GET(A, 2, 2, double) * z_in +
+	    SIFT3D_MAT_RM_GET(A, 2, 3, double);
+}
 
-/* Transform an image according to the inverse of the provided tform. 
- * 
- * Paramters:
- *   tform: The transformation. 
- *   src: The input image.
- *   interp: The type of interpolation.
- *   resize: If true, resizes the dst to be the same size as src. Otherwise,
- *     uses the dimensions of dst. 
- *   dst: The output image.
- *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-int im_inv_transform(const void *const tform, const Image * const src,
-		     const interp_type interp, const int resize, 
-                     Image *const dst)
+/* Apply a thin-plate spline transformation to an [x, y, z] triple. */
+static void apply_Tps_xyz(const void *const tps, const double x_in,
+			  const double y_in, const double z_in,
+			  double *const x_out, double *const y_out,
+			  double *const z_out)
 {
-	int x, y, z, c;
 
-	// Optionally resize the output image
-	if (resize && im_copy_dims(src, dst))
-		return SIFT3D_FAILURE;
+	const Tps *const t = tps;
 
-#define IMUTIL_RESAMPLE(arg) \
-    SIFT3D_IM_LOOP_START(dst, x, y, z) \
-\
-	double transx, transy, transz; \
-\
-        apply_tform_xyz(tform, (double)x, (double)y, (double)z, \
-            &transx, &transy, &transz); \
-                        \
-                for (c = 0; c < dst->nc; c++) { \
-                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = resample_ ## arg(src, \
-                                transx, transy, transz, c); \
-                } \
-    SIFT3D_IM_LOOP_END
+	const Mat_rm *const params = &t->params;
+	const Mat_rm *const kp_src = &t->kp_src;
+	assert(t->dim == 3);
+	int n;
+	int ctrl_pts = kp_src->num_rows;	//number of control points
+	double x_c, y_c, z_c, r_sq, U;
+	double temp_x = 0.0, temp_y = 0.0, temp_z = 0.0;
 
-	// Transform
-	switch (interp) {
-	case LINEAR:
-		IMUTIL_RESAMPLE(linear)
-		    break;
-	case LANCZOS2:
-		IMUTIL_RESAMPLE(lanczos2)
-		    break;
-	default:
-		SIFT3D_ERR("im_inv_transform: unrecognized "
-			"interpolation type");
-		return SIFT3D_FAILURE;
+	for (n = 0; n < ctrl_pts; n++) {
+		x_c = SIFT3D_MAT_RM_GET(kp_src, n, 0, double);
+		y_c = SIFT3D_MAT_RM_GET(kp_src, n, 1, double);
+		z_c = SIFT3D_MAT_RM_GET(kp_src, n, 2, double);
+		r_sq =
+		    (x_in - x_c) * (x_in - x_c) + (y_in - y_c) * (y_in - y_c) +
+		    (z_in - z_c) * (z_in - z_c);
+		if (r_sq == 0) {
+			U = 0.0;
+		} else {
+			U = r_sq * log(r_sq);
+		}
+		temp_x += U * SIFT3D_MAT_RM_GET(params, 0, n, double);
+		temp_y += U * SIFT3D_MAT_RM_GET(params, 1, n, double);
+		temp_z += U * SIFT3D_MAT_RM_GET(params, 2, n, double);
 	}
 
-#undef RESAMPLE
-
-	return SIFT3D_SUCCESS;
-}
-
-/* Helper routine for image transformation. Performs trilinear
- * interpolation, setting out-of-bounds voxels to zero. */
-static double resample_linear(const Image * const in, const double x,
-			      const double y, const double z, const int c)
-{
+	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts, double);
+	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 1, double) * x_in;
+	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 2, double) * y_in;
+	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 3, double) * z_in;
 
-	// Detect out-of-bounds
-	if (x < 0 || x > in->nx - 1 ||
-	    y < 0 || y > in->ny - 1 || z < 0 || z > in->nz - 1)
-		return 0.0;
+	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts, double);
+	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 1, double) * x_in;
+	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 2, double) * y_in;
+	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 3, double) * z_in;
 
-	int fx = (int)floor(x);
-	int fy = (int)floor(y);
-	int fz = (int)floor(z);
-	int cx = (int)ceil(x);
-	int cy = (int)ceil(y);
-	int cz = (int)ceil(z);
+	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts, double);
+	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 1, double) * x_in;
+	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 2, double) * y_in;
+	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 3, double) * z_in;
 
-	double dist_x = x - fx;
-	double dist_y = y - fy;
-	double dist_z = z - fz;
+	//Save results
+	x_out[0] = temp_x;
+	y_out[0] = temp_y;
+	z_out[0] = temp_z;
 
-	double c0 = SIFT3D_IM_GET_VOX(in, fx, fy, fz, c);
-	double c1 = SIFT3D_IM_GET_VOX(in, fx, cy, fz, c);
-	double c2 = SIFT3D_IM_GET_VOX(in, cx, fy, fz, c);
-	double c3 = SIFT3D_IM_GET_VOX(in, cx, cy, fz, c);
-	double c4 = SIFT3D_IM_GET_VOX(in, fx, fy, cz, c);
-	double c5 = SIFT3D_IM_GET_VOX(in, fx, cy, cz, c);
-	double c6 = SIFT3D_IM_GET_VOX(in, cx, fy, cz, c);
-	double c7 = SIFT3D_IM_GET_VOX(in, cx, cy, cz, c);
+}
 
-	double out = c0 * (1.0 - dist_x) * (1.0 - dist_y) * (1.0 - dist_z)
-	    + c1 * (1.0 - dist_x) * dist_y * (1.0 - dist_z)
-	    + c2 * dist_x * (1.0 - dist_y) * (1.0 - dist_z)
-	    + c3 * dist_x * dist_y * (1.0 - dist_z)
-	    + c4 * (1.0 - dist_x) * (1.0 - dist_y) * dist_z
-	    + c5 * (1.0 - dist_x) * dist_y * dist_z
-	    + c6 * dist_x * (1.0 - dist_y) * dist_z
-	    + c7 * dist_x * dist_y * dist_z;
+/* Apply an arbitrary transformation to num points, given in 
+ * structure-of-arrays form. All six arrays have the given type, which is 
+ * either SIFT3D_DOUBLE or SIFT3D_FLOAT. Each output array may be the same as
+ * the corresponding input array, to transform the points in place.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int apply_tform_points(const void *const tform, const Mat_rm_type type, 
+        const int num, const void *const x_in, const void *const y_in, 
+        const void *const z_in, void *const x_out, void *const y_out, 
+        void *const z_out)
+{
+        if (type != SIFT3D_DOUBLE && type != SIFT3D_FLOAT) {
+                SIFT3D_ERR("apply_tform_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
 
-	return out;
+	return TFORM_GET_VTABLE(tform)->apply_points(tform, type, num, x_in, 
+                y_in, z_in, x_out, y_out, z_out);
 }
 
-/* Helper routine to resample an image at a point, using the Lanczos kernel */
-static double resample_lanczos2(const Image * const im, const double x,
-				const double y, const double z, const int c)
+/* Apply an Affine transformation to an array of points. See 
+ * apply_tform_points. The loop is vectorized, in single precision for 
+ * SIFT3D_FLOAT. */
+static int apply_Affine_points(const void *const affine, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out)
 {
+        int i;
 
-	double val;
-	int xs, ys, zs;
+	const Affine *const aff = affine;
+	const Mat_rm *const A = &aff->A;
 
-	//TODO: faster separable implementation
+        if (AFFINE_GET_DIM(aff) != 3) {
+                SIFT3D_ERR("apply_Affine_points: unsupported "
+                        "dimensionality: %d \n", AFFINE_GET_DIM(aff));
+                return SIFT3D_FAILURE;
+        }
 
-	// Kernel parameter
-	const double a = 2;
+#define APPLY_AFFINE_POINTS(type) { \
+        const type *const xi = x_in; \
+        const type *const yi = y_in; \
+        const type *const zi = z_in; \
+        type *const xo = x_out; \
+        type *const yo = y_out; \
+        type *const zo = z_out; \
+        const type a00 = (type) SIFT3D_MAT_RM_GET(A, 0, 0, double); \
+        const type a01 = (type) SIFT3D_MAT_RM_GET(A, 0, 1, double); \
+        const type a02 = (type) SIFT3D_MAT_RM_GET(A, 0, 2, double); \
+        const type a03 = (type) SIFT3D_MAT_RM_GET(A, 0, 3, double); \
+        const type a10 = (type) SIFT3D_MAT_RM_GET(A, 1, 0, double); \
+        const type a11 = (type) SIFT3D_MAT_RM_GET(A, 1, 1, double); \
+        const type a12 = (type) SIFT3D_MAT_RM_GET(A, 1, 2, double); \
+        const type a13 = (type) SIFT3D_MAT_RM_GET(A, 1, 3, double); \
+        const type a20 = (type) SIFT3D_MAT_RM_GET(A, 2, 0, double); \
+        const type a21 = (type) SIFT3D_MAT_RM_GET(A, 2, 1, double); \
+        const type a22 = (type) SIFT3D_MAT_RM_GET(A, 2, 2, double); \
+        const type a23 = (type) SIFT3D_MAT_RM_GET(A, 2, 3, double); \
+        _Pragma("omp simd") \
+        for (i = 0; i < num; i++) { \
+                const type x = xi[i]; \
+                const type y = yi[i]; \
+                const type z = zi[i]; \
+                xo[i] = a00 * x + a01 * y + a02 * z + a03; \
+                yo[i] = a10 * x + a11 * y + a12 * z + a13; \
+                zo[i] = a20 * x + a21 * y + a22 * z + a23; \
+        } \
+}
+
+        switch (type) {
+        case SIFT3D_DOUBLE:
+                APPLY_AFFINE_POINTS(double)
+                break;
+        case SIFT3D_FLOAT:
+                APPLY_AFFINE_POINTS(float)
+                break;
+        default:
+                SIFT3D_ERR("apply_Affine_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
+#undef APPLY_AFFINE_POINTS
 
-	// Check bounds
-	const double xMin = 0;
-	const double yMin = 0;
-	const double zMin = 0;
-	const double xMax = im->nx - 1;
-	const double yMax = im->ny - 1;
-	const double zMax = im->nz - 1;
-	if (x < xMin || y < yMin || z < zMin ||
-	    x > xMax || y > yMax || z > zMax)
-		return 0.0;
-
-	// Window 
-	const int x_start = SIFT3D_MAX(floor(x) - a, xMin);
-	const int x_end = SIFT3D_MIN(floor(x) + a, xMax);
-	const int y_start = SIFT3D_MAX(floor(y) - a, yMin);
-	const int y_end = SIFT3D_MIN(floor(y) + a, yMax);
-	const int z_start = SIFT3D_MAX(floor(z) - a, zMin);
-	const int z_end = SIFT3D_MIN(floor(z) + a, zMax);
-
-	// Iterate through the window 
-	val = 0.0;
-	SIFT3D_IM_LOOP_LIMITED_START(in, xs, ys, zs, x_start, x_end, y_start,
-				     y_end, z_start, z_end)
-
-        // Evalutate the kernel
-	const double xw = fabs((double)xs - x) + DBL_EPSILON;
-	const double yw = fabs((double)ys - y) + DBL_EPSILON;
-	const double zw = fabs((double)zs - z) + DBL_EPSILON;
-	const double kernel = lanczos(xw, a) * lanczos(yw, a) * lanczos(zw, a);
-
-	// Accumulate
-	val += kernel * SIFT3D_IM_GET_VOX(im, xs, ys, zs, c);
-
-	SIFT3D_IM_LOOP_END return val;
+        return SIFT3D_SUCCESS;
 }
 
-/* Lanczos kernel function */
-static double lanczos(double x, double a)
+#ifdef __AVX2__
+/* Helper function to compute the natural logarithm of a positive, finite x,
+ * in a form which vectorizes, unlike log() in most C libraries. The mantissa
+ * is reduced to [sqrt(1/2), sqrt(2)), where the series of 
+ * log(m) = 2 * atanh((m - 1) / (m + 1)) converges to double precision in 
+ * ten terms. Without AVX2, the loops using this are not vectorized, and the
+ * table-based log() of the C library is faster. */
+static inline double log_simd(const double x)
 {
-	const double pi_x = M_PI * x;
-	return a * sin(pi_x) * sin(pi_x / a) / (pi_x * pi_x);
-}
+        uint64_t bits, e_bits;
+        double m, e, s, s2, p;
+        int big;
+
+        // Split x into the exponent e and the mantissa m, in [1, 2). The 
+        // exponent is converted to floating point by placing it in the 
+        // mantissa of 2^52, as vector integer conversions are not portable.
+        memcpy(&bits, &x, sizeof(bits));
+        e_bits = (bits >> 52) | 0x4330000000000000ULL;
+        memcpy(&e, &e_bits, sizeof(e));
+        e -= 4503599627370496.0 + 1023.0;
+        bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+        memcpy(&m, &bits, sizeof(m));
+
+        // Reduce m to [sqrt(1/2), sqrt(2)), without branching
+        big = m > 1.4142135623730951;
+        m = big ? 0.5 * m : m;
+        e = big ? e + 1.0 : e;
+
+        // Sum the series, in Horner form
+        s = (m - 1.0) / (m + 1.0);
+        s2 = s * s;
+        p = 1.0 / 21.0;
+        p = p * s2 + 1.0 / 19.0;
+        p = p * s2 + 1.0 / 17.0;
+        p = p * s2 + 1.0 / 15.0;
+        p = p * s2 + 1.0 / 13.0;
+        p = p * s2 + 1.0 / 11.0;
+        p = p * s2 + 1.0 / 9.0;
+        p = p * s2 + 1.0 / 7.0;
+        p = p * s2 + 1.0 / 5.0;
+        p = p * s2 + 1.0 / 3.0;
+        p = p * s2 + 1.0;
+
+        return e * 0.6931471805599453 + 2.0 * s * p;
+}
+#define TPS_LOG(x) log_simd(x)
+#else
+#define TPS_LOG(x) log(x)
+#endif
 
-/* Resample an image to different units.
- *
- * Parameters:
- *   src: The input image.
- *   units: The new units. 
- *   interp: The type of interpolation to use.
- *   dst: The output image. 
- *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-int im_resample(const Image *const src, const double *const units, 
-	const interp_type interp, Image *const dst) {
+/* Apply a thin-plate spline to an array of points. See apply_tform_points.
+ * For each input point, the kernel sums over the control points are 
+ * vectorized with omp simd, using log_simd with AVX2. They are accumulated
+ * in double precision for both types, as the weights sum to zero, so the 
+ * sums cancel heavily. */
+static int apply_Tps_points(const void *const tps, const Mat_rm_type type,
+        const int num, const void *const x_in, const void *const y_in, 
+        const void *const z_in, void *const x_out, void *const y_out, 
+        void *const z_out)
+{
+        const double *kp, *w0, *w1, *w2;
+        double a[3][4];
+        int i, m;
 
-	Affine aff;
-	Mat_rm A;
-	double factors[IM_NDIMS];
-	int i;
+	const Tps *const t = tps;
+	const Mat_rm *const params = &t->params;
+	const Mat_rm *const kp_src = &t->kp_src;
+	const int ctrl_pts = kp_src->num_rows;
 
-	// Initialize intermediates
-	if (init_Mat_rm(&A, IM_NDIMS, IM_NDIMS + 1, SIFT3D_DOUBLE, 
-		SIFT3D_TRUE) ||
-		init_Affine(&aff, IM_NDIMS))
-		return SIFT3D_FAILURE;
+        if (t->dim != 3) {
+                SIFT3D_ERR("apply_Tps_points: unsupported dimensionality: "
+                        "%d \n", t->dim);
+                return SIFT3D_FAILURE;
+        }
 
-	// Compute the scaling factors
-	for (i = 0; i < IM_NDIMS; i++) {
-		factors[i] = SIFT3D_IM_GET_UNITS(src)[i] / units[i];
-	}
+        // Get the control points, the kernel weights and the affine part
+        kp = kp_src->u.data_double;
+        w0 = &SIFT3D_MAT_RM_GET(params, 0, 0, double);
+        w1 = &SIFT3D_MAT_RM_GET(params, 1, 0, double);
+        w2 = &SIFT3D_MAT_RM_GET(params, 2, 0, double);
+        for (m = 0; m < 3; m++) {
+                for (i = 0; i < 4; i++) {
+                        a[m][i] = SIFT3D_MAT_RM_GET(params, m, ctrl_pts + i,
+                                double);
+                }
+        }
 
-	// Set the transformation matrix
-	for (i = 0; i < IM_NDIMS; i++) {
-		SIFT3D_MAT_RM_GET(&A, i, i, double) = 1.0 / factors[i];
-	}
-	if (Affine_set_mat(&A, &aff))
-		goto im_resample_quit;
+#define APPLY_TPS_POINTS(type) { \
+        const type *const xi = x_in; \
+        const type *const yi = y_in; \
+        const type *const zi = z_in; \
+        type *const xo = x_out; \
+        type *const yo = y_out; \
+        type *const zo = z_out; \
+        for (i = 0; i < num; i++) { \
+                double s0, s1, s2; \
+                int n; \
+                const double x = (double) xi[i]; \
+                const double y = (double) yi[i]; \
+                const double z = (double) zi[i]; \
+                s0 = s1 = s2 = 0.0; \
+                _Pragma("omp simd reduction(+:s0, s1, s2)") \
+                for (n = 0; n < ctrl_pts; n++) { \
+                        const double dx = x - kp[3 * n]; \
+                        const double dy = y - kp[3 * n + 1]; \
+                        const double dz = z - kp[3 * n + 2]; \
+                        const double r_sq = dx * dx + dy * dy + dz * dz; \
+                        const double U = r_sq > 0.0 ? \
+                                r_sq * TPS_LOG(r_sq) : 0.0; \
+                        s0 += U * w0[n]; \
+                        s1 += U * w1[n]; \
+                        s2 += U * w2[n]; \
+                } \
+                xo[i] = (type) (s0 + a[0][0] + a[0][1] * x + a[0][2] * y + \
+                        a[0][3] * z); \
+                yo[i] = (type) (s1 + a[1][0] + a[1][1] * x + a[1][2] * y + \
+                        a[1][3] * z); \
+                zo[i] = (type) (s2 + a[2][0] + a[2][1] * x + a[2][2] * y + \
+                        a[2][3] * z); \
+        } \
+}
 
-	// Set the output dimensions
-	dst->nc = src->nc;
-	for (i = 0; i < IM_NDIMS; i++) {
-		SIFT3D_IM_GET_DIMS(dst)[i] = (int) ceil((double) 
-                        SIFT3D_IM_GET_DIMS(src)[i] * factors[i]);
-	}
-	im_default_stride(dst);	
-        if (im_resize(dst))
-		goto im_resample_quit;
+        switch (type) {
+        case SIFT3D_DOUBLE:
+                APPLY_TPS_POINTS(double)
+                break;
+        case SIFT3D_FLOAT:
+                APPLY_TPS_POINTS(float)
+                break;
+        default:
+                SIFT3D_ERR("apply_Tps_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
+#undef APPLY_TPS_POINTS
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Apply an arbitrary transform to a matrix. See apply_Affine_Mat_rm for
+ * matrix formats. */
+int apply_tform_Mat_rm(const void *const tform, const Mat_rm * const mat_in,
+		       Mat_rm * const mat_out)
+{
+	return TFORM_GET_VTABLE(tform)->apply_Mat_rm(tform, mat_in, mat_out);
+}
 
-	// Apply the transformation
-	if (im_inv_transform(&aff, src, interp, SIFT3D_FALSE, dst))
-		goto im_resample_quit;
+/* Apply a spline transformation to a matrix. See apply_Affine_Mat_rm for 
+ * the format of the matrices. Only the first three rows of mat_in are used.
+ *
+ * All matrices must be initialized with init_Mat_rm prior to use. For 3D!*/
+static int apply_Tps_Mat_rm(const void *const tps, const Mat_rm * const mat_in,
+			    Mat_rm * const mat_out)
+{
 
-        // Set the new output units
-	memcpy(SIFT3D_IM_GET_UNITS(dst), units, IM_NDIMS * sizeof(double));
+	const int num_pts = mat_in->num_cols;	//number of points to be transformed
 
-	// Clean up
-	cleanup_tform(&aff);
-	cleanup_Mat_rm(&A);
+        // Verify inputs
+        if (mat_in->type != SIFT3D_DOUBLE || mat_in->num_rows < 3) {
+                SIFT3D_ERR("apply_Tps_Mat_rm: invalid input matrix \n");
+                return SIFT3D_FAILURE;
+        }
 
-	return SIFT3D_SUCCESS;
+        // Resize the output
+        mat_out->type = SIFT3D_DOUBLE;
+        mat_out->num_rows = 3;
+        mat_out->num_cols = num_pts;
+        if (resize_Mat_rm(mat_out))
+                return SIFT3D_FAILURE;
 
-im_resample_quit:
-	cleanup_tform(&aff);
-	cleanup_Mat_rm(&A);
-	return SIFT3D_FAILURE;
+        // Transform the rows
+        return apply_Tps_points(tps, SIFT3D_DOUBLE, num_pts, 
+                &SIFT3D_MAT_RM_GET(mat_in, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 2, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 2, 0, double));
 }
 
-/* Horizontally convolves a separable filter with an image, 
- * on CPU. Currently only works in 3D.
- * 
- * This function chooses among the best variant of convolve_sep* based on
- * compilation options and filter parameters.
- * 
- * Parameters: 
- * src - input image (initialized)
- * dst - output image (initialized) 
-    int x, y, z;
- * f - filter to be applied
- * dim - dimension in which to convolve
- * unit - the spacing of the filter coefficients
- */
-static int convolve_sep(const Image * const src,
-			Image * const dst, const Sep_FIR_filter * const f,
-			const int dim, const double unit) {
-
-#ifdef SIFT3D_USE_OPENCL
-        return convolve_sep_cl(src, dst, f, dim, unit);
-#else
-	return f->symmetric ? 
-                convolve_sep_sym(src, dst, f, dim, unit) : 
-                convolve_sep_gen(src, dst, f, dim, unit);
-#endif
+/* Initialize a Tps_grid struct. */
+void init_Tps_grid(Tps_grid *const grid)
+{
+        grid->tps = NULL;
+        grid->coef = NULL;
+        grid->err = 0.0;
+        grid->spacing = 0;
+        grid->nx = grid->ny = grid->nz = 0;
+        grid->lx = grid->ly = grid->lz = 0;
 }
 
-/* Convolve_sep for general filters */
-static int convolve_sep_gen(const Image * const src,
-			Image * const dst, const Sep_FIR_filter * const f,
-			const int dim, const double unit)
+/* Free the memory associated with a Tps_grid. */
+void cleanup_Tps_grid(Tps_grid *const grid)
 {
-	register int x, y, z, c, d;
-
-	register const int half_width = f->width / 2;
-	register const int nx = src->nx;
-	register const int ny = src->ny;
-	register const int nz = src->nz;
-        register const float conv_eps = 0.1f;
-	register const int dim_end = SIFT3D_IM_GET_DIMS(src)[dim] - 1;
-        register const float unit_factor =  unit /
-                SIFT3D_IM_GET_UNITS(src)[dim];
-        register const int unit_half_width = 
-                (int) ceilf(half_width * unit_factor);
-        int start[] = {0, 0, 0};
-        int end[] = {nx - 1, ny - 1, nz - 1};
+        if (grid->coef != NULL)
+                free(grid->coef);
+        init_Tps_grid(grid);
+}
+
+/* Sample a 3D thin-plate spline on a lattice over the voxels 
+ * [0, nx - 1] x [0, ny - 1] x [0, nz - 1], so that it can be evaluated by
+ * cubic B-spline interpolation, at a cost which does not depend on the 
+ * number of control points. The lattice is refined until the largest error 
+ * measured at the centers of its cells is at most tol voxels. If even a 
+ * spacing of two voxels does not meet the tolerance, the grid falls back to
+ * exact evaluation, with spacing 0.
+ *
+ * The error is measured against the exact spline at the centers of up to 
+ * TPS_GRID_NUM_TEST^3 cells, including those on the faces of the domain, 
+ * where the interpolation is least accurate. It is stored in grid->err. 
+ * This is an estimate of the interpolation error, not a bound: the error 
+ * may be larger elsewhere, e.g. near control points, where the spline is 
+ * least smooth. Points outside the domain are always evaluated exactly.
+ *
+ * tps must remain valid for the lifetime of grid, which must be initialized 
+ * with init_Tps_grid.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int make_Tps_grid(const Tps *const tps, const int nx, const int ny, 
+        const int nz, const double tol, Tps_grid *const grid)
+{
+        int spacing;
 
-        // Compute starting and ending points for the convolution dimension
-        start[dim] += unit_half_width;
-        end[dim] -= unit_half_width + 1;
+        // Verify inputs
+        if (tps->dim != 3) {
+                SIFT3D_ERR("make_Tps_grid: unsupported dimensionality: %d \n",
+                        tps->dim);
+                return SIFT3D_FAILURE;
+        }
+        if (nx < 1 || ny < 1 || nz < 1) {
+                SIFT3D_ERR("make_Tps_grid: invalid dimensions [%d x %d x %d] "
+                        "\n", nx, ny, nz);
+                return SIFT3D_FAILURE;
+        }
+        if (tol <= 0.0) {
+                SIFT3D_ERR("make_Tps_grid: invalid tolerance: %f \n", tol);
+                return SIFT3D_FAILURE;
+        }
 
-	//TODO: Convert this to convolve_x, which only convolves in x,
-	// then make a wrapper to restride, transpose, convolve x, and transpose 
-	// back
+        grid->tps = tps;
+        grid->nx = nx;
+        grid->ny = ny;
+        grid->nz = nz;
 
-	// Resize the output, with the default stride
-        if (im_copy_dims(src, dst))
-                return SIFT3D_FAILURE;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        // Refine the lattice until it meets the tolerance
+        for (spacing = TPS_GRID_SPACING_MAX; spacing > 1; spacing /= 2) {
+                if (sample_Tps_grid(spacing, grid))
+                        return SIFT3D_FAILURE;
+                if (grid->err <= tol)
+                        return SIFT3D_SUCCESS;
+        }
 
-	// Initialize the output to zeros
-	im_zero(dst);
+        // Fall back to exact evaluation
+        free(grid->coef);
+        grid->coef = NULL;
+        grid->err = 0.0;
+        grid->spacing = 0;
+        grid->lx = grid->ly = grid->lz = 0;
 
-#define SAMP_AND_ACC(src, dst, tap, coords, c) \
-{ \
-        float frac; \
-\
-        const int idx_lo[] = {(coords)[0], (coords)[1], (coords)[2]}; \
-        int idx_hi[] = {idx_lo[0], idx_lo[1], idx_lo[2]}; \
-\
-        /* Convert the physical coordinates to integer indices*/ \
-        idx_hi[dim] += 1; \
-        frac = (coords)[dim] - (float) idx_lo[dim]; \
-\
-        /* Sample with linear interpolation */ \
-        SIFT3D_IM_GET_VOX(dst, x, y, z, c) += (tap) * \
-                ((1.0f - frac) * \
-                SIFT3D_IM_GET_VOX(src, idx_lo[0], idx_lo[1], idx_lo[2], c) + \
-                frac * \
-                SIFT3D_IM_GET_VOX(src, idx_hi[0], idx_hi[1], idx_hi[2], c)); \
+        return SIFT3D_SUCCESS;
 }
 
-	// First pass: process the interior
-#pragma omp parallel for private(x) private(y) private(c)
-	SIFT3D_IM_LOOP_LIMITED_START_C(dst, x, y, z, c, start[0], end[0], 
-                start[1], end[1], start[2], end[2])
+/* Helper routine for make_Tps_grid. Samples the non-affine part of the 
+ * spline on a lattice of the given spacing, converts the samples to cubic 
+ * B-spline coefficients, and measures the error. */
+static int sample_Tps_grid(const int spacing, Tps_grid *const grid)
+{
+        double *tx, *ty, *tz, *buf;
+        size_t row_size;
+        int i, j, k, m, lx, ly, lz, ntx, nty, ntz, nt_max, ret;
+
+        const Tps *const tps = grid->tps;
+        const Mat_rm *const params = &tps->params;
+        const int ctrl_pts = tps->kp_src.num_rows;
+        const double h = (double) spacing;
+
+        // Lattice dimensions, including the padding
+        lx = (grid->nx + spacing - 2) / spacing + 1 + 2 * TPS_GRID_PAD;
+        ly = (grid->ny + spacing - 2) / spacing + 1 + 2 * TPS_GRID_PAD;
+        lz = (grid->nz + spacing - 2) / spacing + 1 + 2 * TPS_GRID_PAD;
+        row_size = 3 * (size_t) lx;
+
+        // Allocate the coefficients
+        if ((grid->coef = SIFT3D_safe_realloc(grid->coef, 
+                row_size * ly * lz * sizeof(double))) == NULL)
+                return SIFT3D_FAILURE;
+        grid->spacing = spacing;
+        grid->lx = lx;
+        grid->ly = ly;
+        grid->lz = lz;
 
-                float coords[] = { x, y, z };
+        // Sample the spline, less its affine part
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for private(i) private(j) private(m) schedule(dynamic)
+        for (k = 0; k < lz; k++) {
 
-                for (d = -half_width; d <= half_width; d++) {
+                double *const row = malloc(6 * lx * sizeof(double));
 
-                        const float tap = f->kernel[d + half_width];
-                        const float step = d * unit_factor;
+                if (row == NULL) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
 
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
+                for (j = 0; j < ly; j++) {
 
-                        // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                        double *const coef = grid->coef + 
+                                row_size * ((size_t) k * ly + j);
 
-                        // Reset the sampling coordinates
-                        coords[dim] += step;
+                        for (i = 0; i < lx; i++) {
+                                row[i] = (i - TPS_GRID_PAD) * h;
+                                row[lx + i] = (j - TPS_GRID_PAD) * h;
+                                row[2 * lx + i] = (k - TPS_GRID_PAD) * h;
+                        }
+
+                        if (apply_Tps_points(tps, SIFT3D_DOUBLE, lx, row,
+                                row + lx, row + 2 * lx, row + 3 * lx, 
+                                row + 4 * lx, row + 5 * lx)) {
+                                ret = SIFT3D_FAILURE;
+                                break;
+                        }
+
+                        for (i = 0; i < lx; i++) {
+                                for (m = 0; m < 3; m++) {
+                                        coef[3 * i + m] = row[(3 + m) * lx + i]
+                                            - SIFT3D_MAT_RM_GET(params, m, 
+                                                ctrl_pts, double)
+                                            - SIFT3D_MAT_RM_GET(params, m, 
+                                                ctrl_pts + 1, double) * row[i]
+                                            - SIFT3D_MAT_RM_GET(params, m, 
+                                                ctrl_pts + 2, double) * 
+                                                row[lx + i]
+                                            - SIFT3D_MAT_RM_GET(params, m, 
+                                                ctrl_pts + 3, double) * 
+                                                row[2 * lx + i];
+                                }
+                        }
                 }
 
-	SIFT3D_IM_LOOP_END_C
+                free(row);
+        }
+        if (ret)
+                return SIFT3D_FAILURE;
 
-        // Second pass: process the boundaries
-#pragma omp parallel for private(x) private(y) private(c)
-        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        // Convert the samples to B-spline coefficients, separably
+        for (k = 0; k < lz; k++) {
+        for (j = 0; j < ly; j++) {
+        for (m = 0; m < 3; m++) {
+                bspline_prefilter(grid->coef + row_size * ((size_t) k * ly + j)
+                        + m, lx, 3);
+        }}}
+        for (k = 0; k < lz; k++) {
+        for (i = 0; i < lx; i++) {
+        for (m = 0; m < 3; m++) {
+                bspline_prefilter(grid->coef + row_size * ly * k + 3 * i + m,
+                        ly, row_size);
+        }}}
+        for (j = 0; j < ly; j++) {
+        for (i = 0; i < lx; i++) {
+        for (m = 0; m < 3; m++) {
+                bspline_prefilter(grid->coef + row_size * j + 3 * i + m, lz, 
+                        row_size * ly);
+        }}}
+
+        // Choose the test points, at the cell centers, clamped to the domain
+        if ((buf = malloc(11 * TPS_GRID_NUM_TEST * sizeof(double))) == NULL)
+                return SIFT3D_FAILURE;
+        tx = buf;
+        ty = tx + TPS_GRID_NUM_TEST;
+        tz = ty + TPS_GRID_NUM_TEST;
+
+#define TPS_GRID_TEST_PTS(n, t, nt) { \
+        const int num_cells = SIFT3D_MAX((n - 1 + spacing - 1) / spacing, 1); \
+        nt = SIFT3D_MIN(num_cells, TPS_GRID_NUM_TEST); \
+        for (i = 0; i < nt; i++) { \
+                const int cell = nt == 1 ? 0 : \
+                        (int) ((long) i * (num_cells - 1) / (nt - 1)); \
+                t[i] = SIFT3D_MIN((cell + 0.5) * h, (double) (n - 1)); \
+        } \
+}
+        TPS_GRID_TEST_PTS(grid->nx, tx, ntx)
+        TPS_GRID_TEST_PTS(grid->ny, ty, nty)
+        TPS_GRID_TEST_PTS(grid->nz, tz, ntz)
+#undef TPS_GRID_TEST_PTS
+
+        // Measure the error
+        grid->err = 0.0;
+        nt_max = TPS_GRID_NUM_TEST;
+        for (k = 0; k < ntz; k++) {
+        for (j = 0; j < nty; j++) {
+
+                double *const y_row = tz + nt_max;
+                double *const z_row = y_row + nt_max;
+                double *const exact = z_row + nt_max;
+                double *const approx = exact + 3 * nt_max;
+
+                for (i = 0; i < ntx; i++) {
+                        y_row[i] = ty[j];
+                        z_row[i] = tz[k];
+                }
 
-                const int i_coords[] = { x, y, z };
+                if (apply_Tps_points(tps, SIFT3D_DOUBLE, ntx, tx, y_row, 
+                        z_row, exact, exact + nt_max, exact + 2 * nt_max) ||
+                    apply_Tps_grid_points(grid, ntx, tx, y_row, z_row, approx,
+                        approx + nt_max, approx + 2 * nt_max)) {
+                        free(buf);
+                        return SIFT3D_FAILURE;
+                }
 
-                // Skip pixels we have already processed
-                if (i_coords[dim] >= start[dim] && i_coords[dim] <= end[dim]) 
-                        continue;
+                for (i = 0; i < ntx; i++) {
+                        double dist_sq = 0.0;
+                        for (m = 0; m < 3; m++) {
+                                const double diff = exact[m * nt_max + i] -
+                                        approx[m * nt_max + i];
+                                dist_sq += diff * diff;
+                        }
+                        grid->err = SIFT3D_MAX(grid->err, sqrt(dist_sq));
+                }
+        }}
 
-                // Process the boundary pixel
-                for (d = -half_width; d <= half_width; d++) {
+        free(buf);
+        return SIFT3D_SUCCESS;
+}
 
-                        float coords[] = { x, y, z };
-                        const float tap = f->kernel[d + half_width];
-                        const float step = d * unit_factor;
+/* Convert n samples to the coefficients of an interpolating cubic B-spline, 
+ * in place, with mirror-symmetric boundaries. The samples are spaced by 
+ * stride. Requires n >= 2. */
+static void bspline_prefilter(double *const c, const int n, 
+        const size_t stride)
+{
+        double zn, z2n, sum;
+        int k;
 
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
+        const double pole = sqrt(3.0) - 2.0;
+        const double gain = (1.0 - pole) * (1.0 - 1.0 / pole);
 
-                        // Mirror coordinates
-                        if ((int) coords[dim] < 0) {
-                                coords[dim] = -coords[dim];
-                                assert((int) coords[dim] >= 0);
-                        } else if ((int) coords[dim] >= dim_end) {
-                                coords[dim] = 2.0f * dim_end - coords[dim] -    
-                                        conv_eps;
-                                assert((int) coords[dim] < dim_end);
-                        }
+#define C(k) c[(size_t) (k) * stride]
 
-                        // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
-                }
+        for (k = 0; k < n; k++) {
+                C(k) *= gain;
+        }
 
-	SIFT3D_IM_LOOP_END_C 
+        // Causal initialization, summing over the mirrored signal
+        zn = pole;
+        z2n = pow(pole, n - 1);
+        sum = C(0) + z2n * C(n - 1);
+        z2n *= z2n / pole;
+        for (k = 1; k < n - 1; k++) {
+                sum += (zn + z2n) * C(k);
+                zn *= pole;
+                z2n /= pole;
+        }
+        C(0) = sum / (1.0 - zn * zn);
 
-#undef SAMP_AND_ACC
+        // Causal recursion
+        for (k = 1; k < n; k++) {
+                C(k) += pole * C(k - 1);
+        }
 
-        return SIFT3D_SUCCESS;
+        // Anti-causal initialization and recursion
+        C(n - 1) = pole / (pole * pole - 1.0) * (C(n - 1) + pole * C(n - 2));
+        for (k = n - 2; k >= 0; k--) {
+                C(k) = pole * (C(k + 1) - C(k));
+        }
+
+#undef C
 }
 
-/* Same as convolve_sep, but with OpenCL acceleration. This does NOT
- * read back the results to C-accessible data. Use im_read_back for that. */
-SIFT3D_IGNORE_UNUSED
-static int convolve_sep_cl(const Image * const src, Image * const dst,
-			   const Sep_FIR_filter * const f, const int dim,
-                           const double unit)
+/* Compute the cubic B-spline weights of the four lattice nodes around the 
+ * position u, in units of the lattice spacing. Returns the index of the 
+ * first node, not counting the padding. */
+static int bspline_weights(const double u, double w[4])
 {
-#ifdef SIFT3D_USE_OPENCL
-	cl_kernel kernel;
-	cl_int dx, dy, dz, err;
+        const int idx = (int) floor(u);
+        const double t = u - idx;
+        const double t2 = t * t;
+        const double t3 = t2 * t;
+        const double s = 1.0 - t;
 
-	const size_t global_work_size[] = { src->nx, src->ny, src->nz };
+        w[0] = s * s * s / 6.0;
+        w[1] = (3.0 * t3 - 6.0 * t2 + 4.0) / 6.0;
+        w[2] = (-3.0 * t3 + 3.0 * t2 + 3.0 * t + 1.0) / 6.0;
+        w[3] = t3 / 6.0;
 
-	// Resize the output, with the default stride
-        if (im_copy_dims(src, dst))
-                return SIFT3D_FAILURE;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        return idx - 1;
+}
 
-	// Do not have a 2D kernel right now
-	if (dim != 3) {
-		printf("convolve_sep_cl: unsupported dimension: %d \n", dim);
-	return SIFT3D_FAILURE}
+/* Apply a thin-plate spline, sampled by make_Tps_grid, to an array of points.
+ * The arguments are as in apply_tform_points, in double precision. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int apply_Tps_grid_points(const Tps_grid *const grid, const int num,
+        const double *const x_in, const double *const y_in, 
+        const double *const z_in, double *const x_out, double *const y_out, 
+        double *const z_out)
+{
+        int i;
 
-	// Form the dimension offsets
-	dx = dy = dz = 0;
-	switch (dim) {
-	case 0:
-		dx = 1;
-		break;
-	case 1:
-		dy = 1;
-		break;
-	case 2:
-		dz = 1;
-		break;
-	default:
-		return SIFT3D_FAILURE;
-	}
+        const Tps *const tps = grid->tps;
+        const Mat_rm *const params = &tps->params;
+        const int ctrl_pts = tps->kp_src.num_rows;
+        const double h = (double) grid->spacing;
+        const size_t row_size = 3 * (size_t) grid->lx;
+
+        // Evaluate exactly if there is no lattice
+        if (grid->spacing == 0)
+                return apply_Tps_points(tps, SIFT3D_DOUBLE, num, x_in, y_in, 
+                        z_in, x_out, y_out, z_out);
+
+        for (i = 0; i < num; i++) {
+
+                double wx[4], wy[4], wz[4], out[3];
+                int ix, iy, iz, a, b, c, m;
+
+                const double x = x_in[i];
+                const double y = y_in[i];
+                const double z = z_in[i];
+
+                // Evaluate points outside the domain exactly
+                if (x < 0.0 || x > (double) (grid->nx - 1) ||
+                    y < 0.0 || y > (double) (grid->ny - 1) ||
+                    z < 0.0 || z > (double) (grid->nz - 1)) {
+                        if (apply_Tps_points(tps, SIFT3D_DOUBLE, 1, x_in + i,
+                                y_in + i, z_in + i, x_out + i, y_out + i, 
+                                z_out + i))
+                                return SIFT3D_FAILURE;
+                        continue;
+                }
 
-	kernel = f->cl_apply_unrolled;
-	im_set_kernel_arg(kernel, 0, src);
-	im_set_kernel_arg(kernel, 1, dst);
-	err = clSetKernelArg(kernel, 2, sizeof(cl_int), &dx);
-	err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &dy);
-	err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &dz);
-	check_cl_error(err, "convolve_sep_cl: set kernel arg");
+                // Interpolate the non-affine part
+                ix = bspline_weights(x / h, wx) + TPS_GRID_PAD;
+                iy = bspline_weights(y / h, wy) + TPS_GRID_PAD;
+                iz = bspline_weights(z / h, wz) + TPS_GRID_PAD;
+                out[0] = out[1] = out[2] = 0.0;
+                for (c = 0; c < 4; c++) {
+                for (b = 0; b < 4; b++) {
+
+                        const double w_yz = wz[c] * wy[b];
+                        const double *const coef = grid->coef + row_size * 
+                                ((size_t) (iz + c) * grid->ly + iy + b) + 
+                                3 * ix;
+
+                        for (a = 0; a < 4; a++) {
+                                const double w = w_yz * wx[a];
+                                for (m = 0; m < 3; m++) {
+                                        out[m] += w * coef[3 * a + m];
+                                }
+                        }
+                }}
+
+                // Add the affine part
+                for (m = 0; m < 3; m++) {
+                        out[m] += SIFT3D_MAT_RM_GET(params, m, ctrl_pts, 
+                                double) +
+                            SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 1, 
+                                double) * x +
+                            SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 2, 
+                                double) * y +
+                            SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 3, 
+                                double) * z;
+                }
 
-	err =
-	    clEnqueueNDRangeKernel(cl_data.queues[0], kernel, dim, NULL,
-				   global_work_size, NULL, 0, NULL, NULL);
-	return (int)err;
-#else
-	printf("colvolve_sep_cl: This version was not compiled with OpenCL!\n");
-	return SIFT3D_FAILURE;
-#endif
+                x_out[i] = out[0];
+                y_out[i] = out[1];
+                z_out[i] = out[2];
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
- /* Convolve_sep for symmetric filters. */
-static int convolve_sep_sym(const Image * const src, Image * const dst,
-			    const Sep_FIR_filter * const f, const int dim,
-                            const double unit)
+/* Apply a B-spline free-form deformation to an [x, y, z] triple. */
+static void apply_Bspline_xyz(const void *const bspline, const double x_in, 
+                              const double y_in, const double z_in, 
+                              double *const x_out, double *const y_out, 
+                              double *const z_out)
+{
+        // A single point never allocates, so this cannot fail
+        apply_Bspline_points(bspline, SIFT3D_DOUBLE, 1, &x_in, &y_in, &z_in,
+                x_out, y_out, z_out);
+}
+
+/* Apply a B-spline free-form deformation to a matrix. See apply_Tps_Mat_rm.
+ */
+static int apply_Bspline_Mat_rm(const void *const bspline, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out)
 {
 
-	// TODO: Symmetry-specific function
-	return convolve_sep_gen(src, dst, f, dim, unit);
+	const int num_pts = mat_in->num_cols;
+
+        // Verify inputs
+        if (mat_in->type != SIFT3D_DOUBLE || mat_in->num_rows < 3) {
+                SIFT3D_ERR("apply_Bspline_Mat_rm: invalid input matrix \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output
+        mat_out->type = SIFT3D_DOUBLE;
+        mat_out->num_rows = 3;
+        mat_out->num_cols = num_pts;
+        if (resize_Mat_rm(mat_out))
+                return SIFT3D_FAILURE;
+
+        // Transform the rows
+        return apply_Bspline_points(bspline, SIFT3D_DOUBLE, num_pts, 
+                &SIFT3D_MAT_RM_GET(mat_in, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 2, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 2, 0, double));
 }
 
-/* Permute the dimensions of an image.
+/* Apply a B-spline free-form deformation to an array of points. See 
+ * apply_tform_points. 
  *
- * Arguments: 
- * src - input image (initialized)
- * dim1 - input permutation dimension (x = 0, y = 1, z = 2)
- * dim2 - output permutation dimension (x = 0, y = 1, z = 2)
- * dst - output image (initialized)
- * 
- * example:
- * im_permute(src, dst, 0, 1) -- permute x with y in src
- *                              and save to dst
- */
-int im_permute(const Image * const src, const int dim1, const int dim2,
-		 Image * const dst)
+ * Each displacement is a weighted sum of the 4 x 4 x 4 nearest control 
+ * points. When consecutive points share their y and z coordinates, as in the
+ * rows of an image, the y and z weights are applied once per row, leaving 
+ * 4 multiply-adds per point and coordinate. */
+static int apply_Bspline_points(const void *const bspline, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out)
 {
-	register int x, y, z, c;
+        double *row_coef, row_y, row_z;
+        int i, in_row;
+
+	const Bspline *const b = bspline;
+        const Mat_rm *const A = &b->A;
+        const Mat_rm *const coef = &b->coef;
+        const int nx = b->dims[0];
+        const int ny = b->dims[1];
+        const int nz = b->dims[2];
+
+        if (type != SIFT3D_DOUBLE && type != SIFT3D_FLOAT) {
+                SIFT3D_ERR("apply_Bspline_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
 
-	// Verify inputs
-	if (dim1 < 0 || dim2 < 0 || dim1 > 3 || dim2 > 3) {
-		printf("im_permute: invalid dimensions: dim1 %d dim2 %d \n",
-		       dim1, dim2);
-		return SIFT3D_FAILURE;
-	}
+#define BSPLINE_GET(arr, i) (type == SIFT3D_DOUBLE ? \
+        ((const double *) (arr))[i] : (double) ((const float *) (arr))[i])
+#define BSPLINE_SET(arr, i, val) { \
+        if (type == SIFT3D_DOUBLE) \
+                ((double *) (arr))[i] = (val); \
+        else \
+                ((float *) (arr))[i] = (float) (val); \
+}
+#define BSPLINE_COEF(kx, ky, kz, m) SIFT3D_MAT_RM_GET(coef, \
+        ((kz) * ny + (ky)) * nx + (kx), m, double)
+
+        row_coef = NULL;
+        row_y = row_z = 0.0;
+        in_row = SIFT3D_FALSE;
+        for (i = 0; i < num; i++) {
+
+                double wx[4], wy[4], wz[4], out[IM_NDIMS];
+                int ix, iy, iz, a, bb, c, m, kx, ky, kz;
+
+                const double x = BSPLINE_GET(x_in, i);
+                const double y = BSPLINE_GET(y_in, i);
+                const double z = BSPLINE_GET(z_in, i);
+                const double u = x / b->spacing[0] + 1.0;
+                const double v = y / b->spacing[1] + 1.0;
+                const double w = z / b->spacing[2] + 1.0;
+
+                // Affine part
+                for (m = 0; m < IM_NDIMS; m++) {
+                        out[m] = SIFT3D_MAT_RM_GET(A, m, 0, double) * x +
+                                SIFT3D_MAT_RM_GET(A, m, 1, double) * y +
+                                SIFT3D_MAT_RM_GET(A, m, 2, double) * z +
+                                SIFT3D_MAT_RM_GET(A, m, 3, double);
+                }
 
-	// Check for the trivial case
-	if (dim1 == dim2) {
-		return im_copy_data(src, dst);
-        }
+                // Skip the displacement outside the support of the lattice
+                if (!(u >= -2.0 && u < nx + 1.0 && v >= -2.0 && 
+                        v < ny + 1.0 && w >= -2.0 && w < nz + 1.0))
+                        goto apply_Bspline_points_store;
 
-        // Permute the units
-        memcpy(SIFT3D_IM_GET_UNITS(dst), SIFT3D_IM_GET_UNITS(src), 
-                IM_NDIMS * sizeof(double));
-        SIFT3D_IM_GET_UNITS(dst)[dim1] = SIFT3D_IM_GET_UNITS(src)[dim2];
-        SIFT3D_IM_GET_UNITS(dst)[dim2] = SIFT3D_IM_GET_UNITS(src)[dim1];
+                ix = bspline_weights(u, wx);
+                iy = bspline_weights(v, wy);
+                iz = bspline_weights(w, wz);
 
-	// Resize the output
-	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
-                IM_NDIMS * sizeof(int));
-        SIFT3D_IM_GET_DIMS(dst)[dim1] = SIFT3D_IM_GET_DIMS(src)[dim2];
-        SIFT3D_IM_GET_DIMS(dst)[dim2] = SIFT3D_IM_GET_DIMS(src)[dim1];
-	dst->nc = src->nc;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+                // Start a new row if the next point shares y and z
+                in_row = in_row && y == row_y && z == row_z;
+                if (!in_row && i + 1 < num && BSPLINE_GET(y_in, i + 1) == y &&
+                        BSPLINE_GET(z_in, i + 1) == z) {
 
-	// Transpose the data
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+                        if (row_coef == NULL && (row_coef = 
+                                malloc(IM_NDIMS * nx * sizeof(double))) == 
+                                NULL)
+                                return SIFT3D_FAILURE;
 
-                int src_coords[] = {x, y, z};
-                int temp;
+                        for (kx = 0; kx < nx; kx++) {
 
-                // Permute the coordinates
-                temp = src_coords[dim1];
-                src_coords[dim1] = src_coords[dim2];
-                src_coords[dim2] = temp;
+                                double *const col = row_coef + IM_NDIMS * kx;
 
-                // Copy the datum
-                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = SIFT3D_IM_GET_VOX(src, 
-                        src_coords[0], src_coords[1], src_coords[2], c);
+                                col[0] = col[1] = col[2] = 0.0;
+                                for (c = 0; c < 4; c++) {
 
-	SIFT3D_IM_LOOP_END_C 
+                                        kz = iz + c;
+                                        if (kz < 0 || kz >= nz)
+                                                continue;
 
-        return SIFT3D_SUCCESS;
-}
+                                for (bb = 0; bb < 4; bb++) {
 
-/* Change an image's stride, preserving its data. 
- *
- * Parameters:
- *  -src: The source image. Must be initialized
- *  -strides: an array of length IM_NDIMS specifying the new strides
- *  -dst: The destination image. Must be initialized
- * 
- * Return: SIFT3D_SUCCESS (0) on success, nonzero otherwise. */
-int im_restride(const Image * const src, const size_t *const strides,
-		Image * const dst)
-{
+                                        const double w_yz = wz[c] * wy[bb];
 
-	int x, y, z, c;
+                                        ky = iy + bb;
+                                        if (ky < 0 || ky >= ny)
+                                                continue;
 
-	// Resize the output
-	memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
-                IM_NDIMS * sizeof(int));
-	memcpy(SIFT3D_IM_GET_STRIDES(dst), strides, IM_NDIMS * sizeof(size_t));
-	dst->nc = src->nc;
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+                                        for (m = 0; m < IM_NDIMS; m++) {
+                                                col[m] += w_yz * 
+                                                        BSPLINE_COEF(kx, ky,
+                                                        kz, m);
+                                        }
+                                }}
+                        }
 
-	// Copy the data
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
-	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
-	    SIFT3D_IM_GET_VOX(src, x, y, z, c);
-	SIFT3D_IM_LOOP_END_C 
+                        row_y = y;
+                        row_z = z;
+                        in_row = SIFT3D_TRUE;
+                }
 
-        return SIFT3D_SUCCESS;
-}
+                if (in_row) {
+                        // Apply the x weights to the collapsed row
+                        for (a = 0; a < 4; a++) {
+                                kx = ix + a;
+                                if (kx < 0 || kx >= nx)
+                                        continue;
+                                for (m = 0; m < IM_NDIMS; m++) {
+                                        out[m] += wx[a] * 
+                                                row_coef[IM_NDIMS * kx + m];
+                                }
+                        }
+                } else {
+                        // Sum over the 4 x 4 x 4 neighborhood
+                        for (c = 0; c < 4; c++) {
 
-/* Initializes a tform to ensure memory safety. 
- * Either this or the type-specific version must be called prior to using
- * a tform. */
-int init_tform(void *const tform, const tform_type type)
-{
+                                kz = iz + c;
+                                if (kz < 0 || kz >= nz)
+                                        continue;
 
-	switch (type) {
-	case TPS:
-		puts("init_tform: TPS not yet implemented \n");
-		return SIFT3D_FAILURE;
-	case AFFINE:
-		if (init_Affine((Affine *) tform, IM_NDIMS))
-			return SIFT3D_FAILURE;
-		break;
-	default:
-		puts("init_tform: unrecognized type \n");
-		return SIFT3D_FAILURE;
-	}
+                        for (bb = 0; bb < 4; bb++) {
 
-	return SIFT3D_SUCCESS;
-}
+                                const double w_yz = wz[c] * wy[bb];
 
-/* Initialize an Affine struct. This initializes
- * all fields, and allocates memory for the inner
- * matrix, initializing it to zero. */
-int init_Affine(Affine * const affine, const int dim)
-{
+                                ky = iy + bb;
+                                if (ky < 0 || ky >= ny)
+                                        continue;
 
-	// Verify inputs
-	if (dim < 2)
-		return SIFT3D_FAILURE;
+                        for (a = 0; a < 4; a++) {
 
-	// Initialize the type
-	affine->tform.type = AFFINE;
+                                const double w_xyz = w_yz * wx[a];
 
-	// Initialize the vtable
-	affine->tform.vtable = &Affine_vtable;
+                                kx = ix + a;
+                                if (kx < 0 || kx >= nx)
+                                        continue;
 
-	// Initialize the matrix
-	if (init_Mat_rm(&affine->A, dim, dim + 1, SIFT3D_DOUBLE, SIFT3D_TRUE))
-		return SIFT3D_FAILURE;
+                                for (m = 0; m < IM_NDIMS; m++) {
+                                        out[m] += w_xyz * 
+                                                BSPLINE_COEF(kx, ky, kz, m);
+                                }
+                        }}}
+                }
 
-	return SIFT3D_SUCCESS;
+apply_Bspline_points_store:
+                BSPLINE_SET(x_out, i, out[0])
+                BSPLINE_SET(y_out, i, out[1])
+                BSPLINE_SET(z_out, i, out[2])
+        }
+
+#undef BSPLINE_GET
+#undef BSPLINE_SET
+#undef BSPLINE_COEF
+
+        if (row_coef != NULL)
+                free(row_coef);
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Deep copy of a tform. Both src and dst must be initialized. */
-int copy_tform(const void *const src, void *const dst)
+/* Apply a displacement field to an [x, y, z] triple. */
+static void apply_Disp_field_xyz(const void *const field, const double x_in, 
+                                 const double y_in, const double z_in, 
+                                 double *const x_out, double *const y_out, 
+                                 double *const z_out)
 {
-	return TFORM_GET_VTABLE(src)->copy(src, dst);
+        // This never allocates, so it cannot fail
+        apply_Disp_field_points(field, SIFT3D_DOUBLE, 1, &x_in, &y_in, &z_in,
+                x_out, y_out, z_out);
 }
 
-/* Deep copy of one Affine to another. Both must be initialized. */
-static int copy_Affine(const void *const src, void *const dst)
+/* Apply a displacement field to a matrix. See apply_Tps_Mat_rm. */
+static int apply_Disp_field_Mat_rm(const void *const field, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out)
 {
 
-	const Affine *const srcAff = src;
-	Affine *const dstAff = dst;
+	const int num_pts = mat_in->num_cols;
 
-	return Affine_set_mat(&srcAff->A, dstAff);
-}
+        // Verify inputs
+        if (mat_in->type != SIFT3D_DOUBLE || mat_in->num_rows < 3) {
+                SIFT3D_ERR("apply_Disp_field_Mat_rm: invalid input matrix \n");
+                return SIFT3D_FAILURE;
+        }
 
-/* Deep copy of one TPS to another. Both must be initialized. */
-static int copy_Tps(const void *const src, void *const dst)
-{
-	SIFT3D_ERR("copy_Tps has not yet been implemented!");
-	return SIFT3D_FAILURE;
-}
+        // Resize the output
+        mat_out->type = SIFT3D_DOUBLE;
+        mat_out->num_rows = 3;
+        mat_out->num_cols = num_pts;
+        if (resize_Mat_rm(mat_out))
+                return SIFT3D_FAILURE;
 
-/* Set an Affine transform to the given matrix.
- * mat is copied. mat must be an n x (n + 1) matrix, where
- * n is the dimensionality of the transformation. */
-int Affine_set_mat(const Mat_rm * const mat, Affine * const affine)
+        // Transform the rows
+        return apply_Disp_field_points(field, SIFT3D_DOUBLE, num_pts, 
+                &SIFT3D_MAT_RM_GET(mat_in, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 2, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 2, 0, double));
+}
+
+/* Apply a displacement field to an array of points. See apply_tform_points.
+ * The displacements are interpolated trilinearly, clamping the points to the
+ * lattice. An empty field is the identity. */
+static int apply_Disp_field_points(const void *const field, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out)
 {
+        int i;
 
-	// Verify inputs
-	if (mat->num_cols != mat->num_rows + 1 || mat->num_rows < 2)
-		return SIFT3D_FAILURE;
+        const Image *const disp = &((const Disp_field *) field)->disp;
 
-	return convert_Mat_rm(mat, &affine->A, SIFT3D_DOUBLE);
-}
+        if (type != SIFT3D_DOUBLE && type != SIFT3D_FLOAT) {
+                SIFT3D_ERR("apply_Disp_field_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
 
-/* Apply an arbitrary transformation to an [x, y, z] triple. */
-void apply_tform_xyz(const void *const tform, const double x_in, 
-                     const double y_in, const double z_in, double *const x_out,
-		     double *const y_out, double *const z_out)
-{
-	TFORM_GET_VTABLE(tform)->apply_xyz(tform, x_in, y_in, z_in,
-					   x_out, y_out, z_out);
+#define DISP_FIELD_GET(arr, i) (type == SIFT3D_DOUBLE ? \
+        ((const double *) (arr))[i] : (double) ((const float *) (arr))[i])
+#define DISP_FIELD_SET(arr, i, val) { \
+        if (type == SIFT3D_DOUBLE) \
+                ((double *) (arr))[i] = (val); \
+        else \
+                ((float *) (arr))[i] = (float) (val); \
 }
 
-/* Apply an Affine transformation to an [x, y, z] triple. */
-static void apply_Affine_xyz(const void *const affine, const double x_in,
-			     const double y_in, const double z_in,
-			     double *const x_out, double *const y_out,
-			     double *const z_out)
-{
+        for (i = 0; i < num; i++) {
 
-	const Affine *const aff = affine;
+                double p[IM_NDIMS], frac[IM_NDIMS], out[IM_NDIMS];
+                size_t off[IM_NDIMS];
+                int d, a, b, c;
 
-	const Mat_rm *const A = &aff->A;
-	assert(AFFINE_GET_DIM(aff) == 3);
-	*x_out = SIFT3D_MAT_RM_GET(A, 0, 0, double) * x_in +
-	    SIFT3D_MAT_RM_GET(A, 0, 1, double) * y_in +
-	    SIFT3D_MAT_RM_GET(A, 0, 2, double) * z_in +
-	    SIFT3D_MAT_RM_GET(A, 0, 3, double);
-	*y_out = SIFT3D_MAT_RM_GET(A, 1, 0, double) * x_in +
-	    SIFT3D_MAT_RM_GET(A, 1, 1, double) * y_in +
-	    SIFT3D_MAT_RM_GET(A, 1, 2, double) * z_in +
-	    SIFT3D_MAT_RM_GET(A, 1, 3, double);
-	*z_out = SIFT3D_MAT_RM_GET(A, 2, 0, double) * x_in +
-	    SIFT3D_MAT_RM_GET(A, 2, 1, double) * y_in +
-	    SIFT3D_MAT_RM_GET(A, 2, 2, double) * z_in +
-	    SIFT3D_MAT_RM_GET(A, 2, 3, double);
+                p[0] = DISP_FIELD_GET(x_in, i);
+                p[1] = DISP_FIELD_GET(y_in, i);
+                p[2] = DISP_FIELD_GET(z_in, i);
+                memcpy(out, p, IM_NDIMS * sizeof(double));
+
+                if (disp->data == NULL)
+                        goto apply_Disp_field_points_store;
+
+                // Clamp to the lattice, and find the lower corner of the cell
+                for (d = 0; d < IM_NDIMS; d++) {
+
+                        const int n = SIFT3D_IM_GET_DIMS(disp)[d];
+                        const double q = SIFT3D_MIN(SIFT3D_MAX(p[d], 0.0), 
+                                (double) (n - 1));
+                        const int lo = SIFT3D_MIN((int) q, SIFT3D_MAX(n - 2, 
+                                0));
+
+                        frac[d] = q - lo;
+                        off[d] = n > 1 ? SIFT3D_IM_GET_STRIDES(disp)[d] : 0;
+                        p[d] = lo;
+                }
+
+                // Interpolate the displacement
+                for (c = 0; c < 2; c++) {
+                for (b = 0; b < 2; b++) {
+                for (a = 0; a < 2; a++) {
+
+                        const double w = (a ? frac[0] : 1.0 - frac[0]) * 
+                                (b ? frac[1] : 1.0 - frac[1]) * 
+                                (c ? frac[2] : 1.0 - frac[2]);
+                        const float *const v = &SIFT3D_IM_GET_VOX(disp, 
+                                (int) p[0], (int) p[1], (int) p[2], 0) + 
+                                a * off[0] + b * off[1] + c * off[2];
+
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                out[d] += w * v[d];
+                        }
+                }}}
+
+apply_Disp_field_points_store:
+                DISP_FIELD_SET(x_out, i, out[0])
+                DISP_FIELD_SET(y_out, i, out[1])
+                DISP_FIELD_SET(z_out, i, out[2])
+        }
+
+#undef DISP_FIELD_GET
+#undef DISP_FIELD_SET
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Apply a thin-plate spline transformation to an [x, y, z] triple. */
-static void apply_Tps_xyz(const void *const tps, const double x_in,
-			  const double y_in, const double z_in,
-			  double *const x_out, double *const y_out,
-			  double *const z_out)
+/* Apply a composite transformation to an [x, y, z] triple. */
+static void apply_Composite_xyz(const void *const comp, const double x_in, 
+                                const double y_in, const double z_in, 
+                                double *const x_out, double *const y_out, 
+                                double *const z_out)
 {
+	const Composite *const c = comp;
+        int i;
 
-	const Tps *const t = tps;
+        *x_out = x_in;
+        *y_out = y_in;
+        *z_out = z_in;
+        for (i = c->num - 1; i >= 0; i--) {
+                apply_tform_xyz(c->tforms[i], *x_out, *y_out, *z_out, x_out, 
+                        y_out, z_out);
+        }
+}
 
-	const Mat_rm *const params = &t->params;
-	const Mat_rm *const kp_src = &t->kp_src;
-	assert(t->dim == 3);
-	int n;
-	int ctrl_pts = kp_src->num_rows;	//number of control points
-	double x_c, y_c, z_c, r_sq, U;
-	double temp_x = 0.0, temp_y = 0.0, temp_z = 0.0;
+/* Apply a composite transformation to a matrix. See apply_Tps_Mat_rm. */
+static int apply_Composite_Mat_rm(const void *const comp, 
+        const Mat_rm * const mat_in, Mat_rm * const mat_out)
+{
 
-	for (n = 0; n < ctrl_pts; n++) {
-		x_c = SIFT3D_MAT_RM_GET(kp_src, n, 0, double);
-		y_c = SIFT3D_MAT_RM_GET(kp_src, n, 1, double);
-		z_c = SIFT3D_MAT_RM_GET(kp_src, n, 2, double);
-		r_sq =
-		    (x_in - x_c) * (x_in - x_c) + (y_in - y_c) * (y_in - y_c) +
-		    (z_in - z_c) * (z_in - z_c);
-		if (r_sq == 0) {
-			U = 0.0;
-		} else {
-			U = r_sq * log(r_sq);
-		}
-		temp_x += U * SIFT3D_MAT_RM_GET(params, 0, n, double);
-		temp_y += U * SIFT3D_MAT_RM_GET(params, 1, n, double);
-		temp_z += U * SIFT3D_MAT_RM_GET(params, 2, n, double);
-	}
+	const int num_pts = mat_in->num_cols;
 
-	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts, double);
-	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 1, double) * x_in;
-	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 2, double) * y_in;
-	temp_x += SIFT3D_MAT_RM_GET(params, 0, ctrl_pts + 3, double) * z_in;
+        // Verify inputs
+        if (mat_in->type != SIFT3D_DOUBLE || mat_in->num_rows < 3) {
+                SIFT3D_ERR("apply_Composite_Mat_rm: invalid input matrix \n");
+                return SIFT3D_FAILURE;
+        }
 
-	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts, double);
-	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 1, double) * x_in;
-	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 2, double) * y_in;
-	temp_y += SIFT3D_MAT_RM_GET(params, 1, ctrl_pts + 3, double) * z_in;
+        // Resize the output
+        mat_out->type = SIFT3D_DOUBLE;
+        mat_out->num_rows = 3;
+        mat_out->num_cols = num_pts;
+        if (resize_Mat_rm(mat_out))
+                return SIFT3D_FAILURE;
 
-	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts, double);
-	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 1, double) * x_in;
-	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 2, double) * y_in;
-	temp_z += SIFT3D_MAT_RM_GET(params, 2, ctrl_pts + 3, double) * z_in;
+        // Transform the rows
+        return apply_Composite_points(comp, SIFT3D_DOUBLE, num_pts, 
+                &SIFT3D_MAT_RM_GET(mat_in, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 2, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 2, 0, double));
+}
+
+/* Apply a composite transformation to an array of points. See 
+ * apply_tform_points. The innermost transformation reads the input, and the
+ * rest transform the output in place. */
+static int apply_Composite_points(const void *const comp, 
+        const Mat_rm_type type, const int num, const void *const x_in, 
+        const void *const y_in, const void *const z_in, void *const x_out, 
+        void *const y_out, void *const z_out)
+{
+        int i;
+
+	const Composite *const c = comp;
 
-	//Save results
-	x_out[0] = temp_x;
-	y_out[0] = temp_y;
-	z_out[0] = temp_z;
+        if (type != SIFT3D_DOUBLE && type != SIFT3D_FLOAT) {
+                SIFT3D_ERR("apply_Composite_points: unsupported type \n");
+                return SIFT3D_FAILURE;
+        }
 
-}
+        // The empty composite is the identity
+        if (c->num == 0) {
 
-/* Apply an arbitrary transform to a matrix. See apply_Affine_Mat_rm for
- * matrix formats. */
-int apply_tform_Mat_rm(const void *const tform, const Mat_rm * const mat_in,
-		       Mat_rm * const mat_out)
-{
-	return TFORM_GET_VTABLE(tform)->apply_Mat_rm(tform, mat_in, mat_out);
-}
+                const size_t size = (size_t) num * (type == SIFT3D_DOUBLE ? 
+                        sizeof(double) : sizeof(float));
 
-/* Apply a spline transformation to a matrix, 
- * by multiplication. See apply_Affine_Mat_rm for format of input matrices
- *
- * All matrices must be initialized with init_Mat_rm prior to use. For 3D!*/
-static int apply_Tps_Mat_rm(const void *const tps, const Mat_rm * const mat_in,
-			    Mat_rm * const mat_out)
-{
+                memmove(x_out, x_in, size);
+                memmove(y_out, y_in, size);
+                memmove(z_out, z_in, size);
+                return SIFT3D_SUCCESS;
+        }
 
-	const Tps *const t = tps;
+        for (i = c->num - 1; i >= 0; i--) {
 
-	//Spline transformation matrix is dim * [number of chosen points+dim+1]
-	//sp_src is [number of chosen points] * dim
-	const Mat_rm *const params = &(t->params);
-	const Mat_rm *const kp_src = &(t->kp_src);
+                const int first = i == c->num - 1;
 
-	int num_pts = mat_in->num_cols;	//number of points to be transformed
-	int ctrl_pts = kp_src->num_rows;	//number of control points
-	int m, n, q;
-	double temp, x, y, z, r_sq, x_c, y_c, z_c;
-	double U[ctrl_pts];
-	//for each point
-	for (q = 0; q < num_pts; q++) {
-		//extract the coordinates
-		x = SIFT3D_MAT_RM_GET(mat_in, 0, q, double);
-		y = SIFT3D_MAT_RM_GET(mat_in, 1, q, double);
-		z = SIFT3D_MAT_RM_GET(mat_in, 2, q, double);
-		//Calculate U function for each control point
-		for (n = 0; n < ctrl_pts; n++) {
-			x_c = SIFT3D_MAT_RM_GET(kp_src, n, 0, double);
-			y_c = SIFT3D_MAT_RM_GET(kp_src, n, 1, double);
-			z_c = SIFT3D_MAT_RM_GET(kp_src, n, 2, double);
-			r_sq =
-			    (x - x_c) * (x - x_c) + (y - y_c) * (y - y_c) + (z -
-									     z_c)
-			    * (z - z_c);
-			if (r_sq == 0) {
-				U[n] = 0.0;
-			} else {
-				U[n] = r_sq * log(r_sq);
-			}
-		}
-		//for each dimension
-		for (m = 0; m < 3; m++) {	//For 3D!
-			temp = 0.0;
-			for (n = 0; n < ctrl_pts; n++) {
-				temp +=
-				    U[n] * SIFT3D_MAT_RM_GET(params, m, n,
-							     double);
-			}
-			temp += SIFT3D_MAT_RM_GET(params, m, ctrl_pts, double);
-			temp +=
-			    SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 1,
-					      double) * x;
-			temp +=
-			    SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 2,
-					      double) * y;
-			temp +=
-			    SIFT3D_MAT_RM_GET(params, m, ctrl_pts + 3,
-					      double) * z;
-
-			//Store results
-			SIFT3D_MAT_RM_GET(mat_out, m, q, double) = temp;
-		}
+                if (apply_tform_points(c->tforms[i], type, num, 
+                        first ? x_in : x_out, first ? y_in : y_out, 
+                        first ? z_in : z_out, x_out, y_out, z_out))
+                        return SIFT3D_FAILURE;
+        }
 
-	}
-	return SIFT3D_SUCCESS;
+        return SIFT3D_SUCCESS;
 }
 
 /* Get the type of a tform. */
@@ -2819,9 +6090,17 @@ size_t tform_type_get_size(const tform_type type)
 {
 	switch (type) {
 	case AFFINE:
+	case RIGID:
+	case SIMILARITY:
 		return Affine_vtable.get_size();
 	case TPS:
 		return Tps_vtable.get_size();
+	case BSPLINE_FFD:
+		return Bspline_vtable.get_size();
+	case DISPLACEMENT_FIELD:
+		return Disp_field_vtable.get_size();
+	case COMPOSITE:
+		return Composite_vtable.get_size();
 	default:
 		SIFT3D_ERR("tform_type_get_size: unrecognized " "type \n");
 		return 0;
@@ -2840,7 +6119,26 @@ static size_t Tps_get_size(void)
 	return sizeof(Tps);
 }
 
-/* Write a tform to a file. */
+/* Returns the size of a Bspline struct */
+static size_t Bspline_get_size(void)
+{
+	return sizeof(Bspline);
+}
+
+/* Returns the size of a Disp_field struct */
+static size_t Disp_field_get_size(void)
+{
+	return sizeof(Disp_field);
+}
+
+/* Returns the size of a Composite struct */
+static size_t Composite_get_size(void)
+{
+	return sizeof(Composite);
+}
+
+/* Write a tform to a file. Composite transformations write each member to
+ * a file of its own, alongside path. See write_Composite. */
 int write_tform(const char *path, const void *const tform)
 {
 	return TFORM_GET_VTABLE(tform)->write(path, tform);
@@ -2855,14 +6153,414 @@ static int write_Affine(const char *path, const void *const tform)
 	return write_Mat_rm(path, &affine->A);
 }
 
-/* Write a thin-plate spline transformation to a file. */
+/* Write a thin-plate spline transformation to a file. The file holds a 
+ * matrix with dim columns. The first rows hold the num_ctrl control points,
+ * and the rest the transpose of the parameters. */
 static int write_Tps(const char *path, const void *const tform)
 {
-SIFT3D_IGNORE_UNUSED
+        Mat_rm mat;
+        int i, j, ret;
+
 	const Tps *const tps = tform;
+        const int dim = tps->dim;
+        const int num_ctrl = tps->kp_src.num_rows;
+        const int num_terms = tps->params.num_cols;
 
-	SIFT3D_ERR("write_Tps: this function has not yet been implemented.");
-	return SIFT3D_FAILURE;
+        if (init_Mat_rm(&mat, num_ctrl + num_terms, dim, SIFT3D_DOUBLE, 
+                SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        for (j = 0; j < dim; j++) {
+                for (i = 0; i < num_ctrl; i++) {
+                        SIFT3D_MAT_RM_GET(&mat, i, j, double) = 
+                                SIFT3D_MAT_RM_GET(&tps->kp_src, i, j, double);
+                }
+                for (i = 0; i < num_terms; i++) {
+                        SIFT3D_MAT_RM_GET(&mat, i + num_ctrl, j, double) = 
+                                SIFT3D_MAT_RM_GET(&tps->params, j, i, double);
+                }
+        }
+
+        ret = write_Mat_rm_text(path, &mat, SIFT3D_TRUE);
+        cleanup_Mat_rm(&mat);
+        return ret;
+}
+
+/* Write a B-spline free-form deformation to a file. The file holds a matrix 
+ * with three columns. The first row holds the lattice dimensions, the second
+ * the spacing, the next four the transpose of the affine part, and the rest 
+ * the control point displacements, x fastest. */
+static int write_Bspline(const char *path, const void *const tform)
+{
+        Mat_rm mat;
+        int i, j, ret;
+
+	const Bspline *const bspline = tform;
+        const int num_ctrl = bspline->coef.num_rows;
+
+        if (init_Mat_rm(&mat, num_ctrl + IM_NDIMS + 3, IM_NDIMS, 
+                SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        for (j = 0; j < IM_NDIMS; j++) {
+                SIFT3D_MAT_RM_GET(&mat, 0, j, double) = bspline->dims[j];
+                SIFT3D_MAT_RM_GET(&mat, 1, j, double) = bspline->spacing[j];
+                for (i = 0; i <= IM_NDIMS; i++) {
+                        SIFT3D_MAT_RM_GET(&mat, i + 2, j, double) = 
+                                SIFT3D_MAT_RM_GET(&bspline->A, j, i, double);
+                }
+        }
+        for (i = 0; i < num_ctrl; i++) {
+                for (j = 0; j < IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(&mat, i + IM_NDIMS + 3, j, double) =
+                                SIFT3D_MAT_RM_GET(&bspline->coef, i, j, 
+                                        double);
+                }
+        }
+
+        ret = write_Mat_rm_text(path, &mat, SIFT3D_TRUE);
+        cleanup_Mat_rm(&mat);
+        return ret;
+}
+
+/* Write a displacement field to a file. The file holds a matrix with three 
+ * columns. The first row holds the lattice dimensions, and the rest the 
+ * displacements, x fastest. */
+static int write_Disp_field(const char *path, const void *const tform)
+{
+        Mat_rm mat;
+        int x, y, z, j, ret;
+
+	const Image *const disp = &((const Disp_field *) tform)->disp;
+        const int empty = disp->data == NULL;
+        const int num_vox = empty ? 0 : disp->nx * disp->ny * disp->nz;
+
+        if (init_Mat_rm(&mat, num_vox + 1, IM_NDIMS, SIFT3D_DOUBLE, 
+                SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        for (j = 0; j < IM_NDIMS; j++) {
+                SIFT3D_MAT_RM_GET(&mat, 0, j, double) = empty ? 0 : 
+                        SIFT3D_IM_GET_DIMS(disp)[j];
+        }
+        if (!empty) {
+                SIFT3D_IM_LOOP_START(disp, x, y, z)
+                        const int row = 1 + x + disp->nx * (y + disp->ny * z);
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                SIFT3D_MAT_RM_GET(&mat, row, j, double) = 
+                                        SIFT3D_IM_GET_VOX(disp, x, y, z, j);
+                        }
+                SIFT3D_IM_LOOP_END
+        }
+
+        ret = write_Mat_rm_text(path, &mat, SIFT3D_TRUE);
+        cleanup_Mat_rm(&mat);
+        return ret;
+}
+
+/* Helper function to get the path of member i of a composite 
+ * transformation stored at path, by inserting "_i" before the extension, 
+ * e.g. "tform.csv.gz" becomes "tform_0.csv.gz". The result must later be 
+ * freed. */
+static char *composite_member_path(const char *path, const int i)
+{
+        const char *name, *dot;
+        char *member;
+        size_t len;
+
+        // Find the extension, skipping a leading dot in the file name
+        name = get_file_name(path);
+        dot = *name == '\0' ? NULL : strchr(name + 1, '.');
+        if (dot == NULL)
+                dot = path + strlen(path);
+
+        len = strlen(path) + 16;
+        if ((member = malloc(len)) == NULL)
+                return NULL;
+        snprintf(member, len, "%.*s_%d%s", (int) (dot - path), path, i, dot);
+
+        return member;
+}
+
+/* Write a composite transformation to a file. The file holds a column 
+ * vector with the number of members, followed by their types. Each member is
+ * written with write_tform to a file of its own, named as in 
+ * composite_member_path. */
+static int write_Composite(const char *path, const void *const tform)
+{
+        Mat_rm mat;
+        char *member;
+        int i, ret;
+
+	const Composite *const comp = tform;
+
+        if (init_Mat_rm(&mat, comp->num + 1, 1, SIFT3D_INT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        // Write the types of the members
+        SIFT3D_MAT_RM_GET(&mat, 0, 0, int) = comp->num;
+        for (i = 0; i < comp->num; i++) {
+                SIFT3D_MAT_RM_GET(&mat, i + 1, 0, int) = 
+                        (int) tform_get_type(comp->tforms[i]);
+        }
+        ret = write_Mat_rm(path, &mat);
+        cleanup_Mat_rm(&mat);
+
+        // Write the members
+        for (i = 0; i < comp->num && !ret; i++) {
+                if ((member = composite_member_path(path, i)) == NULL)
+                        return SIFT3D_FAILURE;
+                ret = write_tform(member, comp->tforms[i]);
+                free(member);
+        }
+
+        return ret ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* Read a tform from a file written by write_tform. The tform must be 
+ * initialized to the type stored in the file, e.g. with init_tform. */
+int read_tform(const char *path, void *const tform)
+{
+	return TFORM_GET_VTABLE(tform)->read(path, tform);
+}
+
+/* Read an affine transformation from a file. */
+static int read_Affine(const char *path, void *const tform)
+{
+        Mat_rm A;
+        int ret;
+
+        if (init_Mat_rm(&A, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        ret = read_Mat_rm(path, &A) || Affine_set_mat(&A, (Affine *) tform);
+
+        cleanup_Mat_rm(&A);
+        return ret ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* Read a thin-plate spline transformation from a file. See write_Tps. */
+static int read_Tps(const char *path, void *const tform)
+{
+        Mat_rm mat;
+        int i, j, dim, num_ctrl;
+
+	Tps *const tps = tform;
+
+        if (init_Mat_rm(&mat, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        if (read_Mat_rm(path, &mat))
+                goto read_Tps_quit;
+
+        // Verify the dimensions
+        dim = mat.num_cols;
+        if (dim < 2 || mat.num_rows < dim + 1 || 
+                (mat.num_rows - dim - 1) % 2)
+                goto read_Tps_format;
+        num_ctrl = (mat.num_rows - dim - 1) / 2;
+
+        // Copy the data
+        if (resize_Tps(tps, num_ctrl, dim))
+                goto read_Tps_quit;
+        for (j = 0; j < dim; j++) {
+                for (i = 0; i < num_ctrl; i++) {
+                        SIFT3D_MAT_RM_GET(&tps->kp_src, i, j, double) = 
+                                SIFT3D_MAT_RM_GET(&mat, i, j, double);
+                }
+                for (i = 0; i < tps->params.num_cols; i++) {
+                        SIFT3D_MAT_RM_GET(&tps->params, j, i, double) = 
+                                SIFT3D_MAT_RM_GET(&mat, i + num_ctrl, j, 
+                                        double);
+                }
+        }
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_Tps_format:
+        SIFT3D_ERR("read_Tps: invalid file %s \n", path);
+read_Tps_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
+/* Read a B-spline free-form deformation from a file. See write_Bspline. */
+static int read_Bspline(const char *path, void *const tform)
+{
+        Mat_rm mat;
+        int i, j, nx, ny, nz;
+
+	Bspline *const bspline = tform;
+
+        if (init_Mat_rm(&mat, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        if (read_Mat_rm(path, &mat))
+                goto read_Bspline_quit;
+
+        // Verify the dimensions
+        if (mat.num_cols != IM_NDIMS || mat.num_rows < IM_NDIMS + 3)
+                goto read_Bspline_format;
+        nx = (int) SIFT3D_MAT_RM_GET(&mat, 0, 0, double);
+        ny = (int) SIFT3D_MAT_RM_GET(&mat, 0, 1, double);
+        nz = (int) SIFT3D_MAT_RM_GET(&mat, 0, 2, double);
+        if (nx < 0 || ny < 0 || nz < 0 || 
+                (long) nx * ny * nz != mat.num_rows - IM_NDIMS - 3)
+                goto read_Bspline_format;
+        for (j = 0; j < IM_NDIMS; j++) {
+                if (SIFT3D_MAT_RM_GET(&mat, 1, j, double) <= 0.0)
+                        goto read_Bspline_format;
+        }
+
+        // Copy the data
+        if (resize_Bspline(bspline, nx, ny, nz, 1.0))
+                goto read_Bspline_quit;
+        for (j = 0; j < IM_NDIMS; j++) {
+                bspline->spacing[j] = SIFT3D_MAT_RM_GET(&mat, 1, j, double);
+                for (i = 0; i <= IM_NDIMS; i++) {
+                        SIFT3D_MAT_RM_GET(&bspline->A, j, i, double) =
+                                SIFT3D_MAT_RM_GET(&mat, i + 2, j, double);
+                }
+        }
+        for (i = 0; i < bspline->coef.num_rows; i++) {
+                for (j = 0; j < IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(&bspline->coef, i, j, double) =
+                                SIFT3D_MAT_RM_GET(&mat, i + IM_NDIMS + 3, j,
+                                        double);
+                }
+        }
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_Bspline_format:
+        SIFT3D_ERR("read_Bspline: invalid file %s \n", path);
+read_Bspline_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
+/* Read a displacement field from a file. See write_Disp_field. */
+static int read_Disp_field(const char *path, void *const tform)
+{
+        Mat_rm mat;
+        int x, y, z, j, nx, ny, nz;
+
+	Image *const disp = &((Disp_field *) tform)->disp;
+
+        if (init_Mat_rm(&mat, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        if (read_Mat_rm(path, &mat))
+                goto read_Disp_field_quit;
+
+        // Verify the dimensions
+        if (mat.num_cols != IM_NDIMS || mat.num_rows < 1)
+                goto read_Disp_field_format;
+        nx = (int) SIFT3D_MAT_RM_GET(&mat, 0, 0, double);
+        ny = (int) SIFT3D_MAT_RM_GET(&mat, 0, 1, double);
+        nz = (int) SIFT3D_MAT_RM_GET(&mat, 0, 2, double);
+        if (nx < 0 || ny < 0 || nz < 0 || 
+                (long) nx * ny * nz != mat.num_rows - 1)
+                goto read_Disp_field_format;
+
+        // Copy the data
+        im_free(disp);
+        init_im(disp);
+        disp->nc = IM_NDIMS;
+        if (mat.num_rows > 1) {
+                disp->nx = nx;
+                disp->ny = ny;
+                disp->nz = nz;
+                im_default_stride(disp);
+                if (im_resize(disp))
+                        goto read_Disp_field_quit;
+                SIFT3D_IM_LOOP_START(disp, x, y, z)
+                        const int row = 1 + x + nx * (y + ny * z);
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                SIFT3D_IM_GET_VOX(disp, x, y, z, j) = (float)
+                                        SIFT3D_MAT_RM_GET(&mat, row, j, 
+                                                double);
+                        }
+                SIFT3D_IM_LOOP_END
+        }
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_Disp_field_format:
+        SIFT3D_ERR("read_Disp_field: invalid file %s \n", path);
+read_Disp_field_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
+/* Read a composite transformation from a file, replacing its members. See
+ * write_Composite. */
+static int read_Composite(const char *path, void *const tform)
+{
+        Mat_rm mat;
+        char *member;
+        int i, num, ret;
+
+	Composite *const comp = tform;
+
+        if (init_Mat_rm(&mat, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        if (read_Mat_rm(path, &mat))
+                goto read_Composite_quit;
+
+        // Verify the dimensions
+        if (mat.num_cols != 1 || mat.num_rows < 1)
+                goto read_Composite_format;
+        num = (int) SIFT3D_MAT_RM_GET(&mat, 0, 0, double);
+        if (num != mat.num_rows - 1)
+                goto read_Composite_format;
+
+        // Remove the existing members
+        cleanup_Composite(comp);
+        if (num > 0 && (comp->tforms = calloc(num, sizeof(void *))) == NULL)
+                goto read_Composite_quit;
+
+        // Read the members
+        for (i = 0; i < num; i++) {
+
+                void *memb;
+
+                const double type = SIFT3D_MAT_RM_GET(&mat, i + 1, 0, double);
+
+                // Members are never composites, as these are flattened
+                if (type != (int) type || type < AFFINE || type >= COMPOSITE)
+                        goto read_Composite_format;
+
+                if ((memb = malloc(tform_type_get_size((tform_type) type))) ==
+                        NULL)
+                        goto read_Composite_quit;
+                if (init_tform(memb, (tform_type) type)) {
+                        free(memb);
+                        goto read_Composite_quit;
+                }
+                comp->tforms[comp->num++] = memb;
+
+                if ((member = composite_member_path(path, i)) == NULL)
+                        goto read_Composite_quit;
+                ret = read_tform(member, memb);
+                free(member);
+                if (ret)
+                        goto read_Composite_quit;
+        }
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_Composite_format:
+        SIFT3D_ERR("read_Composite: invalid file %s \n", path);
+read_Composite_quit:
+        cleanup_Mat_rm(&mat);
+        cleanup_Composite(comp);
+        return SIFT3D_FAILURE;
 }
 
 /* Free the memory associated with a tform */
@@ -2890,6 +6588,39 @@ static void cleanup_Tps(void *const tps)
 	cleanup_Mat_rm(&t->kp_src);
 }
 
+/* Free the memory associated with a B-spline free-form deformation. */
+static void cleanup_Bspline(void *const bspline)
+{
+
+	Bspline *const b = bspline;
+
+	cleanup_Mat_rm(&b->A);
+	cleanup_Mat_rm(&b->coef);
+}
+
+/* Free the memory associated with a displacement field. */
+static void cleanup_Disp_field(void *const field)
+{
+	im_free(&((Disp_field *) field)->disp);
+}
+
+/* Free the memory associated with a composite transformation, including its
+ * members. */
+static void cleanup_Composite(void *const comp)
+{
+	Composite *const c = comp;
+        int i;
+
+        for (i = 0; i < c->num; i++) {
+                cleanup_tform(c->tforms[i]);
+                free(c->tforms[i]);
+        }
+        if (c->tforms != NULL)
+                free(c->tforms);
+        c->tforms = NULL;
+        c->num = 0;
+}
+
 /* Apply an Affine transformation to a matrix, by multiplication. The format
  * of Mat_in should be:
  * [x1 x2 ... xN
@@ -2911,7 +6642,29 @@ static int apply_Affine_Mat_rm(const void *const affine,
 
 	const Affine *const aff = affine;
 
-	return mul_Mat_rm(&aff->A, mat_in, mat_out);
+        const int num_pts = mat_in->num_cols;
+
+        // Use the general multiplication, unless this is a 3D transformation
+        // of a distinct double matrix
+        if (AFFINE_GET_DIM(aff) != 3 || mat_in->type != SIFT3D_DOUBLE ||
+                mat_in->num_rows != 4 || mat_in == mat_out)
+	        return mul_Mat_rm(&aff->A, mat_in, mat_out);
+
+        // Resize the output
+        mat_out->type = SIFT3D_DOUBLE;
+        mat_out->num_rows = 3;
+        mat_out->num_cols = num_pts;
+        if (resize_Mat_rm(mat_out))
+                return SIFT3D_FAILURE;
+
+        // The rows are the coordinate arrays
+        return apply_Affine_points(affine, SIFT3D_DOUBLE, num_pts, 
+                &SIFT3D_MAT_RM_GET(mat_in, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_in, 2, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 0, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 1, 0, double),
+                &SIFT3D_MAT_RM_GET(mat_out, 2, 0, double));
 }
 
 /* Computes mat_in1 * mat_in2 = mat_out. mat_out will be resized
@@ -3633,6 +7386,8 @@ void init_im(Image *const im)
 {
 	im->data = NULL;
 	im->cl_valid = SIFT3D_FALSE;
+        im->map = NULL;
+        im->map_size = 0;
 
 	im->ux = 1;
 	im->uy = 1;
@@ -4224,46 +7979,172 @@ int init_Tps(Tps * tps, int dim, int terms)
 	if (init_Mat_rm(&tps->params, dim, terms, SIFT3D_DOUBLE, SIFT3D_TRUE))
 		return SIFT3D_FAILURE;
 
-	if (init_Mat_rm(&tps->kp_src, terms - dim - 1, dim,
-			SIFT3D_DOUBLE, SIFT3D_TRUE))
-		return SIFT3D_FAILURE;
+	if (init_Mat_rm(&tps->kp_src, terms - dim - 1, dim,
+			SIFT3D_DOUBLE, SIFT3D_TRUE))
+		return SIFT3D_FAILURE;
+
+	tps->dim = dim;
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize a RANSAC struct with the default parameters */
+void init_Ransac(Ransac *const ran)
+{
+	ran->err_thresh = SIFT3D_err_thresh_default;
+	ran->num_iter = SIFT3D_num_iter_default;
+	ran->seed = SIFT3D_seed_default;
+	ran->conf = SIFT3D_conf_default;
+	ran->prosac = SIFT3D_FALSE;
+	ran->tdd = SIFT3D_tdd_default;
+	ran->tps_ctrl = SIFT3D_tps_ctrl_default;
+	ran->tps_lambda = SIFT3D_tps_lambda_default;
+	ran->ffd_spacing = SIFT3D_ffd_spacing_default;
+	ran->ffd_lambda = SIFT3D_ffd_lambda_default;
+}
+
+/* Set the err_thresh parameter in a Ransac struct, checking for validity. */
+int set_err_thresh_Ransac(Ransac *const ran, double err_thresh)
+{
+
+	if (err_thresh < 0.0) {
+		SIFT3D_ERR("set_err_thresh_Ransac: invalid error "
+			"threshold: %f \n", err_thresh);
+		return SIFT3D_FAILURE;
+	}
+
+	ran->err_thresh = err_thresh;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Set the num_iter parameter in a Ransac struct. */
+int set_num_iter_Ransac(Ransac *const ran, int num_iter)
+{
+        if (num_iter < 1) {
+                SIFT3D_ERR("set_num_iter_Ransac: invalid number of "
+                                "iterations: %d \n", num_iter);
+                return SIFT3D_FAILURE;
+        }
+
+	ran->num_iter = num_iter;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the random seed in a Ransac struct. The same seed always yields the 
+ * same result, regardless of the number of threads. */
+int set_seed_Ransac(Ransac *const ran, const uint64_t seed)
+{
+        ran->seed = seed;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the conf parameter in a Ransac struct, checking for validity. RANSAC 
+ * stops once the best model has been found with this probability, or after
+ * num_iter iterations. A value of 1, the default, always runs all num_iter 
+ * iterations. */
+int set_conf_Ransac(Ransac *const ran, const double conf)
+{
+        if (conf <= 0.0 || conf > 1.0) {
+                SIFT3D_ERR("set_conf_Ransac: invalid confidence: %f \n", 
+                        conf);
+                return SIFT3D_FAILURE;
+        }
+
+        ran->conf = conf;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the prosac parameter in a Ransac struct. If true, find_tform_ransac
+ * assumes the correspondences are sorted from best to worst, and samples
+ * progressively from the best ones (PROSAC). */
+int set_prosac_Ransac(Ransac *const ran, const int prosac)
+{
+        ran->prosac = prosac ? SIFT3D_TRUE : SIFT3D_FALSE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the tdd parameter in a Ransac struct, checking for validity. If 
+ * positive, each RANSAC hypothesis is first tested on tdd random points, and
+ * only scored in full if all of them are inliers. Zero disables the test. */
+int set_tdd_Ransac(Ransac *const ran, const int tdd)
+{
+        if (tdd < 0) {
+                SIFT3D_ERR("set_tdd_Ransac: invalid number of "
+                        "pre-verification points: %d \n", tdd);
+                return SIFT3D_FAILURE;
+        }
+
+        ran->tdd = tdd;
 
-	tps->dim = dim;
-	return SIFT3D_SUCCESS;
+        return SIFT3D_SUCCESS;
 }
 
-/* Initialize a RANSAC struct with the default parameters */
-void init_Ransac(Ransac *const ran)
+/* Set the tps_ctrl parameter in a Ransac struct, checking for validity. This 
+ * is the maximum number of control points of a thin-plate spline fitted to 
+ * the consensus set. See fit_Tps. */
+int set_tps_ctrl_Ransac(Ransac *const ran, const int tps_ctrl)
 {
-	ran->err_thresh = SIFT3D_err_thresh_default;
-	ran->num_iter = SIFT3D_num_iter_default;
+        if (tps_ctrl < 1) {
+                SIFT3D_ERR("set_tps_ctrl_Ransac: invalid number of control "
+                        "points: %d \n", tps_ctrl);
+                return SIFT3D_FAILURE;
+        }
+
+        ran->tps_ctrl = tps_ctrl;
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Set the err_thresh parameter in a Ransac struct, checking for validity. */
-int set_err_thresh_Ransac(Ransac *const ran, double err_thresh)
+/* Set the tps_lambda parameter in a Ransac struct, checking for validity. 
+ * This is the smoothing weight of a thin-plate spline fitted to the 
+ * consensus set. See fit_Tps. */
+int set_tps_lambda_Ransac(Ransac *const ran, const double tps_lambda)
 {
+        if (tps_lambda < 0.0) {
+                SIFT3D_ERR("set_tps_lambda_Ransac: invalid smoothing weight: "
+                        "%f \n", tps_lambda);
+                return SIFT3D_FAILURE;
+        }
 
-	if (err_thresh < 0.0) {
-		SIFT3D_ERR("set_err_thresh_Ransac: invalid error "
-			"threshold: %f \n", err_thresh);
-		return SIFT3D_FAILURE;
-	}
+        ran->tps_lambda = tps_lambda;
 
-	ran->err_thresh = err_thresh;
+        return SIFT3D_SUCCESS;
+}
 
-	return SIFT3D_SUCCESS;
+/* Set the ffd_spacing parameter in a Ransac struct, checking for validity.
+ * This is the control point spacing of a B-spline free-form deformation 
+ * fitted to the consensus set, in the units of the matches. register_SIFT3D 
+ * runs RANSAC on matches in mm, so there the spacing is in mm. See 
+ * fit_Bspline. */
+int set_ffd_spacing_Ransac(Ransac *const ran, const double ffd_spacing)
+{
+        if (ffd_spacing <= 0.0) {
+                SIFT3D_ERR("set_ffd_spacing_Ransac: invalid spacing: %f \n",
+                        ffd_spacing);
+                return SIFT3D_FAILURE;
+        }
+
+        ran->ffd_spacing = ffd_spacing;
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Set the num_iter parameter in a Ransac struct. */
-int set_num_iter_Ransac(Ransac *const ran, int num_iter)
+/* Set the ffd_lambda parameter in a Ransac struct, checking for validity.
+ * This is the smoothing weight of a B-spline free-form deformation fitted 
+ * to the consensus set. See fit_Bspline. */
+int set_ffd_lambda_Ransac(Ransac *const ran, const double ffd_lambda)
 {
-        if (num_iter < 1) {
-                SIFT3D_ERR("set_num_iter_Ransac: invalid number of "
-                                "iterations: %d \n", num_iter);
+        if (ffd_lambda <= 0.0) {
+                SIFT3D_ERR("set_ffd_lambda_Ransac: invalid smoothing weight: "
+                        "%f \n", ffd_lambda);
                 return SIFT3D_FAILURE;
         }
 
-	ran->num_iter = num_iter;
+        ran->ffd_lambda = ffd_lambda;
 
         return SIFT3D_SUCCESS;
 }
@@ -4271,56 +8152,198 @@ int set_num_iter_Ransac(Ransac *const ran, int num_iter)
 /* Copy a Ransac struct from src to dst. */
 int copy_Ransac(const Ransac *const src, Ransac *const dst) {
         return set_num_iter_Ransac(dst, src->num_iter) ||
-                set_err_thresh_Ransac(dst, src->err_thresh);
-}
-
-/* Returns an array of k integers, (uniformly) randomly chosen from the 
- * integers 0 through n - 1.
+                set_err_thresh_Ransac(dst, src->err_thresh) ||
+                set_seed_Ransac(dst, src->seed) ||
+                set_conf_Ransac(dst, src->conf) ||
+                set_prosac_Ransac(dst, src->prosac) ||
+                set_tdd_Ransac(dst, src->tdd) ||
+                set_tps_ctrl_Ransac(dst, src->tps_ctrl) ||
+                set_tps_lambda_Ransac(dst, src->tps_lambda) ||
+                set_ffd_spacing_Ransac(dst, src->ffd_spacing) ||
+                set_ffd_lambda_Ransac(dst, src->ffd_lambda);
+}
+
+/* Initialize a RANSAC workspace from the [mx3] src and ref matrices. The 
+ * coordinates are copied into structure-of-arrays layout, so that the 
+ * residuals of a hypothesis can be scored in vectorized batches. All memory
+ * needed by the RANSAC iterations is allocated here, once per run.
  *
- * The value of *ret must either be NULL, or a pointer to a previously
- * allocated block. On successful return, *ret contains the k random integers.
+ * The type of the model determines the size of the minimal samples: 
+ * IM_NDIMS + 1 points for AFFINE, and IM_NDIMS for RIGID and SIMILARITY.
  *
- * Returns SIFT3D_SUCCESS on succes, SIFT3D_FAILURE otherwise. */
-static int n_choose_k(const int n, const int k, int **ret) {
+ * If ran->prosac is set, this also computes the PROSAC growth schedule:
+ * prosac_iter[n] is the last iteration (1-based) whose sample is drawn from 
+ * the first n points, following Chum and Matas, "Matching with PROSAC - 
+ * progressive sample consensus", CVPR 2005. The schedule is scaled so that
+ * the samples reach all of the points after ran->num_iter iterations.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int init_Ransac_ws(const Ransac *const ran, const tform_type type,
+        const Mat_rm *const src, const Mat_rm *const ref, Ransac_ws *const ws)
+{
+        int i, j;
 
-        int i;
+        const int num_pts = src->num_rows;
+        const int k = type == AFFINE ? IM_NDIMS + 1 : IM_NDIMS;
 
-        // Verify inputs
-        if (n < k || k < 1)
-                goto n_choose_k_fail;
+        ws->buf = NULL;
+        ws->cset = NULL;
+        ws->prosac_iter = NULL;
+        ws->type = type;
+        ws->num_sample = k;
+        ws->num_pts = num_pts;
 
-        // Allocate the array of n elements
-        if ((*ret = malloc(n * sizeof(int))) == NULL)
-                goto n_choose_k_fail;
+        // Verify inputs
+	if (src->type != SIFT3D_DOUBLE || src->type != ref->type) {
+		SIFT3D_ERR("init_Ransac_ws: all matrices must have type "
+                        "double \n");
+		return SIFT3D_FAILURE;
+	}
+	if (src->num_rows != ref->num_rows || src->num_cols != ref->num_cols) {
+		SIFT3D_ERR("init_Ransac_ws: src and ref must have the same "
+                        "dimensions \n");
+		return SIFT3D_FAILURE;
+	}
+        if (src->num_cols != IM_NDIMS) {
+		SIFT3D_ERR("init_Ransac_ws: points must have %d "
+                        "dimensions \n", IM_NDIMS);
+		return SIFT3D_FAILURE;
+        }
 
-        // Initialize the array of indices
-        for (i = 0; i < n; i++) {
-                (*ret)[i] = i;
+        // Allocate memory
+        if ((ws->buf = malloc(2 * IM_NDIMS * (size_t) num_pts * 
+                sizeof(double))) == NULL ||
+                (ws->cset = malloc(SIFT3D_MAX(num_pts, 1) * 
+                sizeof(int))) == NULL) {
+                cleanup_Ransac_ws(ws);
+                return SIFT3D_FAILURE;
         }
 
-        // Randomize the first k indices using Knuth shuffles
-        for (i = 0; i < k; i++) {
+        // Compute the PROSAC schedule
+        if (ran->prosac && num_pts >= k) {
+
+                double T_n;
+                int n;
+
+                if ((ws->prosac_iter = malloc((num_pts + 1) * 
+                        sizeof(int))) == NULL) {
+                        cleanup_Ransac_ws(ws);
+                        return SIFT3D_FAILURE;
+                }
 
-                int *const ints = *ret;
-                const int temp = ints[i]; 
-                const int rand_idx = i + rand() % (n - i);
+                // T_n is the expected number of samples drawn from the first
+                // n points, out of num_iter samples drawn from all of them
+                T_n = (double) ran->num_iter;
+                for (i = 0; i < k; i++) {
+                        T_n *= (double) (k - i) / (double) (num_pts - i);
+                }
 
-                ints[i] = ints[rand_idx];
-                ints[rand_idx] = temp;
+                ws->prosac_iter[k] = 1;
+                for (n = k; n < num_pts; n++) {
+                        const double T_next = T_n * (double) (n + 1) / 
+                                (double) (n + 1 - k);
+                        ws->prosac_iter[n + 1] = ws->prosac_iter[n] + 
+                                (int) ceil(T_next - T_n);
+                        T_n = T_next;
+                }
         }
 
-        // Release unused memory
-        if ((*ret = SIFT3D_safe_realloc(*ret, k * sizeof(int))) == NULL)
-                goto n_choose_k_fail;
+        // Transpose the points
+        for (j = 0; j < IM_NDIMS; j++) {
+                ws->src[j] = ws->buf + (size_t) j * num_pts;
+                ws->ref[j] = ws->buf + (size_t) (IM_NDIMS + j) * num_pts;
+        }
+        for (i = 0; i < num_pts; i++) {
+                for (j = 0; j < IM_NDIMS; j++) {
+                        ws->src[j][i] = SIFT3D_MAT_RM_GET(src, i, j, double);
+                        ws->ref[j][i] = SIFT3D_MAT_RM_GET(ref, i, j, double);
+                }
+        }
 
         return SIFT3D_SUCCESS;
+}
+
+/* Release the memory held by a RANSAC workspace. */
+static void cleanup_Ransac_ws(Ransac_ws *const ws)
+{
+        if (ws->buf != NULL)
+                free(ws->buf);
+        if (ws->cset != NULL)
+                free(ws->cset);
+        if (ws->prosac_iter != NULL)
+                free(ws->prosac_iter);
+        ws->buf = NULL;
+        ws->cset = NULL;
+        ws->prosac_iter = NULL;
+}
+
+/* Advance a splitmix64 state, returning the next output. Used to seed the
+ * RANSAC streams. */
+static uint64_t splitmix64(uint64_t *const x)
+{
+        uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+}
+
+/* Seed the generator for the given stream, e.g. the RANSAC iteration 
+ * index. */
+static void seed_Ransac_rng(Ransac_rng *const rng, const uint64_t seed,
+        const uint64_t stream)
+{
+        uint64_t x;
+        int i;
 
-n_choose_k_fail:
-        if (*ret != NULL) {
-                free(*ret);
-                *ret = NULL;
+        x = stream;
+        x = seed ^ splitmix64(&x);
+        for (i = 0; i < 4; i++) {
+                rng->s[i] = splitmix64(&x);
+        }
+}
+
+/* Return the next 64 random bits from a generator. */
+static uint64_t next_Ransac_rng(Ransac_rng *const rng)
+{
+        uint64_t *const s = rng->s;
+        const uint64_t x = s[1] * 5;
+        const uint64_t result = ((x << 7) | (x >> 57)) * 9;
+        const uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = (s[3] << 45) | (s[3] >> 19);
+
+        return result;
+}
+
+/* Return a random integer, (uniformly) from 0 through n - 1. */
+static int rand_int_Ransac_rng(Ransac_rng *const rng, const int n)
+{
+        return (int) (((next_Ransac_rng(rng) >> 32) * (uint64_t) n) >> 32);
+}
+
+/* Draw k distinct integers, (uniformly) at random, from 0 through n - 1, 
+ * storing them in idx. Since k is the size of a minimal sample, duplicates are
+ * simply redrawn, which takes O(k) draws in expectation when k << n. Requires
+ * 1 <= k <= n. */
+static void ransac_sample(Ransac_rng *const rng, const int n, const int k, 
+        int *const idx)
+{
+        int i, j;
+
+        for (i = 0; i < k; i++) {
+redraw:
+                idx[i] = rand_int_Ransac_rng(rng, n);
+                for (j = 0; j < i; j++) {
+                        if (idx[j] == idx[i])
+                                goto redraw;
+                }
         }
-        return SIFT3D_FAILURE;
 }
 
 //make the system matrix for spline
@@ -4398,82 +8421,697 @@ static int make_spline_matrix(Mat_rm * src, Mat_rm * src_in, Mat_rm * sp_src,
 			break;
 		}
 
-		//construct sp_src matrix(matrix that stores control points)
-		switch (dim) {
-		case 2:
-			SIFT3D_MAT_RM_GET(sp_src, i, 0, double) = x;
-			SIFT3D_MAT_RM_GET(sp_src, i, 1, double) = y;
-			break;
-		case 3:
-			SIFT3D_MAT_RM_GET(sp_src, i, 0, double) = x;
-			SIFT3D_MAT_RM_GET(sp_src, i, 1, double) = y;
-			SIFT3D_MAT_RM_GET(sp_src, i, 2, double) = z;
-			break;
-		}
+		//construct sp_src matrix(matrix that stores control points)
+		switch (dim) {
+		case 2:
+			SIFT3D_MAT_RM_GET(sp_src, i, 0, double) = x;
+			SIFT3D_MAT_RM_GET(sp_src, i, 1, double) = y;
+			break;
+		case 3:
+			SIFT3D_MAT_RM_GET(sp_src, i, 0, double) = x;
+			SIFT3D_MAT_RM_GET(sp_src, i, 1, double) = y;
+			SIFT3D_MAT_RM_GET(sp_src, i, 2, double) = z;
+			break;
+		}
+
+	}
+
+	//construct O
+	for (i = 0; i < dim; i++) {
+		for (d = 0; d < dim; d++) {
+			SIFT3D_MAT_RM_GET(src_in, K_terms + i, K_terms + d,
+					  double) = 0.0;
+		}
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+//make the system matrix for affine
+static int make_affine_matrix(const Mat_rm *const pts_in, const int dim, 
+        Mat_rm *const mat_out)
+{
+
+	int i, j;
+
+	const int num_rows = pts_in->num_rows;
+
+	mat_out->type = SIFT3D_DOUBLE;
+	mat_out->num_rows = num_rows;
+	mat_out->num_cols = dim + 1;
+	if (resize_Mat_rm(mat_out))
+		return SIFT3D_FAILURE;
+
+	for (i = 0; i < num_rows; i++) {
+
+		//Add one row to the matrix
+		for (j = 0; j < dim; j++) {
+			SIFT3D_MAT_RM_GET(mat_out, i, j, double) =
+			    SIFT3D_MAT_RM_GET(pts_in, i, j, double);
+		}
+		SIFT3D_MAT_RM_GET(mat_out, i, dim, double) = 1.0;
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+//extract the control matrix from tform struct (only valid for spline)
+SIFT3D_IGNORE_UNUSED
+static Mat_rm *extract_ctrl_pts(void *tform, tform_type type)
+{
+	Mat_rm *T;
+	Tps *tps = (Tps *) tform;
+	switch (type) {
+	case TPS:
+		T = extract_ctrl_pts_Tps(tps);
+		break;
+	case AFFINE:
+		break;
+	default:
+		return NULL;
+	}
+	return T;
+}
+
+static Mat_rm *extract_ctrl_pts_Tps(Tps * tps)
+{
+	Mat_rm *kp_src = &tps->kp_src;
+	return kp_src;
+}
+
+/* Fit a 3D thin-plate spline mapping the [mx3] ref points to the src points,
+ * scaling to thousands of correspondences.
+ *
+ * The control points are a subset of at most max_ctrl of the ref points, 
+ * chosen by farthest-point sampling. The spline minimizes the mean squared 
+ * residual plus lambda times the bending energy, computed with the points
+ * centered and scaled to unit RMS radius, so that lambda does not depend on 
+ * the units. With lambda = 0 and max_ctrl >= m, this interpolates the points.
+ *
+ * The normal equations, bordered by the side conditions on the control 
+ * point weights, are accumulated in blocks of TPS_FIT_BLOCK points with BLAS 
+ * dsyrk, and solved by an LDL^T factorization. The cost is 
+ * O(m * max_ctrl^2 + max_ctrl^3) time and O(max_ctrl^2) memory.
+ *
+ * tps must be initialized, e.g. with init_tform.
+ *
+ * Returns SIFT3D_SUCCESS, SIFT3D_SINGULAR, or SIFT3D_FAILURE. */
+int fit_Tps(const Mat_rm *const src, const Mat_rm *const ref, 
+        const int max_ctrl, const double lambda, Tps *const tps)
+{
+        double center[IM_NDIMS], affine[IM_NDIMS][IM_NDIMS + 1];
+        double *G, *rhs, *block, *work, scale, log_scale_sq, work_query;
+        fortran_int *ipiv, info, lwork;
+        int *idx, i, j, k, d, num_ctrl, ret;
+
+        const int num_pts = ref->num_rows;
+        const double one = 1.0;
+        const char uplo = 'U';
+        const char trans = 'N';
+        const fortran_int lwork_query = -1;
+        fortran_int n, nrhs, ldg, num_block_rows, block_cols;
+
+        // Verify inputs
+        if (src->num_rows != num_pts || src->num_cols != IM_NDIMS || 
+                ref->num_cols != IM_NDIMS || src->type != SIFT3D_DOUBLE || 
+                ref->type != SIFT3D_DOUBLE) {
+                SIFT3D_ERR("fit_Tps: invalid input matrices \n");
+                return SIFT3D_FAILURE;
+        }
+        if (num_pts < IM_NDIMS + 1) {
+                SIFT3D_ERR("fit_Tps: not enough points: %d \n", num_pts);
+                return SIFT3D_FAILURE;
+        }
+        if (max_ctrl < 1 || lambda < 0.0) {
+                SIFT3D_ERR("fit_Tps: invalid parameters \n");
+                return SIFT3D_FAILURE;
+        }
+
+        G = rhs = block = work = NULL;
+        ipiv = NULL;
+        ret = SIFT3D_FAILURE;
+
+        // Choose the control points
+        if ((idx = malloc(SIFT3D_MIN(num_pts, max_ctrl) * sizeof(int))) == 
+                NULL)
+                goto fit_Tps_quit;
+        num_ctrl = select_ctrl_pts(ref, max_ctrl, idx);
+
+        // Center and scale the ref points
+        for (d = 0; d < IM_NDIMS; d++) {
+                center[d] = 0.0;
+                for (i = 0; i < num_pts; i++) {
+                        center[d] += SIFT3D_MAT_RM_GET(ref, i, d, double);
+                }
+                center[d] /= (double) num_pts;
+        }
+        scale = 0.0;
+        for (i = 0; i < num_pts; i++) {
+                for (d = 0; d < IM_NDIMS; d++) {
+                        const double diff = SIFT3D_MAT_RM_GET(ref, i, d, 
+                                double) - center[d];
+                        scale += diff * diff;
+                }
+        }
+        scale = sqrt(scale / (double) num_pts);
+        if (scale == 0.0) {
+                ret = SIFT3D_SINGULAR;
+                goto fit_Tps_quit;
+        }
+
+#define TPS_FIT_NORM(row, d) \
+        ((SIFT3D_MAT_RM_GET(ref, row, d, double) - center[d]) / scale)
+
+        // Allocate the system. The unknowns are the control point weights, 
+        // the affine part, and the Lagrange multipliers of the side 
+        // conditions.
+        block_cols = num_ctrl + IM_NDIMS + 1;
+        n = block_cols + IM_NDIMS + 1;
+        ldg = n;
+        nrhs = IM_NDIMS;
+        if ((G = calloc((size_t) n * n, sizeof(double))) == NULL ||
+                (rhs = calloc((size_t) n * nrhs, sizeof(double))) == NULL ||
+                (block = malloc((size_t) TPS_FIT_BLOCK * block_cols * 
+                        sizeof(double))) == NULL ||
+                (ipiv = malloc(n * sizeof(fortran_int))) == NULL)
+                goto fit_Tps_quit;
+
+        // Accumulate the normal equations in blocks of points. Each block is
+        // stored in row-major order, i.e. the column-major transpose.
+        for (i = 0; i < num_pts; i += TPS_FIT_BLOCK) {
+
+                num_block_rows = SIFT3D_MIN(TPS_FIT_BLOCK, num_pts - i);
+
+#pragma omp parallel for private(k) private(d)
+                for (j = 0; j < num_block_rows; j++) {
+
+                        double *const row = block + (size_t) j * block_cols;
+                        const int pt = i + j;
+
+                        for (k = 0; k < num_ctrl; k++) {
+                                double r_sq = 0.0;
+                                for (d = 0; d < IM_NDIMS; d++) {
+                                        const double diff = 
+                                                TPS_FIT_NORM(pt, d) -
+                                                TPS_FIT_NORM(idx[k], d);
+                                        r_sq += diff * diff;
+                                }
+                                row[k] = r_sq == 0.0 ? 0.0 : r_sq * log(r_sq);
+                        }
+                        row[num_ctrl] = 1.0;
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                row[num_ctrl + 1 + d] = TPS_FIT_NORM(pt, d);
+                        }
+                }
+
+                // G += B^T B
+                dsyrk_(&uplo, &trans, &block_cols, &num_block_rows, &one, 
+                        block, &block_cols, &one, G, &ldg);
+
+                // rhs += B^T Y, with rhs in column-major order
+                for (j = 0; j < num_block_rows; j++) {
+                        const double *const row = block + 
+                                (size_t) j * block_cols;
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                const double y = SIFT3D_MAT_RM_GET(src, i + j,
+                                        d, double);
+                                double *const col = rhs + (size_t) d * n;
+                                for (k = 0; k < block_cols; k++) {
+                                        col[k] += row[k] * y;
+                                }
+                        }
+                }
+        }
+
+        // Add the bending energy, and border with the side conditions. Only 
+        // the upper triangle (column-major) is referenced.
+        for (j = 0; j < num_ctrl; j++) {
+                for (k = 0; k <= j; k++) {
+                        double r_sq = 0.0;
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                const double diff = TPS_FIT_NORM(idx[j], d) -
+                                        TPS_FIT_NORM(idx[k], d);
+                                r_sq += diff * diff;
+                        }
+                        G[(size_t) j * n + k] += num_pts * lambda * 
+                                (r_sq == 0.0 ? 0.0 : r_sq * log(r_sq));
+                }
+        }
+        for (k = 0; k < num_ctrl; k++) {
+                double *const col = G + (size_t) block_cols * n;
+                col[k] = 1.0;
+                for (d = 0; d < IM_NDIMS; d++) {
+                        col[(size_t) (d + 1) * n + k] = TPS_FIT_NORM(idx[k], d);
+                }
+        }
+
+        // Solve by LDL^T factorization
+        dsysv_(&uplo, &n, &nrhs, G, &ldg, ipiv, rhs, &ldg, &work_query, 
+                &lwork_query, &info);
+        if ((int32_t) info) {
+                SIFT3D_ERR("fit_Tps: LAPACK dsysv work query error code %d \n",
+                        (int) info);
+                goto fit_Tps_quit;
+        }
+        lwork = (fortran_int) work_query;
+        if ((work = malloc(SIFT3D_MAX(lwork, 1) * sizeof(double))) == NULL)
+                goto fit_Tps_quit;
+        dsysv_(&uplo, &n, &nrhs, G, &ldg, ipiv, rhs, &ldg, work, &lwork, 
+                &info);
+        if ((int32_t) info < 0) {
+                SIFT3D_ERR("fit_Tps: LAPACK dsysv error code %d \n", 
+                        (int) info);
+                goto fit_Tps_quit;
+        } else if ((int32_t) info > 0) {
+                ret = SIFT3D_SINGULAR;
+                goto fit_Tps_quit;
+        }
+        for (k = 0; k < n * nrhs; k++) {
+                if (!isfinite(rhs[k])) {
+                        ret = SIFT3D_SINGULAR;
+                        goto fit_Tps_quit;
+                }
+        }
+
+        // Convert the solution back to the original units. Since the weights
+        // sum to zero, with zero first moments, the change of scale in the 
+        // kernel only shifts the constant term.
+        if (resize_Tps(tps, num_ctrl, IM_NDIMS))
+                goto fit_Tps_quit;
+        log_scale_sq = log(scale * scale);
+        for (d = 0; d < IM_NDIMS; d++) {
+
+                const double *const x = rhs + (size_t) d * n;
+
+                affine[d][0] = x[num_ctrl];
+                for (j = 0; j < IM_NDIMS; j++) {
+                        affine[d][0] -= x[num_ctrl + 1 + j] * center[j] / 
+                                scale;
+                        affine[d][j + 1] = x[num_ctrl + 1 + j] / scale;
+                }
+
+                for (k = 0; k < num_ctrl; k++) {
+                        double c_sq = 0.0;
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                const double c = SIFT3D_MAT_RM_GET(ref, idx[k],
+                                        j, double);
+                                c_sq += c * c;
+                        }
+                        affine[d][0] -= x[k] * log_scale_sq * c_sq / 
+                                (scale * scale);
+                        SIFT3D_MAT_RM_GET(&tps->params, d, k, double) = 
+                                x[k] / (scale * scale);
+                }
+
+                for (j = 0; j <= IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(&tps->params, d, num_ctrl + j, 
+                                double) = affine[d][j];
+                }
+        }
+        for (k = 0; k < num_ctrl; k++) {
+                for (d = 0; d < IM_NDIMS; d++) {
+                        SIFT3D_MAT_RM_GET(&tps->kp_src, k, d, double) = 
+                                SIFT3D_MAT_RM_GET(ref, idx[k], d, double);
+                }
+        }
+
+#undef TPS_FIT_NORM
+
+        ret = SIFT3D_SUCCESS;
+
+fit_Tps_quit:
+        if (idx != NULL)
+                free(idx);
+        if (G != NULL)
+                free(G);
+        if (rhs != NULL)
+                free(rhs);
+        if (block != NULL)
+                free(block);
+        if (work != NULL)
+                free(work);
+        if (ipiv != NULL)
+                free(ipiv);
+        return ret;
+}
+
+/* Helper routine for fit_Tps. Chooses up to max_ctrl of the [mx3] points by 
+ * farthest-point sampling, starting from the point farthest from the 
+ * centroid, and writes their rows to idx. Duplicate points are never 
+ * chosen twice. Returns the number of points chosen. */
+static int select_ctrl_pts(const Mat_rm *const pts, const int max_ctrl,
+        int *const idx)
+{
+        double *dist_sq;
+        double center[IM_NDIMS];
+        int i, d, k, next;
+
+        const int num_pts = pts->num_rows;
+
+        // Use all of the points, if possible
+        if (num_pts <= max_ctrl) {
+                for (i = 0; i < num_pts; i++) {
+                        idx[i] = i;
+                }
+                return num_pts;
+        }
+
+        if ((dist_sq = malloc(num_pts * sizeof(double))) == NULL) {
+                // Fall back to uniform subsampling
+                for (k = 0; k < max_ctrl; k++) {
+                        idx[k] = (int) ((long) k * num_pts / max_ctrl);
+                }
+                return max_ctrl;
+        }
+
+        // Start from the point farthest from the centroid
+        for (d = 0; d < IM_NDIMS; d++) {
+                center[d] = 0.0;
+                for (i = 0; i < num_pts; i++) {
+                        center[d] += SIFT3D_MAT_RM_GET(pts, i, d, double);
+                }
+                center[d] /= (double) num_pts;
+        }
+        for (i = 0; i < num_pts; i++) {
+                dist_sq[i] = 0.0;
+                for (d = 0; d < IM_NDIMS; d++) {
+                        const double diff = SIFT3D_MAT_RM_GET(pts, i, d, 
+                                double) - center[d];
+                        dist_sq[i] += diff * diff;
+                }
+        }
+
+        // Repeatedly take the point farthest from those already chosen
+        for (k = 0; k < max_ctrl; k++) {
+
+                next = 0;
+                for (i = 1; i < num_pts; i++) {
+                        if (dist_sq[i] > dist_sq[next])
+                                next = i;
+                }
+                if (k > 0 && dist_sq[next] == 0.0)
+                        break;
+                idx[k] = next;
+
+                for (i = 0; i < num_pts; i++) {
+                        double diff_sq = 0.0;
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                const double diff = SIFT3D_MAT_RM_GET(pts, i, 
+                                        d, double) - SIFT3D_MAT_RM_GET(pts, 
+                                        next, d, double);
+                                diff_sq += diff * diff;
+                        }
+                        dist_sq[i] = k == 0 ? diff_sq : 
+                                SIFT3D_MIN(dist_sq[i], diff_sq);
+                }
+        }
+
+        free(dist_sq);
+        return k;
+}
+
+/* Fit a B-spline free-form deformation mapping the [mx3] ref points to the 
+ * src points. The affine part is fitted by least squares, and the lattice 
+ * displacements to the remaining residuals.
+ *
+ * The lattice has the given spacing, in the units of the ref points, and 
+ * covers the bounding box of the ref points and the origin. The displacements minimize the mean squared 
+ * residual plus lambda times the mean squared difference between adjacent 
+ * control points, which fills in the parts of the lattice without data. The
+ * normal equations are sparse, and solved by conjugate gradients with a 
+ * Jacobi preconditioner.
+ *
+ * bspline must be initialized, e.g. with init_tform.
+ *
+ * Returns SIFT3D_SUCCESS, SIFT3D_SINGULAR, or SIFT3D_FAILURE. */
+int fit_Bspline(const Mat_rm *const src, const Mat_rm *const ref, 
+        const double spacing, const double lambda, Bspline *const bspline)
+{
+        Affine aff;
+        double *buf, *weights, *resid, *diag, *rhs, *x, *r, *z, *p, *q;
+        int *nodes, dims[IM_NDIMS], i, j, k, m, d, num_ctrl, ret;
+
+        const int num_pts = ref->num_rows;
+
+#define BSPLINE_SUPPORT 64
+
+        // Verify inputs
+        if (src->num_rows != num_pts || src->num_cols != IM_NDIMS || 
+                ref->num_cols != IM_NDIMS || src->type != SIFT3D_DOUBLE || 
+                ref->type != SIFT3D_DOUBLE) {
+                SIFT3D_ERR("fit_Bspline: invalid input matrices \n");
+                return SIFT3D_FAILURE;
+        }
+        if (num_pts < IM_NDIMS + 1) {
+                SIFT3D_ERR("fit_Bspline: not enough points: %d \n", num_pts);
+                return SIFT3D_FAILURE;
+        }
+        if (spacing <= 0.0 || lambda <= 0.0) {
+                SIFT3D_ERR("fit_Bspline: invalid parameters \n");
+                return SIFT3D_FAILURE;
+        }
+
+        buf = NULL;
+        nodes = NULL;
+        ret = SIFT3D_FAILURE;
 
-	}
+        // Fit the affine part
+        if (init_Affine(&aff, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        if ((ret = solve_system(src, ref, &aff)) != SIFT3D_SUCCESS ||
+                (ret = copy_Mat_rm(&aff.A, &bspline->A)) != SIFT3D_SUCCESS)
+                goto fit_Bspline_quit;
+        ret = SIFT3D_FAILURE;
+
+        // Size the lattice to cover the points
+        for (d = 0; d < IM_NDIMS; d++) {
+                double max_coord = 0.0;
+                for (i = 0; i < num_pts; i++) {
+                        max_coord = SIFT3D_MAX(max_coord, 
+                                SIFT3D_MAT_RM_GET(ref, i, d, double));
+                }
+                dims[d] = (int) floor(max_coord / spacing) + 4;
+        }
+        if (resize_Bspline(bspline, dims[0], dims[1], dims[2], spacing))
+                goto fit_Bspline_quit;
+        num_ctrl = bspline->coef.num_rows;
+
+        // Allocate the workspace
+        if ((buf = malloc(((size_t) num_pts * (BSPLINE_SUPPORT + IM_NDIMS) + 
+                7 * (size_t) num_ctrl) * sizeof(double))) == NULL ||
+            (nodes = malloc((size_t) num_pts * BSPLINE_SUPPORT * 
+                sizeof(int))) == NULL)
+                goto fit_Bspline_quit;
+        weights = buf;
+        resid = weights + (size_t) num_pts * BSPLINE_SUPPORT;
+        diag = resid + (size_t) num_pts * IM_NDIMS;
+        rhs = diag + num_ctrl;
+        x = rhs + num_ctrl;
+        r = x + num_ctrl;
+        z = r + num_ctrl;
+        p = z + num_ctrl;
+        q = p + num_ctrl;
+
+        // Compute the residuals of the affine part, and the lattice weights 
+        // of each point. Nodes outside the lattice are marked with -1.
+        for (i = 0; i < num_pts; i++) {
+
+                double xyz[IM_NDIMS], w[IM_NDIMS][4] = {{0.0}};
+                int idx[IM_NDIMS], a, b, c;
+
+                for (d = 0; d < IM_NDIMS; d++) {
+                        xyz[d] = SIFT3D_MAT_RM_GET(ref, i, d, double);
+                }
+                for (m = 0; m < IM_NDIMS; m++) {
+                        resid[i * IM_NDIMS + m] = SIFT3D_MAT_RM_GET(src, i, m,
+                                double) - SIFT3D_MAT_RM_GET(&aff.A, m, 3, 
+                                double);
+                        for (d = 0; d < IM_NDIMS; d++) {
+                                resid[i * IM_NDIMS + m] -= 
+                                        SIFT3D_MAT_RM_GET(&aff.A, m, d, 
+                                        double) * xyz[d];
+                        }
+                }
 
-	//construct O
-	for (i = 0; i < dim; i++) {
-		for (d = 0; d < dim; d++) {
-			SIFT3D_MAT_RM_GET(src_in, K_terms + i, K_terms + d,
-					  double) = 0.0;
-		}
-	}
+                for (d = 0; d < IM_NDIMS; d++) {
+                        const double u = xyz[d] / spacing + 1.0;
+                        idx[d] = u >= -2.0 && u < dims[d] + 1.0 ? 
+                                bspline_weights(u, w[d]) : -4;
+                }
 
-	return SIFT3D_SUCCESS;
+                k = 0;
+                for (c = 0; c < 4; c++) {
+                for (b = 0; b < 4; b++) {
+                for (a = 0; a < 4; a++) {
+
+                        const int kx = idx[0] + a;
+                        const int ky = idx[1] + b;
+                        const int kz = idx[2] + c;
+                        const size_t pos = (size_t) i * BSPLINE_SUPPORT + k++;
+
+                        if (kx < 0 || kx >= dims[0] || ky < 0 || 
+                                ky >= dims[1] || kz < 0 || kz >= dims[2]) {
+                                nodes[pos] = -1;
+                                weights[pos] = 0.0;
+                                continue;
+                        }
+                        nodes[pos] = (kz * dims[1] + ky) * dims[0] + kx;
+                        weights[pos] = w[0][a] * w[1][b] * w[2][c];
+                }}}
+        }
+
+#define BSPLINE_FOR_NEIGHBORS(node, nbr) \
+        for (d = 0; d < IM_NDIMS; d++) { \
+                const int stride = d == 0 ? 1 : \
+                        (d == 1 ? dims[0] : dims[0] * dims[1]); \
+                const int coord = (node / stride) % dims[d]; \
+                int side; \
+                for (side = -1; side <= 1; side += 2) { \
+                        const int nbr = node + side * stride; \
+                        if (coord + side < 0 || coord + side >= dims[d]) \
+                                continue;
+
+#define BSPLINE_END_NEIGHBORS }}
+
+        // The Jacobi preconditioner
+        for (j = 0; j < num_ctrl; j++) {
+                diag[j] = 0.0;
+                BSPLINE_FOR_NEIGHBORS(j, nbr)
+                        diag[j] += lambda / num_ctrl;
+                        (void) nbr;
+                BSPLINE_END_NEIGHBORS
+        }
+        for (k = 0; k < num_pts * BSPLINE_SUPPORT; k++) {
+                if (nodes[k] >= 0)
+                        diag[nodes[k]] += weights[k] * weights[k] / num_pts;
+        }
+
+        // The product with the normal matrix, out = (Phi^T Phi / m + 
+        // lambda L / num_ctrl) in
+#define BSPLINE_NORMAL_MUL(in, out) { \
+        for (j = 0; j < num_ctrl; j++) { \
+                out[j] = 0.0; \
+                BSPLINE_FOR_NEIGHBORS(j, nbr) \
+                        out[j] += lambda / num_ctrl * (in[j] - in[nbr]); \
+                BSPLINE_END_NEIGHBORS \
+        } \
+        for (i = 0; i < num_pts; i++) { \
+                const int *const n_i = nodes + (size_t) i * BSPLINE_SUPPORT; \
+                const double *const w_i = weights + \
+                        (size_t) i * BSPLINE_SUPPORT; \
+                double dot = 0.0; \
+                for (k = 0; k < BSPLINE_SUPPORT; k++) { \
+                        if (n_i[k] >= 0) \
+                                dot += w_i[k] * in[n_i[k]]; \
+                } \
+                dot /= num_pts; \
+                for (k = 0; k < BSPLINE_SUPPORT; k++) { \
+                        if (n_i[k] >= 0) \
+                                out[n_i[k]] += w_i[k] * dot; \
+                } \
+        } \
 }
 
-//make the system matrix for affine
-static int make_affine_matrix(const Mat_rm *const pts_in, const int dim, 
-        Mat_rm *const mat_out)
-{
+        // Solve for each coordinate by preconditioned conjugate gradients
+        for (m = 0; m < IM_NDIMS; m++) {
 
-	int i, j;
+                double rz, rhs_norm;
+                int iter;
 
-	const int num_rows = pts_in->num_rows;
+                // Right-hand side Phi^T resid / m
+                for (j = 0; j < num_ctrl; j++) {
+                        rhs[j] = x[j] = 0.0;
+                }
+                for (k = 0; k < num_pts * BSPLINE_SUPPORT; k++) {
+                        if (nodes[k] >= 0)
+                                rhs[nodes[k]] += weights[k] * 
+                                        resid[(k / BSPLINE_SUPPORT) * 
+                                        IM_NDIMS + m] / num_pts;
+                }
 
-	mat_out->type = SIFT3D_DOUBLE;
-	mat_out->num_rows = num_rows;
-	mat_out->num_cols = dim + 1;
-	if (resize_Mat_rm(mat_out))
-		return SIFT3D_FAILURE;
+                rz = rhs_norm = 0.0;
+                for (j = 0; j < num_ctrl; j++) {
+                        r[j] = rhs[j];
+                        p[j] = z[j] = r[j] / diag[j];
+                        rz += r[j] * z[j];
+                        rhs_norm += rhs[j] * rhs[j];
+                }
+                rhs_norm = sqrt(rhs_norm);
 
-	for (i = 0; i < num_rows; i++) {
+                for (iter = 0; iter < BSPLINE_CG_MAX_ITER && rhs_norm > 0.0;
+                        iter++) {
 
-		//Add one row to the matrix
-		for (j = 0; j < dim; j++) {
-			SIFT3D_MAT_RM_GET(mat_out, i, j, double) =
-			    SIFT3D_MAT_RM_GET(pts_in, i, j, double);
-		}
-		SIFT3D_MAT_RM_GET(mat_out, i, dim, double) = 1.0;
-	}
+                        double pq, alpha, rz_new, r_norm;
 
-	return SIFT3D_SUCCESS;
-}
+                        BSPLINE_NORMAL_MUL(p, q)
 
-//extract the control matrix from tform struct (only valid for spline)
-SIFT3D_IGNORE_UNUSED
-static Mat_rm *extract_ctrl_pts(void *tform, tform_type type)
-{
-	Mat_rm *T;
-	Tps *tps = (Tps *) tform;
-	switch (type) {
-	case TPS:
-		T = extract_ctrl_pts_Tps(tps);
-		break;
-	case AFFINE:
-		break;
-	default:
-		return NULL;
-	}
-	return T;
+                        pq = 0.0;
+                        for (j = 0; j < num_ctrl; j++) {
+                                pq += p[j] * q[j];
+                        }
+                        if (pq <= 0.0) {
+                                ret = SIFT3D_SINGULAR;
+                                goto fit_Bspline_quit;
+                        }
+                        alpha = rz / pq;
+
+                        r_norm = rz_new = 0.0;
+                        for (j = 0; j < num_ctrl; j++) {
+                                x[j] += alpha * p[j];
+                                r[j] -= alpha * q[j];
+                                z[j] = r[j] / diag[j];
+                                rz_new += r[j] * z[j];
+                                r_norm += r[j] * r[j];
+                        }
+                        if (sqrt(r_norm) <= BSPLINE_CG_TOL * rhs_norm)
+                                break;
+
+                        for (j = 0; j < num_ctrl; j++) {
+                                p[j] = z[j] + rz_new / rz * p[j];
+                        }
+                        rz = rz_new;
+                }
+
+                for (j = 0; j < num_ctrl; j++) {
+                        SIFT3D_MAT_RM_GET(&bspline->coef, j, m, double) = x[j];
+                }
+        }
+
+#undef BSPLINE_FOR_NEIGHBORS
+#undef BSPLINE_END_NEIGHBORS
+#undef BSPLINE_NORMAL_MUL
+#undef BSPLINE_SUPPORT
+
+        ret = SIFT3D_SUCCESS;
+
+fit_Bspline_quit:
+        if (buf != NULL)
+                free(buf);
+        if (nodes != NULL)
+                free(nodes);
+        cleanup_Affine(&aff);
+        return ret;
 }
 
-static Mat_rm *extract_ctrl_pts_Tps(Tps * tps)
+/* Set a thin-plate spline to the [3x4] affine transformation matrix A, with
+ * no control points. */
+static int Tps_set_affine(const Mat_rm *const A, Tps *const tps)
 {
-	Mat_rm *kp_src = &tps->kp_src;
-	return kp_src;
+        int i, j;
+
+        if (resize_Tps(tps, 0, IM_NDIMS))
+                return SIFT3D_FAILURE;
+
+        for (i = 0; i < IM_NDIMS; i++) {
+                SIFT3D_MAT_RM_GET(&tps->params, i, 0, double) = 
+                        SIFT3D_MAT_RM_GET(A, i, IM_NDIMS, double);
+                for (j = 0; j < IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(&tps->params, i, j + 1, double) =
+                                SIFT3D_MAT_RM_GET(A, i, j, double);
+                }
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
 /* Solve for a transformation struct. 
@@ -4569,156 +9207,517 @@ static int solve_system(const Mat_rm *const src, const Mat_rm *const ref,
 	return SIFT3D_FAILURE;
 }
 
-//Find the SSD error for the i'th point
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i)
+/* Solve for the affine transformation mapping the minimal sample of 
+ * IM_NDIMS + 1 reference points to the source points, with indices idx. The 
+ * system is solved in closed form on the stack, relative to the first point 
+ * of the sample.
+ *
+ * Returns SIFT3D_SUCCESS, or SIFT3D_SINGULAR if the reference points are
+ * (nearly) coplanar. */
+static int solve_affine_min(const Ransac_ws *const ws, const int *const idx,
+        double A[IM_NDIMS][IM_NDIMS + 1])
 {
+        double D[IM_NDIMS][IM_NDIMS], E[IM_NDIMS][IM_NDIMS], 
+                D_inv[IM_NDIMS][IM_NDIMS];
+        double det, norm_prod;
+        int i, j, k;
+
+        const int idx0 = idx[0];
+
+        // Form the differences to the first point, column-wise
+        norm_prod = 1.0;
+        for (k = 0; k < IM_NDIMS; k++) {
+
+                double norm_sq = 0.0;
+                const int idx_k = idx[k + 1];
+
+                for (i = 0; i < IM_NDIMS; i++) {
+                        D[i][k] = ws->ref[i][idx_k] - ws->ref[i][idx0];
+                        E[i][k] = ws->src[i][idx_k] - ws->src[i][idx0];
+                        norm_sq += D[i][k] * D[i][k];
+                }
+                norm_prod *= sqrt(norm_sq);
+        }
+
+        // Invert D by cofactors
+        D_inv[0][0] = D[1][1] * D[2][2] - D[1][2] * D[2][1];
+        D_inv[1][0] = D[1][2] * D[2][0] - D[1][0] * D[2][2];
+        D_inv[2][0] = D[1][0] * D[2][1] - D[1][1] * D[2][0];
+        det = D[0][0] * D_inv[0][0] + D[0][1] * D_inv[1][0] + 
+                D[0][2] * D_inv[2][0];
+
+        // Check the volume spanned by the sample, relative to its edges
+        if (!(fabs(det) > 100.0 * DBL_EPSILON * norm_prod))
+                return SIFT3D_SINGULAR;
+
+        D_inv[0][1] = D[0][2] * D[2][1] - D[0][1] * D[2][2];
+        D_inv[1][1] = D[0][0] * D[2][2] - D[0][2] * D[2][0];
+        D_inv[2][1] = D[0][1] * D[2][0] - D[0][0] * D[2][1];
+        D_inv[0][2] = D[0][1] * D[1][2] - D[0][2] * D[1][1];
+        D_inv[1][2] = D[0][2] * D[1][0] - D[0][0] * D[1][2];
+        D_inv[2][2] = D[0][0] * D[1][1] - D[0][1] * D[1][0];
+
+        // The linear part is E * D^-1, the translation maps the first point
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                double trans = ws->src[i][idx0];
+
+                for (j = 0; j < IM_NDIMS; j++) {
+                        A[i][j] = (E[i][0] * D_inv[0][j] + 
+                                E[i][1] * D_inv[1][j] + 
+                                E[i][2] * D_inv[2][j]) / det;
+                }
+                for (j = 0; j < IM_NDIMS; j++) {
+                        trans -= A[i][j] * ws->ref[j][idx0];
+                }
+                A[i][IM_NDIMS] = trans;
+        }
+
+        return SIFT3D_SUCCESS;
+}
 
-	double err = 0.0;
-	//Initialization
-	//in -- inputs coordinates of source points
-	//out -- registered points
-	//r -- reference points (ground truth)
-	double x_in, y_in, z_in, x_r, y_r, z_r, x_out, y_out, z_out;
+/* Compute the eigenvalues w and eigenvectors (the columns of v) of the 
+ * symmetric 4x4 matrix a, by cyclic Jacobi rotations. a is overwritten. */
+static void eig_sym4(double a[4][4], double w[4], double v[4][4])
+{
+        int i, k, p, q, sweep;
 
-	//Find the source point
-	x_in = SIFT3D_MAT_RM_GET(ref, i, 0, double);
-	y_in = SIFT3D_MAT_RM_GET(ref, i, 1, double);
-	z_in = SIFT3D_MAT_RM_GET(ref, i, 2, double);
+        for (i = 0; i < 4; i++) {
+                for (k = 0; k < 4; k++) {
+                        v[i][k] = i == k ? 1.0 : 0.0;
+                }
+        }
 
-	//Register
-	apply_tform_xyz(tform, x_in, y_in, z_in, &x_out, &y_out, &z_out);
+        for (sweep = 0; sweep < 50; sweep++) {
 
-	//Find the reference point
-	x_r = SIFT3D_MAT_RM_GET(src, i, 0, double);
-	y_r = SIFT3D_MAT_RM_GET(src, i, 1, double);
-	z_r = SIFT3D_MAT_RM_GET(src, i, 2, double);
+                double off = 0.0, diag = 0.0;
 
-	//Find the SSD error
-	err = (x_r - x_out) * (x_r - x_out) + (y_r - y_out) * (y_r - y_out) +
-	    (z_r - z_out) * (z_r - z_out);
+                // Check for convergence
+                for (p = 0; p < 4; p++) {
+                        diag += a[p][p] * a[p][p];
+                        for (q = p + 1; q < 4; q++) {
+                                off += a[p][q] * a[p][q];
+                        }
+                }
+                if (!(off > DBL_EPSILON * DBL_EPSILON * diag))
+                        break;
+
+                // Annihilate each off-diagonal element in turn
+                for (p = 0; p < 4; p++) {
+                        for (q = p + 1; q < 4; q++) {
+
+                                double theta, t, c, s;
+
+                                if (a[p][q] == 0.0)
+                                        continue;
+
+                                theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+                                t = (theta >= 0.0 ? 1.0 : -1.0) / 
+                                        (fabs(theta) + sqrt(theta * theta + 
+                                        1.0));
+                                c = 1.0 / sqrt(t * t + 1.0);
+                                s = t * c;
+
+                                for (k = 0; k < 4; k++) {
+                                        const double akp = a[k][p];
+                                        const double akq = a[k][q];
+                                        a[k][p] = c * akp - s * akq;
+                                        a[k][q] = s * akp + c * akq;
+                                }
+                                for (k = 0; k < 4; k++) {
+                                        const double apk = a[p][k];
+                                        const double aqk = a[q][k];
+                                        a[p][k] = c * apk - s * aqk;
+                                        a[q][k] = s * apk + c * aqk;
+                                }
+                                for (k = 0; k < 4; k++) {
+                                        const double vkp = v[k][p];
+                                        const double vkq = v[k][q];
+                                        v[k][p] = c * vkp - s * vkq;
+                                        v[k][q] = s * vkp + c * vkq;
+                                }
+                        }
+                }
+        }
 
-	//return the result 
-	return err;
+        for (i = 0; i < 4; i++) {
+                w[i] = a[i][i];
+        }
 }
 
-/* Perform one iteration of RANSAC. 
+/* Solve for the rigid or similarity transformation best mapping the 
+ * reference points to the source points with indices idx[0], ..., 
+ * idx[num - 1], in the least-squares sense. The rotation is found in closed 
+ * form from the eigenvector of Horn's 4x4 quaternion matrix, which always
+ * yields a proper rotation, and the scale as in Umeyama, "Least-squares 
+ * estimation of transformation parameters between two point patterns", 
+ * TPAMI 1991. Uses no heap memory, so it serves both as the minimal 
+ * 3-point solver and for the refinement on the concensus set.
  *
  * Parameters:
- *  src - The source points.
- *  ref - The reference points.
- *  tform - The output transformation. Must be initialized.
- *  cset - An array in which to store the concensus set. The value *cset must
- *         either be NULL, or a pointer to a previously allocated block.
- *  len - A location in which to store the length of the cset. 
+ *  ws - The RANSAC workspace.
+ *  idx - The indices of the points, of length num.
+ *  num - The number of points, at least 3.
+ *  scale - If true, solve for a similarity transformation. Otherwise, rigid.
+ *  A - The output transformation matrix.
  *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_SINGULAR if the system is 
- * near singular, and SIFT3D_FAILURE otherwise. */
-static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len)
+ * Returns SIFT3D_SUCCESS, or SIFT3D_SINGULAR if the reference points are
+ * (nearly) collinear. */
+static int solve_umeyama(const Ransac_ws *const ws, const int *const idx,
+        const int num, const int scale, double A[IM_NDIMS][IM_NDIMS + 1])
 {
-        int *rand_indices;
-	Mat_rm src_rand, ref_rand;
-	int i, j, num_rand, cset_len;
+        double mu_src[IM_NDIMS], mu_ref[IM_NDIMS], S[IM_NDIMS][IM_NDIMS], 
+                N[4][4], V[4][4], w[4], R[IM_NDIMS][IM_NDIMS];
+        double var_ref, q0, qx, qy, qz, c, lambda_max, lambda_next;
+        int i, j, k, i_max;
 
-	const double err_thresh = ran->err_thresh;
-	const double err_thresh_sq = err_thresh * err_thresh;
-	const int num_pts = src->num_rows;
-        const int num_dim = src->num_cols;
-	const tform_type type = tform_get_type(tform);
+        // Compute the centroids
+        for (i = 0; i < IM_NDIMS; i++) {
 
-	// Verify inputs
-	if (src->type != SIFT3D_DOUBLE || src->type != ref->type) {
-		puts("ransac: all matrices must have type double \n");
-		return SIFT3D_FAILURE;
-	}
-	if (src->num_rows != ref->num_rows || src->num_cols != ref->num_cols) {
-		puts("ransac: src and ref must have the same dimensions \n");
-		return SIFT3D_FAILURE;
-	}
+                double sum_src = 0.0, sum_ref = 0.0;
 
-        // Get the number of points for this transform
-	switch (type) {
-	case AFFINE:
-		num_rand = AFFINE_GET_DIM((Affine *const) tform) + 1;
-		break;
-	default:
-		printf("ransac: unknown transformation type \n");
-                return SIFT3D_FAILURE;
-	}
+                for (k = 0; k < num; k++) {
+                        sum_src += ws->src[i][idx[k]];
+                        sum_ref += ws->ref[i][idx[k]];
+                }
+                mu_src[i] = sum_src / num;
+                mu_ref[i] = sum_ref / num;
+        }
 
-	// Initialize intermediates
-        rand_indices = NULL;
-	init_Mat_rm(&src_rand, num_rand, num_dim, SIFT3D_DOUBLE, SIFT3D_FALSE);
-	init_Mat_rm(&ref_rand, num_rand, num_dim, SIFT3D_DOUBLE, SIFT3D_FALSE);
+        // Compute the cross-covariance of the centered points
+        memset(S, 0, sizeof(S));
+        var_ref = 0.0;
+        for (k = 0; k < num; k++) {
 
-        // Draw random point indices
-        if (n_choose_k(num_pts, num_rand, &rand_indices))
-                goto RANSAC_FAIL;
+                double x[IM_NDIMS], y[IM_NDIMS];
 
-        // Copy the random points
-	SIFT3D_MAT_RM_LOOP_START(&src_rand, i, j)
+                for (i = 0; i < IM_NDIMS; i++) {
+                        x[i] = ws->ref[i][idx[k]] - mu_ref[i];
+                        y[i] = ws->src[i][idx[k]] - mu_src[i];
+                        var_ref += x[i] * x[i];
+                }
+                for (i = 0; i < IM_NDIMS; i++) {
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                S[i][j] += x[i] * y[j];
+                        }
+                }
+        }
+        if (!(var_ref > 0.0))
+                return SIFT3D_SINGULAR;
+
+        // Form Horn's matrix, whose top eigenvector is the rotation 
+        // quaternion
+        N[0][0] = S[0][0] + S[1][1] + S[2][2];
+        N[1][1] = S[0][0] - S[1][1] - S[2][2];
+        N[2][2] = -S[0][0] + S[1][1] - S[2][2];
+        N[3][3] = -S[0][0] - S[1][1] + S[2][2];
+        N[0][1] = N[1][0] = S[1][2] - S[2][1];
+        N[0][2] = N[2][0] = S[2][0] - S[0][2];
+        N[0][3] = N[3][0] = S[0][1] - S[1][0];
+        N[1][2] = N[2][1] = S[0][1] + S[1][0];
+        N[1][3] = N[3][1] = S[2][0] + S[0][2];
+        N[2][3] = N[3][2] = S[1][2] + S[2][1];
+        eig_sym4(N, w, V);
+
+        // Find the top two eigenvalues
+        i_max = 0;
+        for (i = 1; i < 4; i++) {
+                if (w[i] > w[i_max])
+                        i_max = i;
+        }
+        lambda_max = w[i_max];
+        lambda_next = -DBL_MAX;
+        for (i = 0; i < 4; i++) {
+                if (i != i_max)
+                        lambda_next = SIFT3D_MAX(lambda_next, w[i]);
+        }
 
-                const int rand_idx = rand_indices[i];
+        // The rotation is ambiguous if the top eigenvalue is repeated
+        if (!(lambda_max - lambda_next > 1e-10 * var_ref))
+                return SIFT3D_SINGULAR;
+
+        // Convert the unit quaternion to a rotation matrix
+        q0 = V[0][i_max];
+        qx = V[1][i_max];
+        qy = V[2][i_max];
+        qz = V[3][i_max];
+        R[0][0] = q0 * q0 + qx * qx - qy * qy - qz * qz;
+        R[0][1] = 2.0 * (qx * qy - q0 * qz);
+        R[0][2] = 2.0 * (qx * qz + q0 * qy);
+        R[1][0] = 2.0 * (qy * qx + q0 * qz);
+        R[1][1] = q0 * q0 - qx * qx + qy * qy - qz * qz;
+        R[1][2] = 2.0 * (qy * qz - q0 * qx);
+        R[2][0] = 2.0 * (qz * qx - q0 * qy);
+        R[2][1] = 2.0 * (qz * qy + q0 * qx);
+        R[2][2] = q0 * q0 - qx * qx - qy * qy + qz * qz;
+
+        // The optimal scale is the projected covariance over the variance
+        c = scale ? lambda_max / var_ref : 1.0;
+
+        // Form the output matrix
+        for (i = 0; i < IM_NDIMS; i++) {
 
-                SIFT3D_MAT_RM_GET(&src_rand, i, j, double) =
-                        SIFT3D_MAT_RM_GET(src, rand_idx, j, double);
-                SIFT3D_MAT_RM_GET(&ref_rand, i, j, double) =
-                        SIFT3D_MAT_RM_GET(ref, rand_idx, j, double);
+                double trans = mu_src[i];
 
-        SIFT3D_MAT_RM_LOOP_END
+                for (j = 0; j < IM_NDIMS; j++) {
+                        A[i][j] = c * R[i][j];
+                        trans -= A[i][j] * mu_ref[j];
+                }
+                A[i][IM_NDIMS] = trans;
+        }
 
-        // Fit a transform to the random points
-	switch (solve_system(&src_rand, &ref_rand, tform)) {
-	case SIFT3D_SUCCESS:
-		break;
-	case SIFT3D_SINGULAR:
-		goto RANSAC_SINGULAR;
-	default:
-		goto RANSAC_FAIL;
-	}
+        return SIFT3D_SUCCESS;
+}
 
-	// Extract the consensus set
-	cset_len = 0;
-	for (i = 0; i < num_pts; i++) {
+/* Fit the model of the workspace's type to the points with indices idx, of
+ * length num. Returns as solve_affine_min. */
+static int ransac_solve(const Ransac_ws *const ws, const int *const idx,
+        const int num, double A[IM_NDIMS][IM_NDIMS + 1])
+{
+        switch (ws->type) {
+        case RIGID:
+                return solve_umeyama(ws, idx, num, SIFT3D_FALSE, A);
+        case SIMILARITY:
+                return solve_umeyama(ws, idx, num, SIFT3D_TRUE, A);
+        case AFFINE:
+        default:
+                return solve_affine_min(ws, idx, A);
+        }
+}
 
-		// Calculate the error
-		const double err_sq = tform_err_sq(tform, src, ref, i);
+/* Count the points in the range [start, end) for which A maps the reference 
+ * point within sqrt(err_thresh_sq) of the source point. */
+static int ransac_score(const Ransac_ws *const ws, 
+        const double A[IM_NDIMS][IM_NDIMS + 1], const double err_thresh_sq,
+        const int start, const int end)
+{
+        int i;
+        int count = 0;
+
+        const double *const x_src = ws->src[0];
+        const double *const y_src = ws->src[1];
+        const double *const z_src = ws->src[2];
+        const double *const x_ref = ws->ref[0];
+        const double *const y_ref = ws->ref[1];
+        const double *const z_ref = ws->ref[2];
+        const double a00 = A[0][0], a01 = A[0][1], a02 = A[0][2], 
+                a03 = A[0][3];
+        const double a10 = A[1][0], a11 = A[1][1], a12 = A[1][2], 
+                a13 = A[1][3];
+        const double a20 = A[2][0], a21 = A[2][1], a22 = A[2][2], 
+                a23 = A[2][3];
+
+#pragma omp simd reduction(+:count)
+        for (i = start; i < end; i++) {
+
+                const double dx = a00 * x_ref[i] + a01 * y_ref[i] + 
+                        a02 * z_ref[i] + a03 - x_src[i];
+                const double dy = a10 * x_ref[i] + a11 * y_ref[i] + 
+                        a12 * z_ref[i] + a13 - y_src[i];
+                const double dz = a20 * x_ref[i] + a21 * y_ref[i] + 
+                        a22 * z_ref[i] + a23 - z_src[i];
+
+                count += !(dx * dx + dy * dy + dz * dz > err_thresh_sq);
+        }
 
-		// Reject points below the error threshold
-		if (err_sq > err_thresh_sq)
-			continue;
+        return count;
+}
 
-		// Add to the consensus set (++cset_len cannot be zero)
-		if ((*cset = SIFT3D_safe_realloc(*cset, 
-			++cset_len * sizeof(int))) == NULL)
-			goto RANSAC_FAIL;
+/* Store the indices of the inliers of A in ws->cset, returning their 
+ * number. */
+static int ransac_cset(Ransac_ws *const ws, 
+        const double A[IM_NDIMS][IM_NDIMS + 1], const double err_thresh_sq)
+{
+        int i, len;
 
-		(*cset)[cset_len - 1] = i;
-	}
+        len = 0;
+        for (i = 0; i < ws->num_pts; i++) {
+                if (ransac_score(ws, A, err_thresh_sq, i, i + 1))
+                        ws->cset[len++] = i;
+        }
+
+        return len;
+}
+
+/* Draw the minimal sample of PROSAC iteration iter (0-based). Within the 
+ * schedule, the sample is the nth point plus the others from the first 
+ * n - 1, where n grows with iter. Past the schedule, this is uniform 
+ * sampling. */
+static void prosac_sample(const Ransac_ws *const ws, Ransac_rng *const rng,
+        const int iter, int *const idx)
+{
+        int lo, hi;
+
+        const int *const T = ws->prosac_iter;
+        const int num_pts = ws->num_pts;
+        const int k = ws->num_sample;
+        const int t = iter + 1;
+
+        // Past the schedule, sample uniformly
+        if (t > T[num_pts]) {
+                ransac_sample(rng, num_pts, k, idx);
+                return;
+        }
+
+        // Find the smallest n such that T[n] >= t
+        lo = k;
+        hi = num_pts;
+        while (lo < hi) {
+                const int mid = lo + (hi - lo) / 2;
+                if (T[mid] >= t)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        idx[0] = lo - 1;
+        ransac_sample(rng, lo - 1, k - 1, idx + 1);
+}
+
+/* Perform one iteration of RANSAC. Singular samples are redrawn, up to
+ * RANSAC_MAX_DRAWS times.
+ *
+ * If ran->tdd is positive, the hypothesis is first tested on that many 
+ * random points, and rejected unless all of them are inliers (the T(d,d) 
+ * test of Matas and Chum, "Randomized RANSAC with T(d,d) test", BMVC 2002). 
+ * Rejected hypotheses report no inliers. 
+ * 
+ * Scoring is abandoned as soon as the hypothesis cannot have more than
+ * len_bound inliers, in which case len is a lower bound. 
+ *
+ * Parameters:
+ *  ws - The workspace, initialized from the source and reference points.
+ *  ran - The RANSAC parameters.
+ *  iter - The index of this iteration, which selects its random stream.
+ *  len_bound - The size of the concensus set to beat.
+ *  A - The output transformation matrix.
+ *  len - A location in which to store the size of the concensus set. 
+ *
+ * Returns SIFT3D_SUCCESS on success, and SIFT3D_SINGULAR if no sample yielded
+ * a well-conditioned system. */
+static int ransac(const Ransac_ws *const ws, const Ransac *const ran, 
+        const int iter, const int len_bound, 
+        double A[IM_NDIMS][IM_NDIMS + 1], int *const len)
+{
+        Ransac_rng rng;
+        int idx[IM_NDIMS + 1];
+        int draw, start, count;
+
+	const double err_thresh_sq = ran->err_thresh * ran->err_thresh;
+        const int num_pts = ws->num_pts;
+
+        // Fit a transform to a random sample
+        seed_Ransac_rng(&rng, ran->seed, (uint64_t) iter);
+        for (draw = 0; draw < RANSAC_MAX_DRAWS; draw++) {
+                if (ws->prosac_iter != NULL)
+                        prosac_sample(ws, &rng, iter, idx);
+                else
+                        ransac_sample(&rng, ws->num_pts, ws->num_sample, idx);
+                if (ransac_solve(ws, idx, ws->num_sample, A) == 
+                        SIFT3D_SUCCESS)
+                        break;
+        }
+        if (draw == RANSAC_MAX_DRAWS)
+                return SIFT3D_SINGULAR;
+
+        // Pre-verify on random points
+        for (draw = 0; draw < ran->tdd; draw++) {
 
-	// Return the new length of cset
-	*len = cset_len;
+                const int i = rand_int_Ransac_rng(&rng, num_pts);
+
+                if (!ransac_score(ws, A, err_thresh_sq, i, i + 1)) {
+                        *len = 0;
+                        return SIFT3D_SUCCESS;
+                }
+        }
+
+	// Measure the consensus set, in chunks
+        count = 0;
+        for (start = 0; start < num_pts; start += RANSAC_CHUNK) {
+
+                const int end = SIFT3D_MIN(start + RANSAC_CHUNK, num_pts);
+
+                count += ransac_score(ws, A, err_thresh_sq, start, end);
+
+                // Abort if the hypothesis cannot win
+                if (count + (num_pts - end) <= len_bound)
+                        break;
+        }
+        *len = count;
 
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
 	return SIFT3D_SUCCESS;
+}
 
-RANSAC_SINGULAR:
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_SINGULAR;
+/* Run RANSAC iterations start through end - 1 in parallel, updating the best
+ * model, its consensus set size and its iteration index. Each thread keeps 
+ * its own best model. Ties go to the earliest iteration, so the result does
+ * not depend on the number of threads. For the same reason, hypotheses are
+ * only abandoned early if they cannot beat the best model from the previous
+ * batches. */
+static void ransac_batch(const Ransac_ws *const ws, const Ransac *const ran,
+        const int start, const int end, double A_best[IM_NDIMS][IM_NDIMS + 1],
+        int *const len_best, int *const iter_best)
+{
+#pragma omp parallel
+{
+        double A_cur[IM_NDIMS][IM_NDIMS + 1], 
+                A_thread[IM_NDIMS][IM_NDIMS + 1];
+        int iter;
 
-RANSAC_FAIL:
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_FAILURE;
+        int len_thread = 0;
+        int iter_thread = end;
+        const int len_bound = *len_best;
+
+#pragma omp for schedule(static)
+	for (iter = start; iter < end; iter++) {
+
+                int len;
+
+		if (ransac(ws, ran, iter, len_bound, A_cur, &len))
+                        continue;
+
+		if (len > len_thread || 
+                        (len == len_thread && iter < iter_thread)) {
+			len_thread = len;
+                        iter_thread = iter;
+                        memcpy(A_thread, A_cur, sizeof(A_thread));
+		}
+	}
+
+        // Merge with the other threads
+#pragma omp critical
+{
+        if (len_thread > *len_best || 
+                (len_thread == *len_best && iter_thread < *iter_best)) {
+                *len_best = len_thread;
+                *iter_best = iter_thread;
+                memcpy(A_best, A_thread, sizeof(A_thread));
+        }
+}
+}
+}
+
+/* Returns the number of RANSAC iterations needed to draw an all-inlier 
+ * sample with probability ran->conf, given that the best model so far has 
+ * len_best inliers. The result is capped by ran->num_iter. */
+static int ransac_num_iter(const Ransac *const ran, 
+        const Ransac_ws *const ws, const int len_best)
+{
+        double w, p_good, num_iter;
+
+        // Probability that a sample is all inliers
+        w = (double) len_best / (double) ws->num_pts;
+        p_good = pow(w, ws->num_sample);
+
+        if (ran->conf >= 1.0 || p_good <= 0.0)
+                return ran->num_iter;
+        if (p_good >= 1.0)
+                return 1;
+
+        num_iter = ceil(log(1.0 - ran->conf) / log(1.0 - p_good));
+
+        return num_iter < (double) ran->num_iter ? 
+                SIFT3D_MAX((int) num_iter, 1) : ran->num_iter;
 }
 
 //Resize spline struct based on number of selected points
@@ -4743,6 +9742,11 @@ int resize_Tps(Tps * tps, int num_pts, int dim)
 
 /* Fit a transformation from ref to src points, using random sample concensus 
  * (RANSAC).
+ *
+ * For a thin-plate spline, RANSAC finds the affine consensus set, to which the
+ * spline is then fitted with fit_Tps, using the tps_ctrl and tps_lambda 
+ * parameters of ran. B-spline free-form deformations are fitted likewise 
+ * with fit_Bspline, using ffd_spacing and ffd_lambda.
  * 
  * Parameters:
  *   ran - Struct storing RANSAC parameters.
@@ -4756,32 +9760,53 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
         const Mat_rm *const ref, void *const tform)
 {
 
-	Mat_rm ref_cset, src_cset;
-	void *tform_cur;
-	int *cset, *cset_best;
-	int i, j, dim, num_terms, ret, len, len_best, min_num_inliers;
+        Ransac_ws ws;
+	Mat_rm ref_cset, src_cset, A_best_mat;
+        double A_best[IM_NDIMS][IM_NDIMS + 1];
+	int i, j, ret, len_best, iter_best, iter, num_iter_req, 
+                min_num_inliers;
 
 	const int num_iter = ran->num_iter;
 	const int num_pts = src->num_rows;
-	const size_t tform_size = tform_get_size(tform);
 	const tform_type type = tform_get_type(tform);
+	const double err_thresh_sq = ran->err_thresh * ran->err_thresh;
 
 	// Initialize data structures
-	cset = cset_best = NULL;
 	len_best = 0;
-	if ((tform_cur = malloc(tform_size)) == NULL ||
-	    init_tform(tform_cur, type) ||
-	    init_Mat_rm(&src_cset, len_best, IM_NDIMS, SIFT3D_DOUBLE, 
+        ws.buf = NULL;
+        ws.cset = NULL;
+        ws.prosac_iter = NULL;
+	if (init_Mat_rm(&src_cset, len_best, IM_NDIMS, SIFT3D_DOUBLE, 
             	SIFT3D_FALSE) ||
 	    init_Mat_rm(&ref_cset, len_best, IM_NDIMS, SIFT3D_DOUBLE, 
-		SIFT3D_FALSE))
+		SIFT3D_FALSE) ||
+            init_Mat_rm_p(&A_best_mat, A_best, IM_NDIMS, IM_NDIMS + 1,
+                SIFT3D_DOUBLE, SIFT3D_FALSE))
 		goto find_tform_quit;
 
 	// initialize type-specific variables
 	switch (type) {
 	case AFFINE:
-                dim = AFFINE_GET_DIM((Affine *const) tform);
-		num_terms = dim + 1;
+	case RIGID:
+	case SIMILARITY:
+                if (AFFINE_GET_DIM((Affine *const) tform) != IM_NDIMS) {
+                        SIFT3D_ERR("find_tform_ransac: unsupported affine "
+                                "dimensionality: %d \n", 
+                                AFFINE_GET_DIM((Affine *const) tform));
+                        goto find_tform_quit;
+                }
+		min_num_inliers = 5;
+		break;
+	case BSPLINE_FFD:
+		min_num_inliers = 5;
+		break;
+	case TPS:
+                if (((Tps *const) tform)->dim != IM_NDIMS) {
+                        SIFT3D_ERR("find_tform_ransac: unsupported TPS "
+                                "dimensionality: %d \n", 
+                                ((Tps *const) tform)->dim);
+                        goto find_tform_quit;
+                }
 		min_num_inliers = 5;
 		break;
 	default:
@@ -4790,35 +9815,50 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 		goto find_tform_quit;
 	}
 
-	if (num_pts < num_terms) {
+        // Set up the workspace. Non-rigid transformations use affine 
+        // hypotheses.
+        if (init_Ransac_ws(ran, type == TPS || type == BSPLINE_FFD ? AFFINE : 
+                type, src, ref, &ws))
+                goto find_tform_quit;
+
+	if (num_pts < ws.num_sample) {
 		printf("Not enough matched points \n");
 		goto find_tform_quit;
 	}
-	// Ransac iterations
-	for (i = 0; i < num_iter; i++) {
-		do {
-			ret = ransac(src, ref, ran, tform_cur, &cset, &len);
-		} while (ret == SIFT3D_SINGULAR);
-
-		if (ret == SIFT3D_FAILURE)
-			goto find_tform_quit;
-
-		if (len > len_best) {
-			len_best = len;
-			if ((cset_best = (int *)SIFT3D_safe_realloc(cset_best,
-				len * sizeof(int))) == NULL || 
-				copy_tform(tform_cur, tform))
-				goto find_tform_quit;
-			memcpy(cset_best, cset, len * sizeof(int));
-		}
-	}
+
+	// Ransac iterations, in batches. After each batch, stop if the best 
+        // model so far has been found with the desired confidence.
+        iter_best = num_iter;
+        num_iter_req = num_iter;
+        for (iter = 0; iter < num_iter_req; iter += RANSAC_BATCH) {
+                ransac_batch(&ws, ran, iter, 
+                        SIFT3D_MIN(iter + RANSAC_BATCH, num_iter_req), 
+                        A_best, &len_best, &iter_best);
+                num_iter_req = ransac_num_iter(ran, &ws, len_best);
+        }
 
 	// Check if the minimum number of inliers was found
 	if (len_best < min_num_inliers) {
 		puts("find_tform_ransac: No good model was found! \n");
 		goto find_tform_quit; }
 
+        // Save the best model
+        switch (type) {
+        case TPS:
+                ret = Tps_set_affine(&A_best_mat, (Tps *) tform);
+                break;
+        case BSPLINE_FFD:
+                ret = resize_Bspline((Bspline *) tform, 0, 0, 0, 1.0) ||
+                        copy_Mat_rm(&A_best_mat, &((Bspline *) tform)->A);
+                break;
+        default:
+                ret = Affine_set_mat(&A_best_mat, (Affine *) tform);
+        }
+        if (ret)
+                goto find_tform_quit;
+
 	// Resize the concensus set matrices
+        len_best = ransac_cset(&ws, A_best, err_thresh_sq);
         src_cset.num_rows = ref_cset.num_rows = len_best;
         if (resize_Mat_rm(&src_cset) || resize_Mat_rm(&ref_cset))
                 goto find_tform_quit;
@@ -4826,22 +9866,30 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 	// Extract the concensus set
 	SIFT3D_MAT_RM_LOOP_START(&src_cset, i, j)
 
-	        const int idx = cset_best[i];
+	        const int idx = ws.cset[i];
 
-	        SIFT3D_MAT_RM_GET(&src_cset, i, j, double) =
-	                SIFT3D_MAT_RM_GET(src, idx, j, double);
-	        SIFT3D_MAT_RM_GET(&ref_cset, i, j, double) =
-	                SIFT3D_MAT_RM_GET(ref, idx, j, double);
+	        SIFT3D_MAT_RM_GET(&src_cset, i, j, double) = ws.src[j][idx];
+	        SIFT3D_MAT_RM_GET(&ref_cset, i, j, double) = ws.ref[j][idx];
 
 	SIFT3D_MAT_RM_LOOP_END
 
 #ifdef SIFT3D_RANSAC_REFINE
 	// Refine with least squares
-	switch (solve_system(&src_cset, &ref_cset, tform_cur)) {
+        if (type == AFFINE) {
+                ret = solve_system(&src_cset, &ref_cset, tform);
+        } else if (type == TPS) {
+                ret = fit_Tps(&src_cset, &ref_cset, ran->tps_ctrl, 
+                        ran->tps_lambda, (Tps *) tform);
+        } else if (type == BSPLINE_FFD) {
+                ret = fit_Bspline(&src_cset, &ref_cset, ran->ffd_spacing,
+                        ran->ffd_lambda, (Bspline *) tform);
+        } else if ((ret = ransac_solve(&ws, ws.cset, len_best, A_best)) ==
+                SIFT3D_SUCCESS && 
+                Affine_set_mat(&A_best_mat, (Affine *) tform)) {
+                ret = SIFT3D_FAILURE;
+        }
+	switch (ret) {
 	case SIFT3D_SUCCESS:
-		// Copy the refined transformation to the output
-		if (copy_tform(tform_cur, tform))
-			goto find_tform_quit;
 		break;
 	case SIFT3D_SINGULAR:
 		// Stick with the old transformation 
@@ -4856,26 +9904,18 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 #endif
 
         // Clean up
-	free(cset);
-	free(cset_best);
-	cleanup_tform(tform_cur);
+        cleanup_Ransac_ws(&ws);
         cleanup_Mat_rm(&ref_cset);
         cleanup_Mat_rm(&src_cset);
-	if (tform_cur != NULL)
-		free(tform_cur);
+        cleanup_Mat_rm(&A_best_mat);
 	return SIFT3D_SUCCESS;
 
 find_tform_quit:
         // Clean up and return an error
-	if (cset != NULL)
-		free(cset);
-	if (cset_best != NULL)
-		free(cset_best);
-	cleanup_tform(tform_cur);
-	if (tform_cur != NULL)
-		free(tform_cur);
+        cleanup_Ransac_ws(&ws);
         cleanup_Mat_rm(&ref_cset);
         cleanup_Mat_rm(&src_cset);
+        cleanup_Mat_rm(&A_best_mat);
 	return SIFT3D_FAILURE;
 }
 
@@ -29,6 +29,13 @@ extern "C" {
 /* Parameters */
 const extern double SIFT3D_err_thresh_default;
 const extern int SIFT3D_num_iter_default;
+const extern uint64_t SIFT3D_seed_default;
+const extern double SIFT3D_conf_default;
+const extern int SIFT3D_tdd_default;
+const extern int SIFT3D_tps_ctrl_default;
+const extern double SIFT3D_tps_lambda_default;
+const extern double SIFT3D_ffd_spacing_default;
+const extern double SIFT3D_ffd_lambda_default;
 
 /* Externally-visible routines */
 void *SIFT3D_safe_realloc(void *ptr, size_t size);
@@ -94,10 +101,42 @@ int copy_tform(const void *const src, void *const dst);
 
 int Affine_set_mat(const Mat_rm *const mat, Affine *const affine);
 
+int init_Rigid(Affine *const rigid, const int dim);
+
+int init_Similarity(Affine *const sim, const int dim);
+
+int init_Bspline(Bspline *const bspline);
+
+int init_Disp_field(Disp_field *const field);
+
+int init_Composite(Composite *const comp);
+
+int append_Composite(Composite *const comp, const void *const tform);
+
+int compose_Affine(const Affine *const outer, const Affine *const inner,
+                   Affine *const out);
+
 void apply_tform_xyz(const void *const tform, const double x_in, 
                      const double y_in, const double z_in, double *const x_out,
 		     double *const y_out, double *const z_out);
 
+int apply_tform_points(const void *const tform, const Mat_rm_type type, 
+        const int num, const void *const x_in, const void *const y_in, 
+        const void *const z_in, void *const x_out, void *const y_out, 
+        void *const z_out);
+
+void init_Tps_grid(Tps_grid *const grid);
+
+int make_Tps_grid(const Tps *const tps, const int nx, const int ny, 
+        const int nz, const double tol, Tps_grid *const grid);
+
+int apply_Tps_grid_points(const Tps_grid *const grid, const int num,
+        const double *const x_in, const double *const y_in, 
+        const double *const z_in, double *const x_out, double *const y_out, 
+        double *const z_out);
+
+void cleanup_Tps_grid(Tps_grid *const grid);
+
 int apply_tform_Mat_rm(const void *const tform, const Mat_rm *const mat_in, 
         Mat_rm *const mat_out);
 
@@ -111,6 +150,8 @@ void cleanup_tform(void *const tform);
 
 int write_tform(const char *path, const void *const tform);
 
+int read_tform(const char *path, void *const tform);
+
 int mul_Mat_rm(const Mat_rm *const mat_in1, const Mat_rm *const mat_in2, 
         Mat_rm *const mat_out);
 
@@ -129,10 +170,25 @@ int im_read(const char *path, Image *const im);
 
 int im_write(const char *path, const Image *const im);
 
+void im_set_dcm_index(const int enable);
+
+void im_set_nii_scaling(const int enable);
+
 char *im_get_parent_dir(const char *path);
 
+void im_set_uring(const int enable);
+
+int im_read_files(const char *const *paths, const int num, 
+        const size_t max_len, void **const bufs, size_t *const lens);
+
+int im_read_gz(const char *path, void **const data, size_t *const len);
+
+int im_write_gz(const char *path, const void *const data, const size_t len);
+
 int write_Mat_rm(const char *path, const Mat_rm *const mat);
 
+int read_Mat_rm(const char *path, Mat_rm *const mat);
+
 int init_im_with_dims(Image *const im, const int nx, const int ny, const int nz,
                         const int nc);
 
@@ -183,9 +239,20 @@ int im_inv_transform(const void *const tform, const Image * const src,
 		     const interp_type interp, const int resize, 
                      Image *const dst);
 
+int im_inv_transform_Tps(const Tps *const tps, const Image * const src,
+                         const interp_type interp, const int resize,
+                         const double tol, Image *const dst, 
+                         double *const err);
+
+int make_Disp_field(const void *const tform, const int nx, const int ny,
+                    const int nz, Disp_field *const field);
+
 int im_resample(const Image *const src, const double *const units, 
 	const interp_type interp, Image *const dst);
 
+int im_resample_antialias(const Image *const src, const double *const units, 
+	const interp_type interp, Image *const dst);
+
 void init_im(Image *const im);
 
 int init_Gauss_filter(Gauss_filter *const gauss, const double sigma, 
@@ -240,8 +307,30 @@ int set_err_thresh_Ransac(Ransac *const ran, double err_thresh);
 
 int set_num_iter_Ransac(Ransac *const ran, int num_iter);
 
+int set_seed_Ransac(Ransac *const ran, const uint64_t seed);
+
+int set_conf_Ransac(Ransac *const ran, const double conf);
+
+int set_prosac_Ransac(Ransac *const ran, const int prosac);
+
+int set_tdd_Ransac(Ransac *const ran, const int tdd);
+
+int set_tps_ctrl_Ransac(Ransac *const ran, const int tps_ctrl);
+
+int set_tps_lambda_Ransac(Ransac *const ran, const double tps_lambda);
+
+int set_ffd_spacing_Ransac(Ransac *const ran, const double ffd_spacing);
+
+int set_ffd_lambda_Ransac(Ransac *const ran, const double ffd_lambda);
+
 int copy_Ransac(const Ransac *const src, Ransac *const dst);
 
+int fit_Tps(const Mat_rm *const src, const Mat_rm *const ref, 
+        const int max_ctrl, const double lambda, Tps *const tps);
+
+int fit_Bspline(const Mat_rm *const src, const Mat_rm *const ref, 
+        const double spacing, const double lambda, Bspline *const bspline);
+
 int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src, 
         const Mat_rm *const ref, void *const tform);
 
@@ -12,6 +12,17 @@
 #include "immacros.h"
 #include "nifti.h"
 
+/* Whether read_nii applies the intensity scaling of the header */
+static int nii_scaling_enabled = SIFT3D_FALSE;
+
+/* Enable or disable the NIFTI intensity scaling. When enabled, read_nii 
+ * returns scl_slope * v + scl_inter for each stored voxel v, if scl_slope is
+ * nonzero. Disabled by default, in which case the stored voxels are returned
+ * as they are, so that read_nii followed by write_nii preserves them. */
+void im_set_nii_scaling(const int enable) {
+        nii_scaling_enabled = enable;
+}
+
 #ifndef SIFT3D_WITH_NIFTI
 /* Return error messages if this was not compiled with NIFTI support. */ 
 
@@ -32,25 +43,244 @@ int write_nii(const char *path, const Image *const im) {
 #else
 
 /* Standard includes */
+#include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 /* Nifti includes */
 #include <nifti1_io.h>
 
+/* Helper declarations */
+static int nii_get_scale(const nifti_image *const nifti, float *const slope, 
+        float *const inter);
+static int nii_can_convert(const nifti_image *const nifti, 
+        const Image *const im);
+static int read_nii_mapped(const nifti_image *const nifti, Image *const im);
+static int read_nii_gz(const nifti_image *const nifti, Image *const im);
+static int write_nii_gz(nifti_image *const nifti, const Image *const im,
+        const char *path);
+static void nii_convert(const void *const vox, const int datatype, 
+        const size_t num, const float slope, const float inter, 
+        float *const out);
+
+/* Helper function to convert num voxels of the given NIFTI datatype to 
+ * float, applying the intensity scaling slope * v + inter, in parallel. vox
+ * and out may be the same array for NIFTI_TYPE_FLOAT32. */
+static void nii_convert(const void *const vox, const int datatype, 
+        const size_t num, const float slope, const float inter, 
+        float *const out) {
+
+        ptrdiff_t i;
+
+        const ptrdiff_t n = (ptrdiff_t) num;
+
+        switch (datatype) {
+        case NIFTI_TYPE_UINT8: {
+                const uint8_t *const in = (const uint8_t *) vox;
+#pragma omp parallel for simd schedule(static)
+                for (i = 0; i < n; i++) {
+                        out[i] = slope * (float) in[i] + inter;
+                }
+                break;
+        }
+        case NIFTI_TYPE_INT16: {
+                const int16_t *const in = (const int16_t *) vox;
+#pragma omp parallel for simd schedule(static)
+                for (i = 0; i < n; i++) {
+                        out[i] = slope * (float) in[i] + inter;
+                }
+                break;
+        }
+        case NIFTI_TYPE_UINT16: {
+                const uint16_t *const in = (const uint16_t *) vox;
+#pragma omp parallel for simd schedule(static)
+                for (i = 0; i < n; i++) {
+                        out[i] = slope * (float) in[i] + inter;
+                }
+                break;
+        }
+        case NIFTI_TYPE_FLOAT32: {
+                const float *const in = (const float *) vox;
+#pragma omp parallel for simd schedule(static)
+                for (i = 0; i < n; i++) {
+                        out[i] = slope * in[i] + inter;
+                }
+                break;
+        }
+        default:
+                assert(0);
+        }
+}
+
+/* Helper function to get the intensity scaling of a NIFTI image. Returns
+ * nonzero if the intensities need to be scaled, in which case slope and 
+ * inter are set. Otherwise, these are set to the identity. Scaling is only
+ * applied if enabled with im_set_nii_scaling. */
+static int nii_get_scale(const nifti_image *const nifti, float *const slope, 
+        float *const inter) {
+
+        const int scale = nii_scaling_enabled && nifti->scl_slope != 0.0f && 
+                (nifti->scl_slope != 1.0f || nifti->scl_inter != 0.0f);
+
+        *slope = scale ? nifti->scl_slope : 1.0f;
+        *inter = scale ? nifti->scl_inter : 0.0f;
+        return scale;
+}
+
+/* Helper function to check whether the stored voxels of a NIFTI image can be
+ * converted by nii_convert, i.e. they have one of the common datatypes, in 
+ * native byte order and aligned within the file. The dimensions of im must 
+ * already be set. */
+static int nii_can_convert(const nifti_image *const nifti, 
+        const Image *const im) {
+
+        const size_t num = (size_t) im->nx * im->ny * im->nz;
+
+        switch (nifti->datatype) {
+        case NIFTI_TYPE_FLOAT32:
+        case NIFTI_TYPE_UINT8:
+        case NIFTI_TYPE_INT16:
+        case NIFTI_TYPE_UINT16:
+                break;
+        default:
+                return SIFT3D_FALSE;
+        }
+
+        return nifti->iname != NULL && nifti->iname_offset >= 0 && 
+                nifti->iname_offset % nifti->nbyper == 0 &&
+                nifti->byteorder == nifti_short_order() &&
+                num == (size_t) nifti->nvox && im->nc == 1;
+}
+
+/* Helper function to read the voxels of an uncompressed NIFTI file by
+ * memory-mapping it, for the most common datatypes, stored in native byte
+ * order. float32 data is used in place without copying, while 8- and 16-bit
+ * integers are converted to float in parallel. The dimensions of im must 
+ * already be set.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if the file cannot be
+ * read this way, in which case im is unchanged. */
+static int read_nii_mapped(const nifti_image *const nifti, Image *const im) {
+#ifdef _WINDOWS
+        return SIFT3D_FAILURE;
+#else
+        struct stat st;
+        char *map;
+        size_t map_size;
+        int fd;
+
+        float slope, inter;
+        int scale;
+
+        const size_t num = (size_t) im->nx * im->ny * im->nz;
+
+        // Check that the voxels can be used as stored
+        if (!nii_can_convert(nifti, im) || nifti_is_gzfile(nifti->iname))
+                return SIFT3D_FAILURE;
+        scale = nii_get_scale(nifti, &slope, &inter);
+        map_size = (size_t) nifti->iname_offset + num * nifti->nbyper;
+
+        // Map the file privately, so that writing to the image never 
+        // modifies the file
+        if ((fd = open(nifti->iname, O_RDONLY)) < 0)
+                return SIFT3D_FAILURE;
+        if (fstat(fd, &st) || (size_t) st.st_size < map_size) {
+                close(fd);
+                return SIFT3D_FAILURE;
+        }
+        map = (char *) mmap(NULL, map_size, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return SIFT3D_FAILURE;
+        const void *const vox = map + nifti->iname_offset;
+
+        // Use float data in place, scaling it if necessary
+        if (nifti->datatype == NIFTI_TYPE_FLOAT32) {
+                im_free(im);
+                im->data = (float *) vox;
+                im->size = num;
+                im->map = map;
+                im->map_size = map_size;
+                if (scale)
+                        nii_convert(vox, nifti->datatype, num, slope, inter,
+                                im->data);
+                return SIFT3D_SUCCESS;
+        }
+
+        // Convert other types
+        if (im_resize(im)) {
+                munmap(map, map_size);
+                return SIFT3D_FAILURE;
+        }
+        nii_convert(vox, nifti->datatype, num, slope, inter, im->data);
+        munmap(map, map_size);
+
+        return SIFT3D_SUCCESS;
+#endif
+}
+
+/* Helper function to read the voxels of a gzipped NIFTI file with 
+ * im_read_gz, which decompresses files written by write_nii in parallel. 
+ * Supports the same datatypes as read_nii_mapped, converting them to float
+ * in parallel. The dimensions of im must already be set.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if the file cannot be
+ * read this way, in which case im is unchanged. */
+static int read_nii_gz(const nifti_image *const nifti, Image *const im) {
+
+        void *buf;
+        size_t len;
+        float slope, inter;
+
+        const size_t num = (size_t) im->nx * im->ny * im->nz;
+
+        // Check that the voxels can be used as stored
+        if (!nii_can_convert(nifti, im) || !nifti_is_gzfile(nifti->iname))
+                return SIFT3D_FAILURE;
+
+        // Decompress the whole file
+        if (im_read_gz(nifti->iname, &buf, &len))
+                return SIFT3D_FAILURE;
+        if (len < (size_t) nifti->iname_offset + num * nifti->nbyper ||
+                im_resize(im)) {
+                free(buf);
+                return SIFT3D_FAILURE;
+        }
+
+        // Convert the voxels
+        nii_get_scale(nifti, &slope, &inter);
+        nii_convert((char *) buf + nifti->iname_offset, nifti->datatype, num,
+                slope, inter, im->data);
+        free(buf);
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Helper function to read a NIFTI image (.nii, .nii.gz).
  * Prior to calling this function, use init_im(im).
- * This function allocates memory.
+ * This function allocates memory. Intensities are scaled by scl_slope and
+ * scl_inter only if enabled with im_set_nii_scaling. Uncompressed float32 files are
+ * memory-mapped, rather than copied, while gzipped files are decompressed 
+ * with im_read_gz.
  */
 int read_nii(const char *path, Image *const im)
 {
 
 	nifti_image *nifti;
+        float slope, inter;
 	int x, y, z, i, dim_counter;
 
-	// Read NIFTI file
-	if ((nifti = nifti_image_read(path, 1)) == NULL) {
+	// Read the NIFTI header
+	if ((nifti = nifti_image_read(path, 0)) == NULL) {
 		SIFT3D_ERR("read_nii: failure loading file %s", path);
                 return SIFT3D_FAILURE;
 	}
@@ -80,13 +310,25 @@ int read_nii(const char *path, Image *const im)
 	im->uy = nifti->dy;
 	im->uz = nifti->dz;
 
-	// Resize im    
+	// Set the dimensions
 	im->nx = nifti->nx;
 	im->ny = nifti->ny;
 	im->nz = nifti->nz;
 	im->nc = 1;
 	im_default_stride(im);
-	im_resize(im);
+
+        // Try to read the voxels directly from the file
+        if (!read_nii_mapped(nifti, im) || !read_nii_gz(nifti, im))
+                goto read_nii_done;
+
+        // Otherwise, read them with nifticlib
+        if (nifti_image_load(nifti)) {
+		SIFT3D_ERR("read_nii: failure loading data from file %s", 
+                        path);
+                goto read_nii_quit;
+        }
+	if (im_resize(im))
+                goto read_nii_quit;
 
 #define IM_COPY_FROM_TYPE(type) \
     SIFT3D_IM_LOOP_START(im, x, y, z)   \
@@ -137,6 +379,12 @@ int read_nii(const char *path, Image *const im)
 	}
 #undef IM_COPY_FROM_TYPE
 
+        // Apply the intensity scaling
+        if (nii_get_scale(nifti, &slope, &inter))
+                nii_convert(im->data, NIFTI_TYPE_FLOAT32, im->size, slope,
+                        inter, im->data);
+
+read_nii_done:
 	// Clean up NIFTI data
 	nifti_free_extensions(nifti);
 	nifti_image_free(nifti);
@@ -149,8 +397,41 @@ read_nii_quit:
 	return SIFT3D_FAILURE;
 }
 
+/* Helper function to write a NIFTI image to a .nii.gz file, compressing it in
+ * parallel with im_write_gz. The file holds a single-file NIFTI-1 header
+ * without extensions, followed by the voxels of im. */
+static int write_nii_gz(nifti_image *const nifti, const Image *const im,
+        const char *path) {
+
+        struct nifti_1_header hdr;
+        char *buf;
+        int ret;
+
+        const size_t vox_offset = sizeof(hdr) + 4;
+        const size_t data_size = im->size * sizeof(float);
+
+        // Convert the header, placing the voxels after the extension flag
+        nifti->nifti_type = NIFTI_FTYPE_NIFTI1_1;
+        nifti->iname_offset = (int) vox_offset;
+        hdr = nifti_convert_nim2nhdr(nifti);
+
+        // Write the header and voxels to memory
+        if ((buf = malloc(vox_offset + data_size)) == NULL)
+                return SIFT3D_FAILURE;
+        memcpy(buf, &hdr, sizeof(hdr));
+        memset(buf + sizeof(hdr), 0, vox_offset - sizeof(hdr));
+        memcpy(buf + vox_offset, im->data, data_size);
+
+        // Compress the file
+        ret = im_write_gz(path, buf, vox_offset + data_size);
+        free(buf);
+
+        return ret;
+}
+
 /* Write a Image to the specified path, in NIFTI format.
- * The path extension must be one of (.nii, .nii.gz). */
+ * The path extension must be one of (.nii, .nii.gz). Compressed files are
+ * written in parallel, as in im_write_gz. */
 int write_nii(const char *path, const Image *const im)
 {
 
@@ -189,7 +470,13 @@ int write_nii(const char *path, const Image *const im)
 	if (!nifti_nim_is_valid(nifti, 1))
 		goto write_nii_quit;
 
-	nifti_image_write(nifti);
+        // Write the file, compressing it ourselves if necessary
+        if (nifti_is_gzfile(path)) {
+                if (write_nii_gz(nifti, im, path))
+                        goto write_nii_quit;
+        } else {
+	        nifti_image_write(nifti);
+        }
 	nifti_free_extensions(nifti);
 	nifti_image_free(nifti);
 
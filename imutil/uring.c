@@ -0,0 +1,364 @@
+/* -----------------------------------------------------------------------------
+ * uring.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Batched file reads with the Linux io_uring interface. The opens and reads
+ * of many files are queued to the kernel together, so their latencies
+ * overlap. This talks to the kernel directly, without liburing.
+ * -----------------------------------------------------------------------------
+ */
+
+/* SIFT3D includes */
+#include "imutil.h"
+#include "immacros.h"
+#include "uring.h"
+
+#ifndef SIFT3D_WITH_URING
+/* Without io_uring, the caller falls back to reading with stdio. */
+
+int read_files_uring(const char *const *paths, const int num,
+        const size_t max_len, void **const bufs, size_t *const lens) {
+        return SIFT3D_WRAPPER_NOT_COMPILED;
+}
+
+#else
+
+/* Standard includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Implementation parameters */
+#define URING_DEPTH 64 /* Maximum number of operations in flight */
+#define URING_MAX_READ (1 << 30) /* Maximum length of a single read */
+
+/* Operation codes, stored in the low bit of the user data */
+#define URING_OP_OPEN 0
+#define URING_OP_READ 1
+
+/* A submission and completion queue pair, mapped from the kernel */
+typedef struct _Uring {
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ptr, *cq_ptr;
+        size_t sq_size, cq_size, sqes_size;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        unsigned to_submit;
+        int fd;
+} Uring;
+
+/* The state of one file in a batch */
+typedef struct _Uring_file {
+        size_t len;     // Number of bytes to read
+        size_t off;     // Number of bytes read so far
+        int fd;         // File descriptor, or -1 if closed
+        int busy;       // SIFT3D_TRUE if an operation is in flight
+} Uring_file;
+
+/* Helper declarations */
+static int uring_init(Uring *const ring, const unsigned entries);
+static void uring_cleanup(Uring *const ring);
+static void uring_push(Uring *const ring, 
+        const struct io_uring_sqe *const sqe);
+static int uring_enter(Uring *const ring);
+static int uring_pop(Uring *const ring, uint64_t *const user_data,
+        int *const res);
+static void uring_queue_read(Uring *const ring, Uring_file *const file,
+        void *const buf, const int idx);
+
+/* Set up a ring with the given number of entries. Returns SIFT3D_SUCCESS on
+ * success, SIFT3D_FAILURE if io_uring is unavailable. */
+static int uring_init(Uring *const ring, const unsigned entries) {
+
+        struct io_uring_params p;
+        char *sq, *cq;
+
+        memset(ring, 0, sizeof(Uring));
+        ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+
+        // Create the ring
+        memset(&p, 0, sizeof(p));
+        if ((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p)) < 0)
+                return SIFT3D_FAILURE;
+
+        // Map the queues. Newer kernels map both rings at once.
+        ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                ring->sq_size = ring->cq_size = SIFT3D_MAX(ring->sq_size,
+                        ring->cq_size);
+        ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED)
+                goto uring_init_quit;
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                ring->cq_ptr = mmap(NULL, ring->cq_size,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+                if (ring->cq_ptr == MAP_FAILED)
+                        goto uring_init_quit;
+        }
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto uring_init_quit;
+
+        // Get pointers to the ring fields
+        sq = (char *) ring->sq_ptr;
+        cq = (char *) ring->cq_ptr;
+        ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+        ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+        ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+        return SIFT3D_SUCCESS;
+
+uring_init_quit:
+        uring_cleanup(ring);
+        return SIFT3D_FAILURE;
+}
+
+/* Release a ring. Operations still in flight are cancelled by the kernel. */
+static void uring_cleanup(Uring *const ring) {
+
+        if (ring->sqes != MAP_FAILED)
+                munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+                munmap(ring->cq_ptr, ring->cq_size);
+        if (ring->sq_ptr != MAP_FAILED)
+                munmap(ring->sq_ptr, ring->sq_size);
+        if (ring->fd >= 0)
+                close(ring->fd);
+        ring->fd = -1;
+}
+
+/* Add an operation to the submission queue. The caller must keep the number
+ * of queued operations within the ring size. */
+static void uring_push(Uring *const ring, 
+        const struct io_uring_sqe *const sqe) {
+
+        // Only this thread writes the tail
+        const unsigned tail = *ring->sq_tail;
+        const unsigned idx = tail & *ring->sq_mask;
+
+        ring->sqes[idx] = *sqe;
+        ring->sq_array[idx] = idx;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring->to_submit++;
+}
+
+/* Submit the queued operations and wait for at least one completion. */
+static int uring_enter(Uring *const ring) {
+
+        int ret;
+
+        do {
+                ret = (int) syscall(__NR_io_uring_enter, ring->fd,
+                        ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+        if (ret < 0)
+                return SIFT3D_FAILURE;
+
+        ring->to_submit -= (unsigned) ret;
+        return SIFT3D_SUCCESS;
+}
+
+/* Take a completion from the queue. Returns SIFT3D_TRUE if one was
+ * available, SIFT3D_FALSE otherwise. */
+static int uring_pop(Uring *const ring, uint64_t *const user_data,
+        int *const res) {
+
+        const unsigned head = *ring->cq_head;
+        const struct io_uring_cqe *cqe;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                return SIFT3D_FALSE;
+
+        cqe = ring->cqes + (head & *ring->cq_mask);
+        *user_data = cqe->user_data;
+        *res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        return SIFT3D_TRUE;
+}
+
+/* Queue a read of the remainder of a file into buf. */
+static void uring_queue_read(Uring *const ring, Uring_file *const file,
+        void *const buf, const int idx) {
+
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = file->fd;
+        sqe.addr = (uint64_t) (uintptr_t) ((char *) buf + file->off);
+        sqe.len = (uint32_t) SIFT3D_MIN(file->len - file->off,
+                (size_t) URING_MAX_READ);
+        sqe.off = file->off;
+        sqe.user_data = ((uint64_t) idx << 1) | URING_OP_READ;
+        uring_push(ring, &sqe);
+        file->busy = SIFT3D_TRUE;
+}
+
+/* Read a batch of files with io_uring. See im_read_files for the parameters.
+ * Files which could not be read are left with a NULL buffer, for the caller
+ * to retry.
+ *
+ * Returns SIFT3D_SUCCESS if the batch was processed, SIFT3D_FAILURE if
+ * io_uring is unavailable, in which case all buffers are NULL. */
+int read_files_uring(const char *const *paths, const int num,
+        const size_t max_len, void **const bufs, size_t *const lens) {
+
+        Uring ring;
+        Uring_file *files;
+        struct io_uring_sqe sqe;
+        uint64_t user_data;
+        int i, res, next, done, inflight, ret;
+
+        for (i = 0; i < num; i++) {
+                bufs[i] = NULL;
+                lens[i] = 0;
+        }
+        if (num < 1)
+                return SIFT3D_SUCCESS;
+
+        // Set up the ring
+        if ((files = (Uring_file *) malloc(num * sizeof(Uring_file))) == NULL)
+                return SIFT3D_FAILURE;
+        if (uring_init(&ring, URING_DEPTH)) {
+                free(files);
+                return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < num; i++) {
+                files[i].fd = -1;
+                files[i].busy = SIFT3D_FALSE;
+        }
+
+        ret = SIFT3D_SUCCESS;
+        next = done = inflight = 0;
+        while (done < num) {
+
+                // Queue the opens of the next files, up to the queue depth
+                while (next < num && inflight < URING_DEPTH) {
+                        memset(&sqe, 0, sizeof(sqe));
+                        sqe.opcode = IORING_OP_OPENAT;
+                        sqe.fd = AT_FDCWD;
+                        sqe.addr = (uint64_t) (uintptr_t) paths[next];
+                        sqe.open_flags = O_RDONLY | O_CLOEXEC;
+                        sqe.user_data = ((uint64_t) next << 1) |
+                                URING_OP_OPEN;
+                        uring_push(&ring, &sqe);
+                        files[next].busy = SIFT3D_TRUE;
+                        inflight++;
+                        next++;
+                }
+
+                // Submit, and wait for a completion
+                if (uring_enter(&ring)) {
+                        ret = SIFT3D_FAILURE;
+                        break;
+                }
+
+                // Process the completions. Each one frees a slot in the
+                // queue, which a read may take.
+                while (uring_pop(&ring, &user_data, &res)) {
+
+                        struct stat st;
+
+                        const int idx = (int) (user_data >> 1);
+                        Uring_file *const file = files + idx;
+
+                        inflight--;
+                        file->busy = SIFT3D_FALSE;
+
+                        if ((user_data & 1) == URING_OP_OPEN) {
+
+                                // Leave failed opens to the caller
+                                if (res < 0) {
+                                        done++;
+                                        continue;
+                                }
+                                file->fd = res;
+
+                                // Allocate the buffer
+                                if (fstat(file->fd, &st) ||
+                                        !S_ISREG(st.st_mode))
+                                        goto read_files_uring_fail;
+                                file->len = (size_t) st.st_size;
+                                if (max_len > 0 && file->len > max_len)
+                                        file->len = max_len;
+                                file->off = 0;
+                                if ((bufs[idx] = malloc(file->len > 0 ?
+                                        file->len : 1)) == NULL)
+                                        goto read_files_uring_fail;
+                        } else if (res < 0) {
+                                goto read_files_uring_fail;
+                        } else if (res == 0) {
+                                // The file was truncated since we opened it
+                                file->len = file->off;
+                        } else {
+                                file->off += (size_t) res;
+                        }
+
+                        // Read the rest of the file
+                        if (file->off < file->len) {
+                                uring_queue_read(&ring, file, bufs[idx], idx);
+                                inflight++;
+                                continue;
+                        }
+
+                        // The file is complete
+                        lens[idx] = file->len;
+                        close(file->fd);
+                        file->fd = -1;
+                        done++;
+                        continue;
+
+read_files_uring_fail:
+                        // Leave the file to the caller
+                        free(bufs[idx]);
+                        bufs[idx] = NULL;
+                        close(file->fd);
+                        file->fd = -1;
+                        done++;
+                }
+        }
+
+        // On failure, release everything not still in use by the kernel.
+        // The buffers of operations in flight are leaked, as they may yet be
+        // written.
+        if (ret) {
+                for (i = 0; i < num; i++) {
+                        Uring_file *const file = files + i;
+                        if (file->fd >= 0)
+                                close(file->fd);
+                        if (!file->busy)
+                                free(bufs[i]);
+                        bufs[i] = NULL;
+                        lens[i] = 0;
+                }
+        }
+
+        uring_cleanup(&ring);
+        free(files);
+
+        return ret;
+}
+
+#endif
@@ -0,0 +1,16 @@
+/* -----------------------------------------------------------------------------
+ * uring.h
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Internal header file for the io_uring batched file reader.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+int read_files_uring(const char *const *paths, const int num,
+        const size_t max_len, void **const bufs, size_t *const lens);
+
+#endif
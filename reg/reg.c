@@ -23,13 +23,102 @@
 /* Default parameters */
 const double SIFT3D_nn_thresh_default = 0.8; // Default matching threshold
 
+/* Units of an image in voxels */
+static const double unit_units[IM_NDIMS] = {1.0, 1.0, 1.0};
+
 /* Internal helper routines */
 static void scale_SIFT3D(const double *const factors, 
 	SIFT3D_Descriptor_store *const d);
 static int im2mm(const Mat_rm *const im, const double *const units, 
         Mat_rm *const mm);
+static int mm2im_Mat_rm(const double *const src_units,
+        const double *const ref_units, Mat_rm *const A);
 static int mm2im(const double *const src_units, const double *const ref_units,
         void *const tform);
+static int cmp_match_ratio(const void *const a, const void *const b);
+static int sort_matches(const int *const matches, const float *const ratios,
+        const int num, Mat_rm *const match_src, Mat_rm *const match_ref);
+
+/* Helper struct to sort the matches by quality */
+typedef struct _Match_ratio {
+        float ratio;    // Nearest neighbor distance ratio
+        int row;        // Row in the match matrices
+} Match_ratio;
+
+/* Helper function for qsort, ordering matches by increasing ratio, then by
+ * row. */
+static int cmp_match_ratio(const void *const a, const void *const b) {
+
+        const Match_ratio *const ma = a;
+        const Match_ratio *const mb = b;
+
+        if (ma->ratio != mb->ratio)
+                return ma->ratio < mb->ratio ? -1 : 1;
+
+        return ma->row - mb->row;
+}
+
+/* Sort the rows of the match matrices, in the order returned by 
+ * SIFT3D_matches_to_Mat_rm, from best to worst nearest neighbor ratio. The 
+ * matches and ratios arrays are as returned by SIFT3D_nn_match_ratio, with
+ * num elements.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int sort_matches(const int *const matches, const float *const ratios,
+        const int num, Mat_rm *const match_src, Mat_rm *const match_ref) {
+
+        Mat_rm src_sorted, ref_sorted;
+        Match_ratio *order;
+        int i, j, num_matches;
+
+        const int num_rows = match_src->num_rows;
+
+        if (num_rows < 1)
+                return SIFT3D_SUCCESS;
+
+        // Collect the ratios of the matched rows
+        if ((order = malloc(num_rows * sizeof(Match_ratio))) == NULL)
+                return SIFT3D_FAILURE;
+        num_matches = 0;
+        for (i = 0; i < num && num_matches < num_rows; i++) {
+                if (matches[i] == -1)
+                        continue;
+                order[num_matches].ratio = ratios[i];
+                order[num_matches].row = num_matches;
+                num_matches++;
+        }
+
+        qsort(order, num_matches, sizeof(Match_ratio), cmp_match_ratio);
+
+        // Permute the rows
+        if (init_Mat_rm(&src_sorted, num_rows, match_src->num_cols, 
+                SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                free(order);
+                return SIFT3D_FAILURE;
+        }
+        if (init_Mat_rm(&ref_sorted, num_rows, match_ref->num_cols, 
+                SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                free(order);
+                cleanup_Mat_rm(&src_sorted);
+                return SIFT3D_FAILURE;
+        }
+        SIFT3D_MAT_RM_LOOP_START(&src_sorted, i, j)
+                const int row = order[i].row;
+                SIFT3D_MAT_RM_GET(&src_sorted, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(match_src, row, j, double);
+                SIFT3D_MAT_RM_GET(&ref_sorted, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(match_ref, row, j, double);
+        SIFT3D_MAT_RM_LOOP_END
+
+        i = copy_Mat_rm(&src_sorted, match_src) || 
+                copy_Mat_rm(&ref_sorted, match_ref);
+
+        free(order);
+        cleanup_Mat_rm(&src_sorted);
+        cleanup_Mat_rm(&ref_sorted);
+
+        return i ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
 
 /* Convert an [mxIM_NDIMS] coordinate matrix from image space to mm. 
  *
@@ -67,7 +156,40 @@ static int im2mm(const Mat_rm *const im, const double *const units,
         return SIFT3D_SUCCESS;
 }
 
+/* Convert an affine transformation matrix from mm to image space, in-place.
+ * See mm2im. */
+static int mm2im_Mat_rm(const double *const src_units, 
+        const double *const ref_units, Mat_rm *const A) {
+
+        int i, j;
+
+        // Verify the dimensions
+        if (A->num_rows != IM_NDIMS || A->num_cols != IM_NDIMS + 1) {
+                SIFT3D_ERR("mm2im: Invalid transform "
+                        "dimensionality: %d \n", A->num_rows);
+                return SIFT3D_FAILURE;
+        }
+
+        // Convert the Affine transformation matrix in-place
+        SIFT3D_MAT_RM_LOOP_START(A, i, j)
+                // Invert the input transformation ref->mm
+                SIFT3D_MAT_RM_GET(A, i, j, double) *= 
+                        j < IM_NDIMS ? ref_units[j] : 1.0;
+
+                // Invert the output transformation src->mm
+                SIFT3D_MAT_RM_GET(A, i, j, double) /= 
+                        src_units[i];
+        SIFT3D_MAT_RM_LOOP_END
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Convert a transformation from mm to image space.
+ *
+ * Thin-plate splines are only converted exactly if the reference image has 
+ * isotropic voxels, since the radial kernel does not survive an anisotropic
+ * scaling. Otherwise, this function fails. register_SIFT3D avoids this by 
+ * fitting such splines in reference voxels, passing unit ref_units here.
  *
  * Parameters:
  *   tform: The transformation, which shall be modified.
@@ -83,31 +205,115 @@ static int mm2im(const double *const src_units, const double *const ref_units,
 
         switch (type) {
         case AFFINE:
+        case RIGID:
+        case SIMILARITY:
                 { 
-                        int i, j;
-
                         Affine *const aff = (Affine *const) tform;
-                        Mat_rm *const A = &aff->A;
+
+                        if (mm2im_Mat_rm(src_units, ref_units, &aff->A))
+                                return SIFT3D_FAILURE;
+                }
+                break; 
+        case TPS:
+                {
+                        double s, log_s_sq, shift;
+                        int i, j, k, n;
+
+                        Tps *const tps = (Tps *const) tform;
+                        Mat_rm *const params = &tps->params;
+                        Mat_rm *const kp_src = &tps->kp_src;
 
                         // Verify the dimensions
-                        if (A->num_rows != IM_NDIMS) {
+                        n = kp_src->num_rows;
+                        if (tps->dim != IM_NDIMS || 
+                                kp_src->num_cols != IM_NDIMS ||
+                                params->num_rows != IM_NDIMS || 
+                                params->num_cols != n + IM_NDIMS + 1) {
                                 SIFT3D_ERR("mm2im: Invalid transform "
-                                        "dimensionality: %d \n", A->num_rows);
+                                        "dimensionality: %d \n", tps->dim);
                                 return SIFT3D_FAILURE;
                         }
 
-                        // Convert the Affine transformation matrix in-place
-                        SIFT3D_MAT_RM_LOOP_START(A, i, j)
-                                // Invert the input transformation ref->mm
-                                SIFT3D_MAT_RM_GET(A, i, j, double) *= 
-                                        j < IM_NDIMS ? ref_units[j] : 1.0;
+                        // Verify the reference voxels are isotropic
+                        s = ref_units[0];
+                        for (j = 1; j < IM_NDIMS; j++) {
+                                if (fabs(ref_units[j] - s) > 1e-6 * s) {
+                                        SIFT3D_ERR("mm2im: thin-plate "
+                                                "splines require isotropic "
+                                                "reference voxels, got "
+                                                "[%f, %f, %f] \n", 
+                                                ref_units[0], ref_units[1],
+                                                ref_units[2]);
+                                        return SIFT3D_FAILURE;
+                                }
+                        }
+
+                        /* Invert the input transformation ref->mm. Since the
+                         * weights sum to zero, with zero first moments, 
+                         * U(s * r) = s^2 * U(r) + s^2 * r^2 * log(s^2) only 
+                         * shifts the constant term. */
+                        log_s_sq = log(s * s);
+                        for (i = 0; i < IM_NDIMS; i++) {
+
+                                shift = 0.0;
+                                for (k = 0; k < n; k++) {
+
+                                        double c_sq = 0.0;
+
+                                        for (j = 0; j < IM_NDIMS; j++) {
+                                                const double c = 
+                                                        SIFT3D_MAT_RM_GET(
+                                                        kp_src, k, j, double);
+                                                c_sq += c * c;
+                                        }
+
+                                        shift += SIFT3D_MAT_RM_GET(params, 
+                                                i, k, double) * c_sq;
+                                        SIFT3D_MAT_RM_GET(params, i, k, 
+                                                double) *= s * s;
+                                }
+
+                                SIFT3D_MAT_RM_GET(params, i, n, double) += 
+                                        shift * log_s_sq;
+                                for (j = 0; j < IM_NDIMS; j++) {
+                                        SIFT3D_MAT_RM_GET(params, i, 
+                                                n + 1 + j, double) *= s;
+                                }
+                        }
+                        SIFT3D_MAT_RM_LOOP_START(kp_src, k, j)
+                                SIFT3D_MAT_RM_GET(kp_src, k, j, double) /= s;
+                        SIFT3D_MAT_RM_LOOP_END
 
-                                // Invert the output transformation src->mm
-                                SIFT3D_MAT_RM_GET(A, i, j, double) /= 
+                        // Invert the output transformation src->mm
+                        SIFT3D_MAT_RM_LOOP_START(params, i, j)
+                                SIFT3D_MAT_RM_GET(params, i, j, double) /= 
                                         src_units[i];
                         SIFT3D_MAT_RM_LOOP_END
                 }
-                break; 
+                break;
+        case BSPLINE_FFD:
+                {
+                        int i, m;
+
+                        Bspline *const bspline = (Bspline *const) tform;
+                        Mat_rm *const coef = &bspline->coef;
+
+                        // Convert the affine part
+                        if (mm2im_Mat_rm(src_units, ref_units, &bspline->A))
+                                return SIFT3D_FAILURE;
+
+                        // Invert the input transformation ref->mm
+                        for (i = 0; i < IM_NDIMS; i++) {
+                                bspline->spacing[i] /= ref_units[i];
+                        }
+
+                        // Invert the output transformation src->mm
+                        SIFT3D_MAT_RM_LOOP_START(coef, i, m)
+                                SIFT3D_MAT_RM_GET(coef, i, m, double) /= 
+                                        src_units[m];
+                        SIFT3D_MAT_RM_LOOP_END
+                }
+                break;
         default:
                 SIFT3D_ERR("mm2im: unsupported transform type. \n");
                 return SIFT3D_FAILURE;
@@ -229,6 +435,10 @@ int set_ref_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const ref) {
 }
 
 /* Run the registration procedure. 
+ *
+ * The transformation is fit in mm. The exception is a thin-plate spline when 
+ * the reference image has anisotropic voxels, which is fit from reference 
+ * voxels to source mm, and then converted to voxels.
  *
  * Parameters: 
  *   reg: The struct holding registration state.
@@ -239,7 +449,9 @@ int set_ref_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const ref) {
 int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
 
         Mat_rm match_src_mm, match_ref_mm;
+        const double *ref_units;
         int *matches;
+        float *ratios;
         int i, j;
 
         Ransac *const ran = &reg->ran;
@@ -263,14 +475,16 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
 
         // Initialize intermediates
         matches = NULL;
+        ratios = NULL;
         if (init_Mat_rm(&match_src_mm, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
 	        init_Mat_rm(&match_ref_mm, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
                 SIFT3D_ERR("register_SIFT3D: failed initialization \n");
                 return SIFT3D_FAILURE;
         }
 
-	// Match features
-	if (SIFT3D_nn_match(desc_src, desc_ref, nn_thresh, &matches)) {
+	// Match features, keeping the ratios for PROSAC
+	if (SIFT3D_nn_match_ratio(desc_src, desc_ref, nn_thresh, &matches,
+                ran->prosac ? &ratios : NULL)) {
 		SIFT3D_ERR("register_SIFT3D: failed to match "
                         "descriptors \n");
                 goto register_SIFT3D_quit;
@@ -288,22 +502,46 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
         if (tform == NULL)
                 goto register_SIFT3D_success;
 
+        // Thin-plate splines cannot be converted from anisotropic mm to 
+        // voxels, so in that case they are fit in reference voxels
+        ref_units = reg->ref_units;
+        if (tform_get_type(tform) == TPS) {
+                for (i = 1; i < IM_NDIMS; i++) {
+                        if (fabs(ref_units[i] - ref_units[0]) > 
+                                1e-6 * ref_units[0]) {
+                                ref_units = unit_units;
+                                break;
+                        }
+                }
+        }
+
         // Convert the coordinate matrices to real-world units
         if (im2mm(match_src, reg->src_units, &match_src_mm) ||
-            im2mm(match_ref, reg->ref_units, &match_ref_mm))
+            im2mm(match_ref, ref_units, &match_ref_mm))
                 goto register_SIFT3D_quit;
 
+        // Order the matches from best to worst, for PROSAC. Only the copies
+        // are sorted, so that reg->match_src and reg->match_ref keep the 
+        // order of the descriptors.
+        if (ran->prosac && sort_matches(matches, ratios, desc_src->num,
+                &match_src_mm, &match_ref_mm)) {
+		SIFT3D_ERR("register_SIFT3D: failed to sort the matches \n");
+                goto register_SIFT3D_quit;
+        }
+
 	// Find the transformation in real-world units
 	if (find_tform_ransac(ran, &match_src_mm, &match_ref_mm, tform))
                 goto register_SIFT3D_quit;
 
         // Convert the transformation back to image space
-        if (mm2im(reg->src_units, reg->ref_units, tform))
+        if (mm2im(reg->src_units, ref_units, tform))
                 goto register_SIFT3D_quit;
 
 register_SIFT3D_success:
         // Clean up
         free(matches);
+        if (ratios != NULL)
+                free(ratios);
         cleanup_Mat_rm(&match_src_mm);
         cleanup_Mat_rm(&match_ref_mm);
 
@@ -311,6 +549,8 @@ register_SIFT3D_success:
 
 register_SIFT3D_quit:
         free(matches);
+        if (ratios != NULL)
+                free(ratios);
         cleanup_Mat_rm(&match_src_mm); 
         cleanup_Mat_rm(&match_ref_mm); 
         return SIFT3D_FAILURE;
@@ -15,7 +15,20 @@
 #include <math.h>
 #include <assert.h>
 #include <float.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <getopt.h>
+#if defined(__AVX2__) || defined(__AVX512VNNI__) || \
+        defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "imtypes.h"
 #include "immacros.h"
 #include "imutil.h"
@@ -54,6 +67,19 @@ const double desc_sig_fctr = 7.071067812; // See ori_sig_fctr, 5 * sqrt(2)
 const double desc_rad_fctr = 2.0;  // See ori_rad_fctr
 const double trunc_thresh = 0.2f * 128.0f / DESC_NUMEL; // Descriptor truncation threshold
 
+/* Binary descriptor database format */
+const char db_magic[8] = {'S', 'I', 'F', 'T', '3', 'D', 'D', 'B'};
+const uint32_t db_version = 1;          // Current format version
+const uint32_t db_byte_order = 0x01020304; // Detects foreign endianness
+const size_t db_align = 64;             // Alignment of the coordinate block
+const size_t db_feat_align = 4096;      // Alignment of the feature block
+const size_t db_shard_bytes = 1 << 26;  // Bytes of features per shard
+const char ext_db[] = "sdb";            // File extension
+
+/* PCA projection file format */
+const char pca_magic[8] = {'S', 'I', 'F', 'T', '3', 'D', 'P', 'C'};
+const uint32_t pca_version = 1;         // Current format version
+
 /* Internal math constants */
 const double gr = 1.6180339887; // Golden ratio
 
@@ -146,6 +172,31 @@ const double gr = 1.6180339887; // Golden ratio
 #define DESC_MAT_GET_COL(hist_idx, a, p) \
         (((hist_idx) * HIST_NUMEL) + HIST_GET_IDX(a, p) + IM_NDIMS)
 
+// Get a pointer to the feature vector of a SIFT3D_Descriptor. The histograms
+// are stored contiguously, in the same order as DESC_MAT_GET_COL
+#define DESC_GET_FEAT(desc) ((const float *) (desc)->hists)
+
+// The distance, in floats, between the features of adjacent descriptors in a
+// SIFT3D_Descriptor_store
+#define DESC_STORE_STRIDE (sizeof(SIFT3D_Descriptor) / sizeof(float))
+
+// Tiling parameters for the blocked nearest-neighbor kernel
+#define NN_BLOCK_Q 4   // Queries sharing each reference load
+#define NN_TILE_R 128  // References per cache tile
+#define NN_CHUNK_Q 64  // Queries per thread work item
+#define NN_BATCH_Q 1024 // Queries per work item in SIFT3D_nn_match_batch
+
+// The largest quantized descriptor element. This is limited to 7 bits so that
+// the dot-product kernels may treat one operand as signed.
+#define QUANT_MAX 127
+
+/* A contiguous range of queries from one pair in SIFT3D_nn_match_batch */
+typedef struct _Nn_seg {
+        int pair;       // Index of the pair
+        int start;      // Index of the first query
+        int len;        // Number of queries
+} Nn_seg;
+
 // As SIFT3D_IM_GET_GRAD, but with physical units (1, 1, 1)
 #define IM_GET_GRAD_ISO(im, x, y, z, c, vd) { \
         SIFT3D_IM_GET_GRAD(im, x, y, z, c, vd); \
@@ -207,9 +258,29 @@ static void vox2hist(const Image *const im, const int x, const int y,
 static void hist2vox(Hist *const hist, const Image *const im, const int x, 
         const int y, const int z);
 static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh);
+        const SIFT3D_Descriptor_store *const store, const float nn_thresh,
+        float *const ratio);
 static int resize_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc,
         const int num);
+static void nn_block(const int numel, const float *const q, 
+        const size_t q_stride, const int nq, const float *const r, 
+        const size_t r_stride, const int nr, const int r_idx0, 
+        float *const best, float *const nearest, int *const best_idx);
+static int32_t quant_dot(const uint8_t *const a, const uint8_t *const b);
+static void qnn_block(const SIFT3D_Qdesc_store *const q, const int q_start,
+        const int nq, const SIFT3D_Qdesc_store *const r, const int r_start,
+        const int nr, int32_t *const best, int32_t *const nearest, 
+        int *const best_idx);
+static int hamming_dist(const uint64_t *const a, const uint64_t *const b);
+static void bnn_search(const uint64_t *const bits, 
+        const SIFT3D_Bdesc_store *const store, int *const best, 
+        int *const nearest, int *const best_idx);
+static int nn_ratio_test(const float best, const float nearest,
+        const float nn_thresh);
+static void db_advise(const SIFT3D_Descriptor_db *const db, 
+        const size_t start, const size_t num, const int will_need);
+static int is_db_path(const char *path);
+static int open_db_view(const char *path, SIFT3D_Descriptor_db *const db);
 
 /* Initialize geometry tables. */
 static int init_geometry(SIFT3D *sift3d) {
@@ -2840,6 +2911,21 @@ int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
 int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 		    const SIFT3D_Descriptor_store *const d2,
 		    const float nn_thresh, int **const matches) {
+        return SIFT3D_nn_match_ratio(d1, d2, nn_thresh, matches, NULL);
+}
+
+/* As SIFT3D_nn_match, but also returns the quality of each match. 
+ *
+ * If ratios is not NULL, *ratios must be either NULL or a pointer to a
+ * previously-allocated array, which is reallocated to size d1->num. On 
+ * return, the ith element of ratios contains the ratio of the distances to 
+ * the nearest and second-nearest neighbors of the ith descriptor in d1, as
+ * thresholded by nn_thresh. Lower is better. This is the ordering expected by
+ * the PROSAC mode of find_tform_ransac. */
+int SIFT3D_nn_match_ratio(const SIFT3D_Descriptor_store *const d1,
+		          const SIFT3D_Descriptor_store *const d2,
+		          const float nn_thresh, int **const matches,
+                          float **const ratios) {
 
 	int i;
 
@@ -2847,7 +2933,7 @@ int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 
         // Verify inputs
 	if (num < 1) {
-		SIFT3D_ERR("_SIFT3D_nn_match: invalid number of "
+		SIFT3D_ERR("SIFT3D_nn_match_ratio: invalid number of "
 			"descriptors in d1: %d \n", num);
 		return SIFT3D_FAILURE;
 	}
@@ -2855,7 +2941,14 @@ int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 	// Resize the matches array (num cannot be zero)
 	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
 		num * sizeof(int))) == NULL) {
-	    SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
+	    SIFT3D_ERR("SIFT3D_nn_match_ratio: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+	// Resize the ratios array
+	if (ratios != NULL && (*ratios = (float *) SIFT3D_safe_realloc(*ratios, 
+		num * sizeof(float))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_ratio: out of memory! \n");
 	    return SIFT3D_FAILURE;
 	}
 
@@ -2870,16 +2963,17 @@ int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 
                 const SIFT3D_Descriptor *const desc1 = d1->buf + i;
                 int *const match = *matches + i;
+                float *const ratio = ratios == NULL ? NULL : *ratios + i;
 
                 // Forward matching pass
-                *match = match_desc(desc1, d2, nn_thresh);
+                *match = match_desc(desc1, d2, nn_thresh, ratio);
 
                 // We are done if there was no match
                 if (*match < 0)
                         continue;
 
                 // Check for forward-backward consistency
-                if (match_desc(d2->buf + *match, d1, nn_thresh) != i) {
+                if (match_desc(d2->buf + *match, d1, nn_thresh, NULL) != i) {
                         *match = -1;
                 }
         }
@@ -2888,9 +2982,11 @@ int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 }
 
 /* Helper function to match desc against the descriptors in store. Returns the
- * index of the match, or -1 if none was found. */
+ * index of the match, or -1 if none was found. If ratio is not NULL, it 
+ * receives the nearest neighbor distance ratio. */
 static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh) {
+        const SIFT3D_Descriptor_store *const store, const float nn_thresh,
+        float *const ratio) {
 
 	const SIFT3D_Descriptor *desc_best;
         double ssd_best, ssd_nearest;
@@ -2950,6 +3046,8 @@ static int match_desc(const SIFT3D_Descriptor *const desc,
         }
 
         // Reject a match if the nearest neighbor is too close
+        if (ratio != NULL)
+                *ratio = (float) sqrt(ssd_best / ssd_nearest);
         if (ssd_best / ssd_nearest > nn_thresh * nn_thresh)
                         return -1;
 
@@ -2968,226 +3066,1758 @@ static int match_desc(const SIFT3D_Descriptor *const desc,
         return desc_best - store->buf;
 }
 			
-/* Draw the matches. 
- * 
- * Inputs:
- * -left - lefthand-side image
- * -right - righthand-side image
- * -keys_left - Keypoints from "left" (can be NULL if keys is NULL) 
- * -keys_right - Keypoints from "right" (can be NULL if keys is NULL)
- * -match_left - Matches from "left" (can be NULL if lines is NULL)
- * -match_right - Matches from "right" (can be NULL if lines is NULL)
- * 
- * Outputs:
- * -concat - Concatenated image (NULL if not needed)
- * -keys - Keypoints from concat (NULL is not needed)
- * -lines - Lines between matching keypoints in concat (NULL if not needed)
- * It is an error if all outputs are NULL.
+/* Match the descriptors in d1 against a binary descriptor database, as in
+ * SIFT3D_nn_match. The database is streamed through memory in shards of
+ * db_shard_bytes, so it may be larger than the available RAM. The queries in
+ * d1 are held in memory throughout.
  *
- * Return:
- * SIFT3D_SUCCESS or SIFT3D_FAILURE
- */
-int draw_matches(const Image *const left, const Image *const right,
-                 const Mat_rm *const keys_left, const Mat_rm *const keys_right,
-		 const Mat_rm *const match_left, 
-                 const Mat_rm *const match_right, Image *const concat, 
-                 Image *const keys, Image *const lines) {
+ * On return, the ith element of matches contains the index in db of the match
+ * corresponding to the ith descriptor in d1, or -1 if no match was found. 
+ * The forward-backward consistency check of SIFT3D_nn_match is applied to
+ * each match. 
+ *
+ * Distances are accumulated in single precision, so ties may be broken
+ * differently than in SIFT3D_nn_match. */
+int SIFT3D_nn_match_db(const SIFT3D_Descriptor_store *const d1,
+                       const SIFT3D_Descriptor_db *const db,
+                       const float nn_thresh, int **const matches) {
+
+        float *best, *nearest;
+        size_t shard_start;
+        int i;
 
-        Image concat_temp, left_padded, right_padded;
-	Mat_rm keys_right_draw, keys_left_draw, keys_draw, match_right_draw;
-	int i;
+	const int num = d1->num;
+        const size_t shard_num = SIFT3D_MAX(db_shard_bytes / 
+                (DESC_NUMEL * sizeof(float)), 1);
+        const float *const q = DESC_GET_FEAT(d1->buf);
 
-        const double right_pad = (double) left->nx;
-        const int ny_pad = SIFT3D_MAX(right->ny, left->ny);
-	const int nz_pad = SIFT3D_MAX(right->nz, left->nz);
+        // Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("SIFT3D_nn_match_db: invalid number of "
+			"descriptors in d1: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+        if (db->num < 1 || db->num > INT_MAX) {
+		SIFT3D_ERR("SIFT3D_nn_match_db: invalid number of "
+			"descriptors in db: %lu \n", (unsigned long) db->num);
+		return SIFT3D_FAILURE;
+        }
 
-        // Choose which image to use for concatenation 
-        Image *const concat_arg = concat == NULL ? &concat_temp : concat;
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_db: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
 
-        // Verify inputs
-        if (concat == NULL && keys == NULL && lines == NULL) {
-                SIFT3D_ERR("draw_matches: all outputs are NULL \n");
+        // Allocate the running distances
+        best = (float *) malloc(num * sizeof(float));
+        nearest = (float *) malloc(num * sizeof(float));
+        if (best == NULL || nearest == NULL) {
+	        SIFT3D_ERR("SIFT3D_nn_match_db: out of memory! \n");
+                free(best);
+                free(nearest);
                 return SIFT3D_FAILURE;
         }
-        if (keys_left == NULL && keys != NULL) {
-                SIFT3D_ERR("draw_matches: keys_left is NULL but keys is "
-                        "not \n");
-                return SIFT3D_FAILURE;
+	for (i = 0; i < num; i++) {
+                best[i] = nearest[i] = FLT_MAX;
+	        (*matches)[i] = -1;
+	}
+
+        // Stream the database through the blocked kernel, one shard at a time
+        db_advise(db, 0, shard_num, SIFT3D_TRUE);
+        for (shard_start = 0; shard_start < db->num; 
+                shard_start += shard_num) {
+
+                const int shard_len = (int) SIFT3D_MIN(shard_num, 
+                        db->num - shard_start);
+                const float *const r = db->feat + shard_start * DESC_NUMEL;
+
+                // Prefetch the next shard while this one is processed
+                db_advise(db, shard_start + shard_num, shard_num, SIFT3D_TRUE);
+
+#pragma omp parallel for schedule(dynamic)
+                for (i = 0; i < num; i += NN_CHUNK_Q) {
+                        const int nq = SIFT3D_MIN(NN_CHUNK_Q, num - i);
+                        nn_block(DESC_NUMEL, q + i * DESC_STORE_STRIDE, 
+                                DESC_STORE_STRIDE, nq, r, DESC_NUMEL, 
+                                shard_len, (int) shard_start, best + i, 
+                                nearest + i, *matches + i);
+                }
+
+                // Release the pages of this shard
+                db_advise(db, shard_start, shard_len, SIFT3D_FALSE);
         }
-        if (keys_right == NULL && keys != NULL) {
-                SIFT3D_ERR("draw_matches: keys_right is NULL but keys is "
-                        "not \n");
+
+        // Ratio test and forward-backward consistency check
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < num; i++) {
+
+                float back_best, back_nearest;
+                int back_idx;
+
+                int *const match = *matches + i;
+
+                if (*match < 0)
+                        continue;
+
+                if (!nn_ratio_test(best[i], nearest[i], nn_thresh)) {
+                        *match = -1;
+                        continue;
+                }
+
+                // Match the reference descriptor back to d1
+                back_best = back_nearest = FLT_MAX;
+                back_idx = -1;
+                nn_block(DESC_NUMEL, db->feat + (size_t) *match * DESC_NUMEL, 
+                        DESC_NUMEL, 1, q, DESC_STORE_STRIDE, num, 0, 
+                        &back_best, &back_nearest, &back_idx);
+                if (back_idx != i || 
+                        !nn_ratio_test(back_best, back_nearest, nn_thresh))
+                        *match = -1;
+        }
+
+        free(best);
+        free(nearest);
+	return SIFT3D_SUCCESS;
+}
+
+/* Match many pairs of descriptor stores at once, as in SIFT3D_nn_match. This
+ * is faster than calling SIFT3D_nn_match for each pair, since each tile of a 
+ * reference store is compared to the queries of every pair sharing that
+ * store while it is in cache, and the work is divided between threads by
+ * pairs and tiles.
+ *
+ * Parameters:
+ *  -d1: Array of num_d1 query stores
+ *  -num_d1: The number of query stores
+ *  -d2: Array of num_d2 reference stores. May be the same as d1.
+ *  -num_d2: The number of reference stores
+ *  -pairs: A num_pairs x 2 array, where row k holds the indices in d1 and d2
+ *      of the kth pair, or NULL to match all num_d1 x num_d2 pairs. In that
+ *      case the pairs are ordered by d1 index, then d2 index.
+ *  -num_pairs: The number of rows in pairs. Ignored if pairs is NULL.
+ *  -nn_thresh: As in SIFT3D_nn_match.
+ *  -counts: If not NULL, an array of at least one element per pair. On 
+ *      return, counts[k] is the number of matches in the kth pair.
+ *  -matches: If not NULL, an array of at least one element per pair, each 
+ *      of which is either NULL or a previously-allocated array. On return, 
+ *      matches[k] is the match array of the kth pair, in the format of 
+ *      SIFT3D_nn_match.
+ *
+ * Distances are accumulated in single precision, so ties may be broken
+ * differently than in SIFT3D_nn_match. */
+int SIFT3D_nn_match_batch(const SIFT3D_Descriptor_store *const d1, 
+        const int num_d1, const SIFT3D_Descriptor_store *const d2,
+        const int num_d2, const int *const pairs, const int num_pairs,
+        const float nn_thresh, int *const counts, int **const matches) {
+
+        Nn_seg *segs;
+        size_t *pair_off, *item_start;
+        int *by_ref, *ref_start, *best_idx;
+        float *best, *nearest;
+        size_t total, num_segs, num_items, seg, item_len;
+        int k, r, ret;
+
+        const int64_t num_all = (int64_t) num_d1 * num_d2;
+        const int npairs = pairs != NULL ? num_pairs : 
+                num_all > INT_MAX ? 0 : (int) num_all;
+
+#define PAIR_D1(k) (pairs == NULL ? (k) / num_d2 : pairs[2 * (k)])
+#define PAIR_D2(k) (pairs == NULL ? (k) % num_d2 : pairs[2 * (k) + 1])
+
+        // Verify inputs
+        if (pairs == NULL && num_all > INT_MAX) {
+                SIFT3D_ERR("SIFT3D_nn_match_batch: too many pairs: %d x %d "
+                        "\n", num_d1, num_d2);
                 return SIFT3D_FAILURE;
         }
-        if (match_left == NULL && lines != NULL) {
-                SIFT3D_ERR("draw_matches: match_left is NULL but lines "
-                        "is not \n");
+        if (num_d1 < 1 || num_d2 < 1 || npairs < 1) {
+                SIFT3D_ERR("SIFT3D_nn_match_batch: invalid number of "
+                        "stores or pairs: %d, %d, %d \n", num_d1, num_d2,
+                        npairs);
                 return SIFT3D_FAILURE;
         }
-        if (match_right == NULL && lines != NULL) {
-                SIFT3D_ERR("draw_matches: match_right is NULL but lines "
-                        "is not \n");
+        if (counts == NULL && matches == NULL) {
+                SIFT3D_ERR("SIFT3D_nn_match_batch: all outputs are NULL \n");
                 return SIFT3D_FAILURE;
         }
+        for (k = 0; k < npairs; k++) {
 
-	// Initialize intermediates		
-        init_im(&concat_temp);
-        init_im(&left_padded);
-        init_im(&right_padded);
-        if (init_Mat_rm(&keys_right_draw, 0, 0, SIFT3D_DOUBLE, 
-		SIFT3D_FALSE) ||
-	        init_Mat_rm(&match_right_draw, 0, 0, SIFT3D_DOUBLE, 
-			SIFT3D_FALSE) ||
-                init_Mat_rm(&keys_left_draw, 0, 0, SIFT3D_DOUBLE, 
-			SIFT3D_FALSE) ||
-                init_Mat_rm(&keys_draw, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
-	        return SIFT3D_FAILURE;
+                const int i1 = PAIR_D1(k);
+                const int i2 = PAIR_D2(k);
 
-        // Pad the images to be the same in all dimensions but x
-	if (init_im_with_dims(&right_padded, right->nx, ny_pad, nz_pad, 1) || 
-	        init_im_with_dims(&left_padded, left->nx, ny_pad, nz_pad, 1) ||
-	   	im_pad(right, &right_padded) || 
-	    	im_pad(left, &left_padded)) {
-                SIFT3D_ERR("draw_matches: unable to pad images \n");
-                return SIFT3D_FAILURE;
-	}
+                if (i1 < 0 || i1 >= num_d1 || i2 < 0 || i2 >= num_d2) {
+                        SIFT3D_ERR("SIFT3D_nn_match_batch: pair %d [%d, %d] "
+                                "is out of bounds \n", k, i1, i2);
+                        return SIFT3D_FAILURE;
+                }
+                if (d1[i1].num < 1 || d1[i1].num > INT_MAX ||
+                        d2[i2].num < 1 || d2[i2].num > INT_MAX) {
+                        SIFT3D_ERR("SIFT3D_nn_match_batch: pair %d has an "
+                                "invalid number of descriptors \n", k);
+                        return SIFT3D_FAILURE;
+                }
+        }
 
-	// Draw a concatenated image
-	if (im_concat(&left_padded, &right_padded, 0, concat_arg)) {
-                SIFT3D_ERR("draw_matches: Could not concatenate the "
-                        "images \n");
-                goto draw_matches_quit;
+        // Initialize intermediates
+        segs = NULL;
+        pair_off = item_start = NULL;
+        by_ref = best_idx = NULL;
+        best = nearest = NULL;
+        ret = SIFT3D_FAILURE;
+        if ((ref_start = (int *) calloc((size_t) num_d2 + 1,
+                sizeof(int))) == NULL ||
+                (by_ref = (int *) malloc(npairs * sizeof(int))) == NULL ||
+                (pair_off = (size_t *) malloc(((size_t) npairs + 1) * 
+                        sizeof(size_t))) == NULL)
+                goto nn_match_batch_quit;
+
+        // Group the pairs by reference store, with a counting sort
+        for (k = 0; k < npairs; k++) {
+                ref_start[PAIR_D2(k) + 1]++;
+        }
+        for (r = 0; r < num_d2; r++) {
+                ref_start[r + 1] += ref_start[r];
+        }
+        for (k = 0; k < npairs; k++) {
+                by_ref[ref_start[PAIR_D2(k)]++] = k;
+        }
+        for (r = num_d2; r > 0; r--) {
+                ref_start[r] = ref_start[r - 1];
         }
+        ref_start[0] = 0;
+
+        // Assign each pair a range of the running distance arrays, and
+        // count the query chunks
+        total = num_segs = 0;
+        for (k = 0; k < npairs; k++) {
+                const size_t num = d1[PAIR_D1(k)].num;
+                pair_off[k] = total;
+                total += num;
+                num_segs += (num + NN_CHUNK_Q - 1) / NN_CHUNK_Q;
+        }
+        pair_off[npairs] = total;
+
+        // Allocate the remaining intermediates
+        if ((segs = (Nn_seg *) malloc(num_segs * sizeof(Nn_seg))) == NULL ||
+                (item_start = (size_t *) malloc((num_segs + 1) * 
+                        sizeof(size_t))) == NULL ||
+                (best = (float *) malloc(total * sizeof(float))) == NULL ||
+                (nearest = (float *) malloc(total * sizeof(float))) == NULL ||
+                (best_idx = (int *) malloc(total * sizeof(int))) == NULL)
+                goto nn_match_batch_quit;
+
+        // Split the query chunks into work items, each of which shares a
+        // single reference store
+        seg = num_items = 0;
+        for (r = 0; r < num_d2; r++) {
 
-        // Optionally draw the keypoints
-        if (keys != NULL) { 
+                int j;
 
-                // Convert inputs to double
-                if (convert_Mat_rm(keys_right, &keys_right_draw, 
-			SIFT3D_DOUBLE) ||
-                        convert_Mat_rm(keys_left, &keys_left_draw, 
-				SIFT3D_DOUBLE))
-                        goto draw_matches_quit;
-       
-                // Pad the x-coordinate 
-                for (i = 0; i < keys_right->num_rows; i++) {
-                        SIFT3D_MAT_RM_GET(&keys_right_draw, i, 0, double) += 
-                                right_pad; 
-                }
+                item_len = NN_BATCH_Q;
+                for (j = ref_start[r]; j < ref_start[r + 1]; j++) {
 
-                // Concatenate the points
-                if (concat_Mat_rm(&keys_left_draw, &keys_right_draw,
-                        &keys_draw, 0))
-                        goto draw_matches_quit;
+                        int start;
 
-                // Draw the points
-                if (draw_points(&keys_draw, SIFT3D_IM_GET_DIMS(concat_arg), 
-                        1, keys))
-                        goto draw_matches_quit;
-        }
+                        const int pair = by_ref[j];
+                        const int num = (int) d1[PAIR_D1(pair)].num;
 
-	// Optionally draw the lines 
-        if (lines != NULL) {
+                        for (start = 0; start < num; start += NN_CHUNK_Q) {
 
-                // Convert input to double
-                if (convert_Mat_rm(match_right, &match_right_draw, 
-			SIFT3D_DOUBLE))
-                        goto draw_matches_quit;
+                                // Start a new work item when this one is full
+                                if (item_len >= NN_BATCH_Q) {
+                                        item_start[num_items++] = seg;
+                                        item_len = 0;
+                                }
 
-                // Pad the x-coordinate 
-                for (i = 0; i < match_right->num_rows; i++) {
-                        SIFT3D_MAT_RM_GET(&match_right_draw, i, 0, double) += 
-                                right_pad;
+                                segs[seg].pair = pair;
+                                segs[seg].start = start;
+                                segs[seg].len = SIFT3D_MIN(NN_CHUNK_Q, 
+                                        num - start);
+                                item_len += segs[seg].len;
+                                seg++;
+                        }
                 }
+        }
+        assert(seg == num_segs);
+        item_start[num_items] = num_segs;
 
-                // Draw the lines
-                if (draw_lines(match_left, &match_right_draw, 
-                        SIFT3D_IM_GET_DIMS(concat_arg), lines))
-                        goto draw_matches_quit;
+        // Initialize the running distances
+        for (seg = 0; seg < total; seg++) {
+                best[seg] = nearest[seg] = FLT_MAX;
+                best_idx[seg] = -1;
         }
 
-        // Clean up
-        im_free(&concat_temp);
-        im_free(&left_padded);
-        im_free(&right_padded); 
-        cleanup_Mat_rm(&keys_right_draw); 
-        cleanup_Mat_rm(&keys_left_draw); 
-        cleanup_Mat_rm(&keys_draw); 
-        cleanup_Mat_rm(&match_right_draw); 
-	return SIFT3D_SUCCESS;
+        // Forward matching pass. Each tile of the reference store is
+        // compared to every query in the work item before moving on.
+#pragma omp parallel for schedule(dynamic)
+        for (k = 0; k < (int) num_items; k++) {
 
-draw_matches_quit:
-        im_free(&concat_temp);
-        im_free(&left_padded);
-        im_free(&right_padded); 
-        cleanup_Mat_rm(&keys_right_draw);
-        cleanup_Mat_rm(&keys_left_draw); 
-        cleanup_Mat_rm(&keys_draw); 
-        cleanup_Mat_rm(&match_right_draw);
-        return SIFT3D_FAILURE;
-}
+                size_t s;
+                int t;
 
-/* Write a Keypoint_store to a text file. The keypoints are stored in a matrix
- * (.csv, .csv.gz), where each keypoint is a row. The elements of each row are
- * as follows:
- *
- * x y z o s ori11 ori12 ... orinn
- *
- * x - the x-coordinate
- * y - the y-coordinate
- * z - the z-coordinate
- * o - the pyramid octave. To convert to image coordinates, multiply x,y,z by 
- *      pow(2, o)
- * s - the scale coordinate
- * ori(ij) - the ith row, jth column of the orientation matrix */
-int write_Keypoint_store(const char *path, const Keypoint_store *const kp) {
+                const int ref = PAIR_D2(segs[item_start[k]].pair);
+                const int nr = (int) d2[ref].num;
+                const float *const r_feat = DESC_GET_FEAT(d2[ref].buf);
 
-        Mat_rm mat;
-	int i, i_R, j_R;
+                for (t = 0; t < nr; t += NN_TILE_R) {
 
-        // Keypoint data format constants
-        const int kp_x = 0; // column of x-coordinate
-        const int kp_y = 1; // column of y-coordinate
-        const int kp_z = 2; // column of z-coordinate
-        const int kp_o = 3; // column of octave index
-        const int kp_s = 4; // column of s-coordinate
-        const int kp_ori = 5; // first column of the orientation matrix
-        const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation 
-                // elements
-        const int num_rows = kp->slab.num;
-        const int num_cols = kp_ori + ori_numel;
+                        const int t_len = SIFT3D_MIN(NN_TILE_R, nr - t);
 
-        // Initialize the matrix
-        if (init_Mat_rm(&mat, num_rows, num_cols, SIFT3D_DOUBLE, 
-		SIFT3D_FALSE))
-                return SIFT3D_FAILURE;
-       
-        // Write the keypoints 
-        for (i = 0; i < num_rows; i++) {
+                        for (s = item_start[k]; s < item_start[k + 1]; s++) {
 
-                const Keypoint *const key = kp->buf + i;
-                const Mat_rm *const R = &key->R;
+                                const Nn_seg *const sg = segs + s;
+                                const size_t off = pair_off[sg->pair] + 
+                                        sg->start;
+                                const float *const q_feat = DESC_GET_FEAT(
+                                        d1[PAIR_D1(sg->pair)].buf + sg->start);
 
-                // Write the coordinates 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_x, double) = key->xd;
-                SIFT3D_MAT_RM_GET(&mat, i, kp_y, double) = key->yd; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_z, double) = key->zd; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_o, double) = key->o; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_s, double) = key->sd;
+                                nn_block(DESC_NUMEL, q_feat, 
+                                        DESC_STORE_STRIDE, sg->len, 
+                                        r_feat + t * DESC_STORE_STRIDE, 
+                                        DESC_STORE_STRIDE, t_len, t, 
+                                        best + off, nearest + off, 
+                                        best_idx + off);
+                        }
+                }
+        }
 
-                // Write the orientation matrix
-                SIFT3D_MAT_RM_LOOP_START(R, i_R, j_R)
+        // Ratio test and forward-backward consistency check
+#pragma omp parallel for schedule(dynamic)
+        for (k = 0; k < npairs; k++) {
 
-                        const int kp_idx = kp_ori + 
-                                SIFT3D_MAT_RM_GET_IDX(R, i_R, j_R);
-        
-                        SIFT3D_MAT_RM_GET(&mat, i, kp_idx, double) = 
-                                (double) SIFT3D_MAT_RM_GET(R, i_R, j_R, float);
+                int i;
 
-                SIFT3D_MAT_RM_LOOP_END
-        }
+                const SIFT3D_Descriptor_store *const q = d1 + PAIR_D1(k);
+                const SIFT3D_Descriptor_store *const ref = d2 + PAIR_D2(k);
+                const size_t off = pair_off[k];
+                const int num = (int) q->num;
+                int *const match = best_idx + off;
+                int count = 0;
 
-        // Write the matrix 
+                for (i = 0; i < num; i++) {
+
+                        float back_best, back_nearest;
+                        int back_idx;
+
+                        if (match[i] < 0)
+                                continue;
+
+                        if (!nn_ratio_test(best[off + i], nearest[off + i], 
+                                nn_thresh)) {
+                                match[i] = -1;
+                                continue;
+                        }
+
+                        // Match the reference descriptor back to the queries
+                        back_best = back_nearest = FLT_MAX;
+                        back_idx = -1;
+                        nn_block(DESC_NUMEL, 
+                                DESC_GET_FEAT(ref->buf + match[i]), 
+                                DESC_STORE_STRIDE, 1, DESC_GET_FEAT(q->buf), 
+                                DESC_STORE_STRIDE, num, 0, &back_best, 
+                                &back_nearest, &back_idx);
+                        if (back_idx != i || !nn_ratio_test(back_best, 
+                                back_nearest, nn_thresh)) {
+                                match[i] = -1;
+                                continue;
+                        }
+
+                        count++;
+                }
+
+                if (counts != NULL)
+                        counts[k] = count;
+        }
+
+        // Copy out the match lists
+        if (matches != NULL) {
+                for (k = 0; k < npairs; k++) {
+
+                        const size_t num = d1[PAIR_D1(k)].num;
+
+                        if ((matches[k] = (int *) SIFT3D_safe_realloc(
+                                matches[k], num * sizeof(int))) == NULL)
+                                goto nn_match_batch_quit;
+                        memcpy(matches[k], best_idx + pair_off[k], 
+                                num * sizeof(int));
+                }
+        }
+#undef PAIR_D1
+#undef PAIR_D2
+
+        ret = SIFT3D_SUCCESS;
+
+nn_match_batch_quit:
+        if (ret != SIFT3D_SUCCESS)
+                SIFT3D_ERR("SIFT3D_nn_match_batch: out of memory! \n");
+        free(ref_start);
+        free(by_ref);
+        free(pair_off);
+        free(segs);
+        free(item_start);
+        free(best);
+        free(nearest);
+        free(best_idx);
+        return ret;
+}
+
+/* Initialize a SIFT3D_Qdesc_store for first use. */
+void init_SIFT3D_Qdesc_store(SIFT3D_Qdesc_store *const q) {
+        q->feat = NULL;
+        q->norm_sq = NULL;
+        q->coords = NULL;
+        q->num = 0;
+        q->scale = 0.0f;
+        q->nx = q->ny = q->nz = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Qdesc_store. */
+void cleanup_SIFT3D_Qdesc_store(SIFT3D_Qdesc_store *const q) {
+        free(q->feat);
+        free(q->norm_sq);
+        free(q->coords);
+        init_SIFT3D_Qdesc_store(q);
+}
+
+/* Calibrate the quantization scale for a set of descriptor stores. The scale
+ * maps the largest feature element in the stores to the largest quantized 
+ * value. Since descriptors are normalized and truncated, this bound is tight
+ * and stable across images, so a scale calibrated on a sample of stores can be
+ * reused for others. All stores which are to be matched against each other
+ * must be quantized with the same scale.
+ *
+ * Parameters:
+ *  -desc: Array of num_stores descriptor stores
+ *  -num_stores: The number of stores
+ *  -scale: The output scale */
+int SIFT3D_calibrate_quant_scale(const SIFT3D_Descriptor_store *const desc,
+        const int num_stores, float *const scale) {
+
+        float max_val;
+        int i;
+
+        // Find the largest element
+        max_val = 0.0f;
+        for (i = 0; i < num_stores; i++) {
+
+                size_t j;
+
+                const SIFT3D_Descriptor_store *const store = desc + i;
+
+                for (j = 0; j < store->num; j++) {
+
+                        int k;
+
+                        const float *const feat = DESC_GET_FEAT(store->buf + j);
+
+                        for (k = 0; k < DESC_NUMEL; k++) {
+                                max_val = SIFT3D_MAX(max_val, feat[k]);
+                        }
+                }
+        }
+
+        if (max_val <= 0.0f) {
+                SIFT3D_ERR("SIFT3D_calibrate_quant_scale: no nonzero "
+                        "descriptor elements \n");
+                return SIFT3D_FAILURE;
+        }
+
+        *scale = (float) QUANT_MAX / max_val;
+        return SIFT3D_SUCCESS;
+}
+
+/* Quantize a descriptor store. If scale is positive, it is used as the
+ * quantization scale. Otherwise, the scale is calibrated from desc with
+ * SIFT3D_calibrate_quant_scale. q must be initialized with 
+ * init_SIFT3D_Qdesc_store. */
+int SIFT3D_quantize_descriptors(const SIFT3D_Descriptor_store *const desc,
+        const float scale, SIFT3D_Qdesc_store *const q) {
+
+        int i;
+
+        const int num = (int) desc->num;
+
+        // Verify inputs
+        if (desc->num < 1 || desc->num > INT_MAX) {
+                SIFT3D_ERR("SIFT3D_quantize_descriptors: invalid number of "
+                        "descriptors: %lu \n", (unsigned long) desc->num);
+                return SIFT3D_FAILURE;
+        }
+
+        // Get the scale
+        if (scale > 0.0f) {
+                q->scale = scale;
+        } else if (SIFT3D_calibrate_quant_scale(desc, 1, &q->scale)) {
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output
+        if ((q->feat = (uint8_t *) SIFT3D_safe_realloc(q->feat, 
+                (size_t) num * DESC_NUMEL * sizeof(uint8_t))) == NULL ||
+                (q->norm_sq = (int32_t *) SIFT3D_safe_realloc(q->norm_sq, 
+                (size_t) num * sizeof(int32_t))) == NULL ||
+                (q->coords = (float *) SIFT3D_safe_realloc(q->coords, 
+                (size_t) num * 4 * sizeof(float))) == NULL) {
+                SIFT3D_ERR("SIFT3D_quantize_descriptors: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+        q->num = desc->num;
+        q->nx = desc->nx;
+        q->ny = desc->ny;
+        q->nz = desc->nz;
+
+        // Quantize the features
+#pragma omp parallel for
+        for (i = 0; i < num; i++) {
+
+                int32_t norm_sq;
+                int k;
+
+                const SIFT3D_Descriptor *const d = desc->buf + i;
+                const float *const feat = DESC_GET_FEAT(d);
+                uint8_t *const qfeat = q->feat + (size_t) i * DESC_NUMEL;
+                float *const coords = q->coords + 4 * i;
+
+                norm_sq = 0;
+                for (k = 0; k < DESC_NUMEL; k++) {
+
+                        const float val = feat[k] * q->scale + 0.5f;
+                        const int qval = val <= 0.0f ? 0 : 
+                                val >= (float) QUANT_MAX ? QUANT_MAX : 
+                                (int) val;
+
+                        qfeat[k] = (uint8_t) qval;
+                        norm_sq += qval * qval;
+                }
+                q->norm_sq[i] = norm_sq;
+
+                coords[0] = (float) d->xd;
+                coords[1] = (float) d->yd;
+                coords[2] = (float) d->zd;
+                coords[3] = (float) d->sd;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Perform nearest neighbor matching on two sets of quantized descriptors, as
+ * in SIFT3D_nn_match. Both stores must have been quantized with the same 
+ * scale. Distances are computed exactly in integer arithmetic, using the 
+ * dot-product instructions of the target machine where available (AVX-512 
+ * VNNI, AVX-VNNI, or AVX2). */
+int SIFT3D_nn_match_quant(const SIFT3D_Qdesc_store *const d1,
+                          const SIFT3D_Qdesc_store *const d2,
+                          const float nn_thresh, int **const matches) {
+
+        int i;
+
+	const int num = d1->num;
+
+        // Verify inputs
+	if (num < 1 || d2->num < 1 || d1->num > INT_MAX || d2->num > INT_MAX) {
+		SIFT3D_ERR("SIFT3D_nn_match_quant: invalid number of "
+			"descriptors: %d, %lu \n", num, (unsigned long) d2->num);
+		return SIFT3D_FAILURE;
+	}
+        if (d1->scale != d2->scale) {
+		SIFT3D_ERR("SIFT3D_nn_match_quant: the stores were quantized "
+                        "with different scales: %f, %f \n", d1->scale, 
+                        d2->scale);
+		return SIFT3D_FAILURE;
+        }
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_quant: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (i = 0; i < num; i += NN_CHUNK_Q) {
+
+                int32_t best[NN_CHUNK_Q], nearest[NN_CHUNK_Q];
+                int j;
+
+                const int nq = SIFT3D_MIN(NN_CHUNK_Q, num - i);
+                int *const match = *matches + i;
+
+                // Forward matching pass
+                for (j = 0; j < nq; j++) {
+                        best[j] = nearest[j] = INT32_MAX;
+                        match[j] = -1;
+                }
+                qnn_block(d1, i, nq, d2, 0, (int) d2->num, best, nearest, 
+                        match);
+
+                for (j = 0; j < nq; j++) {
+
+                        int32_t back_best, back_nearest;
+                        int back_idx;
+
+                        if (match[j] < 0)
+                                continue;
+
+                        if (!nn_ratio_test((float) best[j], 
+                                (float) nearest[j], nn_thresh)) {
+                                match[j] = -1;
+                                continue;
+                        }
+
+                        // Check for forward-backward consistency
+                        back_best = back_nearest = INT32_MAX;
+                        back_idx = -1;
+                        qnn_block(d2, match[j], 1, d1, 0, num, &back_best, 
+                                &back_nearest, &back_idx);
+                        if (back_idx != i + j || !nn_ratio_test(
+                                (float) back_best, (float) back_nearest, 
+                                nn_thresh))
+                                match[j] = -1;
+                }
+        }
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Compute the dot product of two quantized feature vectors. */
+static int32_t quant_dot(const uint8_t *const a, const uint8_t *const b) {
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        __m512i acc = _mm512_setzero_si512();
+        int k;
+
+        for (k = 0; k < DESC_NUMEL; k += 64) {
+                acc = _mm512_dpbusd_epi32(acc, 
+                        _mm512_loadu_si512((const void *) (a + k)),
+                        _mm512_loadu_si512((const void *) (b + k)));
+        }
+
+        return _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+        __m128i sum;
+        __m256i acc = _mm256_setzero_si256();
+        int k;
+
+#ifndef __AVXVNNI__
+        const __m256i ones = _mm256_set1_epi16(1);
+#endif
+
+        for (k = 0; k < DESC_NUMEL; k += 32) {
+
+                const __m256i va = _mm256_loadu_si256(
+                        (const __m256i *) (a + k));
+                const __m256i vb = _mm256_loadu_si256(
+                        (const __m256i *) (b + k));
+
+#ifdef __AVXVNNI__
+                acc = _mm256_dpbusd_avx_epi32(acc, va, vb);
+#else
+                // Elements are at most QUANT_MAX, so the 16-bit pair sums 
+                // cannot saturate
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+                        _mm256_maddubs_epi16(va, vb), ones));
+#endif
+        }
+
+        // Horizontal sum
+        sum = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+                _mm256_extracti128_si256(acc, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 
+                _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 
+                _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+#else
+        int32_t dot;
+        int k;
+
+        dot = 0;
+#pragma omp simd reduction(+:dot)
+        for (k = 0; k < DESC_NUMEL; k++) {
+                dot += (int32_t) a[k] * (int32_t) b[k];
+        }
+
+        return dot;
+#endif
+}
+
+/* Blocked nearest-neighbor kernel for quantized descriptors, as nn_block. 
+ * Compares descriptors [q_start, q_start + nq) of q to descriptors 
+ * [r_start, r_start + nr) of r. The SSD is computed from the dot product and
+ * the precomputed norms. */
+static void qnn_block(const SIFT3D_Qdesc_store *const q, const int q_start,
+        const int nq, const SIFT3D_Qdesc_store *const r, const int r_start,
+        const int nr, int32_t *const best, int32_t *const nearest, 
+        int *const best_idx) {
+
+        int t, i, j;
+
+        for (t = r_start; t < r_start + nr; t += NN_TILE_R) {
+
+                const int t_end = SIFT3D_MIN(t + NN_TILE_R, r_start + nr);
+
+                for (i = 0; i < nq; i++) {
+
+                        const int qi = q_start + i;
+                        const uint8_t *const qfeat = q->feat + 
+                                (size_t) qi * DESC_NUMEL;
+                        const int32_t q_norm_sq = q->norm_sq[qi];
+
+                        for (j = t; j < t_end; j++) {
+
+                                const int32_t ssd = q_norm_sq + 
+                                        r->norm_sq[j] - 2 * quant_dot(qfeat, 
+                                        r->feat + (size_t) j * DESC_NUMEL);
+
+                                if (ssd < best[i]) {
+                                        nearest[i] = best[i];
+                                        best[i] = ssd;
+                                        best_idx[i] = j;
+                                } else if (ssd < nearest[i]) {
+                                        nearest[i] = ssd;
+                                }
+                        }
+                }
+        }
+}
+
+/* Initialize a SIFT3D_Bdesc_store for first use. */
+void init_SIFT3D_Bdesc_store(SIFT3D_Bdesc_store *const b) {
+        b->bits = NULL;
+        b->coords = NULL;
+        b->num = 0;
+        b->nx = b->ny = b->nz = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Bdesc_store. */
+void cleanup_SIFT3D_Bdesc_store(SIFT3D_Bdesc_store *const b) {
+        free(b->bits);
+        free(b->coords);
+        init_SIFT3D_Bdesc_store(b);
+}
+
+/* Helper function to resize a SIFT3D_Bdesc_store to hold num descriptors. */
+static int resize_SIFT3D_Bdesc_store(SIFT3D_Bdesc_store *const b, 
+        const int num) {
+
+        if (num < 1) {
+                SIFT3D_ERR("resize_SIFT3D_Bdesc_store: invalid size: %d \n",
+                        num);
+                return SIFT3D_FAILURE;
+        }
+
+        if ((b->bits = (uint64_t *) SIFT3D_safe_realloc(b->bits, 
+                (size_t) num * DESC_BIN_WORDS * sizeof(uint64_t))) == NULL ||
+                (b->coords = (float *) SIFT3D_safe_realloc(b->coords,
+                (size_t) num * 4 * sizeof(float))) == NULL) {
+                SIFT3D_ERR("resize_SIFT3D_Bdesc_store: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        b->num = num;
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to binarize a descriptor. Each bit is set if the 
+ * corresponding histogram bin exceeds the mean of its histogram. The bits are
+ * packed in the order of the feature vector, see DESC_GET_FEAT. Also writes 
+ * the coordinates. */
+static void binarize_desc(const SIFT3D_Descriptor *const desc, 
+        uint64_t *const bits, float *const coords) {
+
+        int i, k;
+
+        const float *const feat = DESC_GET_FEAT(desc);
+
+        for (k = 0; k < DESC_BIN_WORDS; k++) {
+                bits[k] = 0;
+        }
+
+        for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+
+                float mean;
+
+                const float *const hist = feat + i * HIST_NUMEL;
+
+                // Compute the histogram mean
+                mean = 0.0f;
+                for (k = 0; k < HIST_NUMEL; k++) {
+                        mean += hist[k];
+                }
+                mean /= (float) HIST_NUMEL;
+
+                // Set the bits
+                for (k = 0; k < HIST_NUMEL; k++) {
+
+                        const int bit = i * HIST_NUMEL + k;
+
+                        if (hist[k] > mean)
+                                bits[bit / 64] |= (uint64_t) 1 << (bit % 64);
+                }
+        }
+
+        coords[0] = (float) desc->xd;
+        coords[1] = (float) desc->yd;
+        coords[2] = (float) desc->zd;
+        coords[3] = (float) desc->sd;
+}
+
+/* Convert SIFT3D descriptors to binary descriptors. Each bit is set if the 
+ * corresponding bin exceeds the mean of its histogram. b must be initialized
+ * with init_SIFT3D_Bdesc_store. */
+int SIFT3D_binarize_descriptors(const SIFT3D_Descriptor_store *const desc,
+        SIFT3D_Bdesc_store *const b) {
+
+        int i;
+
+        const int num = (int) desc->num;
+
+        // Resize the output
+        if (desc->num > INT_MAX || resize_SIFT3D_Bdesc_store(b, num))
+                return SIFT3D_FAILURE;
+        b->nx = desc->nx;
+        b->ny = desc->ny;
+        b->nz = desc->nz;
+
+#pragma omp parallel for
+        for (i = 0; i < num; i++) {
+                binarize_desc(desc->buf + i, b->bits + 
+                        (size_t) i * DESC_BIN_WORDS, b->coords + 4 * i);
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract binary SIFT3D descriptors from a list of keypoints, as in 
+ * SIFT3D_extract_descriptors. Each descriptor is binarized as it is 
+ * extracted, so the full-precision descriptors are never stored. See
+ * SIFT3D_binarize_descriptors for the binarization.
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters. Must have
+ *      been used to detect keypoints in an image.
+ *  kp - keypoint list populated by a feature detector 
+ *  b - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_binary_descriptors(SIFT3D *const sift3d,
+        const Keypoint_store *const kp, SIFT3D_Bdesc_store *const b) {
+
+        int i, ret;
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num = kp->slab.num;
+
+	// Verify inputs
+	if (verify_keys(kp, &sift3d->im))
+		return SIFT3D_FAILURE;
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_binary_descriptors: no Gaussian "
+                        "pyramid is available. Make sure "
+                        "SIFT3D_detect_keypoints was called prior to calling "
+                        "this function. \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output
+        if (resize_SIFT3D_Bdesc_store(b, num))
+                return SIFT3D_FAILURE;
+        {
+	        const Image *const first_level = SIFT3D_PYR_IM_GET(gpyr, 
+                        gpyr->first_octave, gpyr->first_level);
+                b->nx = first_level->nx;
+                b->ny = first_level->ny;
+                b->nz = first_level->nz;
+        }
+
+        // Extract and binarize the descriptors
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
+
+                SIFT3D_Descriptor descrip;
+
+                const Keypoint *const key = kp->buf + i;
+		const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+
+		if (extract_descrip(sift3d, level, key, &descrip)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                binarize_desc(&descrip, b->bits + (size_t) i * DESC_BIN_WORDS,
+                        b->coords + 4 * i);
+	}	
+
+        return ret;
+}
+
+/* Perform nearest neighbor matching on two sets of binary descriptors, as in
+ * SIFT3D_nn_match. The distance is the Hamming distance, which equals the
+ * SSD of the bit vectors, so nn_thresh has the same meaning as in 
+ * SIFT3D_nn_match. */
+int SIFT3D_nn_match_binary(const SIFT3D_Bdesc_store *const d1,
+                           const SIFT3D_Bdesc_store *const d2,
+                           const float nn_thresh, int **const matches) {
+
+        int i;
+
+	const int num = d1->num;
+
+        // Verify inputs
+	if (num < 1 || d2->num < 1 || d1->num > INT_MAX || d2->num > INT_MAX) {
+		SIFT3D_ERR("SIFT3D_nn_match_binary: invalid number of "
+			"descriptors: %d, %lu \n", num, (unsigned long) d2->num);
+		return SIFT3D_FAILURE;
+	}
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_binary: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
+
+                int best, nearest, back_best, back_nearest, back_idx;
+
+                int *const match = *matches + i;
+
+                // Forward matching pass
+                best = nearest = INT_MAX;
+                *match = -1;
+                bnn_search(d1->bits + (size_t) i * DESC_BIN_WORDS, d2, &best, 
+                        &nearest, match);
+                if (*match < 0 || 
+                        !nn_ratio_test((float) best, (float) nearest, 
+                                nn_thresh)) {
+                        *match = -1;
+                        continue;
+                }
+
+                // Check for forward-backward consistency
+                back_best = back_nearest = INT_MAX;
+                back_idx = -1;
+                bnn_search(d2->bits + (size_t) *match * DESC_BIN_WORDS, d1, 
+                        &back_best, &back_nearest, &back_idx);
+                if (back_idx != i || !nn_ratio_test((float) back_best, 
+                        (float) back_nearest, nn_thresh))
+                        *match = -1;
+        }
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Initialize a SIFT3D_Pca for first use. */
+void init_SIFT3D_Pca(SIFT3D_Pca *const pca) {
+        pca->mean = NULL;
+        pca->proj = NULL;
+        pca->var = NULL;
+        pca->dim = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Pca. */
+void cleanup_SIFT3D_Pca(SIFT3D_Pca *const pca) {
+        free(pca->mean);
+        free(pca->proj);
+        free(pca->var);
+        init_SIFT3D_Pca(pca);
+}
+
+/* Helper function to resize a SIFT3D_Pca to dim dimensions. */
+static int resize_SIFT3D_Pca(SIFT3D_Pca *const pca, const int dim) {
+
+        if (dim < 1 || dim > DESC_NUMEL) {
+                SIFT3D_ERR("resize_SIFT3D_Pca: invalid dimension: %d \n", dim);
+                return SIFT3D_FAILURE;
+        }
+
+        if ((pca->mean = (float *) SIFT3D_safe_realloc(pca->mean, 
+                DESC_NUMEL * sizeof(float))) == NULL ||
+                (pca->proj = (float *) SIFT3D_safe_realloc(pca->proj, 
+                (size_t) dim * DESC_NUMEL * sizeof(float))) == NULL ||
+                (pca->var = (float *) SIFT3D_safe_realloc(pca->var, 
+                (size_t) dim * sizeof(float))) == NULL) {
+                SIFT3D_ERR("resize_SIFT3D_Pca: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        pca->dim = dim;
+        return SIFT3D_SUCCESS;
+}
+
+/* Learn a PCA projection from a sample of descriptor stores. The projection 
+ * keeps the dim principal axes of greatest variance, computed by 
+ * eigendecomposition of the sample covariance matrix.
+ *
+ * Parameters:
+ *  -desc: Array of num_stores descriptor stores
+ *  -num_stores: The number of stores
+ *  -dim: The dimension of the projected descriptors, typically 64-128
+ *  -pca: The output projection, initialized with init_SIFT3D_Pca
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_learn_pca(const SIFT3D_Descriptor_store *const desc, 
+        const int num_stores, const int dim, SIFT3D_Pca *const pca) {
+
+        Mat_rm cov, Q, L;
+        double *mean;
+        size_t num_total;
+        int i, j, s;
+
+        // Verify inputs
+        num_total = 0;
+        for (s = 0; s < num_stores; s++) {
+                num_total += desc[s].num;
+        }
+        if (num_total < 2) {
+                SIFT3D_ERR("SIFT3D_learn_pca: at least two descriptors are "
+                        "required \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Initialize intermediates
+        mean = NULL;
+        if (init_Mat_rm(&cov, DESC_NUMEL, DESC_NUMEL, SIFT3D_DOUBLE, 
+                SIFT3D_TRUE))
+                return SIFT3D_FAILURE;
+        if (init_Mat_rm(&Q, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&cov);
+                return SIFT3D_FAILURE;
+        }
+        if (init_Mat_rm(&L, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&cov);
+                cleanup_Mat_rm(&Q);
+                return SIFT3D_FAILURE;
+        }
+        if (resize_SIFT3D_Pca(pca, dim) ||
+                (mean = (double *) calloc(DESC_NUMEL, sizeof(double))) == NULL)
+                goto learn_pca_quit;
+
+        // Compute the mean
+        for (s = 0; s < num_stores; s++) {
+
+                size_t n;
+
+                const SIFT3D_Descriptor_store *const store = desc + s;
+
+                for (n = 0; n < store->num; n++) {
+
+                        const float *const feat = DESC_GET_FEAT(store->buf + n);
+
+                        for (j = 0; j < DESC_NUMEL; j++) {
+                                mean[j] += feat[j];
+                        }
+                }
+        }
+        for (j = 0; j < DESC_NUMEL; j++) {
+                mean[j] /= (double) num_total;
+        }
+
+        // Accumulate the upper triangle of the second moment, in blocks of 
+        // descriptors which stay in cache while each thread takes its rows
+        for (s = 0; s < num_stores; s++) {
+
+                size_t start;
+
+                const SIFT3D_Descriptor_store *const store = desc + s;
+
+                for (start = 0; start < store->num; start += NN_CHUNK_Q) {
+
+                        const size_t end = SIFT3D_MIN(start + NN_CHUNK_Q, 
+                                store->num);
+
+#pragma omp parallel for schedule(dynamic)
+                        for (i = 0; i < DESC_NUMEL; i++) {
+
+                                size_t n;
+                                int k;
+
+                                double *const row = &SIFT3D_MAT_RM_GET(&cov, 
+                                        i, 0, double);
+
+                                for (n = start; n < end; n++) {
+
+                                        const float *const feat = 
+                                                DESC_GET_FEAT(store->buf + n);
+                                        const double xi = feat[i];
+
+                                        if (xi == 0.0)
+                                                continue;
+
+#pragma omp simd
+                                        for (k = i; k < DESC_NUMEL; k++) {
+                                                row[k] += xi * feat[k];
+                                        }
+                                }
+                        }
+                }
+        }
+
+        // Convert to the covariance, filling in the lower triangle
+        for (i = 0; i < DESC_NUMEL; i++) {
+                for (j = i; j < DESC_NUMEL; j++) {
+
+                        const double c = SIFT3D_MAT_RM_GET(&cov, i, j, double) /
+                                (double) num_total - mean[i] * mean[j];
+
+                        SIFT3D_MAT_RM_GET(&cov, i, j, double) = c;
+                        SIFT3D_MAT_RM_GET(&cov, j, i, double) = c;
+                }
+        }
+
+        // Eigendecomposition, with eigenvalues in ascending order
+        if (eigen_Mat_rm(&cov, &Q, &L))
+                goto learn_pca_quit;
+
+        // Keep the axes of greatest variance
+        for (i = 0; i < dim; i++) {
+
+                const int col = DESC_NUMEL - 1 - i;
+
+                for (j = 0; j < DESC_NUMEL; j++) {
+                        pca->proj[i * DESC_NUMEL + j] = (float) 
+                                SIFT3D_MAT_RM_GET(&Q, j, col, double);
+                }
+                pca->var[i] = (float) SIFT3D_MAX(
+                        SIFT3D_MAT_RM_GET(&L, col, 0, double), 0.0);
+        }
+        for (j = 0; j < DESC_NUMEL; j++) {
+                pca->mean[j] = (float) mean[j];
+        }
+
+        free(mean);
+        cleanup_Mat_rm(&cov);
+        cleanup_Mat_rm(&Q);
+        cleanup_Mat_rm(&L);
+        return SIFT3D_SUCCESS;
+
+learn_pca_quit:
+        free(mean);
+        cleanup_Mat_rm(&cov);
+        cleanup_Mat_rm(&Q);
+        cleanup_Mat_rm(&L);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function to project a feature vector with a PCA. */
+static void project_desc(const SIFT3D_Pca *const pca, 
+        const SIFT3D_Descriptor *const desc, float *const feat, 
+        float *const coords) {
+
+        float centered[DESC_NUMEL];
+        int i, k;
+
+        const float *const in = DESC_GET_FEAT(desc);
+
+        for (k = 0; k < DESC_NUMEL; k++) {
+                centered[k] = in[k] - pca->mean[k];
+        }
+
+        for (i = 0; i < pca->dim; i++) {
+
+                float dot;
+
+                const float *const axis = pca->proj + i * DESC_NUMEL;
+
+                dot = 0.0f;
+#pragma omp simd reduction(+:dot)
+                for (k = 0; k < DESC_NUMEL; k++) {
+                        dot += axis[k] * centered[k];
+                }
+                feat[i] = dot;
+        }
+
+        coords[0] = (float) desc->xd;
+        coords[1] = (float) desc->yd;
+        coords[2] = (float) desc->zd;
+        coords[3] = (float) desc->sd;
+}
+
+/* Initialize a SIFT3D_Pdesc_store for first use. */
+void init_SIFT3D_Pdesc_store(SIFT3D_Pdesc_store *const p) {
+        p->feat = NULL;
+        p->coords = NULL;
+        p->num = 0;
+        p->dim = 0;
+        p->nx = p->ny = p->nz = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Pdesc_store. */
+void cleanup_SIFT3D_Pdesc_store(SIFT3D_Pdesc_store *const p) {
+        free(p->feat);
+        free(p->coords);
+        init_SIFT3D_Pdesc_store(p);
+}
+
+/* Helper function to resize a SIFT3D_Pdesc_store to hold num descriptors of
+ * dimension dim. */
+static int resize_SIFT3D_Pdesc_store(SIFT3D_Pdesc_store *const p, 
+        const int num, const int dim) {
+
+        if (num < 1 || dim < 1) {
+                SIFT3D_ERR("resize_SIFT3D_Pdesc_store: invalid size: "
+                        "[%d x %d] \n", num, dim);
+                return SIFT3D_FAILURE;
+        }
+
+        if ((p->feat = (float *) SIFT3D_safe_realloc(p->feat, 
+                (size_t) num * dim * sizeof(float))) == NULL ||
+                (p->coords = (float *) SIFT3D_safe_realloc(p->coords,
+                (size_t) num * 4 * sizeof(float))) == NULL) {
+                SIFT3D_ERR("resize_SIFT3D_Pdesc_store: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        p->num = num;
+        p->dim = dim;
+        return SIFT3D_SUCCESS;
+}
+
+/* Project SIFT3D descriptors with a PCA learned by SIFT3D_learn_pca. p must 
+ * be initialized with init_SIFT3D_Pdesc_store. */
+int SIFT3D_project_descriptors(const SIFT3D_Pca *const pca,
+        const SIFT3D_Descriptor_store *const desc, 
+        SIFT3D_Pdesc_store *const p) {
+
+        int i;
+
+        const int num = (int) desc->num;
+
+        // Resize the output
+        if (desc->num > INT_MAX || resize_SIFT3D_Pdesc_store(p, num, pca->dim))
+                return SIFT3D_FAILURE;
+        p->nx = desc->nx;
+        p->ny = desc->ny;
+        p->nz = desc->nz;
+
+#pragma omp parallel for
+        for (i = 0; i < num; i++) {
+                project_desc(pca, desc->buf + i, p->feat + 
+                        (size_t) i * pca->dim, p->coords + 4 * i);
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract PCA-projected SIFT3D descriptors from a list of keypoints, as in 
+ * SIFT3D_extract_descriptors. Each descriptor is projected as it is 
+ * extracted, so the full-precision descriptors are never stored.
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters. Must have
+ *      been used to detect keypoints in an image.
+ *  kp - keypoint list populated by a feature detector 
+ *  pca - the projection, see SIFT3D_learn_pca
+ *  p - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_pca_descriptors(SIFT3D *const sift3d,
+        const Keypoint_store *const kp, const SIFT3D_Pca *const pca,
+        SIFT3D_Pdesc_store *const p) {
+
+        int i, ret;
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num = kp->slab.num;
+
+	// Verify inputs
+	if (verify_keys(kp, &sift3d->im))
+		return SIFT3D_FAILURE;
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_pca_descriptors: no Gaussian "
+                        "pyramid is available. Make sure "
+                        "SIFT3D_detect_keypoints was called prior to calling "
+                        "this function. \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output
+        if (resize_SIFT3D_Pdesc_store(p, num, pca->dim))
+                return SIFT3D_FAILURE;
+        {
+	        const Image *const first_level = SIFT3D_PYR_IM_GET(gpyr, 
+                        gpyr->first_octave, gpyr->first_level);
+                p->nx = first_level->nx;
+                p->ny = first_level->ny;
+                p->nz = first_level->nz;
+        }
+
+        // Extract and project the descriptors
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
+
+                SIFT3D_Descriptor descrip;
+
+                const Keypoint *const key = kp->buf + i;
+		const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+
+		if (extract_descrip(sift3d, level, key, &descrip)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                project_desc(pca, &descrip, p->feat + (size_t) i * pca->dim,
+                        p->coords + 4 * i);
+	}	
+
+        return ret;
+}
+
+/* Perform nearest neighbor matching on two sets of PCA-projected 
+ * descriptors, as in SIFT3D_nn_match. Both stores must have been projected
+ * with the same PCA. The cost scales with the projected dimension. */
+int SIFT3D_nn_match_pca(const SIFT3D_Pdesc_store *const d1,
+                        const SIFT3D_Pdesc_store *const d2,
+                        const float nn_thresh, int **const matches) {
+
+        int i;
+
+	const int num = d1->num;
+        const int dim = d1->dim;
+
+        // Verify inputs
+	if (num < 1 || d2->num < 1 || d1->num > INT_MAX || d2->num > INT_MAX) {
+		SIFT3D_ERR("SIFT3D_nn_match_pca: invalid number of "
+			"descriptors: %d, %lu \n", num, (unsigned long) d2->num);
+		return SIFT3D_FAILURE;
+	}
+        if (d2->dim != dim) {
+		SIFT3D_ERR("SIFT3D_nn_match_pca: dimension mismatch: %d, %d \n",
+                        dim, d2->dim);
+		return SIFT3D_FAILURE;
+        }
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_pca: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (i = 0; i < num; i += NN_CHUNK_Q) {
+
+                float best[NN_CHUNK_Q], nearest[NN_CHUNK_Q];
+                int j;
+
+                const int nq = SIFT3D_MIN(NN_CHUNK_Q, num - i);
+                int *const match = *matches + i;
+
+                // Forward matching pass
+                for (j = 0; j < nq; j++) {
+                        best[j] = nearest[j] = FLT_MAX;
+                        match[j] = -1;
+                }
+                nn_block(dim, d1->feat + (size_t) i * dim, dim, nq, d2->feat,
+                        dim, (int) d2->num, 0, best, nearest, match);
+
+                for (j = 0; j < nq; j++) {
+
+                        float back_best, back_nearest;
+                        int back_idx;
+
+                        if (match[j] < 0)
+                                continue;
+
+                        if (!nn_ratio_test(best[j], nearest[j], nn_thresh)) {
+                                match[j] = -1;
+                                continue;
+                        }
+
+                        // Check for forward-backward consistency
+                        back_best = back_nearest = FLT_MAX;
+                        back_idx = -1;
+                        nn_block(dim, d2->feat + (size_t) match[j] * dim, dim,
+                                1, d1->feat, dim, num, 0, &back_best, 
+                                &back_nearest, &back_idx);
+                        if (back_idx != i + j || !nn_ratio_test(back_best, 
+                                back_nearest, nn_thresh))
+                                match[j] = -1;
+                }
+        }
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Compute the Hamming distance between two binary descriptors. */
+static int hamming_dist(const uint64_t *const a, const uint64_t *const b) {
+
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+        __m512i acc = _mm512_setzero_si512();
+        int k;
+
+        // Process 8 words at a time, masking the remainder
+        for (k = 0; k < DESC_BIN_WORDS; k += 8) {
+
+                const __mmask8 mask = DESC_BIN_WORDS - k >= 8 ? 0xFF :
+                        (__mmask8) ((1u << (DESC_BIN_WORDS - k)) - 1);
+
+                acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(
+                        _mm512_xor_si512(
+                        _mm512_maskz_loadu_epi64(mask, a + k),
+                        _mm512_maskz_loadu_epi64(mask, b + k))));
+        }
+
+        return (int) _mm512_reduce_add_epi64(acc);
+#else
+        int k, dist;
+
+        dist = 0;
+        for (k = 0; k < DESC_BIN_WORDS; k++) {
+#if defined(__GNUC__)
+                dist += __builtin_popcountll(a[k] ^ b[k]);
+#else
+                uint64_t x = a[k] ^ b[k];
+                x = x - ((x >> 1) & 0x5555555555555555ULL);
+                x = (x & 0x3333333333333333ULL) + 
+                        ((x >> 2) & 0x3333333333333333ULL);
+                x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+                dist += (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+        }
+
+        return dist;
+#endif
+}
+
+/* Helper function to update the best and second-best Hamming distances of 
+ * the binary descriptor bits against all the descriptors in store. */
+static void bnn_search(const uint64_t *const bits, 
+        const SIFT3D_Bdesc_store *const store, int *const best, 
+        int *const nearest, int *const best_idx) {
+
+        int j;
+
+        const int num = (int) store->num;
+
+        for (j = 0; j < num; j++) {
+
+                const int dist = hamming_dist(bits, store->bits + 
+                        (size_t) j * DESC_BIN_WORDS);
+
+                if (dist < *best) {
+                        *nearest = *best;
+                        *best = dist;
+                        *best_idx = j;
+                } else if (dist < *nearest) {
+                        *nearest = dist;
+                }
+        }
+}
+
+/* Blocked nearest-neighbor kernel. Updates the running best and second-best
+ * SSD of each of the nq query vectors in q against the nr reference vectors
+ * in r. Each vector has numel elements, and consecutive vectors are
+ * q_stride or r_stride floats apart. The index of the best reference, offset
+ * by r_idx0, is written to best_idx. 
+ *
+ * The references are processed in tiles of NN_TILE_R, which stay in cache
+ * while all the queries are compared to them. Each reference load is shared
+ * by NN_BLOCK_Q queries. */
+static void nn_block(const int numel, const float *const q, 
+        const size_t q_stride, const int nq, const float *const r, 
+        const size_t r_stride, const int nr, const int r_idx0, 
+        float *const best, float *const nearest, int *const best_idx) {
+
+        int t, i, j, k, b;
+
+        for (t = 0; t < nr; t += NN_TILE_R) {
+
+                const int t_end = SIFT3D_MIN(t + NN_TILE_R, nr);
+
+                for (i = 0; i < nq; i += NN_BLOCK_Q) {
+
+                        // Alias missing queries to the first one in the block
+                        const int nb = SIFT3D_MIN(NN_BLOCK_Q, nq - i);
+                        const float *const q0 = q + i * q_stride;
+                        const float *const q1 = nb > 1 ? q0 + q_stride : q0;
+                        const float *const q2 = nb > 2 ? 
+                                q0 + 2 * q_stride : q0;
+                        const float *const q3 = nb > 3 ? 
+                                q0 + 3 * q_stride : q0;
+
+                        for (j = t; j < t_end; j++) {
+
+                                float ssd[NN_BLOCK_Q];
+                                float s0, s1, s2, s3;
+
+                                const float *const rj = r + j * r_stride;
+
+                                // Compute the SSD to each query
+                                s0 = s1 = s2 = s3 = 0.0f;
+#pragma omp simd reduction(+:s0,s1,s2,s3)
+                                for (k = 0; k < numel; k++) {
+                                        const float rk = rj[k];
+                                        const float d0 = q0[k] - rk;
+                                        const float d1 = q1[k] - rk;
+                                        const float d2 = q2[k] - rk;
+                                        const float d3 = q3[k] - rk;
+                                        s0 += d0 * d0;
+                                        s1 += d1 * d1;
+                                        s2 += d2 * d2;
+                                        s3 += d3 * d3;
+                                }
+                                ssd[0] = s0;
+                                ssd[1] = s1;
+                                ssd[2] = s2;
+                                ssd[3] = s3;
+
+                                // Compare to the best matches
+                                for (b = 0; b < nb; b++) {
+
+                                        const int idx = i + b;
+
+                                        if (ssd[b] < best[idx]) {
+                                                nearest[idx] = best[idx];
+                                                best[idx] = ssd[b];
+                                                best_idx[idx] = r_idx0 + j;
+                                        } else if (ssd[b] < nearest[idx]) {
+                                                nearest[idx] = ssd[b];
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+/* Returns SIFT3D_TRUE if the best match is sufficiently closer than the 
+ * second-best, as in match_desc. */
+static int nn_ratio_test(const float best, const float nearest,
+        const float nn_thresh) {
+        return !((double) best / (double) nearest > 
+                (double) nn_thresh * (double) nn_thresh);
+}
+
+/* Draw the matches. 
+ * 
+ * Inputs:
+ * -left - lefthand-side image
+ * -right - righthand-side image
+ * -keys_left - Keypoints from "left" (can be NULL if keys is NULL) 
+ * -keys_right - Keypoints from "right" (can be NULL if keys is NULL)
+ * -match_left - Matches from "left" (can be NULL if lines is NULL)
+ * -match_right - Matches from "right" (can be NULL if lines is NULL)
+ * 
+ * Outputs:
+ * -concat - Concatenated image (NULL if not needed)
+ * -keys - Keypoints from concat (NULL is not needed)
+ * -lines - Lines between matching keypoints in concat (NULL if not needed)
+ * It is an error if all outputs are NULL.
+ *
+ * Return:
+ * SIFT3D_SUCCESS or SIFT3D_FAILURE
+ */
+int draw_matches(const Image *const left, const Image *const right,
+                 const Mat_rm *const keys_left, const Mat_rm *const keys_right,
+		 const Mat_rm *const match_left, 
+                 const Mat_rm *const match_right, Image *const concat, 
+                 Image *const keys, Image *const lines) {
+
+        Image concat_temp, left_padded, right_padded;
+	Mat_rm keys_right_draw, keys_left_draw, keys_draw, match_right_draw;
+	int i;
+
+        const double right_pad = (double) left->nx;
+        const int ny_pad = SIFT3D_MAX(right->ny, left->ny);
+	const int nz_pad = SIFT3D_MAX(right->nz, left->nz);
+
+        // Choose which image to use for concatenation 
+        Image *const concat_arg = concat == NULL ? &concat_temp : concat;
+
+        // Verify inputs
+        if (concat == NULL && keys == NULL && lines == NULL) {
+                SIFT3D_ERR("draw_matches: all outputs are NULL \n");
+                return SIFT3D_FAILURE;
+        }
+        if (keys_left == NULL && keys != NULL) {
+                SIFT3D_ERR("draw_matches: keys_left is NULL but keys is "
+                        "not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (keys_right == NULL && keys != NULL) {
+                SIFT3D_ERR("draw_matches: keys_right is NULL but keys is "
+                        "not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (match_left == NULL && lines != NULL) {
+                SIFT3D_ERR("draw_matches: match_left is NULL but lines "
+                        "is not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (match_right == NULL && lines != NULL) {
+                SIFT3D_ERR("draw_matches: match_right is NULL but lines "
+                        "is not \n");
+                return SIFT3D_FAILURE;
+        }
+
+	// Initialize intermediates		
+        init_im(&concat_temp);
+        init_im(&left_padded);
+        init_im(&right_padded);
+        if (init_Mat_rm(&keys_right_draw, 0, 0, SIFT3D_DOUBLE, 
+		SIFT3D_FALSE) ||
+	        init_Mat_rm(&match_right_draw, 0, 0, SIFT3D_DOUBLE, 
+			SIFT3D_FALSE) ||
+                init_Mat_rm(&keys_left_draw, 0, 0, SIFT3D_DOUBLE, 
+			SIFT3D_FALSE) ||
+                init_Mat_rm(&keys_draw, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+	        return SIFT3D_FAILURE;
+
+        // Pad the images to be the same in all dimensions but x
+	if (init_im_with_dims(&right_padded, right->nx, ny_pad, nz_pad, 1) || 
+	        init_im_with_dims(&left_padded, left->nx, ny_pad, nz_pad, 1) ||
+	   	im_pad(right, &right_padded) || 
+	    	im_pad(left, &left_padded)) {
+                SIFT3D_ERR("draw_matches: unable to pad images \n");
+                return SIFT3D_FAILURE;
+	}
+
+	// Draw a concatenated image
+	if (im_concat(&left_padded, &right_padded, 0, concat_arg)) {
+                SIFT3D_ERR("draw_matches: Could not concatenate the "
+                        "images \n");
+                goto draw_matches_quit;
+        }
+
+        // Optionally draw the keypoints
+        if (keys != NULL) { 
+
+                // Convert inputs to double
+                if (convert_Mat_rm(keys_right, &keys_right_draw, 
+			SIFT3D_DOUBLE) ||
+                        convert_Mat_rm(keys_left, &keys_left_draw, 
+				SIFT3D_DOUBLE))
+                        goto draw_matches_quit;
+       
+                // Pad the x-coordinate 
+                for (i = 0; i < keys_right->num_rows; i++) {
+                        SIFT3D_MAT_RM_GET(&keys_right_draw, i, 0, double) += 
+                                right_pad; 
+                }
+
+                // Concatenate the points
+                if (concat_Mat_rm(&keys_left_draw, &keys_right_draw,
+                        &keys_draw, 0))
+                        goto draw_matches_quit;
+
+                // Draw the points
+                if (draw_points(&keys_draw, SIFT3D_IM_GET_DIMS(concat_arg), 
+                        1, keys))
+                        goto draw_matches_quit;
+        }
+
+	// Optionally draw the lines 
+        if (lines != NULL) {
+
+                // Convert input to double
+                if (convert_Mat_rm(match_right, &match_right_draw, 
+			SIFT3D_DOUBLE))
+                        goto draw_matches_quit;
+
+                // Pad the x-coordinate 
+                for (i = 0; i < match_right->num_rows; i++) {
+                        SIFT3D_MAT_RM_GET(&match_right_draw, i, 0, double) += 
+                                right_pad;
+                }
+
+                // Draw the lines
+                if (draw_lines(match_left, &match_right_draw, 
+                        SIFT3D_IM_GET_DIMS(concat_arg), lines))
+                        goto draw_matches_quit;
+        }
+
+        // Clean up
+        im_free(&concat_temp);
+        im_free(&left_padded);
+        im_free(&right_padded); 
+        cleanup_Mat_rm(&keys_right_draw); 
+        cleanup_Mat_rm(&keys_left_draw); 
+        cleanup_Mat_rm(&keys_draw); 
+        cleanup_Mat_rm(&match_right_draw); 
+	return SIFT3D_SUCCESS;
+
+draw_matches_quit:
+        im_free(&concat_temp);
+        im_free(&left_padded);
+        im_free(&right_padded); 
+        cleanup_Mat_rm(&keys_right_draw);
+        cleanup_Mat_rm(&keys_left_draw); 
+        cleanup_Mat_rm(&keys_draw); 
+        cleanup_Mat_rm(&match_right_draw);
+        return SIFT3D_FAILURE;
+}
+
+/* Write a Keypoint_store to a text file. The keypoints are stored in a matrix
+ * (.csv, .csv.gz), where each keypoint is a row. The elements of each row are
+ * as follows:
+ *
+ * x y z o s ori11 ori12 ... orinn
+ *
+ * x - the x-coordinate
+ * y - the y-coordinate
+ * z - the z-coordinate
+ * o - the pyramid octave. To convert to image coordinates, multiply x,y,z by 
+ *      pow(2, o)
+ * s - the scale coordinate
+ * ori(ij) - the ith row, jth column of the orientation matrix */
+int write_Keypoint_store(const char *path, const Keypoint_store *const kp) {
+
+        Mat_rm mat;
+	int i, i_R, j_R;
+
+        // Keypoint data format constants
+        const int kp_x = 0; // column of x-coordinate
+        const int kp_y = 1; // column of y-coordinate
+        const int kp_z = 2; // column of z-coordinate
+        const int kp_o = 3; // column of octave index
+        const int kp_s = 4; // column of s-coordinate
+        const int kp_ori = 5; // first column of the orientation matrix
+        const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation 
+                // elements
+        const int num_rows = kp->slab.num;
+        const int num_cols = kp_ori + ori_numel;
+
+        // Initialize the matrix
+        if (init_Mat_rm(&mat, num_rows, num_cols, SIFT3D_DOUBLE, 
+		SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+       
+        // Write the keypoints 
+        for (i = 0; i < num_rows; i++) {
+
+                const Keypoint *const key = kp->buf + i;
+                const Mat_rm *const R = &key->R;
+
+                // Write the coordinates 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_x, double) = key->xd;
+                SIFT3D_MAT_RM_GET(&mat, i, kp_y, double) = key->yd; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_z, double) = key->zd; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_o, double) = key->o; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_s, double) = key->sd;
+
+                // Write the orientation matrix
+                SIFT3D_MAT_RM_LOOP_START(R, i_R, j_R)
+
+                        const int kp_idx = kp_ori + 
+                                SIFT3D_MAT_RM_GET_IDX(R, i_R, j_R);
+        
+                        SIFT3D_MAT_RM_GET(&mat, i, kp_idx, double) = 
+                                (double) SIFT3D_MAT_RM_GET(R, i_R, j_R, float);
+
+                SIFT3D_MAT_RM_LOOP_END
+        }
+
+        // Write the matrix 
         if (write_Mat_rm(path, &mat))
                 goto write_kp_quit;
 
@@ -3201,13 +4831,19 @@ write_kp_quit:
         return SIFT3D_FAILURE;
 }
 
-/* Write SIFT3D descriptors to a text file.
- * See SIFT3D_Descriptor_store_to_Mat_rm for the file format. */
+/* Write SIFT3D descriptors to a file. If the path has the extension .sdb, 
+ * a binary database is written, see write_SIFT3D_Descriptor_db. Otherwise,
+ * the descriptors are written to a text file.
+ * See SIFT3D_Descriptor_store_to_Mat_rm for the text file format. */
 int write_SIFT3D_Descriptor_store(const char *path, 
         const SIFT3D_Descriptor_store *const desc) {
 
         Mat_rm mat;
 
+        // Optionally write a binary database
+        if (is_db_path(path))
+                return write_SIFT3D_Descriptor_db(path, desc);
+
         // Initialize the matrix
         if (init_Mat_rm(&mat, 0, 0, SIFT3D_FLOAT, SIFT3D_FALSE))
                 return SIFT3D_FAILURE;
@@ -3229,3 +4865,585 @@ write_desc_quit:
         return SIFT3D_FAILURE;
 }
 
+
+/* Header of a binary descriptor database file. All fields are stored in the
+ * byte order of the machine which wrote the file. */
+typedef struct _Db_header {
+        char magic[8];          // Equal to db_magic
+        uint32_t version;       // Format version
+        uint32_t byte_order;    // Equal to db_byte_order
+        uint32_t header_size;   // Size of this header, in bytes
+        uint32_t numel;         // Number of feature elements per descriptor
+        uint64_t num;           // Number of descriptors
+        int32_t nx, ny, nz;     // Image dimensions
+        uint32_t reserved;      // Unused, set to zero
+        uint64_t coords_offset; // Offset of the coordinate block, in bytes
+        uint64_t feat_offset;   // Offset of the feature block, in bytes
+} Db_header;
+
+/* Round x up to a multiple of align */
+#define DB_ALIGN_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+/* Helper function to write num zero bytes to a file */
+static int db_write_pad(FILE *const file, size_t num) {
+
+        static const char zeros[256] = {0};
+
+        while (num > 0) {
+                const size_t chunk = SIFT3D_MIN(num, sizeof(zeros));
+                if (fwrite(zeros, 1, chunk, file) != chunk)
+                        return SIFT3D_FAILURE;
+                num -= chunk;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Write SIFT3D descriptors to a binary database file (.sdb), which can
+ * later be opened with open_SIFT3D_Descriptor_db. See that function for the
+ * file format. */
+int write_SIFT3D_Descriptor_db(const char *path,
+        const SIFT3D_Descriptor_store *const desc) {
+
+        Db_header header;
+        FILE *file;
+        size_t i, pos;
+
+        const size_t num = desc->num;
+        const size_t coords_offset = DB_ALIGN_UP(sizeof(Db_header), db_align);
+        const size_t coords_size = num * 4 * sizeof(float);
+        const size_t feat_offset = DB_ALIGN_UP(coords_offset + coords_size, 
+                db_feat_align);
+
+        // Fill in the header
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, db_magic, sizeof(header.magic));
+        header.version = db_version;
+        header.byte_order = db_byte_order;
+        header.header_size = (uint32_t) sizeof(Db_header);
+        header.numel = DESC_NUMEL;
+        header.num = (uint64_t) num;
+        header.nx = desc->nx;
+        header.ny = desc->ny;
+        header.nz = desc->nz;
+        header.coords_offset = (uint64_t) coords_offset;
+        header.feat_offset = (uint64_t) feat_offset;
+
+        // Open the file
+        if ((file = fopen(path, "wb")) == NULL) {
+                SIFT3D_ERR("write_SIFT3D_Descriptor_db: failed to open file "
+                        "%s \n", path);
+                return SIFT3D_FAILURE;
+        }
+
+        // Write the header
+        if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+                db_write_pad(file, coords_offset - sizeof(header)))
+                goto write_db_quit;
+
+        // Write the coordinates
+        for (i = 0; i < num; i++) {
+
+                float coords[4];
+
+                const SIFT3D_Descriptor *const d = desc->buf + i;
+
+                coords[0] = (float) d->xd;
+                coords[1] = (float) d->yd;
+                coords[2] = (float) d->zd;
+                coords[3] = (float) d->sd;
+                if (fwrite(coords, sizeof(float), 4, file) != 4)
+                        goto write_db_quit;
+        }
+        pos = coords_offset + coords_size;
+        if (db_write_pad(file, feat_offset - pos))
+                goto write_db_quit;
+
+        // Write the features
+        for (i = 0; i < num; i++) {
+                if (fwrite(DESC_GET_FEAT(desc->buf + i), sizeof(float), 
+                        DESC_NUMEL, file) != DESC_NUMEL)
+                        goto write_db_quit;
+        }
+
+        // Check for errors and finish writing
+        if (ferror(file))
+                goto write_db_quit;
+        if (fclose(file)) {
+                SIFT3D_ERR("write_SIFT3D_Descriptor_db: failed to close file "
+                        "%s \n", path);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+
+write_db_quit:
+        SIFT3D_ERR("write_SIFT3D_Descriptor_db: failed to write file %s \n",
+                path);
+        fclose(file);
+        return SIFT3D_FAILURE;
+}
+
+/* Initialize a SIFT3D_Descriptor_db for first use. */
+void init_SIFT3D_Descriptor_db(SIFT3D_Descriptor_db *const db) {
+        db->coords = NULL;
+        db->feat = NULL;
+        db->map = NULL;
+        db->map_size = 0;
+        db->num = 0;
+        db->nx = db->ny = db->nz = 0;
+        db->mapped = SIFT3D_FALSE;
+}
+
+/* Open a binary descriptor database for reading. db must be initialized
+ * with init_SIFT3D_Descriptor_db, and later released with
+ * close_SIFT3D_Descriptor_db. The file is memory-mapped read-only, so 
+ * multiple processes opening the same file share its pages. On platforms 
+ * without mmap, the file is read into memory.
+ *
+ * File format:
+ *  -A 64-byte header, see Db_header
+ *  -At coords_offset (64-byte aligned), a num x 4 array of floats, where 
+ *      each row is [x y z s]
+ *  -At feat_offset (4096-byte aligned), a num x DESC_NUMEL array of floats, 
+ *      where each row is a feature vector, ordered as in 
+ *      SIFT3D_Descriptor_store_to_Mat_rm
+ *
+ * Files of a newer version, or written on a machine of different byte order,
+ * are rejected. */
+int open_SIFT3D_Descriptor_db(const char *path, 
+        SIFT3D_Descriptor_db *const db) {
+
+        Db_header header;
+        size_t size;
+
+        // Release any previously-opened file
+        close_SIFT3D_Descriptor_db(db);
+
+#ifndef _WINDOWS
+        {
+                struct stat st;
+                void *map;
+                int fd;
+
+                // Open the file and get its size
+                if ((fd = open(path, O_RDONLY)) < 0) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: failed to open "
+                                "file %s \n", path);
+                        return SIFT3D_FAILURE;
+                }
+                if (fstat(fd, &st) || st.st_size < (off_t) sizeof(header)) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s is "
+                                "too small \n", path);
+                        close(fd);
+                        return SIFT3D_FAILURE;
+                }
+                size = (size_t) st.st_size;
+
+                // Map the file. The mapping persists after closing fd.
+                map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: failed to map "
+                                "file %s \n", path);
+                        return SIFT3D_FAILURE;
+                }
+                db->map = map;
+                db->mapped = SIFT3D_TRUE;
+        }
+#else
+        {
+                FILE *file;
+                long len;
+
+                // Read the whole file into memory
+                if ((file = fopen(path, "rb")) == NULL) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: failed to open "
+                                "file %s \n", path);
+                        return SIFT3D_FAILURE;
+                }
+                if (fseek(file, 0, SEEK_END) || (len = ftell(file)) < 
+                        (long) sizeof(header) || fseek(file, 0, SEEK_SET)) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s is "
+                                "too small \n", path);
+                        fclose(file);
+                        return SIFT3D_FAILURE;
+                }
+                size = (size_t) len;
+                if ((db->map = malloc(size)) == NULL ||
+                        fread(db->map, 1, size, file) != size) {
+                        SIFT3D_ERR("open_SIFT3D_Descriptor_db: failed to read "
+                                "file %s \n", path);
+                        fclose(file);
+                        free(db->map);
+                        db->map = NULL;
+                        return SIFT3D_FAILURE;
+                }
+                fclose(file);
+                db->mapped = SIFT3D_FALSE;
+        }
+#endif
+        db->map_size = size;
+
+        // Validate the file and set up the view
+        return open_db_view(path, db);
+}
+
+/* Open a batch of binary descriptor databases, for example the shards of a
+ * cohort, reading them into memory together with im_read_files. This hides 
+ * the per-file latency of network storage, where opening the files one at a
+ * time with open_SIFT3D_Descriptor_db would be slow. 
+ *
+ * Parameters:
+ *      paths - The paths of the files.
+ *      num - The number of files.
+ *      dbs - An array of num databases, each initialized with 
+ *              init_SIFT3D_Descriptor_db, and later released with 
+ *              close_SIFT3D_Descriptor_db.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise, in which case
+ * all of the databases are closed. */
+int open_SIFT3D_Descriptor_db_batch(const char *const *paths, const int num,
+        SIFT3D_Descriptor_db *const dbs) {
+
+        void **bufs;
+        size_t *lens;
+        int i;
+
+        // Release any previously-opened files
+        for (i = 0; i < num; i++) {
+                close_SIFT3D_Descriptor_db(dbs + i);
+        }
+        if (num < 1)
+                return SIFT3D_SUCCESS;
+
+        // Read the files
+        bufs = (void **) malloc(num * sizeof(void *));
+        lens = (size_t *) malloc(num * sizeof(size_t));
+        if (bufs == NULL || lens == NULL || 
+                im_read_files(paths, num, 0, bufs, lens)) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db_batch: failed to read "
+                        "the files \n");
+                goto open_db_batch_quit;
+        }
+
+        // Take ownership of the buffers
+        for (i = 0; i < num; i++) {
+                SIFT3D_Descriptor_db *const db = dbs + i;
+                db->map = bufs[i];
+                db->map_size = lens[i];
+                db->mapped = SIFT3D_FALSE;
+        }
+        free(bufs);
+        free(lens);
+        bufs = NULL;
+        lens = NULL;
+
+        // Validate each file
+        for (i = 0; i < num; i++) {
+                if (open_db_view(paths[i], dbs + i))
+                        goto open_db_batch_quit;
+        }
+
+        return SIFT3D_SUCCESS;
+
+open_db_batch_quit:
+        for (i = 0; i < num; i++) {
+                close_SIFT3D_Descriptor_db(dbs + i);
+        }
+        if (bufs != NULL)
+                free(bufs);
+        if (lens != NULL)
+                free(lens);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function to validate the contents of a descriptor database, whose 
+ * map and map_size are set, and set up its view of the data. On failure, 
+ * the database is closed. */
+static int open_db_view(const char *path, SIFT3D_Descriptor_db *const db) {
+
+        Db_header header;
+        size_t feat_size;
+
+        const size_t size = db->map_size;
+
+        // Validate the header
+        if (size < sizeof(header)) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s is "
+                        "too small \n", path);
+                goto open_db_quit;
+        }
+        memcpy(&header, db->map, sizeof(header));
+        if (memcmp(header.magic, db_magic, sizeof(header.magic))) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s is not a "
+                        "SIFT3D descriptor database \n", path);
+                goto open_db_quit;
+        }
+        if (header.byte_order != db_byte_order) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s was written "
+                        "with a different byte order \n", path);
+                goto open_db_quit;
+        }
+        if (header.version > db_version) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s has "
+                        "unsupported version %u \n", path, 
+                        (unsigned int) header.version);
+                goto open_db_quit;
+        }
+        if (header.header_size < sizeof(header) || 
+                header.numel != DESC_NUMEL) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s has an "
+                        "invalid header \n", path);
+                goto open_db_quit;
+        }
+
+        // Validate the data layout
+        feat_size = DESC_NUMEL * sizeof(float);
+        if (header.coords_offset % db_align || 
+                header.feat_offset % db_align ||
+                header.coords_offset < header.header_size ||
+                header.feat_offset > size ||
+                header.num > (size - header.feat_offset) / feat_size ||
+                header.coords_offset + header.num * 4 * sizeof(float) > 
+                        header.feat_offset) {
+                SIFT3D_ERR("open_SIFT3D_Descriptor_db: file %s is "
+                        "truncated or corrupt \n", path);
+                goto open_db_quit;
+        }
+
+        // Set up the view
+        db->coords = (const float *) ((const char *) db->map + 
+                header.coords_offset);
+        db->feat = (const float *) ((const char *) db->map + 
+                header.feat_offset);
+        db->num = (size_t) header.num;
+        db->nx = header.nx;
+        db->ny = header.ny;
+        db->nz = header.nz;
+
+        return SIFT3D_SUCCESS;
+
+open_db_quit:
+        close_SIFT3D_Descriptor_db(db);
+        return SIFT3D_FAILURE;
+}
+
+/* Release the memory associated with a SIFT3D_Descriptor_db. db may be 
+ * re-opened afterwards. */
+void close_SIFT3D_Descriptor_db(SIFT3D_Descriptor_db *const db) {
+
+        if (db->map != NULL) {
+#ifndef _WINDOWS
+                if (db->mapped)
+                        munmap(db->map, db->map_size);
+                else
+#endif
+                        free(db->map);
+        }
+
+        init_SIFT3D_Descriptor_db(db);
+}
+
+/* Copy the contents of a SIFT3D_Descriptor_db into a 
+ * SIFT3D_Descriptor_store. The scale is restored from the file. */
+int SIFT3D_Descriptor_db_to_store(const SIFT3D_Descriptor_db *const db,
+        SIFT3D_Descriptor_store *const store) {
+
+        size_t i;
+
+        // Verify inputs
+        if (db->num < 1 || db->num > INT_MAX) {
+                SIFT3D_ERR("SIFT3D_Descriptor_db_to_store: invalid number of "
+                        "descriptors: %lu \n", (unsigned long) db->num);
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the descriptor store
+        if (resize_SIFT3D_Descriptor_store(store, (int) db->num))
+                return SIFT3D_FAILURE;
+        store->nx = db->nx;
+        store->ny = db->ny;
+        store->nz = db->nz;
+
+        // Copy the data
+        for (i = 0; i < db->num; i++) {
+
+                SIFT3D_Descriptor *const desc = store->buf + i;
+                const float *const coords = db->coords + 4 * i;
+
+                desc->xd = coords[0];
+                desc->yd = coords[1];
+                desc->zd = coords[2];
+                desc->sd = coords[3];
+                memcpy(desc->hists, db->feat + i * DESC_NUMEL, 
+                        DESC_NUMEL * sizeof(float));
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Read SIFT3D descriptors from a binary database file (.sdb). See 
+ * open_SIFT3D_Descriptor_db for the file format. */
+int read_SIFT3D_Descriptor_store(const char *path,
+        SIFT3D_Descriptor_store *const desc) {
+
+        SIFT3D_Descriptor_db db;
+        int ret;
+
+        // Only the binary format can be read
+        if (!is_db_path(path)) {
+                SIFT3D_ERR("read_SIFT3D_Descriptor_store: unsupported file "
+                        "extension in %s. Only .%s files can be read. \n", 
+                        path, ext_db);
+                return SIFT3D_UNSUPPORTED_FILE_TYPE;
+        }
+
+        init_SIFT3D_Descriptor_db(&db);
+        if (open_SIFT3D_Descriptor_db(path, &db))
+                return SIFT3D_FAILURE;
+
+        ret = SIFT3D_Descriptor_db_to_store(&db, desc);
+        close_SIFT3D_Descriptor_db(&db);
+
+        return ret;
+}
+
+/* Header of a PCA projection file, see write_SIFT3D_Pca */
+typedef struct _Pca_header {
+        char magic[8];          // Equal to pca_magic
+        uint32_t version;       // Format version
+        uint32_t byte_order;    // Equal to db_byte_order
+        uint32_t numel;         // Number of feature elements per descriptor
+        uint32_t dim;           // Projected dimension
+} Pca_header;
+
+/* Write a PCA projection to a binary file. The file contains a header 
+ * (see Pca_header), followed by the mean, the variances and the axes, as 
+ * float arrays. */
+int write_SIFT3D_Pca(const char *path, const SIFT3D_Pca *const pca) {
+
+        Pca_header header;
+        FILE *file;
+
+        const size_t proj_numel = (size_t) pca->dim * DESC_NUMEL;
+
+        // Fill in the header
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, pca_magic, sizeof(header.magic));
+        header.version = pca_version;
+        header.byte_order = db_byte_order;
+        header.numel = DESC_NUMEL;
+        header.dim = (uint32_t) pca->dim;
+
+        // Write the file
+        if ((file = fopen(path, "wb")) == NULL) {
+                SIFT3D_ERR("write_SIFT3D_Pca: failed to open file %s \n", 
+                        path);
+                return SIFT3D_FAILURE;
+        }
+        if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+                fwrite(pca->mean, sizeof(float), DESC_NUMEL, file) != 
+                        DESC_NUMEL ||
+                fwrite(pca->var, sizeof(float), pca->dim, file) != 
+                        (size_t) pca->dim ||
+                fwrite(pca->proj, sizeof(float), proj_numel, file) != 
+                        proj_numel) {
+                SIFT3D_ERR("write_SIFT3D_Pca: failed to write file %s \n",
+                        path);
+                fclose(file);
+                return SIFT3D_FAILURE;
+        }
+        if (fclose(file)) {
+                SIFT3D_ERR("write_SIFT3D_Pca: failed to close file %s \n",
+                        path);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Read a PCA projection written by write_SIFT3D_Pca. pca must be 
+ * initialized with init_SIFT3D_Pca. */
+int read_SIFT3D_Pca(const char *path, SIFT3D_Pca *const pca) {
+
+        Pca_header header;
+        FILE *file;
+        size_t proj_numel;
+
+        if ((file = fopen(path, "rb")) == NULL) {
+                SIFT3D_ERR("read_SIFT3D_Pca: failed to open file %s \n", 
+                        path);
+                return SIFT3D_FAILURE;
+        }
+
+        // Read and validate the header
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+                memcmp(header.magic, pca_magic, sizeof(header.magic)) ||
+                header.byte_order != db_byte_order ||
+                header.version > pca_version ||
+                header.numel != DESC_NUMEL ||
+                header.dim < 1 || header.dim > DESC_NUMEL) {
+                SIFT3D_ERR("read_SIFT3D_Pca: file %s is not a supported PCA "
+                        "projection \n", path);
+                goto read_pca_quit;
+        }
+
+        // Read the data
+        proj_numel = (size_t) header.dim * DESC_NUMEL;
+        if (resize_SIFT3D_Pca(pca, (int) header.dim))
+                goto read_pca_quit;
+        if (fread(pca->mean, sizeof(float), DESC_NUMEL, file) != DESC_NUMEL ||
+                fread(pca->var, sizeof(float), header.dim, file) != 
+                        header.dim ||
+                fread(pca->proj, sizeof(float), proj_numel, file) != 
+                        proj_numel) {
+                SIFT3D_ERR("read_SIFT3D_Pca: file %s is truncated \n", path);
+                goto read_pca_quit;
+        }
+
+        fclose(file);
+        return SIFT3D_SUCCESS;
+
+read_pca_quit:
+        fclose(file);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function to advise the OS of upcoming accesses to the features of
+ * num descriptors in db, starting at start. If will_need is SIFT3D_TRUE, the
+ * pages are prefetched. Otherwise, they are released. Does nothing if db is 
+ * not memory-mapped. */
+static void db_advise(const SIFT3D_Descriptor_db *const db, 
+        const size_t start, const size_t num, const int will_need) {
+#ifndef _WINDOWS
+        uintptr_t begin, end;
+
+        if (!db->mapped || start >= db->num)
+                return;
+
+        const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        const size_t len = SIFT3D_MIN(num, db->num - start);
+
+        // madvise requires a page-aligned address
+        begin = (uintptr_t) (db->feat + start * DESC_NUMEL);
+        end = (uintptr_t) (db->feat + (start + len) * DESC_NUMEL);
+        begin -= begin % page;
+
+        madvise((void *) begin, end - begin, 
+                will_need ? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+}
+
+/* Helper function returning SIFT3D_TRUE if path has the extension of a 
+ * binary descriptor database */
+static int is_db_path(const char *path) {
+
+        const char *name, *dot;
+
+        name = strrchr(path, SIFT3D_FILE_SEP);
+        name = name == NULL ? path : name + 1;
+        dot = strrchr(name, '.');
+
+        return dot != NULL && dot != name && !strcmp(dot + 1, ext_db);
+}
@@ -79,6 +79,83 @@ int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 		    const SIFT3D_Descriptor_store *const d2,
 		    const float nn_thresh, int **const matches);
 
+int SIFT3D_nn_match_ratio(const SIFT3D_Descriptor_store *const d1,
+		          const SIFT3D_Descriptor_store *const d2,
+		          const float nn_thresh, int **const matches,
+                          float **const ratios);
+
+void init_SIFT3D_Descriptor_db(SIFT3D_Descriptor_db *const db);
+
+int open_SIFT3D_Descriptor_db(const char *path, SIFT3D_Descriptor_db *const db);
+
+int open_SIFT3D_Descriptor_db_batch(const char *const *paths, const int num,
+        SIFT3D_Descriptor_db *const dbs);
+
+void close_SIFT3D_Descriptor_db(SIFT3D_Descriptor_db *const db);
+
+int SIFT3D_Descriptor_db_to_store(const SIFT3D_Descriptor_db *const db,
+        SIFT3D_Descriptor_store *const store);
+
+int SIFT3D_nn_match_db(const SIFT3D_Descriptor_store *const d1,
+                       const SIFT3D_Descriptor_db *const db,
+                       const float nn_thresh, int **const matches);
+
+int SIFT3D_nn_match_batch(const SIFT3D_Descriptor_store *const d1, 
+        const int num_d1, const SIFT3D_Descriptor_store *const d2,
+        const int num_d2, const int *const pairs, const int num_pairs,
+        const float nn_thresh, int *const counts, int **const matches);
+
+void init_SIFT3D_Qdesc_store(SIFT3D_Qdesc_store *const q);
+
+void cleanup_SIFT3D_Qdesc_store(SIFT3D_Qdesc_store *const q);
+
+int SIFT3D_calibrate_quant_scale(const SIFT3D_Descriptor_store *const desc,
+        const int num_stores, float *const scale);
+
+int SIFT3D_quantize_descriptors(const SIFT3D_Descriptor_store *const desc,
+        const float scale, SIFT3D_Qdesc_store *const q);
+
+int SIFT3D_nn_match_quant(const SIFT3D_Qdesc_store *const d1,
+                          const SIFT3D_Qdesc_store *const d2,
+                          const float nn_thresh, int **const matches);
+
+void init_SIFT3D_Bdesc_store(SIFT3D_Bdesc_store *const b);
+
+void cleanup_SIFT3D_Bdesc_store(SIFT3D_Bdesc_store *const b);
+
+int SIFT3D_binarize_descriptors(const SIFT3D_Descriptor_store *const desc,
+        SIFT3D_Bdesc_store *const b);
+
+int SIFT3D_extract_binary_descriptors(SIFT3D *const sift3d,
+        const Keypoint_store *const kp, SIFT3D_Bdesc_store *const b);
+
+int SIFT3D_nn_match_binary(const SIFT3D_Bdesc_store *const d1,
+                           const SIFT3D_Bdesc_store *const d2,
+                           const float nn_thresh, int **const matches);
+
+void init_SIFT3D_Pca(SIFT3D_Pca *const pca);
+
+void cleanup_SIFT3D_Pca(SIFT3D_Pca *const pca);
+
+int SIFT3D_learn_pca(const SIFT3D_Descriptor_store *const desc, 
+        const int num_stores, const int dim, SIFT3D_Pca *const pca);
+
+void init_SIFT3D_Pdesc_store(SIFT3D_Pdesc_store *const p);
+
+void cleanup_SIFT3D_Pdesc_store(SIFT3D_Pdesc_store *const p);
+
+int SIFT3D_project_descriptors(const SIFT3D_Pca *const pca,
+        const SIFT3D_Descriptor_store *const desc, 
+        SIFT3D_Pdesc_store *const p);
+
+int SIFT3D_extract_pca_descriptors(SIFT3D *const sift3d,
+        const Keypoint_store *const kp, const SIFT3D_Pca *const pca,
+        SIFT3D_Pdesc_store *const p);
+
+int SIFT3D_nn_match_pca(const SIFT3D_Pdesc_store *const d1,
+                        const SIFT3D_Pdesc_store *const d2,
+                        const float nn_thresh, int **const matches);
+
 int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat);
 
 int SIFT3D_Descriptor_coords_to_Mat_rm(
@@ -107,6 +184,16 @@ int write_Keypoint_store(const char *path, const Keypoint_store *const kp);
 int write_SIFT3D_Descriptor_store(const char *path, 
         const SIFT3D_Descriptor_store *const desc);
 
+int write_SIFT3D_Descriptor_db(const char *path,
+        const SIFT3D_Descriptor_store *const desc);
+
+int read_SIFT3D_Descriptor_store(const char *path,
+        SIFT3D_Descriptor_store *const desc);
+
+int write_SIFT3D_Pca(const char *path, const SIFT3D_Pca *const pca);
+
+int read_SIFT3D_Pca(const char *path, SIFT3D_Pca *const pca);
+
 #ifdef __cplusplus
 }
 #endif
@@ -436,6 +436,186 @@ classdef Sift3DTest < TestCase
             assertTrue(threwErr);
         end
         
+        % Test reading an affine transformation from a file
+        function tformAffineTest(self)
+            
+            % The temporary file name
+            tformName = 'affine.csv';
+            
+            % Write a random affine transformation
+            A = [eye(3) + 0.1 * randn(3) 10 * randn(3, 1)];
+            dlmwrite(tformName, A, 'precision', 17);
+            
+            % Transform random points
+            coords = 50 * rand(20, 3);
+            coordsOut = transform3D(tformName, 'affine', coords);
+            
+            % Clean up
+            delete(tformName);
+            
+            % Check the results
+            assertElementsAlmostEqual(coordsOut, ...
+                (A * [coords ones(size(coords, 1), 1)]')', 'absolute', 1E-9);
+        end
+        
+        % Test that composite transformations apply their members in
+        % order, merge consecutive affine transformations, and are read 
+        % back as written
+        function tformCompositeTest(self)
+            
+            % Temporary file names
+            aff1Name = 'affine1.csv';
+            aff2Name = 'affine2.csv';
+            dispName = 'disp.csv';
+            compName = 'composite.csv';
+            memberNames = {'composite_0.csv', 'composite_1.csv'};
+            
+            % Write two random affine transformations
+            A1 = [eye(3) + 0.1 * randn(3) 10 * randn(3, 1)];
+            A2 = [eye(3) + 0.1 * randn(3) 10 * randn(3, 1)];
+            dlmwrite(aff1Name, A1, 'precision', 17);
+            dlmwrite(aff2Name, A2, 'precision', 17);
+            
+            % Write a displacement field of [2x2x2] voxels, which moves
+            % every point by d
+            d = [1 -2 3];
+            dlmwrite(dispName, [2 2 2; repmat(d, 8, 1)]);
+            
+            % Random points, and the affine transformations as functions
+            coords = 50 * rand(20, 3);
+            aff1 = @(x) (A1 * [x ones(size(x, 1), 1)]')';
+            aff2 = @(x) (A2 * [x ones(size(x, 1), 1)]')';
+            
+            % Compose A1(A2(D(x))), merging A1 and A2
+            composeTransform3D(compName, {aff1Name, aff2Name, dispName}, ...
+                {'affine', 'affine', 'displacement'});
+            compTypes = csvread(compName);
+            merged = csvread(memberNames{1});
+            coordsMerged = transform3D(compName, 'composite', coords);
+            
+            % Compose D(A1(x)), which differs in the order
+            composeTransform3D(compName, {dispName, aff1Name}, ...
+                {'displacement', 'affine'});
+            coordsSwapped = transform3D(compName, 'composite', coords);
+            
+            % Clean up
+            delete(aff1Name);
+            delete(aff2Name);
+            delete(dispName);
+            delete(compName);
+            delete(memberNames{:});
+            
+            % Check the members: one affine and one displacement field
+            assertEqual(compTypes, [2; 0; 5]);
+            assertElementsAlmostEqual(merged, A1 * [A2; 0 0 0 1], ...
+                'absolute', 1E-5);
+            
+            % Check the results, written with 6 decimal places
+            assertElementsAlmostEqual(coordsMerged, ...
+                aff1(aff2(coords + repmat(d, size(coords, 1), 1))), ...
+                'absolute', 1E-3);
+            assertElementsAlmostEqual(coordsSwapped, ...
+                aff1(coords) + repmat(d, size(coords, 1), 1), ...
+                'absolute', 1E-3);
+        end
+        
+        % Test applying B-spline free-form deformations read from files,
+        % and writing B-splines and thin-plate splines back exactly
+        function tformSplineTest(self)
+            
+            % Temporary file names
+            bsplineName = 'bspline.csv';
+            tpsName = 'tps.csv';
+            compName = 'composite.csv';
+            memberName = 'composite_0.csv';
+            
+            % Write a random B-spline on a [4x5x3] lattice. The rows are 
+            % the dimensions, the spacing, the transposed affine part and 
+            % the displacements, x fastest
+            dims = [4 5 3];
+            A = [eye(3) + 0.1 * randn(3) 10 * randn(3, 1)];
+            bspline = [dims; 10 8 12; A'; randn(prod(dims), 3)];
+            dlmwrite(bsplineName, bspline, 'precision', 17);
+            
+            % Write a random thin-plate spline with 5 control points. The 
+            % rows are the control points and the transposed parameters
+            tps = [50 * rand(5, 3); randn(9, 3)];
+            dlmwrite(tpsName, tps, 'precision', 17);
+            
+            % Transform random points, and a row of points sharing y and z
+            coords = [30 * rand(20, 3); ...
+                linspace(0, 30, 10)' repmat([5 7], 10, 1)];
+            coordsOut = transform3D(bsplineName, 'bspline', coords);
+            
+            % Write the splines back, as members of composites
+            composeTransform3D(compName, {bsplineName}, {'bspline'});
+            bsplineWritten = csvread(memberName);
+            composeTransform3D(compName, {tpsName}, {'tps'});
+            tpsWritten = csvread(memberName);
+            
+            % Clean up
+            delete(bsplineName);
+            delete(tpsName);
+            delete(compName);
+            delete(memberName);
+            
+            % Check the results
+            assertElementsAlmostEqual(coordsOut, ...
+                bsplineRef(bspline, coords), 'absolute', 1E-9);
+            assertEqual(bsplineWritten, bspline);
+            assertEqual(tpsWritten, tps);
+        end
+        
+        % Test baking a transformation into a displacement field, and 
+        % reading and writing the field
+        function tformDispFieldTest(self)
+            
+            % Temporary file names
+            affName = 'affine.csv';
+            dispName = 'disp.csv';
+            compName = 'composite.csv';
+            memberName = 'composite_0.csv';
+            
+            % Write a random affine transformation
+            A = [eye(3) + 0.1 * randn(3) 10 * randn(3, 1)];
+            dlmwrite(affName, A, 'precision', 17);
+            aff = @(x) (A * [x ones(size(x, 1), 1)]')';
+            
+            % Bake it into a displacement field
+            dims = [6 5 4];
+            bakeTransform3D(dispName, affName, 'affine', dims);
+            field = csvread(dispName);
+            
+            % Transform random points inside the lattice, where trilinear 
+            % interpolation reproduces the affine transformation
+            coords = rand(20, 3) * diag(dims - 1);
+            coordsOut = transform3D(dispName, 'displacement', coords);
+            
+            % Write the field back, as a member of a composite
+            composeTransform3D(compName, {dispName}, {'displacement'});
+            fieldWritten = csvread(memberName);
+            
+            % Clean up
+            delete(affName);
+            delete(dispName);
+            delete(compName);
+            delete(memberName);
+            
+            % Check the field: the dimensions, then the displacements at 
+            % the voxels, x fastest, in single precision
+            [x, y, z] = ndgrid(0 : dims(1) - 1, 0 : dims(2) - 1, ...
+                0 : dims(3) - 1);
+            voxels = [x(:) y(:) z(:)];
+            assertEqual(field(1, :), dims);
+            assertElementsAlmostEqual(field(2 : end, :), ...
+                aff(voxels) - voxels, 'absolute', 1E-4);
+            
+            % Check the results
+            assertElementsAlmostEqual(coordsOut, aff(coords), ...
+                'absolute', 1E-4);
+            assertEqual(fieldWritten, field);
+        end
+        
         % Test reading and writing a NIFTI image
         function niftiIOTest(self)
             
@@ -458,6 +638,87 @@ classdef Sift3DTest < TestCase
             assertElementsAlmostEqual(imWritten, imRead, 'relative', 1E-3);
         end
         
+        % Test that the intensity scaling of a NIFTI header is only applied
+        % when enabled
+        function niftiScalingTest(self)
+            
+            % The temporary file name
+            imName = 'temp.nii';
+            
+            % Make random image data
+            imWritten = rand(10, 15, 20);
+            
+            % Write the image as an uncompressed NIFTI file
+            imWrite3D(imName, imWritten);
+            
+            % Set scl_slope and scl_inter in the header
+            slope = 2;
+            inter = 10;
+            fid = fopen(imName, 'r+', 'l');
+            fseek(fid, 112, 'bof');
+            fwrite(fid, [slope inter], 'float32');
+            fclose(fid);
+            
+            % Read the image with and without scaling
+            imRaw = imRead3D(imName);
+            imOptions3D('niiScaling', true);
+            imScaled = imRead3D(imName);
+            
+            % Clean up
+            imOptions3D('niiScaling', false);
+            delete(imName);
+            
+            % Check the results
+            assertElementsAlmostEqual(imWritten, imRaw, 'relative', 1E-3);
+            assertElementsAlmostEqual(slope * imWritten + inter, imScaled, ...
+                'relative', 1E-3);
+        end
+        
+        % Test that compressed NIFTI files are valid gzip files with a
+        % NIFTI-1 header, and that plain gzip files can be read
+        function niftiGzipTest(self)
+            
+            % The temporary file names
+            imName = 'temp.nii.gz';
+            rawName = 'temp.nii';
+            
+            % Make random image data, spanning several gzip blocks
+            imWritten = rand(100, 110, 50);
+            
+            % Write the image as a compressed NIFTI file
+            imWrite3D(imName, imWritten);
+            
+            % Decompress it with a standard gzip reader
+            gunzip(imName);
+            delete(imName);
+            
+            % Check the header size and magic string
+            fid = fopen(rawName, 'r', 'l');
+            sizeofHdr = fread(fid, 1, 'int32');
+            fseek(fid, 344, 'bof');
+            magic = fread(fid, 4, 'uint8=>char')';
+            fclose(fid);
+            
+            % Read the uncompressed image back
+            imRawRead = imRead3D(rawName);
+            
+            % Compress it with a standard gzip writer, and read it back
+            gzip(rawName);
+            imGzipRead = imRead3D(imName);
+            
+            % Clean up
+            delete(rawName);
+            delete(imName);
+            
+            % Ensure the results are identical
+            assertEqual(sizeofHdr, 348);
+            assertEqual(magic, ['n+1' char(0)]);
+            assertElementsAlmostEqual(imWritten, imRawRead, 'relative', ...
+                1E-3);
+            assertElementsAlmostEqual(imWritten, imGzipRead, 'relative', ...
+                1E-3);
+        end
+        
         % Test reading and writing a DICOM image
         function dicomIOTest(self)
             
@@ -511,6 +772,133 @@ classdef Sift3DTest < TestCase
             assertElementsAlmostEqual(imWritten, imRead, 'absolute', 1E-2);
         end
         
+        % Test that a directory of DICOM images is read in the order of the
+        % slice positions, rather than the file names
+        function dirOrderTest(self)
+            
+            % The temporary file name
+            dirName = 'temp';
+            
+            % Make random image data, scaled to the range [0, 1], and
+            % anisotropic units
+            imWritten = rand(10, 15, 40);
+            imWritten = imWritten / max(imWritten(:));
+            unitsWritten = [0.5 0.75 2]';
+            
+            % Write the image as a DICOM directory
+            imWrite3D(dirName, imWritten, unitsWritten);
+            
+            % Rename the files in the reverse order of their names
+            files = dir(fullfile(dirName, '*.dcm'));
+            numFiles = length(files);
+            for i = 1 : numFiles
+                movefile(fullfile(dirName, files(i).name), ...
+                    fullfile(dirName, sprintf('slice%04d.dcm', ...
+                    numFiles - i)));
+            end
+            
+            % Read the image back and scale it
+            [imRead, unitsRead] = imRead3D(dirName);
+            imRead = imRead / max(imRead(:));
+            
+            % Clean up
+            rmdir(dirName, 's');
+            
+            % Ensure the results are identical
+            assertEqual(numFiles, size(imWritten, 3));
+            assertElementsAlmostEqual(imWritten, imRead, 'absolute', 1E-2);
+            assertElementsAlmostEqual(unitsWritten, unitsRead, ...
+                'relative', 1E-3);
+        end
+        
+        % Test that images read with io_uring are identical to those read
+        % with standard file I/O
+        function uringFallbackTest(self)
+            
+            % The temporary file names
+            imName = 'temp.nii.gz';
+            dirName = 'temp';
+            
+            % Make random image data, scaled to the range [0, 1]
+            imWritten = rand(10, 15, 20);
+            imWritten = imWritten / max(imWritten(:));
+            
+            % Write the image as a NIFTI file and a DICOM directory
+            imWrite3D(imName, imWritten);
+            imWrite3D(dirName, imWritten);
+            
+            % Read the images with io_uring, if available
+            imOptions3D('uring', true);
+            niftiUring = imRead3D(imName);
+            dirUring = imRead3D(dirName);
+            
+            % Read the images again, with standard file I/O
+            imOptions3D('uring', false);
+            niftiStdio = imRead3D(imName);
+            dirStdio = imRead3D(dirName);
+            
+            % Clean up
+            imOptions3D('uring', true);
+            delete(imName);
+            rmdir(dirName, 's');
+            
+            % Check the results
+            assertElementsAlmostEqual(imWritten, niftiUring, 'relative', ...
+                1E-3);
+            assertEqual(niftiUring, niftiStdio);
+            assertEqual(dirUring, dirStdio);
+        end
+        
+        % Test reading a directory of DICOM images through the series
+        % index, and that the index is not used after a file is replaced
+        function dcmIndexTest(self)
+            
+            % The temporary file names
+            dirName = 'temp';
+            otherName = 'tempOther';
+            indexName = fullfile(dirName, '.sift3d_dcm_index');
+            
+            % Make random image data, scaled to the range [0, 1]
+            imWritten = rand(10, 15, 20);
+            imWritten = imWritten / max(imWritten(:));
+            
+            % Write the image, and another one from a different series
+            imWrite3D(dirName, imWritten);
+            imWrite3D(otherName, rand(10, 15, 20));
+            
+            % Read the image twice, first writing the index, then using it
+            imOptions3D('dcmIndex', true);
+            imFirst = imRead3D(dirName);
+            indexed = exist(indexName, 'file') == 2;
+            imSecond = imRead3D(dirName);
+            
+            % Replace a file with one from the other series
+            files = dir(fullfile(dirName, '*.dcm'));
+            otherFiles = dir(fullfile(otherName, '*.dcm'));
+            copyfile(fullfile(otherName, otherFiles(1).name), ...
+                fullfile(dirName, files(1).name));
+            
+            % Reading the directory must now fail, as the series are mixed
+            threwErr = false;
+            try
+                imRead3D(dirName);
+            catch ME
+                threwErr = true;
+            end
+            
+            % Clean up
+            imOptions3D('dcmIndex', false);
+            rmdir(dirName, 's');
+            rmdir(otherName, 's');
+            
+            % Check the results
+            assertTrue(indexed);
+            assertEqual(imFirst, imSecond);
+            assertElementsAlmostEqual(imWritten, imFirst / max(imFirst(:)), ...
+                'absolute', 1E-2);
+            assertTrue(threwErr);
+        end
+        
         % Test reading and writing a 2D NIFTI image
         function nifti2DTest(self)
             % The temporary file name
@@ -893,6 +1281,41 @@ setenv(ldPathVar, oldLdPath);
 
 end
 
+function coordsOut = bsplineRef(bspline, coords)
+%bsplineRef Helper function to apply a B-spline free-form deformation, 
+% stored as in the files read by transform3D, to an [Nx3] array of points
+dims = bspline(1, :);
+spacing = bspline(2, :);
+A = bspline(3 : 6, :)';
+coef = bspline(7 : end, :);
+
+% Affine part
+coordsOut = (A * [coords ones(size(coords, 1), 1)]')';
+
+% Displacement, with the node [kx ky kz] at (([kx ky kz] - 2) .* spacing)
+for i = 1 : size(coords, 1)
+    u = coords(i, :) ./ spacing + 1;
+    for k = 1 : prod(dims)
+        [kx, ky, kz] = ind2sub(dims, k);
+        w = cubicBspline(u(1) - kx + 1) * cubicBspline(u(2) - ky + 1) * ...
+            cubicBspline(u(3) - kz + 1);
+        coordsOut(i, :) = coordsOut(i, :) + w * coef(k, :);
+    end
+end
+end
+
+function w = cubicBspline(t)
+%cubicBspline Helper function to evaluate the centered cubic B-spline
+t = abs(t);
+if t < 1
+    w = 2 / 3 - t ^ 2 + t ^ 3 / 2;
+elseif t < 2
+    w = (2 - t) ^ 3 / 6;
+else
+    w = 0;
+end
+end
+
 function R = rotMat(theta)
 %rotMat Helper function to make a 3D rotation matrix, rotating by angle
 % theta in the XY plane
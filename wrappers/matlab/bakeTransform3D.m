@@ -0,0 +1,37 @@
+function bakeTransform3D(path, inPath, inType, dims)
+%bakeTransform3D(path, inPath, inType, dims) Bake a transformation stored 
+%  in a file into a displacement field, and write the field to a file.
+%  Arguments:
+%    path - The path of the output file, e.g. 'field.csv.gz'.
+%    inPath - The path of the transformation.
+%    inType - The type of the transformation. See transform3D for the 
+%       list of types.
+%    dims - The dimensions [nx ny nz] of the lattice, typically those of 
+%       the images to be warped.
+%
+%  The transformation is applied once at every voxel of the lattice. The
+%  field interpolates it trilinearly in between, and uses the nearest 
+%  voxel outside the lattice. Apply the field with transform3D, with the 
+%  type 'displacement'.
+%
+%  Example:
+%    bakeTransform3D('field.csv.gz', 'bspline.csv', 'bspline', size(im));
+%    coords = transform3D('field.csv.gz', 'displacement', [1 2 3]);
+%
+%  See also:
+%    transform3D, composeTransform3D, setupSift3D
+%
+% Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+
+% Verify inputs
+narginchk(4, 4)
+validateattributes(path, {'char'}, {'nonempty'}, 'path')
+validateattributes(inPath, {'char'}, {'nonempty'}, 'inPath')
+validateattributes(inType, {'char'}, {'nonempty'}, 'inType')
+validateattributes(dims, {'numeric'}, {'real', 'integer', 'positive', ...
+    'numel', 3}, 'dims')
+
+% Bake the transformation
+mexBakeTransform3D(path, inPath, inType, double(dims));
+
+end
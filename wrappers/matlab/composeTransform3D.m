@@ -0,0 +1,44 @@
+function composeTransform3D(path, inPaths, inTypes)
+%composeTransform3D(path, inPaths, inTypes) Compose transformations 
+%  stored in files, and write the result to a file.
+%  Arguments:
+%    path - The path of the output file, e.g. 'composite.csv'. Each member
+%       of the composite is written to a file of its own, with "_i" 
+%       inserted before the extension, e.g. 'composite_0.csv'.
+%    inPaths - A cell array of the paths of the transformations to 
+%       compose.
+%    inTypes - A cell array of the types of those transformations. See 
+%       transform3D for the list of types.
+%
+%  The result is inPaths{1}(inPaths{2}(... inPaths{end}(x))). This is the
+%  transformation resampling through the whole chain of resamplings with 
+%  inPaths{1}, inPaths{2}, and so on. Consecutive affine transformations 
+%  are merged into one.
+%
+%  Example:
+%    composeTransform3D('composite.csv', {'first.csv', 'second.csv'}, ...
+%       {'affine', 'bspline'});
+%    coords = transform3D('composite.csv', 'composite', [1 2 3]);
+%
+%  See also:
+%    transform3D, bakeTransform3D, setupSift3D
+%
+% Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+
+% Verify inputs
+narginchk(3, 3)
+validateattributes(path, {'char'}, {'nonempty'}, 'path')
+if ~iscellstr(inPaths)
+    error('inPaths must be a cell array of strings')
+end
+if ~iscellstr(inTypes)
+    error('inTypes must be a cell array of strings')
+end
+if numel(inPaths) ~= numel(inTypes)
+    error('inPaths and inTypes must have the same length')
+end
+
+% Compose the transformations
+mexComposeTransform3D(path, inPaths, inTypes);
+
+end
@@ -0,0 +1,48 @@
+function imOptions3D(name, value)
+%imOptions3D(name, value) Set a global option for reading 3D images.
+%  Arguments:
+%    name - The name of the option, from the list below.
+%    value - The new value of the option.
+%
+%  Options:
+%    'dcmIndex' - If true, reading a directory of DICOM files stores the
+%       metadata of its files in a hidden index file in that directory,
+%       which speeds up later reads of the same directory. The index is 
+%       ignored for files which have changed since it was written. 
+%       (default: false)
+%    'niiScaling' - If true, reading a NIFTI file applies the intensity 
+%       scaling scl_slope * v + scl_inter of its header to each voxel v. 
+%       Otherwise, the voxels are returned as stored. (default: false)
+%    'uring' - If true, batches of files, such as the slices of a DICOM 
+%       directory, are read with io_uring where it is available. Otherwise,
+%       they are read with standard file I/O. (default: true)
+%
+%  Example:
+%    imOptions3D('dcmIndex', true);
+%    [im, units] = imRead3D('someDirectory');
+%
+%  See also:
+%    imRead3D, imWrite3D, setupSift3D
+%
+% Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+
+% Verify inputs
+if nargin < 1 || isempty(name)
+    error('name not specified')
+end
+
+if ~isa(name, 'char')
+    error('name must be a string')
+end
+
+if nargin < 2 || isempty(value)
+    error('value not specified')
+end
+
+validateattributes(value, {'numeric', 'logical'}, {'real', 'scalar'}, ...
+    'value')
+
+% Set the option
+mexImOptions3D(name, double(value));
+
+end
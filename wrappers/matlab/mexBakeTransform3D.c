@@ -0,0 +1,90 @@
+/* -----------------------------------------------------------------------------
+ * mexBakeTransform3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Mex interface to bake a transformation stored in a file into a 
+ * displacement field.
+ * -----------------------------------------------------------------------------
+ */
+
+#include "imutil.h"
+#include "mexutil.h"
+#include "mex.h"
+#include "matrix.h"
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+        const mxArray *mxPath, *mxInPath, *mxInType, *mxDims;
+        Disp_field field;
+        const double *dims;
+        char *path;
+        void *tform;
+
+/* Clean up and print an error */
+#define CLEAN_AND_QUIT(name, msg, expected) { \
+                mex_free_tform(tform); \
+                cleanup_tform(&field); \
+                if (path != NULL) \
+                        mxFree(path); \
+                if (expected) { \
+                        err_msg(name, msg); \
+                } else { \
+                        err_msgu(name, msg); \
+                } \
+        }
+
+	// Verify the number of inputs
+	if (nrhs != 4)
+                err_msgu("main:numInputs", "This function takes 4 inputs.");
+
+        // Verify the number of outputs
+        if (nlhs != 0) 
+                err_msgu("main:numOutputs", "This function takes no outputs.");
+
+        // Assign the inputs
+        mxPath = prhs[0];
+        mxInPath = prhs[1];
+        mxInType = prhs[2];
+        mxDims = prhs[3];
+
+        // Verify the dimensions
+        if (!isDouble(mxDims) || mxGetNumberOfElements(mxDims) != IM_NDIMS)
+                err_msgu("main:dims", "The dimensions must be a real vector "
+                        "of length 3.");
+        dims = mxGetData(mxDims);
+
+        // Initialize intermediates
+        tform = NULL;
+        path = NULL;
+        if (init_Disp_field(&field))
+                err_msgu("main:init", "Failed to initialize intermediates");
+
+        // Get the output path
+        if ((path = mxArrayToString(mxPath)) == NULL)
+                CLEAN_AND_QUIT("main:getPath", "Failed to convert the path "
+                        "to a string.", SIFT3D_TRUE);
+
+        // Read the transformation
+        if ((tform = mx2tform(mxInPath, mxInType)) == NULL)
+                CLEAN_AND_QUIT("main:read", "Failed to read the "
+                        "transformation.", SIFT3D_TRUE);
+
+        // Bake it into a displacement field
+        if (make_Disp_field(tform, (int) dims[0], (int) dims[1], 
+                (int) dims[2], &field))
+                CLEAN_AND_QUIT("main:bake", "Failed to make the displacement "
+                        "field.", SIFT3D_TRUE);
+
+        // Write the field
+        if (write_tform(path, &field))
+                CLEAN_AND_QUIT("main:write", "Failed to write the "
+                        "displacement field.", SIFT3D_TRUE);
+
+        // Clean up
+        mex_free_tform(tform);
+        cleanup_tform(&field);
+        mxFree(path);
+
+#undef CLEAN_AND_QUIT
+}
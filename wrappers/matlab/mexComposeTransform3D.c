@@ -0,0 +1,94 @@
+/* -----------------------------------------------------------------------------
+ * mexComposeTransform3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Mex interface to compose transformations stored in files.
+ * -----------------------------------------------------------------------------
+ */
+
+#include "imutil.h"
+#include "mexutil.h"
+#include "mex.h"
+#include "matrix.h"
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+        const mxArray *mxPath, *mxInPaths, *mxInTypes;
+        Composite comp;
+        char *path;
+        void *tform;
+        mwSize i, num;
+
+/* Clean up and print an error */
+#define CLEAN_AND_QUIT(name, msg, expected) { \
+                mex_free_tform(tform); \
+                cleanup_tform(&comp); \
+                if (path != NULL) \
+                        mxFree(path); \
+                if (expected) { \
+                        err_msg(name, msg); \
+                } else { \
+                        err_msgu(name, msg); \
+                } \
+        }
+
+	// Verify the number of inputs
+	if (nrhs != 3)
+                err_msgu("main:numInputs", "This function takes 3 inputs.");
+
+        // Verify the number of outputs
+        if (nlhs != 0) 
+                err_msgu("main:numOutputs", "This function takes no outputs.");
+
+        // Assign the inputs
+        mxPath = prhs[0];
+        mxInPaths = prhs[1];
+        mxInTypes = prhs[2];
+
+        // Verify the lists of members
+        if (!mxIsCell(mxInPaths) || !mxIsCell(mxInTypes) ||
+                mxGetNumberOfElements(mxInPaths) != 
+                mxGetNumberOfElements(mxInTypes))
+                err_msgu("main:inputs", "The paths and types must be cell "
+                        "arrays of the same length.");
+        num = mxGetNumberOfElements(mxInPaths);
+
+        // Initialize intermediates
+        tform = NULL;
+        path = NULL;
+        if (init_Composite(&comp))
+                err_msgu("main:init", "Failed to initialize intermediates");
+
+        // Get the output path
+        if ((path = mxArrayToString(mxPath)) == NULL)
+                CLEAN_AND_QUIT("main:getPath", "Failed to convert the path "
+                        "to a string.", SIFT3D_TRUE);
+
+        // Append the members, applied last to first
+        for (i = 0; i < num; i++) {
+
+                if ((tform = mx2tform(mxGetCell(mxInPaths, i), 
+                        mxGetCell(mxInTypes, i))) == NULL)
+                        CLEAN_AND_QUIT("main:read", "Failed to read a "
+                                "transformation.", SIFT3D_TRUE);
+
+                if (append_Composite(&comp, tform))
+                        CLEAN_AND_QUIT("main:append", "Failed to append a "
+                                "transformation.", SIFT3D_FALSE);
+
+                mex_free_tform(tform);
+                tform = NULL;
+        }
+
+        // Write the composite
+        if (write_tform(path, &comp))
+                CLEAN_AND_QUIT("main:write", "Failed to write the "
+                        "composite transformation.", SIFT3D_TRUE);
+
+        // Clean up
+        cleanup_tform(&comp);
+        mxFree(path);
+
+#undef CLEAN_AND_QUIT
+}
@@ -0,0 +1,54 @@
+/* -----------------------------------------------------------------------------
+ * mexImOptions3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Mex interface to set global options for reading 3D images.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include "imutil.h"
+#include "mexutil.h"
+#include "mex.h"
+#include "matrix.h"
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+        const mxArray *mxName, *mxValue;
+        const char *name;
+        int enable;
+
+	// Verify the number of inputs
+	if (nrhs != 2)
+                err_msgu("main:numInputs", "This function takes 2 inputs.");
+
+        // Verify the number of outputs
+        if (nlhs != 0) 
+                err_msgu("main:numOutputs", "This function takes no outputs.");
+
+        // Assign the inputs
+        mxName = prhs[0];
+        mxValue = prhs[1];
+
+        // Get the option name
+        if ((name = mxArrayToString(mxName)) == NULL)
+                err_msgu("main:getName", "Failed to convert the input to a "
+                        "string");
+
+        // Get the value
+        if (!isDouble(mxValue) || !mxIsScalar(mxValue))
+                err_msgu("main:getValue", "The value must be a real scalar");
+        enable = mxGetScalar(mxValue) != 0.0;
+
+        // Set the option
+        if (!strcmp(name, "dcmIndex")) {
+                im_set_dcm_index(enable);
+        } else if (!strcmp(name, "niiScaling")) {
+                im_set_nii_scaling(enable);
+        } else if (!strcmp(name, "uring")) {
+                im_set_uring(enable);
+        } else {
+                err_msg("main:unknownOption", "Unknown option");
+        }
+}
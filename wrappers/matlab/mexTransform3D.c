@@ -0,0 +1,78 @@
+/* -----------------------------------------------------------------------------
+ * mexTransform3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Mex interface to apply a transformation stored in a file to points.
+ * -----------------------------------------------------------------------------
+ */
+
+#include "imutil.h"
+#include "mexutil.h"
+#include "mex.h"
+#include "matrix.h"
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+        const mxArray *mxPath, *mxType, *mxCoords;
+        Mat_rm in, out;
+        void *tform;
+
+/* Clean up and print an error */
+#define CLEAN_AND_QUIT(name, msg, expected) { \
+                mex_free_tform(tform); \
+                cleanup_Mat_rm(&in); \
+                cleanup_Mat_rm(&out); \
+                if (expected) { \
+                        err_msg(name, msg); \
+                } else { \
+                        err_msgu(name, msg); \
+                } \
+        }
+
+	// Verify the number of inputs
+	if (nrhs != 3)
+                err_msgu("main:numInputs", "This function takes 3 inputs.");
+
+        // Verify the number of outputs
+        if (nlhs > 1) 
+                err_msgu("main:numOutputs", "This function takes 1 output.");
+
+        // Assign the inputs
+        mxPath = prhs[0];
+        mxType = prhs[1];
+        mxCoords = prhs[2];
+
+        // Initialize intermediates
+        tform = NULL;
+        if (init_Mat_rm(&in, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&out, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+                err_msgu("main:init", "Failed to initialize intermediates");
+
+        // Read the transformation
+        if ((tform = mx2tform(mxPath, mxType)) == NULL)
+                CLEAN_AND_QUIT("main:read", "Failed to read the "
+                        "transformation.", SIFT3D_TRUE);
+
+        // Convert the coordinates, one homogeneous point per column
+        if (mx2mat(mxCoords, &in) || in.num_rows != IM_NDIMS + 1)
+                CLEAN_AND_QUIT("main:convertCoords", "Failed to convert the "
+                        "coordinates.", SIFT3D_TRUE);
+
+        // Transform the coordinates
+        if (apply_tform_Mat_rm(tform, &in, &out))
+                CLEAN_AND_QUIT("main:apply", "Failed to apply the "
+                        "transformation.", SIFT3D_FALSE);
+
+        // Convert the output
+        if ((plhs[0] = mat2mx(&out)) == NULL)
+                CLEAN_AND_QUIT("main:convertOut", "Failed to convert the "
+                        "output.", SIFT3D_FALSE);
+
+        // Clean up
+        mex_free_tform(tform);
+        cleanup_Mat_rm(&in);
+        cleanup_Mat_rm(&out);
+
+#undef CLEAN_AND_QUIT
+}
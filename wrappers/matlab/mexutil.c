@@ -9,6 +9,8 @@
 
 /* Standard headers */
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /* SIFT3D headers */
@@ -668,6 +670,93 @@ mxArray *array2mx(const double *const array, const size_t len) {
         return mx;
 }
 
+/* Convert the name of a transformation type to a tform_type. The names are
+ * 'affine', 'rigid', 'similarity', 'tps', 'bspline', 'displacement' and 
+ * 'composite'.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int mx2tform_type(const mxArray *const mx, tform_type *const type) {
+
+        char *name;
+        int i;
+
+        const struct {
+                const char *name;
+                tform_type type;
+        } types[] = {
+                {"affine", AFFINE},
+                {"rigid", RIGID},
+                {"similarity", SIMILARITY},
+                {"tps", TPS},
+                {"bspline", BSPLINE_FFD},
+                {"displacement", DISPLACEMENT_FIELD},
+                {"composite", COMPOSITE}
+        };
+        const int num_types = sizeof(types) / sizeof(types[0]);
+
+        if ((name = mxArrayToString(mx)) == NULL)
+                return SIFT3D_FAILURE;
+
+        for (i = 0; i < num_types; i++) {
+                if (!strcmp(name, types[i].name)) {
+                        *type = types[i].type;
+                        mxFree(name);
+                        return SIFT3D_SUCCESS;
+                }
+        }
+
+        SIFT3D_ERR("mx2tform_type: unknown type %s \n", name);
+        mxFree(name);
+        return SIFT3D_FAILURE;
+}
+
+/* Read a transformation from a file, with read_tform. The arguments are the
+ * path and the name of the type, as in mx2tform_type. 
+ *
+ * Returns the transformation, or NULL on failure. The transformation must 
+ * later be freed with mex_free_tform. */
+void *mx2tform(const mxArray *const path, const mxArray *const type) {
+
+        void *tform;
+        char *pathStr;
+        tform_type tformType;
+        int ret;
+
+        if (mx2tform_type(type, &tformType) || 
+                (pathStr = mxArrayToString(path)) == NULL)
+                return NULL;
+
+        if ((tform = malloc(tform_type_get_size(tformType))) == NULL) {
+                mxFree(pathStr);
+                return NULL;
+        }
+        if (init_tform(tform, tformType)) {
+                mxFree(pathStr);
+                free(tform);
+                return NULL;
+        }
+
+        ret = read_tform(pathStr, tform);
+        mxFree(pathStr);
+        if (ret) {
+                mex_free_tform(tform);
+                return NULL;
+        }
+
+        return tform;
+}
+
+/* Free a transformation returned by mx2tform. Does nothing if tform is 
+ * NULL. */
+void mex_free_tform(void *const tform) {
+
+        if (tform == NULL)
+                return;
+
+        cleanup_tform(tform);
+        free(tform);
+}
+
 /* Wrapper for SIFT3D_detect_keypoints. */
 int mex_SIFT3D_detect_keypoints(const Image *const im, 
         Keypoint_store *const kp) {
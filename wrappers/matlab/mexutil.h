@@ -52,6 +52,12 @@ int mx2desc(const mxArray *const mx, SIFT3D_Descriptor_store *const desc);
 
 mxArray *array2mx(const double *const array, const size_t len);
 
+int mx2tform_type(const mxArray *const mx, tform_type *const type);
+
+void *mx2tform(const mxArray *const path, const mxArray *const type);
+
+void mex_free_tform(void *const tform);
+
 int mex_SIFT3D_detect_keypoints(const Image *const im, 
         Keypoint_store *const kp);
 
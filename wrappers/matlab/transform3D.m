@@ -0,0 +1,41 @@
+function coordsOut = transform3D(path, type, coords)
+%transform3D(path, type, coords) Apply a transformation stored in a file 
+%  to points.
+%  Arguments:
+%    path - The path to the file, as written by regSift3D or 
+%       composeTransform3D, e.g. 'transform.csv'.
+%    type - The type of the transformation, from the list below.
+%    coords - An [Nx3] array of points, one (x, y, z) coordinate per row.
+%
+%  Types:
+%    'affine', 'rigid', 'similarity' - A [3x4] matrix A, transforming 
+%       [x y z]' to A * [x y z 1]'.
+%    'tps' - A thin-plate spline.
+%    'bspline' - An affine transformation plus a cubic B-spline free-form
+%       deformation.
+%    'displacement' - A dense displacement field, see bakeTransform3D.
+%    'composite' - A composition of transformations, see 
+%       composeTransform3D.
+%
+%  Return values:
+%    coordsOut - An [Nx3] array of the transformed points.
+%
+%  Example:
+%    coords = transform3D('transform.csv', 'affine', [0 0 0; 1 2 3]);
+%
+%  See also:
+%    composeTransform3D, bakeTransform3D, registerSift3D, setupSift3D
+%
+% Copyright (c) 2015-2017 Blaine Rister et al., see LICENSE for details.
+
+% Verify inputs
+narginchk(3, 3)
+validateattributes(path, {'char'}, {'nonempty'}, 'path')
+validateattributes(type, {'char'}, {'nonempty'}, 'type')
+validateattributes(coords, {'numeric'}, {'real', 'ncols', 3}, 'coords')
+
+% Transform the points in homogeneous coordinates
+coords = double(coords);
+coordsOut = mexTransform3D(path, type, [coords ones(size(coords, 1), 1)]')';
+
+end